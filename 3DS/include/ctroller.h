@@ -4,6 +4,7 @@
 #include <stddef.h>
 
 #include "hid.h"
+#include "protocol.h"
 
 #define _STRINGIFY(a) #a
 #define STRINGIFY(a) _STRINGIFY(a)
@@ -47,6 +48,19 @@
  **/
 #define CFG_FILE CFG_DIR "ctroller.cfg"
 
+/** Lines of the config file, after the server IP, that turn on sending on
+ * changes only and sending the motion sensors sampled between packets
+ **/
+#define CFG_EVENT "event"
+#define CFG_MOTION "motion"
+
+/** Options read from the config file
+ **/
+enum ctrollerOption {
+    CTROLLER_OPTION_EVENT  = 1 << 0, /* CFG_EVENT */
+    CTROLLER_OPTION_MOTION = 1 << 1, /* CFG_MOTION */
+};
+
 /** Port of the server to connect to.
  **/
 #define CFG_PORT "15708"
@@ -59,6 +73,38 @@ Result ctrollerInit(void);
  **/
 void ctrollerExit(void);
 
+/** Start sending HID info on a thread of its own
+ *
+ * The thread wakes up CTROLLER_RATE_MAX times per second, independently of
+ * the screen refresh, and sends the newest sample of the sampler (see
+ * sampler.h) whenever the send rate is due. Send errors are printed on the
+ * debug console and retried after three seconds.
+ *
+ * @returns 0 on success
+ **/
+Result ctrollerStart(void);
+
+/** Stop the sending thread and wait for it to exit
+ **/
+void ctrollerStop(void);
+
+/** Latency from sampling the HID state to sending it, in microseconds
+ **/
+struct ctrollerLatency {
+    unsigned count; /* packets sent */
+    uint32_t mean;
+    uint32_t max;
+};
+
+/** Take the latency of the packets sent since the last call
+ **/
+void ctrollerTakeLatency(struct ctrollerLatency *latency);
+
+/** Microseconds since boot, wrapping around after about 71 minutes like the
+ * server expects
+ **/
+uint32_t ctrollerClock(void);
+
 /** Read the server IP from a file
  *
  * @param ipstr Pointer to array of chars to be filled with the server IP
@@ -70,9 +116,13 @@ void ctrollerExit(void);
  **/
 int ctrollerReadServerIP(char *ipstr, size_t len, const char *path);
 
-/** Magic constant identifying a ctroller packet
+/** Read the options following the server IP from a file
+ *
+ * @param path Location of the config file on the SD
+ *
+ * @returns Bits of enum ctrollerOption, 0 if the file cannot be read
  **/
-#define PACKET_MAGIC 0x3d5c
+unsigned ctrollerReadOptions(const char *path);
 
 /** Constant identifying a packet version
  *
@@ -81,16 +131,9 @@ int ctrollerReadServerIP(char *ipstr, size_t len, const char *path);
  **/
 #define PACKET_VERSION MAKEBCDVER(VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH)
 
-/** Minimum number of bytes per package
- *
- * A package consists of metadata (magic value + version info) and the
- * contents of a hidinfo structure encoded in network byte order.
- **/
-#define PACKET_SIZE (2 * sizeof(uint16_t) + sizeof(struct hidInfo))
-
 /** A network packet that can hold all HID information collected
  **/
-typedef uint8_t packet_hid_t[PACKET_SIZE];
+typedef uint8_t packet_hid_t[PACKET_V1_SIZE];
 
 struct hidInfo;
 /** Write HID info into a packet ready to be sent
@@ -102,6 +145,105 @@ struct hidInfo;
  **/
 int ctrollerPackHIDInfo(packet_hid_t packet, const struct hidInfo *hid);
 
+/** Version field of v2 packets, the protocol revision in the upper nibble
+ *
+ * Revision 0 (v1) sends the whole hidInfo structure in PACKET_V1_SIZE bytes.
+ * Revision 2 (v2) sends keyframes and deltas relative to keyframes the server
+ * acknowledged, stamped with a sequence number and the time the input was
+ * sampled at. The constants and the order of the values of both are shared
+ * with the server in protocol.h, see linux/include/packet.h for the format.
+ **/
+#define PACKET_V2_VERSION (PACKET_PROTOCOL_V2 << 12 | PACKET_VERSION)
+
+/** Longest time to wait for the echo of a probe, in milliseconds
+ *
+ * Packets from the server are only read once per packet sent otherwise, which
+ * would add up to the send interval to the round-trip time.
+ **/
+#define PACKET_ECHO_WAIT 5
+
+/** Range of the send rate, in packets per second
+ *
+ * At most one packet is sent per tick of the sending thread, which runs at
+ * CTROLLER_RATE_MAX. The rate is adapted to the reports of the server (see
+ * common/ratectl.h).
+ **/
+#define CTROLLER_RATE_MIN 30
+#define CTROLLER_RATE_MAX 120
+
+/** A network packet that can hold any v2 packet
+ **/
+typedef uint8_t packet_v2_t[PACKET_V2_MAX_SIZE];
+
+/** Write HID info into a v2 packet ready to be sent
+ *
+ * Sends a keyframe until the server acknowledged one and every
+ * PACKET_KEYFRAME_INTERVAL frames, a delta otherwise. The key edges of the
+ * last packets are repeated, so the server can recover them if one is lost.
+ *
+ * @param packet Buffer to pack HID info into
+ * @param hidinfo HID info collected from the system
+ * @param sample Time the HID info was collected at, in microseconds
+ *
+ * @returns Number of bytes written to packet
+ **/
+int ctrollerPackHIDInfoV2(packet_v2_t packet,
+                          const struct hidInfo *hid,
+                          uint32_t sample);
+
+/** A sample of the motion sensors
+ **/
+struct motionSample {
+    uint32_t sample; /* time it was sampled at, in microseconds */
+    angularRate gyro;
+    accelVector accel;
+};
+
+/** Append the motion sensors sampled since the last packet to a v2 packet
+ *
+ * The samples follow the history as their count, then per sample its age
+ * before the packet and the differences to the gyroscope and accelerometer of
+ * `hid`. Only the newest PACKET_MOTION_MAX samples of at most
+ * PACKET_MOTION_AGE microseconds before the packet are sent.
+ *
+ * @param packet Packet written by ctrollerPackHIDInfoV2()
+ * @param len    Its length
+ * @param hid    HID info it was packed from
+ * @param sample Time the HID info was collected at, in microseconds
+ * @param motion Samples taken before `hid`, oldest first
+ * @param count  Number of samples
+ *
+ * @returns New length of the packet
+ **/
+int ctrollerPackMotion(packet_v2_t packet,
+                       int len,
+                       const struct hidInfo *hid,
+                       uint32_t sample,
+                       const struct motionSample *motion,
+                       size_t count);
+
+/** Handle the keyframe acknowledgements, probe echoes and reports the server
+ * sent, without blocking
+ *
+ * @returns 0 on success
+ * @returns < 0 on failure
+ **/
+int ctrollerReceive(void);
+
+/** Send a probe of the offset between the 3DS clock and the server clock
+ *
+ * The server echoes it with its receive and send times, which give the
+ * round-trip time and the offset like NTP. The best estimate so far is sent
+ * along, so the server can measure how long input takes to reach it. Waits up
+ * to PACKET_ECHO_WAIT milliseconds for the echo.
+ *
+ * @param now Current time, in microseconds
+ *
+ * @returns 0 on success
+ * @returns < 0 on failure
+ **/
+int ctrollerSendProbe(uint32_t now);
+
 /** Send data to the server
  *
  * @param buf Pointer to data to be sent
@@ -109,7 +251,19 @@ int ctrollerPackHIDInfo(packet_hid_t packet, const struct hidInfo *hid);
  **/
 int ctrollerSend(const void *buf, size_t len);
 
-/** Collect and send HID information to the server
+/** Send the newest HID sample to the server
+ *
+ * Called once per tick of the sending thread. Ticks are skipped to keep to
+ * the send rate, the key edges sampled meanwhile are sent with the next
+ * packet.
+ *
+ * When sending on changes only (see CFG_EVENT), key edges are sent on the
+ * next tick, analog changes beyond the thresholds of the sampler at the send
+ * rate followed by one more packet once they stopped, and otherwise a packet
+ * every PACKET_KEEPALIVE_INTERVAL milliseconds.
+ *
+ * With CFG_MOTION, the motion sensors sampled since the last packet are sent
+ * along (see ctrollerPackMotion()).
  **/
 int ctrollerSendHIDInfo(void);
 
@@ -0,0 +1,79 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <stdint.h>
+
+#include <3ds/types.h>
+#include <3ds/result.h>
+#include <3ds/os.h>
+
+#include "ctroller.h"
+#include "hid.h"
+
+/** Time between two samples of the HID state, in system ticks
+ *
+ * The HID module refreshes the pad in its shared memory about every 4
+ * milliseconds, several times per frame.
+ **/
+#define SAMPLER_PERIOD (SYSCLOCK_ARM11 / 250)
+
+/** Smallest changes of the analog values that count as a change, in the raw
+ * units of HID. Smaller ones are mostly noise of a console at rest.
+ **/
+#define SAMPLER_THRESHOLD_STICK 2
+#define SAMPLER_THRESHOLD_TOUCH 1
+#define SAMPLER_THRESHOLD_GYRO 16
+#define SAMPLER_THRESHOLD_ACCEL 4
+
+/** Changes since the last samplerTake(), see samplerChanged()
+ **/
+enum samplerChange {
+    SAMPLER_CHANGED_KEYS = 1 << 0, /* key pressed or released */
+    SAMPLER_CHANGED_AXES = 1 << 1, /* analog value beyond its threshold */
+};
+
+/** Start sampling the HID state on a thread of its own
+ *
+ * The thread runs every SAMPLER_PERIOD at a higher priority than the calling
+ * thread, independently of the screen refresh. hidScanInput() must not be
+ * called elsewhere while it runs.
+ *
+ * @returns 0 on success
+ **/
+Result samplerStart(void);
+
+/** Stop the sampling thread and wait for it to exit
+ **/
+void samplerStop(void);
+
+/** Take the newest sample
+ *
+ * The key edges are those of all samples since the last call, so no press or
+ * release is lost between two calls. The motion sensors of the samples before
+ * the newest one are taken along, at most the PACKET_MOTION_MAX newest.
+ *
+ * @param info   Filled with the newest HID state
+ * @param sample Filled with the time it was sampled at, in microseconds
+ * @param motion Filled with the motion sensors sampled since the last call,
+ *               before `info`, oldest first
+ * @param count  Filled with the number of motion samples
+ *
+ * @returns 0 on success
+ * @returns < 0 if nothing was sampled yet
+ **/
+int samplerTake(struct hidInfo *info,
+                uint32_t *sample,
+                struct motionSample motion[PACKET_MOTION_MAX],
+                size_t *count);
+
+/** How the samples since the last samplerTake() differ from the one it took
+ *
+ * @returns Bits of enum samplerChange, 0 if nothing changed
+ **/
+unsigned samplerChanged(void);
+
+/** Keys held in the newest sample
+ **/
+u32 samplerKeysHeld(void);
+
+#endif /* ----- #ifndef SAMPLER_H  ----- */
@@ -1,6 +1,7 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <3ds/types.h>
 #include <3ds/result.h>
 #include <3ds/console.h>
 
@@ -58,4 +59,10 @@ void util_presult(const char *msg, Result res) __attribute__((nonnull(1)));
 
 void util_debug_print_delim(void);
 
+/** Sleep until `*deadline` plus `period`, in system ticks, and move the
+ * deadline there. Runs a loop at a fixed rate without drifting; a deadline
+ * missed by more than a period is skipped.
+ **/
+void util_tick_wait(u64 *deadline, u64 period);
+
 #endif /* ----- #ifndef UTIL_H  ----- */
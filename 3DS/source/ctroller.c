@@ -8,9 +8,17 @@
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <poll.h>
+
+#include <3ds/os.h>
+#include <3ds/svc.h>
+#include <3ds/thread.h>
+#include <3ds/synchronization.h>
 
 #include "util.h"
 #include "hid.h"
+#include "sampler.h"
+#include "ratectl.h"
 
 struct peer {
     int socket;
@@ -22,6 +30,31 @@ static struct peer SERVER = {
     .socket = -1, .addr_list = NULL, .addr = NULL,
 };
 
+/** Send rate and redundancy, adapted to the reports of the server
+ **/
+static struct {
+    struct ratectl ctl;
+    unsigned credit;
+    int event;     /* whether to send on changes only */
+    int motion;    /* whether to send the motion batch */
+    int settling;  /* whether the last packet carried a change */
+    uint32_t sent; /* time the last packet was sent */
+} RATE;
+
+#define SENDER_STACK_SIZE 0x8000
+
+/** Sending thread and the latency from sampling to sending, read by the main
+ * thread
+ **/
+static struct {
+    Thread thread;
+    volatile bool running;
+    LightLock lock;
+    unsigned count;   /* packets sent since the last ctrollerTakeLatency() */
+    uint64_t latency; /* their summed latency, in us */
+    uint32_t max;
+} SENDER;
+
 // static int isNew3DS = 0;
 
 Result ctrollerInit(void)
@@ -84,6 +117,18 @@ Result ctrollerInit(void)
     }
     SERVER.addr = inf;
 
+    ratectl_init(&RATE.ctl,
+                 CTROLLER_RATE_MIN,
+                 CTROLLER_RATE_MAX,
+                 1,
+                 PACKET_HISTORY_FRAMES);
+    unsigned options = ctrollerReadOptions(CFG_FILE);
+    RATE.event       = (options & CTROLLER_OPTION_EVENT) != 0;
+    RATE.motion      = (options & CTROLLER_OPTION_MOTION) != 0;
+    util_debug_printf("- Mode:    %s%s\n",
+                      RATE.event ? "event" : "continuous",
+                      RATE.motion ? ", motion batches" : "");
+
     return SERVER.socket;
 }
 
@@ -110,6 +155,50 @@ int ctrollerReadServerIP(char *ipstr, size_t len, const char *path)
     return res;
 }
 
+unsigned ctrollerReadOptions(const char *path)
+{
+    static const struct {
+        const char *name;
+        enum ctrollerOption option;
+    } names[] = {
+        {CFG_EVENT, CTROLLER_OPTION_EVENT},
+        {CFG_MOTION, CTROLLER_OPTION_MOTION},
+    };
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return 0;
+    }
+
+    /* The first line holds the server IP */
+    char line[32];
+    unsigned options = 0;
+    int first        = 1;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        for (size_t i = 0; !first && i < sizeof_array(names); i++) {
+            if (strncmp(line, names[i].name, strlen(names[i].name)) == 0) {
+                options |= names[i].option;
+            }
+        }
+        first = 0;
+    }
+    fclose(fp);
+
+    return options;
+}
+
+uint32_t ctrollerClock(void)
+{
+    return (uint64_t)(svcGetSystemTick() / CPU_TICKS_PER_USEC);
+}
+
+/** Probes sent and the estimate of the server clock
+ **/
+static struct {
+    struct protocol_clock clock;
+    int probed; /* whether a probe was sent */
+} CLOCK;
+
 int ctrollerSend(const void *buf, size_t len)
 {
     return sendto(SERVER.socket,
@@ -124,63 +213,227 @@ int ctrollerSendHIDInfo(void)
 {
     int res = 0;
     struct hidInfo hid;
-    res = hidCollectData(&hid);
-    if (res) {
-        util_debug_printf("Error reading HID peerinfo.\n");
-        return res;
+    uint32_t sample;
+    struct motionSample motion[PACKET_MOTION_MAX];
+    size_t count;
+
+    /* Key edges of the ticks skipped stay with the sampler */
+    int due = ratectl_due(&RATE.ctl, &RATE.credit);
+    if (RATE.event) {
+        /* Key edges go out right away, other changes at the send rate and
+         * once more after they settled, so the server sees them stop */
+        unsigned changed = samplerChanged();
+        int recent =
+            ctrollerClock() - RATE.sent < PACKET_KEEPALIVE_INTERVAL * 1000;
+        if (!(changed & SAMPLER_CHANGED_KEYS) &&
+            !(due && (changed != 0 || RATE.settling)) && recent) {
+            return 0;
+        }
+        RATE.settling = (changed != 0);
+    } else if (!due) {
+        return 0;
+    }
+    if (samplerTake(&hid, &sample, motion, &count) < 0) {
+        return 0;
+    }
+
+    packet_v2_t packet;
+    int len = ctrollerPackHIDInfoV2(packet, &hid, sample);
+    if (RATE.motion) {
+        len = ctrollerPackMotion(packet, len, &hid, sample, motion, count);
     }
 
-    packet_hid_t packet;
-    ctrollerPackHIDInfo(packet, &hid);
+    res          = ctrollerSend(packet, len);
+    uint32_t now = ctrollerClock();
+
+    if (res > 0) {
+        RATE.sent        = now;
+        uint32_t latency = now - sample;
+        LightLock_Lock(&SENDER.lock);
+        SENDER.count++;
+        SENDER.latency += latency;
+        if (latency > SENDER.max) {
+            SENDER.max = latency;
+        }
+        LightLock_Unlock(&SENDER.lock);
+    }
 
-    res = ctrollerSend(packet, PACKET_SIZE);
+    /* The next packet may refer to keyframes acknowledged so far */
+    if (res > 0 && ctrollerReceive() < 0) {
+        util_debug_printf("Error receiving acknowledgements.\n");
+    }
+    int probe = !CLOCK.probed ||
+                now - CLOCK.clock.sent >= PACKET_PROBE_INTERVAL * 1000;
+    if (res > 0 && probe && ctrollerSendProbe(now) < 0) {
+        util_debug_printf("Error probing the server clock.\n");
+    }
     // ctrollerSend returns a negative value on error
     return (res > 0) ? 0 : res;
 }
 
-#define CTROLLER_PACK_DEFINE(type, packer)                                     \
-    static inline uint8_t *pack_##type(uint8_t *buf, type val)                 \
-    {                                                                          \
-        type *target = (type *) buf;                                           \
-        *target = packer(val);                                                 \
-        return buf + sizeof(type);                                             \
+static void senderMain(void *arg)
+{
+    (void) arg;
+
+    u64 period   = SYSCLOCK_ARM11 / CTROLLER_RATE_MAX;
+    u64 deadline = svcGetSystemTick();
+    while (SENDER.running) {
+        if (ctrollerSendHIDInfo()) {
+            util_perror("Sending HID info");
+            for (int i = 3; i > 0 && SENDER.running; i--) {
+                util_debug_printf("\rRetrying in %ds... ", i);
+                svcSleepThread(1000000000L);
+            }
+            util_debug_printf("\rRetrying now.\x1b[K\n");
+            deadline = svcGetSystemTick();
+        }
+        util_tick_wait(&deadline, period);
+    }
+}
+
+Result ctrollerStart(void)
+{
+    s32 priority = 0x30;
+    svcGetThreadPriority(&priority, CUR_THREAD_HANDLE);
+
+    LightLock_Init(&SENDER.lock);
+    SENDER.running = true;
+    SENDER.count   = 0;
+    SENDER.latency = 0;
+    SENDER.max     = 0;
+
+    SENDER.thread = threadCreate(
+        senderMain, NULL, SENDER_STACK_SIZE, priority - 1, -2, false);
+    if (SENDER.thread == NULL) {
+        SENDER.running = false;
+        return MAKERESULT(
+            RL_PERMANENT, RS_OUTOFRESOURCE, RM_APPLICATION, RD_OUT_OF_MEMORY);
+    }
+    return 0;
+}
+
+void ctrollerStop(void)
+{
+    if (SENDER.thread == NULL) {
+        return;
     }
+    SENDER.running = false;
+    threadJoin(SENDER.thread, U64_MAX);
+    threadFree(SENDER.thread);
+    SENDER.thread = NULL;
+}
+
+void ctrollerTakeLatency(struct ctrollerLatency *latency)
+{
+    LightLock_Lock(&SENDER.lock);
+    latency->count = SENDER.count;
+    latency->mean  = (SENDER.count > 0) ? SENDER.latency / SENDER.count : 0;
+    latency->max   = SENDER.max;
+    SENDER.count   = 0;
+    SENDER.latency = 0;
+    SENDER.max     = 0;
+    LightLock_Unlock(&SENDER.lock);
+}
 
-CTROLLER_PACK_DEFINE(int16_t, htons);
-CTROLLER_PACK_DEFINE(uint16_t, htons);
-CTROLLER_PACK_DEFINE(uint32_t, htonl);
+PROTOCOL_ASSERT_LAYOUT(struct hidInfo)
+PROTOCOL_ASSERT_MOTION_LAYOUT(struct motionSample)
 
-#undef CTROLLER_PACK_DEFINE
+/** Position of the values the protocol sends in our structures
+ **/
+static const struct protocol_layout LAYOUT = PROTOCOL_LAYOUT(struct hidInfo);
+static const struct protocol_motion_layout MOTION_LAYOUT =
+    PROTOCOL_MOTION_LAYOUT(struct motionSample);
 
 int ctrollerPackHIDInfo(packet_hid_t packet, const struct hidInfo *hid)
 {
-    uint8_t *bufptr = packet;
+    return protocol_pack_v1(&LAYOUT, hid, PACKET_VERSION, packet);
+}
 
-    bufptr = pack_uint16_t(bufptr, PACKET_MAGIC);
-    bufptr = pack_uint16_t(bufptr, PACKET_VERSION);
+/** State of the v2 encoder
+ **/
+static struct protocol_encoder ENCODER = {
+    .version = PACKET_V2_VERSION,
+};
 
-    bufptr = pack_uint32_t(bufptr, hid->keys.up);
-    bufptr = pack_uint32_t(bufptr, hid->keys.down);
-    bufptr = pack_uint32_t(bufptr, hid->keys.held);
+int ctrollerPackHIDInfoV2(packet_v2_t packet,
+                          const struct hidInfo *hid,
+                          uint32_t sample)
+{
+    return protocol_pack_v2(&ENCODER, &LAYOUT, hid, sample, packet);
+}
 
-    bufptr = pack_uint16_t(bufptr, hid->touchscreen.px);
-    bufptr = pack_uint16_t(bufptr, hid->touchscreen.py);
+int ctrollerPackMotion(packet_v2_t packet,
+                       int len,
+                       const struct hidInfo *hid,
+                       uint32_t sample,
+                       const struct motionSample *motion,
+                       size_t count)
+{
+    return protocol_pack_motion(&LAYOUT,
+                                &MOTION_LAYOUT,
+                                hid,
+                                sample,
+                                motion,
+                                count,
+                                packet + len) -
+           packet;
+}
 
-    bufptr = pack_int16_t(bufptr, hid->circlepad.dx);
-    bufptr = pack_int16_t(bufptr, hid->circlepad.dy);
+int ctrollerSendProbe(uint32_t now)
+{
+    uint8_t packet[PACKET_V2_PROBE_SIZE];
+    int len =
+        protocol_pack_probe(&CLOCK.clock, PACKET_V2_VERSION, now, packet);
 
-    bufptr = pack_int16_t(bufptr, hid->cstick.dx);
-    bufptr = pack_int16_t(bufptr, hid->cstick.dy);
+    CLOCK.probed = 1;
+    if (ctrollerSend(packet, len) < 0) {
+        return -1;
+    }
 
-    bufptr = pack_int16_t(bufptr, hid->gyro.x);
-    bufptr = pack_int16_t(bufptr, hid->gyro.y);
-    bufptr = pack_int16_t(bufptr, hid->gyro.z);
+    struct pollfd pfd = {.fd = SERVER.socket, .events = POLLIN};
+    uint32_t waited;
+    while (CLOCK.clock.pending &&
+           (waited = ctrollerClock() - now) < PACKET_ECHO_WAIT * 1000) {
+        int res = poll(&pfd, 1, PACKET_ECHO_WAIT - waited / 1000);
+        if (res <= 0) {
+            return res;
+        }
+        if (ctrollerReceive() < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
 
-    bufptr = pack_int16_t(bufptr, hid->accel.x);
-    bufptr = pack_int16_t(bufptr, hid->accel.y);
-    bufptr = pack_int16_t(bufptr, hid->accel.z);
+/** Adapt the send rate and redundancy to a report of the server
+ **/
+static void receiveReport(const struct ratectl_report *report)
+{
+    ratectl_update(&RATE.ctl, report);
+    ENCODER.redundancy = RATE.ctl.redundancy;
+}
+
+int ctrollerReceive(void)
+{
+    uint8_t buf[PACKET_V2_REPORT_SIZE];
+    int len;
+
+    while ((len = recvfrom(
+                SERVER.socket, buf, sizeof(buf), MSG_DONTWAIT, NULL, NULL)) >=
+           0) {
+        uint32_t now = ctrollerClock();
+        struct ratectl_report report;
+        if (protocol_update_clock(&CLOCK.clock, buf, len, now) == 0) {
+            continue;
+        }
+        if (protocol_unpack_report(buf, len, &report) == 0) {
+            receiveReport(&report);
+            continue;
+        }
+        protocol_receive_ack(&ENCODER, buf, len);
+    }
 
-    return bufptr - packet;
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
 }
 
 void ctrollerExit(void)
@@ -18,6 +18,7 @@
 
 #include "ctroller.h"
 
+#include "sampler.h"
 #include "util.h"
 
 #include <stdio.h>
@@ -43,6 +44,9 @@
 #define EXIT_DESC "START+UP+L+B"
 #endif
 
+/* Frames between two prints of the sample-to-send latency */
+#define LATENCY_FRAMES 60
+
 #define SOCU_BUFSZ 0x100000
 #define SOCU_ALIGN 0x1000
 
@@ -104,27 +108,40 @@ int main(int argc, char **argv)
         goto failure;
     }
 
+    if (R_FAILED(res = samplerStart())) {
+        util_presult("Starting the HID sampler failed", res);
+        goto failure;
+    }
+    if (R_FAILED(res = ctrollerStart())) {
+        util_presult("Starting the sender failed", res);
+        goto sender_failure;
+    }
+
     bool isHomebrew = envIsHomebrew();
     printf("Press %s to exit.\n", isHomebrew ? EXIT_DESC : "HOME");
     fflush(stdout);
 
+    /* Input is sampled and sent by threads of their own, this loop only
+     * keeps the screen and the latency shown up to date */
+    unsigned frames = 0;
     while (aptMainLoop()) {
 
         if (isHomebrew) {
-            if (hidKeysHeld() == EXIT_KEYS) {
+            if (samplerKeysHeld() == EXIT_KEYS) {
                 res = RL_SUCCESS;
                 break;
             }
         }
 
-        if (ctrollerSendHIDInfo()) {
-            util_perror("Sending HID info");
-            fflush(stderr);
-            for (int i = 3; i > 0; i--) {
-                util_debug_printf("\rRetrying in %ds... ", i);
-                svcSleepThread(1000000000L);
-            }
-            util_debug_printf("\rRetrying now.\x1b[K\n");
+        if (++frames % LATENCY_FRAMES == 0) {
+            struct ctrollerLatency latency;
+            ctrollerTakeLatency(&latency);
+            util_debug_printf("\rSample to send: %lu.%03lums, max %lu.%03lums"
+                              "\x1b[K",
+                              (unsigned long) latency.mean / 1000,
+                              (unsigned long) latency.mean % 1000,
+                              (unsigned long) latency.max / 1000,
+                              (unsigned long) latency.max % 1000);
         }
 
         gspWaitForVBlank();
@@ -134,6 +151,9 @@ int main(int argc, char **argv)
     }
 
     puts("Exiting...");
+    ctrollerStop();
+sender_failure:
+    samplerStop();
 failure:
     HIDUSER_DisableAccelerometer();
 accel_failure:
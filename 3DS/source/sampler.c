@@ -0,0 +1,186 @@
+#include "sampler.h"
+
+#include <3ds/os.h>
+#include <3ds/svc.h>
+#include <3ds/thread.h>
+#include <3ds/synchronization.h>
+
+#include "ctroller.h"
+#include "util.h"
+
+#define SAMPLER_STACK_SIZE 0x2000
+/* Motion samples kept, the newest one is sent as the state itself */
+#define SAMPLER_MOTION (PACKET_MOTION_MAX + 1)
+
+/** Sampling thread and the newest sample, shared with the sending thread
+ **/
+static struct {
+    Thread thread;
+    volatile bool running;
+    LightLock lock;
+    int sampled;          /* whether `state` holds a sample */
+    struct hidInfo state; /* newest sample */
+    uint32_t sample;      /* time it was sampled at */
+    u32 down, up;         /* key edges since the last samplerTake() */
+    struct hidInfo taken; /* sample taken last */
+    unsigned changed;     /* enum samplerChange since then */
+    /* motion sensors of the samples since then, including the newest */
+    struct motionSample motion[SAMPLER_MOTION];
+    size_t head;  /* index of the next motion sample */
+    size_t count; /* motion samples kept */
+} SAMPLER;
+
+static int exceeds(int a, int b, int threshold)
+{
+    return a - b >= threshold || b - a >= threshold;
+}
+
+/** Whether an analog value of `hid` moved beyond its threshold from `base`
+ **/
+static int axesChanged(const struct hidInfo *hid, const struct hidInfo *base)
+{
+    return exceeds(hid->circlepad.dx,
+                   base->circlepad.dx,
+                   SAMPLER_THRESHOLD_STICK) ||
+           exceeds(hid->circlepad.dy,
+                   base->circlepad.dy,
+                   SAMPLER_THRESHOLD_STICK) ||
+           exceeds(hid->cstick.dx, base->cstick.dx, SAMPLER_THRESHOLD_STICK) ||
+           exceeds(hid->cstick.dy, base->cstick.dy, SAMPLER_THRESHOLD_STICK) ||
+           exceeds(hid->touchscreen.px,
+                   base->touchscreen.px,
+                   SAMPLER_THRESHOLD_TOUCH) ||
+           exceeds(hid->touchscreen.py,
+                   base->touchscreen.py,
+                   SAMPLER_THRESHOLD_TOUCH) ||
+           exceeds(hid->gyro.x, base->gyro.x, SAMPLER_THRESHOLD_GYRO) ||
+           exceeds(hid->gyro.y, base->gyro.y, SAMPLER_THRESHOLD_GYRO) ||
+           exceeds(hid->gyro.z, base->gyro.z, SAMPLER_THRESHOLD_GYRO) ||
+           exceeds(hid->accel.x, base->accel.x, SAMPLER_THRESHOLD_ACCEL) ||
+           exceeds(hid->accel.y, base->accel.y, SAMPLER_THRESHOLD_ACCEL) ||
+           exceeds(hid->accel.z, base->accel.z, SAMPLER_THRESHOLD_ACCEL);
+}
+
+static void samplerMain(void *arg)
+{
+    (void) arg;
+
+    u64 deadline = svcGetSystemTick();
+    while (SAMPLER.running) {
+        struct hidInfo hid;
+        hidCollectData(&hid);
+        uint32_t sample = ctrollerClock();
+
+        LightLock_Lock(&SAMPLER.lock);
+        SAMPLER.state   = hid;
+        SAMPLER.sample  = sample;
+        SAMPLER.sampled = 1;
+        SAMPLER.down |= hid.keys.down;
+        SAMPLER.up |= hid.keys.up;
+        SAMPLER.motion[SAMPLER.head] = (struct motionSample){
+            .sample = sample,
+            .gyro   = hid.gyro,
+            .accel  = hid.accel,
+        };
+        SAMPLER.head = (SAMPLER.head + 1) % SAMPLER_MOTION;
+        if (SAMPLER.count < SAMPLER_MOTION) {
+            SAMPLER.count++;
+        }
+        if ((hid.keys.down | hid.keys.up) != 0) {
+            SAMPLER.changed |= SAMPLER_CHANGED_KEYS;
+        }
+        if (!(SAMPLER.changed & SAMPLER_CHANGED_AXES) &&
+            axesChanged(&hid, &SAMPLER.taken)) {
+            SAMPLER.changed |= SAMPLER_CHANGED_AXES;
+        }
+        LightLock_Unlock(&SAMPLER.lock);
+
+        util_tick_wait(&deadline, SAMPLER_PERIOD);
+    }
+}
+
+Result samplerStart(void)
+{
+    s32 priority = 0x30;
+    svcGetThreadPriority(&priority, CUR_THREAD_HANDLE);
+
+    LightLock_Init(&SAMPLER.lock);
+    SAMPLER.running = true;
+    SAMPLER.sampled = 0;
+    SAMPLER.down    = 0;
+    SAMPLER.up      = 0;
+    SAMPLER.changed = 0;
+    SAMPLER.head    = 0;
+    SAMPLER.count   = 0;
+
+    /* Above the sending thread, which always gets a fresh sample */
+    SAMPLER.thread = threadCreate(
+        samplerMain, NULL, SAMPLER_STACK_SIZE, priority - 2, -2, false);
+    if (SAMPLER.thread == NULL) {
+        SAMPLER.running = false;
+        return MAKERESULT(
+            RL_PERMANENT, RS_OUTOFRESOURCE, RM_APPLICATION, RD_OUT_OF_MEMORY);
+    }
+    return 0;
+}
+
+void samplerStop(void)
+{
+    if (SAMPLER.thread == NULL) {
+        return;
+    }
+    SAMPLER.running = false;
+    threadJoin(SAMPLER.thread, U64_MAX);
+    threadFree(SAMPLER.thread);
+    SAMPLER.thread = NULL;
+}
+
+int samplerTake(struct hidInfo *info,
+                uint32_t *sample,
+                struct motionSample motion[PACKET_MOTION_MAX],
+                size_t *count)
+{
+    int res = -1;
+
+    LightLock_Lock(&SAMPLER.lock);
+    if (SAMPLER.sampled) {
+        size_t first =
+            (SAMPLER.head + SAMPLER_MOTION - SAMPLER.count) % SAMPLER_MOTION;
+        *count = (SAMPLER.count > 0) ? SAMPLER.count - 1 : 0;
+        for (size_t i = 0; i < *count; i++) {
+            motion[i] = SAMPLER.motion[(first + i) % SAMPLER_MOTION];
+        }
+        SAMPLER.count   = 0;
+
+        *info           = SAMPLER.state;
+        *sample         = SAMPLER.sample;
+        info->keys.down = SAMPLER.down;
+        info->keys.up   = SAMPLER.up;
+        SAMPLER.down    = 0;
+        SAMPLER.up      = 0;
+        SAMPLER.taken   = SAMPLER.state;
+        SAMPLER.changed = 0;
+        res             = 0;
+    }
+    LightLock_Unlock(&SAMPLER.lock);
+
+    return res;
+}
+
+unsigned samplerChanged(void)
+{
+    LightLock_Lock(&SAMPLER.lock);
+    unsigned changed = SAMPLER.changed;
+    LightLock_Unlock(&SAMPLER.lock);
+
+    return changed;
+}
+
+u32 samplerKeysHeld(void)
+{
+    LightLock_Lock(&SAMPLER.lock);
+    u32 held = SAMPLER.state.keys.held;
+    LightLock_Unlock(&SAMPLER.lock);
+
+    return held;
+}
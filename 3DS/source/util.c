@@ -2,6 +2,9 @@
 
 #include <3ds/services/hid.h>
 #include <3ds/console.h>
+#include <3ds/synchronization.h>
+#include <3ds/svc.h>
+#include <3ds/os.h>
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -14,6 +17,10 @@ Result util_debug_result;
 
 PrintConsole debug;
 
+/* Held while the debug console is selected, output comes from several
+ * threads */
+static LightLock console_lock;
+
 void util_hang(Result res)
 {
     fprintf(stderr, "Press START to exit.\n");
@@ -37,6 +44,7 @@ void util_debug_init()
     util_debug_result = 0;
 #endif
 
+    LightLock_Init(&console_lock);
     consoleInit(GFX_BOTTOM, &debug);
     consoleSetWindow(&debug, 0, 0, 40, 30);
     consoleDebugInit(debugDevice_CONSOLE);
@@ -45,6 +53,7 @@ void util_debug_init()
 __attribute__((format(printf, 1, 2))) void
 util_debug_printf(const char *restrict fmt, ...)
 {
+    LightLock_Lock(&console_lock);
     PrintConsole *tmp = consoleSelect(&debug);
     va_list ap;
     va_start(ap, fmt);
@@ -52,12 +61,14 @@ util_debug_printf(const char *restrict fmt, ...)
     va_end(ap);
     fflush(stderr);
     consoleSelect(tmp);
+    LightLock_Unlock(&console_lock);
 }
 
 void util_perror(const char *msg)
 {
     char *delim       = (msg == NULL) ? "" : ": \n  ";
     char *color       = (errno == 0) ? CONSOLE_GREEN : CONSOLE_RED;
+    LightLock_Lock(&console_lock);
     PrintConsole *tmp = consoleSelect(&debug);
     fprintf(stderr,
             "%s%s%s%s" CONSOLE_RESET "\n",
@@ -67,12 +78,14 @@ void util_perror(const char *msg)
             strerror(errno));
     fflush(stderr);
     consoleSelect(tmp);
+    LightLock_Unlock(&console_lock);
 }
 
 void util_presult(const char *msg, Result res)
 {
     char *delim       = (msg[0] == '\0') ? "" : ": \n  ";
     char *color       = R_SUCCEEDED(res) ? CONSOLE_GREEN : CONSOLE_RED;
+    LightLock_Lock(&console_lock);
     PrintConsole *tmp = consoleSelect(&debug);
     fprintf(stderr,
             "Error %s0x%08x" CONSOLE_RESET "%s%s\n",
@@ -82,13 +95,30 @@ void util_presult(const char *msg, Result res)
             msg);
     fflush(stderr);
     consoleSelect(tmp);
+    LightLock_Unlock(&console_lock);
 }
 
 void util_debug_print_delim()
 {
+    LightLock_Lock(&console_lock);
     PrintConsole *tmp = consoleSelect(&debug);
     for (int i = 0; i < debug.windowWidth; i++) {
         putchar('=');
     }
     consoleSelect(tmp);
+    LightLock_Unlock(&console_lock);
+}
+
+void util_tick_wait(u64 *deadline, u64 period)
+{
+    *deadline += period;
+    u64 now = svcGetSystemTick();
+    if (now >= *deadline) {
+        /* Late by more than a period, start over from now */
+        if (now - *deadline >= period) {
+            *deadline = now;
+        }
+        return;
+    }
+    svcSleepThread((s64)((*deadline - now) * 1000 / CPU_TICKS_PER_USEC));
 }
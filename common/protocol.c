@@ -0,0 +1,466 @@
+#include "protocol.h"
+
+#define PROTOCOL_FIELD(arg, field, member) field,
+
+/* Field each value is sent in, in the order of the layouts */
+static const uint8_t protocol_fields[] = {
+    PROTOCOL_VALUES(PROTOCOL_FIELD, 0)};
+
+int protocol_revision(const unsigned char *buf, size_t len)
+{
+    if (len < 2 * 2) {
+        return PACKET_ESIZE;
+    }
+    if (protocol_get_u16(buf) != PACKET_MAGIC) {
+        return PACKET_EMAGIC;
+    }
+
+    int revision = PACKET_PROTOCOL(protocol_get_u16(buf + 2));
+    if (revision == PACKET_PROTOCOL_V1 && len != PACKET_V1_SIZE) {
+        return PACKET_ESIZE;
+    }
+    return revision;
+}
+
+int protocol_pack_v1(const struct protocol_layout *layout,
+                     const void *state,
+                     uint16_t version,
+                     unsigned char *buf)
+{
+    unsigned char *pos = buf;
+    pos                = protocol_put_u16(pos, PACKET_MAGIC);
+    pos                = protocol_put_u16(pos, version);
+
+    for (size_t i = 0; i < PROTOCOL_KEYS_COUNT; i++) {
+        pos = protocol_put_u32(pos, protocol_key(state, layout->keys[i]));
+    }
+    for (size_t i = 0; i < PROTOCOL_VALUES_COUNT; i++) {
+        pos = protocol_put_u16(pos, protocol_value(state, layout->values[i]));
+    }
+    return pos - buf;
+}
+
+/* Read the key words of the v1 packet in `buf` into `state` */
+static const unsigned char *protocol_get_v1_keys(
+    const struct protocol_layout *layout, const unsigned char *buf, void *state)
+{
+    const unsigned char *pos = buf + 2 * 2;
+
+    for (size_t i = 0; i < PROTOCOL_KEYS_COUNT; i++, pos += 4) {
+        protocol_set_key(state, layout->keys[i], protocol_get_u32(pos));
+    }
+    return pos;
+}
+
+int protocol_unpack_v1(const struct protocol_layout *layout,
+                       const unsigned char *buf,
+                       void *state)
+{
+    const unsigned char *pos = protocol_get_v1_keys(layout, buf, state);
+
+    for (size_t i = 0; i < PROTOCOL_VALUES_COUNT; i++, pos += 2) {
+        protocol_set_value(state, layout->values[i], protocol_get_u16(pos));
+    }
+    return pos - buf;
+}
+
+int protocol_unpack_v1_keys(const struct protocol_layout *layout,
+                            const unsigned char *buf,
+                            size_t len,
+                            void *state)
+{
+    if (len != PACKET_V1_SIZE) {
+        return PACKET_ESIZE;
+    }
+    return protocol_get_v1_keys(layout, buf, state) - buf;
+}
+
+unsigned char *protocol_pack_header(unsigned char *buf,
+                                    uint16_t version,
+                                    enum packet_type type,
+                                    uint8_t id)
+{
+    buf    = protocol_put_u16(buf, PACKET_MAGIC);
+    buf    = protocol_put_u16(buf, version);
+    buf[0] = type;
+    buf[1] = id;
+    return buf + 2;
+}
+
+unsigned char *protocol_pack_values(const struct protocol_layout *layout,
+                                    const void *state,
+                                    const struct protocol_state *base,
+                                    unsigned char *buf,
+                                    unsigned *fields)
+{
+    size_t first = 0;
+    while (first < PROTOCOL_VALUES_COUNT) {
+        /* The values of a field follow each other */
+        size_t last = first;
+        int changed = 0;
+        for (; last < PROTOCOL_VALUES_COUNT &&
+               protocol_fields[last] == protocol_fields[first];
+             last++) {
+            changed |= protocol_value(state, layout->values[last]) !=
+                       base->values[last];
+        }
+
+        if (changed) {
+            *fields |= protocol_fields[first];
+            for (size_t i = first; i < last; i++) {
+                buf = protocol_put_varint(
+                    buf,
+                    protocol_value(state, layout->values[i]) -
+                        base->values[i]);
+            }
+        }
+        first = last;
+    }
+    return buf;
+}
+
+const unsigned char *
+protocol_unpack_values(const struct protocol_layout *layout,
+                       const unsigned char *buf,
+                       const unsigned char *end,
+                       unsigned fields,
+                       void *state)
+{
+    for (size_t i = 0; i < PROTOCOL_VALUES_COUNT; i++) {
+        if (!(fields & protocol_fields[i])) {
+            continue;
+        }
+        int16_t delta;
+        if ((buf = protocol_get_varint(buf, end, &delta)) == NULL) {
+            return NULL;
+        }
+        size_t offset = layout->values[i];
+        protocol_set_value(
+            state, offset, protocol_value(state, offset) + delta);
+    }
+    return buf;
+}
+
+const unsigned char *protocol_skip_values(const unsigned char *buf,
+                                          const unsigned char *end,
+                                          unsigned fields)
+{
+    for (size_t i = 0; i < PROTOCOL_VALUES_COUNT; i++) {
+        int16_t delta;
+        if ((fields & protocol_fields[i]) &&
+            (buf = protocol_get_varint(buf, end, &delta)) == NULL) {
+            return NULL;
+        }
+    }
+    return buf;
+}
+
+/* Motion values are the last ones of a state */
+#define PROTOCOL_MOTION_FIRST (PROTOCOL_VALUES_COUNT - PROTOCOL_MOTION_COUNT)
+
+unsigned char *
+protocol_pack_motion(const struct protocol_layout *layout,
+                     const struct protocol_motion_layout *mlayout,
+                     const void *state,
+                     uint32_t sample,
+                     const void *motion,
+                     size_t count,
+                     unsigned char *buf)
+{
+    const char *samples = motion;
+#define protocol_sample(i) (samples + (i) * mlayout->size)
+
+    size_t first = (count > PACKET_MOTION_MAX) ? count - PACKET_MOTION_MAX : 0;
+    /* Samples too old for their age field are left out */
+    while (first < count &&
+           sample - protocol_key(protocol_sample(first), mlayout->sample) >
+               PACKET_MOTION_AGE) {
+        first++;
+    }
+    if (first == count) {
+        return buf;
+    }
+
+    *buf++ = count - first;
+    for (size_t i = first; i < count; i++) {
+        const char *s = protocol_sample(i);
+        buf = protocol_put_u16(buf, sample - protocol_key(s, mlayout->sample));
+        for (size_t j = 0; j < PROTOCOL_MOTION_COUNT; j++) {
+            buf = protocol_put_varint(
+                buf,
+                protocol_value(s, mlayout->values[j]) -
+                    protocol_value(state,
+                                   layout->values[PROTOCOL_MOTION_FIRST + j]));
+        }
+    }
+#undef protocol_sample
+    return buf;
+}
+
+int protocol_unpack_motion(const struct protocol_layout *layout,
+                           const struct protocol_motion_layout *mlayout,
+                           const void *state,
+                           uint32_t sample,
+                           const unsigned char *buf,
+                           const unsigned char *end,
+                           void *motion)
+{
+    if (buf >= end) {
+        return 0;
+    }
+    unsigned count = *buf++;
+    if (count > PACKET_MOTION_MAX) {
+        return PACKET_ESIZE;
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        char *s = (char *) motion + i * mlayout->size;
+        if (end - buf < 2) {
+            return PACKET_ESIZE;
+        }
+        protocol_set_key(s, mlayout->sample, sample - protocol_get_u16(buf));
+        buf += 2;
+        for (size_t j = 0; j < PROTOCOL_MOTION_COUNT; j++) {
+            int16_t delta;
+            if ((buf = protocol_get_varint(buf, end, &delta)) == NULL) {
+                return PACKET_ESIZE;
+            }
+            protocol_set_value(
+                s,
+                mlayout->values[j],
+                protocol_value(state,
+                               layout->values[PROTOCOL_MOTION_FIRST + j]) +
+                    delta);
+        }
+    }
+    return count;
+}
+
+/* Version field of the v2 packets of a client of `version` */
+static uint16_t protocol_v2_version(uint16_t version)
+{
+    return PACKET_BCD_VERSION(version) | PACKET_PROTOCOL_V2 << 12;
+}
+
+int protocol_v2_type(const unsigned char *buf, size_t len, size_t min)
+{
+    if (len < min) {
+        return -1;
+    }
+
+    uint16_t magic   = protocol_get_u16(buf);
+    uint16_t version = protocol_get_u16(buf + 2);
+    if (magic != PACKET_MAGIC ||
+        PACKET_PROTOCOL(version) != PACKET_PROTOCOL_V2) {
+        return -1;
+    }
+
+    return buf[PACKET_V2_OFFSET_TYPE];
+}
+
+void protocol_get_state(const struct protocol_layout *layout,
+                        const void *state,
+                        struct protocol_state *values)
+{
+    for (size_t i = 0; i < PROTOCOL_KEYS_COUNT; i++) {
+        values->keys[i] = protocol_key(state, layout->keys[i]);
+    }
+    for (size_t i = 0; i < PROTOCOL_VALUES_COUNT; i++) {
+        values->values[i] = protocol_value(state, layout->values[i]);
+    }
+}
+
+int protocol_pack_v2(struct protocol_encoder *enc,
+                     const struct protocol_layout *layout,
+                     const void *state,
+                     uint32_t sample,
+                     unsigned char *buf)
+{
+    static const struct protocol_state zero;
+
+    enum packet_type type;
+    const struct protocol_state *base;
+    uint8_t id;
+
+    if (!enc->acked || enc->frames >= PACKET_KEYFRAME_INTERVAL) {
+        type = PACKET_TYPE_KEYFRAME;
+        base = &zero;
+        id   = enc->next_id++;
+
+        struct protocol_keyframe *kf = &enc->sent[id % PACKET_KEYFRAMES];
+        kf->valid                    = 1;
+        kf->id                       = id;
+        protocol_get_state(layout, state, &kf->state);
+
+        /* The server drops the keyframe deltas refer to when it receives
+         * this one */
+        if ((uint8_t)(id - enc->base.id) >= PACKET_KEYFRAMES) {
+            enc->acked = 0;
+        }
+        enc->frames = 0;
+    } else {
+        type = PACKET_TYPE_DELTA;
+        base = &enc->base.state;
+        id   = enc->base.id;
+    }
+    enc->frames++;
+
+    unsigned char *pos = protocol_pack_header(
+        buf, protocol_v2_version(enc->version), type, id);
+    pos                = protocol_put_u16(pos, enc->sequence++);
+    pos                = protocol_put_u32(pos, sample);
+
+    unsigned char *present = pos++;
+    unsigned fields        = 0;
+
+    uint32_t held = protocol_key(state, layout->keys[PROTOCOL_KEYS_HELD]);
+    uint32_t down = protocol_key(state, layout->keys[PROTOCOL_KEYS_DOWN]);
+    uint32_t up   = protocol_key(state, layout->keys[PROTOCOL_KEYS_UP]);
+    if (held != base->keys[PROTOCOL_KEYS_HELD]) {
+        fields |= PACKET_FIELD_HELD;
+        pos = protocol_put_keys(pos, held);
+    }
+    if (down != 0 || up != 0) {
+        fields |= PACKET_FIELD_EDGES;
+        pos = protocol_put_keys(pos, down);
+        pos = protocol_put_keys(pos, up);
+    }
+
+    pos = protocol_pack_values(layout, state, base, pos, &fields);
+
+    /* Repeat the edges of the last packets, newest first */
+    unsigned redundancy = enc->redundancy;
+    if (redundancy == 0 || redundancy > PACKET_HISTORY_FRAMES) {
+        redundancy = PACKET_HISTORY_FRAMES;
+    }
+    uint16_t sequence    = enc->sequence - 1;
+    unsigned char *count = pos;
+    *count               = 0;
+    for (unsigned distance = 1;
+         distance <= redundancy && *count < PACKET_HISTORY_MAX;
+         distance++) {
+        uint16_t previous = sequence - distance;
+        const struct protocol_edges *frame =
+            &enc->history[previous % PACKET_HISTORY_FRAMES];
+        if (frame->sequence != previous || (frame->down | frame->up) == 0) {
+            continue;
+        }
+        if (*count == 0) {
+            fields |= PACKET_FIELD_HISTORY;
+            pos++;
+        }
+        *pos++ = distance;
+        pos    = protocol_put_keys(pos, frame->down);
+        pos    = protocol_put_keys(pos, frame->up);
+        (*count)++;
+    }
+    *present = fields;
+
+    enc->history[sequence % PACKET_HISTORY_FRAMES] = (struct protocol_edges){
+        .sequence = sequence,
+        .down     = down,
+        .up       = up,
+    };
+
+    return pos - buf;
+}
+
+int protocol_receive_ack(struct protocol_encoder *enc,
+                         const unsigned char *buf,
+                         size_t len)
+{
+    if (protocol_v2_type(buf, len, PACKET_V2_ACK_SIZE) != PACKET_TYPE_ACK) {
+        return -1;
+    }
+
+    uint8_t id                         = buf[PACKET_V2_OFFSET_ID];
+    const struct protocol_keyframe *kf = &enc->sent[id % PACKET_KEYFRAMES];
+    if (!kf->valid || kf->id != id) {
+        /* Too old, the server no longer keeps it */
+        return 0;
+    }
+    if (!enc->acked || (int8_t)(id - enc->base.id) > 0) {
+        enc->base  = *kf;
+        enc->acked = 1;
+    }
+    return 0;
+}
+
+int protocol_pack_probe(struct protocol_clock *clock,
+                        uint16_t version,
+                        uint32_t now,
+                        unsigned char *buf)
+{
+    uint8_t id         = clock->next_id++;
+    unsigned char *pos = protocol_pack_header(
+        buf, protocol_v2_version(version), PACKET_TYPE_PROBE, id);
+    pos = protocol_put_u32(pos, now);
+    pos = protocol_put_u32(
+        pos, (clock->count > 0) ? clock->estimate.rtt : PACKET_CLOCK_UNKNOWN);
+    pos = protocol_put_u32(pos, clock->estimate.offset);
+
+    clock->sent    = now;
+    clock->pending = 1;
+    return pos - buf;
+}
+
+int protocol_update_clock(struct protocol_clock *clock,
+                          const unsigned char *buf,
+                          size_t len,
+                          uint32_t now)
+{
+    if (protocol_v2_type(buf, len, PACKET_V2_ECHO_SIZE) != PACKET_TYPE_ECHO) {
+        return -1;
+    }
+
+    /* Only the echo of the last probe is used, echoes of earlier ones were
+     * delayed by at least one interval */
+    uint32_t sent = protocol_get_u32(buf + PACKET_V2_OFFSET_ECHO_SENT);
+    uint8_t id    = buf[PACKET_V2_OFFSET_ID];
+    if (!clock->pending || id != (uint8_t)(clock->next_id - 1) ||
+        sent != clock->sent) {
+        return 0;
+    }
+    clock->pending    = 0;
+    uint32_t received = protocol_get_u32(buf + PACKET_V2_OFFSET_ECHO_RECEIVED);
+    uint32_t replied  = protocol_get_u32(buf + PACKET_V2_OFFSET_ECHO_REPLIED);
+
+    /* The time spent on the server does not count, and the path is assumed
+     * to take equally long both ways */
+    int32_t rtt = (int32_t)((now - sent) - (replied - received));
+    if (rtt < 0) {
+        rtt = 0;
+    }
+    struct protocol_clock_sample sample = {
+        .rtt    = rtt,
+        .offset = (received - sent) - rtt / 2,
+    };
+    clock->samples[clock->count++ % PACKET_CLOCK_SAMPLES] = sample;
+
+    unsigned count = (clock->count < PACKET_CLOCK_SAMPLES)
+                         ? clock->count
+                         : PACKET_CLOCK_SAMPLES;
+    clock->estimate = clock->samples[0];
+    for (unsigned i = 1; i < count; i++) {
+        if (clock->samples[i].rtt < clock->estimate.rtt) {
+            clock->estimate = clock->samples[i];
+        }
+    }
+    return 0;
+}
+
+int protocol_unpack_report(const unsigned char *buf,
+                           size_t len,
+                           struct ratectl_report *report)
+{
+    int type = protocol_v2_type(buf, len, PACKET_V2_REPORT_SIZE);
+    if (type != PACKET_TYPE_REPORT) {
+        return (type < 0) ? PACKET_EMAGIC : PACKET_EPROTOCOL;
+    }
+
+    report->received = protocol_get_u32(buf + PACKET_V2_OFFSET_REPORT_RECEIVED);
+    report->lost     = protocol_get_u32(buf + PACKET_V2_OFFSET_REPORT_LOST);
+    report->jitter   = protocol_get_u32(buf + PACKET_V2_OFFSET_REPORT_JITTER);
+    report->queue    = protocol_get_u32(buf + PACKET_V2_OFFSET_REPORT_QUEUE);
+    return 0;
+}
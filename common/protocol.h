@@ -0,0 +1,493 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ratectl.h"
+
+/* Wire format of ctroller packets, shared by the 3DS application and the
+ * server and tools on Linux, so it only depends on the C library. The layout
+ * of the packets is described in linux/include/packet.h.
+ *
+ * The values of a state are listed once below, in the order both protocol
+ * revisions send them. Each side keeps its own state struct (the 3DS one is
+ * built from libctru types), with the member names the schema uses.
+ * PROTOCOL_LAYOUT() takes the position of every value in such a struct, and
+ * the functions below pack and unpack states through it. A new value is a
+ * line in the schema; it changes the size of v1 packets and, if it lacks a
+ * field of its own, the meaning of an existing v2 field, so it takes a new
+ * protocol revision.
+ */
+
+/* Key words of a state, v2 packets send each one by what it holds: X(arg,
+ * key, member) with an enum protocol_key_word, whose order is the one of v1
+ * packets */
+#define PROTOCOL_KEYS(X, arg)                                                  \
+    X(arg, PROTOCOL_KEYS_UP, keys.up)                                          \
+    X(arg, PROTOCOL_KEYS_DOWN, keys.down)                                      \
+    X(arg, PROTOCOL_KEYS_HELD, keys.held)
+
+enum protocol_key_word {
+    PROTOCOL_KEYS_UP,   /* keys released since the last state */
+    PROTOCOL_KEYS_DOWN, /* keys pressed since the last state */
+    PROTOCOL_KEYS_HELD, /* keys held */
+};
+
+/* 16-bit values of a state, in the order of both revisions, with the v2 field
+ * they are sent in: X(arg, field, member). Values of a field are sent
+ * together if any of them changed. */
+#define PROTOCOL_INPUTS(X, arg)                                                \
+    X(arg, PACKET_FIELD_TOUCH, touchscreen.px)                                 \
+    X(arg, PACKET_FIELD_TOUCH, touchscreen.py)                                 \
+    X(arg, PACKET_FIELD_CPAD, circlepad.dx)                                    \
+    X(arg, PACKET_FIELD_CPAD, circlepad.dy)                                    \
+    X(arg, PACKET_FIELD_CSTICK, cstick.dx)                                     \
+    X(arg, PACKET_FIELD_CSTICK, cstick.dy)
+
+/* The values following the inputs, which are also sent in motion batches */
+#define PROTOCOL_MOTION(X, arg)                                                \
+    X(arg, PACKET_FIELD_GYRO, gyro.x)                                          \
+    X(arg, PACKET_FIELD_GYRO, gyro.y)                                          \
+    X(arg, PACKET_FIELD_GYRO, gyro.z)                                          \
+    X(arg, PACKET_FIELD_ACCEL, accel.x)                                        \
+    X(arg, PACKET_FIELD_ACCEL, accel.y)                                        \
+    X(arg, PACKET_FIELD_ACCEL, accel.z)
+
+#define PROTOCOL_VALUES(X, arg) PROTOCOL_INPUTS(X, arg) PROTOCOL_MOTION(X, arg)
+
+#define PROTOCOL_COUNT_KEY(arg, key, member) +1
+#define PROTOCOL_COUNT_VALUE(arg, field, member) +1
+#define PROTOCOL_KEYS_COUNT (0 PROTOCOL_KEYS(PROTOCOL_COUNT_KEY, 0))
+#define PROTOCOL_VALUES_COUNT (0 PROTOCOL_VALUES(PROTOCOL_COUNT_VALUE, 0))
+#define PROTOCOL_MOTION_COUNT (0 PROTOCOL_MOTION(PROTOCOL_COUNT_VALUE, 0))
+
+/* Position of the keys, indexed by enum protocol_key_word, and of the values
+ * in a state struct */
+struct protocol_layout {
+    size_t keys[PROTOCOL_KEYS_COUNT];
+    size_t values[PROTOCOL_VALUES_COUNT];
+};
+
+/* Position of the sample time and motion values in a struct of a motion
+ * sample, and its size */
+struct protocol_motion_layout {
+    size_t size;
+    size_t sample;
+    size_t values[PROTOCOL_MOTION_COUNT];
+};
+
+/* Key and value at `offset` in a state struct, of the type of its member */
+static inline uint32_t protocol_key(const void *state, size_t offset)
+{
+    return *(const uint32_t *) ((const char *) state + offset);
+}
+
+static inline uint16_t protocol_value(const void *state, size_t offset)
+{
+    return *(const uint16_t *) ((const char *) state + offset);
+}
+
+static inline void protocol_set_key(void *state, size_t offset, uint32_t key)
+{
+    *(uint32_t *) ((char *) state + offset) = key;
+}
+
+static inline void protocol_set_value(void *state,
+                                      size_t offset,
+                                      uint16_t value)
+{
+    *(uint16_t *) ((char *) state + offset) = value;
+}
+
+#define PROTOCOL_OFFSET_KEY(type, key, member) [key] = offsetof(type, member),
+#define PROTOCOL_OFFSET_VALUE(type, field, member) offsetof(type, member),
+
+/* Initializer of the struct protocol_layout of `type` */
+#define PROTOCOL_LAYOUT(type)                                                  \
+    {                                                                          \
+        .keys   = {PROTOCOL_KEYS(PROTOCOL_OFFSET_KEY, type)},                  \
+        .values = {PROTOCOL_VALUES(PROTOCOL_OFFSET_VALUE, type)},              \
+    }
+
+/* Initializer of the struct protocol_motion_layout of `type` */
+#define PROTOCOL_MOTION_LAYOUT(type)                                           \
+    {                                                                          \
+        .size   = sizeof(type),                                                \
+        .sample = offsetof(type, sample),                                      \
+        .values = {PROTOCOL_MOTION(PROTOCOL_OFFSET_VALUE, type)},              \
+    }
+
+#define PROTOCOL_ASSERT_KEY(type, key, member)                                 \
+    _Static_assert(sizeof(((type *) 0)->member) == 4,                          \
+                   #type "." #member " must be 32 bits");
+#define PROTOCOL_ASSERT_VALUE(type, field, member)                             \
+    _Static_assert(sizeof(((type *) 0)->member) == 2,                          \
+                   #type "." #member " must be 16 bits");
+
+/* Check at compile time that the members of the state struct `type` have the
+ * sizes the layout expects, at file scope */
+#define PROTOCOL_ASSERT_LAYOUT(type)                                           \
+    PROTOCOL_KEYS(PROTOCOL_ASSERT_KEY, type)                                   \
+    PROTOCOL_VALUES(PROTOCOL_ASSERT_VALUE, type)
+
+/* Same for the motion samples */
+#define PROTOCOL_ASSERT_MOTION_LAYOUT(type)                                    \
+    _Static_assert(sizeof(((type *) 0)->sample) == 4,                          \
+                   #type ".sample must be 32 bits");                           \
+    PROTOCOL_MOTION(PROTOCOL_ASSERT_VALUE, type)
+
+#define PACKET_MAGIC 0x3d5c
+
+/* The upper nibble of the version field is 0 in the BCD versions of v1 */
+#define PACKET_PROTOCOL(version) (((version) >> 12) & 0xf)
+#define PACKET_BCD_VERSION(version) ((version) & 0x0fff)
+#define PACKET_PROTOCOL_V1 0
+#define PACKET_PROTOCOL_V2 2
+
+/* Magic, version, the key words and the values */
+#define PACKET_V1_SIZE                                                         \
+    (2 * 2 + PROTOCOL_KEYS_COUNT * 4 + PROTOCOL_VALUES_COUNT * 2)
+
+enum packet_type {
+    PACKET_TYPE_KEYFRAME = 0, /* state relative to zero */
+    PACKET_TYPE_DELTA    = 1, /* state relative to an acknowledged keyframe */
+    PACKET_TYPE_ACK      = 2, /* server to client: keyframe received */
+    PACKET_TYPE_PROBE    = 3, /* client clock and estimate */
+    PACKET_TYPE_ECHO     = 4, /* server to client: answer to a probe */
+    PACKET_TYPE_REPORT   = 5, /* server to client: reception of its packets */
+};
+
+enum packet_field {
+    PACKET_FIELD_HELD    = 1 << 0, /* keys held, 24 bits */
+    PACKET_FIELD_EDGES   = 1 << 1, /* keys down and up, 24 bits each */
+    PACKET_FIELD_TOUCH   = 1 << 2, /* px, py */
+    PACKET_FIELD_CPAD    = 1 << 3, /* dx, dy */
+    PACKET_FIELD_CSTICK  = 1 << 4, /* dx, dy */
+    PACKET_FIELD_GYRO    = 1 << 5, /* x, y, z */
+    PACKET_FIELD_ACCEL   = 1 << 6, /* x, y, z */
+    PACKET_FIELD_HISTORY = 1 << 7, /* key edges of previous packets */
+};
+
+#define PACKET_V2_HEADER_SIZE 13
+/* Offsets in a v2 packet: the magic and version are followed by the type and
+ * id of every packet, and the sequence number, sample time and present fields
+ * of keyframes and deltas */
+#define PACKET_V2_OFFSET_TYPE 4
+#define PACKET_V2_OFFSET_ID 5
+#define PACKET_V2_OFFSET_SEQUENCE 6
+#define PACKET_V2_OFFSET_SAMPLE 8
+#define PACKET_V2_OFFSET_FIELDS 12
+/* Acks end after the id, probes, echoes and reports carry u32 values */
+#define PACKET_V2_ACK_SIZE (PACKET_V2_OFFSET_ID + 1)
+#define PACKET_V2_OFFSET_PROBE_SENT PACKET_V2_ACK_SIZE
+#define PACKET_V2_OFFSET_PROBE_RTT (PACKET_V2_OFFSET_PROBE_SENT + 4)
+#define PACKET_V2_OFFSET_PROBE_OFFSET (PACKET_V2_OFFSET_PROBE_RTT + 4)
+#define PACKET_V2_PROBE_SIZE (PACKET_V2_OFFSET_PROBE_OFFSET + 4)
+#define PACKET_V2_OFFSET_ECHO_SENT PACKET_V2_ACK_SIZE
+#define PACKET_V2_OFFSET_ECHO_RECEIVED (PACKET_V2_OFFSET_ECHO_SENT + 4)
+#define PACKET_V2_OFFSET_ECHO_REPLIED (PACKET_V2_OFFSET_ECHO_RECEIVED + 4)
+#define PACKET_V2_ECHO_SIZE (PACKET_V2_OFFSET_ECHO_REPLIED + 4)
+#define PACKET_V2_OFFSET_REPORT_RECEIVED PACKET_V2_ACK_SIZE
+#define PACKET_V2_OFFSET_REPORT_LOST (PACKET_V2_OFFSET_REPORT_RECEIVED + 4)
+#define PACKET_V2_OFFSET_REPORT_JITTER (PACKET_V2_OFFSET_REPORT_LOST + 4)
+#define PACKET_V2_OFFSET_REPORT_QUEUE (PACKET_V2_OFFSET_REPORT_JITTER + 4)
+#define PACKET_V2_REPORT_SIZE (PACKET_V2_OFFSET_REPORT_QUEUE + 4)
+/* Packets whose key edges are repeated, and how many of them at most */
+#define PACKET_HISTORY_FRAMES 8
+#define PACKET_HISTORY_MAX 4
+/* Samples of the motion sensors in a packet, and the oldest one, in us before
+ * the packet */
+#define PACKET_MOTION_MAX 8
+#define PACKET_MOTION_AGE UINT16_MAX
+/* Header, keys, the values as varints of up to 3 bytes, the history and the
+ * motion batch */
+#define PACKET_V2_MAX_SIZE                                                     \
+    (PACKET_V2_HEADER_SIZE + 9 + PROTOCOL_VALUES_COUNT * 3 + 1 +               \
+     PACKET_HISTORY_MAX * 7 + 1 +                                              \
+     PACKET_MOTION_MAX * (2 + PROTOCOL_MOTION_COUNT * 3))
+
+/* Time between probes in ms, and the exchanges an estimate is taken from */
+#define PACKET_PROBE_INTERVAL 1000
+#define PACKET_CLOCK_SAMPLES 8
+/* Longest time between packets of a client sending on changes only, in ms */
+#define PACKET_KEEPALIVE_INTERVAL 200
+/* Round-trip time of a client without an estimate yet */
+#define PACKET_CLOCK_UNKNOWN UINT32_MAX
+
+/* Number of keyframes a server keeps per client, indexed by id modulo this */
+#define PACKET_KEYFRAMES 16
+/* Frames between keyframes once one was acknowledged */
+#define PACKET_KEYFRAME_INTERVAL 30
+
+enum packet_error {
+    PACKET_EMAGIC    = -1, /* not a ctroller packet */
+    PACKET_ESIZE     = -2, /* truncated, or the wrong size for v1 */
+    PACKET_EPROTOCOL = -3, /* unknown protocol revision or packet type */
+    PACKET_ESTALE    = -4, /* delta relative to an unknown keyframe */
+};
+
+/* The keys, indexed by enum protocol_key_word, and values of a state, in the
+ * order of the schema */
+struct protocol_state {
+    uint32_t keys[PROTOCOL_KEYS_COUNT];
+    uint16_t values[PROTOCOL_VALUES_COUNT];
+};
+
+/* A keyframe sent by a client */
+struct protocol_keyframe {
+    int valid;
+    uint8_t id;
+    struct protocol_state state;
+};
+
+/* Key edges of a packet sent */
+struct protocol_edges {
+    uint16_t sequence;
+    uint32_t down, up;
+};
+
+/* Round-trip time and clock offset, in us */
+struct protocol_clock_sample {
+    uint32_t rtt;
+    uint32_t offset;
+};
+
+/* Probes of a client and its estimate of the server's clock */
+struct protocol_clock {
+    uint8_t next_id; /* id of the next probe */
+    uint32_t sent;   /* time the last probe was sent */
+    int pending;     /* whether its echo was not received yet */
+    unsigned count;  /* exchanges completed */
+    /* Last exchanges, indexed by their count, and the best one of them. Only
+     * valid once one was completed. */
+    struct protocol_clock_sample samples[PACKET_CLOCK_SAMPLES];
+    struct protocol_clock_sample estimate;
+};
+
+/* State of the v2 encoder of a client */
+struct protocol_encoder {
+    uint16_t version;              /* BCD version sent */
+    uint16_t sequence;             /* sequence number of the next packet */
+    uint8_t next_id;               /* id of the next keyframe */
+    unsigned frames;               /* frames since the last keyframe */
+    int acked;                     /* whether deltas can refer to `base` */
+    struct protocol_keyframe base; /* last acknowledged keyframe */
+    /* Keyframes sent last, an ack is only accepted while the server still
+     * keeps the keyframe */
+    struct protocol_keyframe sent[PACKET_KEYFRAMES];
+    /* Key edges of the last packets, indexed by sequence number */
+    struct protocol_edges history[PACKET_HISTORY_FRAMES];
+    /* Packets back whose key edges are repeated, all of `history` if 0 */
+    unsigned redundancy;
+};
+
+/* All numbers are in network byte order */
+static inline uint16_t protocol_get_u16(const unsigned char *buf)
+{
+    return (uint16_t) buf[0] << 8 | buf[1];
+}
+
+static inline uint32_t protocol_get_u32(const unsigned char *buf)
+{
+    return (uint32_t) buf[0] << 24 | (uint32_t) buf[1] << 16 |
+           (uint32_t) buf[2] << 8 | buf[3];
+}
+
+static inline unsigned char *protocol_put_u16(unsigned char *buf,
+                                              uint16_t value)
+{
+    buf[0] = value >> 8;
+    buf[1] = value;
+    return buf + 2;
+}
+
+static inline unsigned char *protocol_put_u32(unsigned char *buf,
+                                              uint32_t value)
+{
+    buf[0] = value >> 24;
+    buf[1] = value >> 16;
+    buf[2] = value >> 8;
+    buf[3] = value;
+    return buf + 4;
+}
+
+/* Key words in v2 packets: the 24 bits the 3DS uses (0-11, 14-15, 20 and
+ * 24-31) */
+static inline unsigned char *protocol_put_keys(unsigned char *buf,
+                                               uint32_t keys)
+{
+    keys = (keys & 0x000fff) | ((keys >> 2) & 0x003000) |
+           ((keys >> 6) & 0x004000) | ((keys >> 8) & 0xff0000);
+
+    buf[0] = keys >> 16;
+    buf[1] = keys >> 8;
+    buf[2] = keys;
+    return buf + 3;
+}
+
+/* Returns NULL if the packet ends before `end` */
+static inline const unsigned char *protocol_get_keys(const unsigned char *buf,
+                                                     const unsigned char *end,
+                                                     uint32_t *keys)
+{
+    if (end - buf < 3) {
+        return NULL;
+    }
+    uint32_t packed = (uint32_t) buf[0] << 16 | (uint32_t) buf[1] << 8 | buf[2];
+
+    *keys = (packed & 0x000fff) | ((packed & 0x003000) << 2) |
+            ((packed & 0x004000) << 6) | ((packed & 0xff0000) << 8);
+    return buf + 3;
+}
+
+/* Differences in v2 packets: zigzag encoded LEB128 varints */
+static inline unsigned char *protocol_put_varint(unsigned char *buf,
+                                                 int16_t value)
+{
+    uint32_t zigzag = ((uint32_t) value << 1) ^ (uint32_t)(value >> 15);
+    while (zigzag >= 0x80) {
+        *buf++ = zigzag | 0x80;
+        zigzag >>= 7;
+    }
+    *buf++ = zigzag;
+    return buf;
+}
+
+/* Returns NULL if the packet ends before `end` or the varint is too long */
+static inline const unsigned char *
+protocol_get_varint(const unsigned char *buf,
+                    const unsigned char *end,
+                    int16_t *value)
+{
+    uint32_t zigzag = 0;
+    for (unsigned shift = 0; shift < 21; shift += 7) {
+        if (buf == end) {
+            return NULL;
+        }
+        unsigned char byte = *buf++;
+        zigzag |= (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = (int16_t)((zigzag >> 1) ^ -(zigzag & 1));
+            return buf;
+        }
+    }
+    return NULL;
+}
+
+/* Protocol revision of the packet in `buf` after checking its magic, and its
+ * size for v1. Returns a negative enum packet_error otherwise. */
+int protocol_revision(const unsigned char *buf, size_t len);
+
+/* Write the v1 packet of `state` to `buf`, which must hold PACKET_V1_SIZE
+ * bytes. Returns the number of bytes written. */
+int protocol_pack_v1(const struct protocol_layout *layout,
+                     const void *state,
+                     uint16_t version,
+                     unsigned char *buf);
+/* Read the keys and values of the v1 packet in `buf` into `state`, the size
+ * must have been checked by protocol_revision(). Returns the number of bytes
+ * read. */
+int protocol_unpack_v1(const struct protocol_layout *layout,
+                       const unsigned char *buf,
+                       void *state);
+/* Only read the keys of the v1 packet in `buf` of `len` bytes into `state`.
+ * Returns the number of bytes read, or PACKET_ESIZE. */
+int protocol_unpack_v1_keys(const struct protocol_layout *layout,
+                            const unsigned char *buf,
+                            size_t len,
+                            void *state);
+
+/* Write the magic, `version`, `type` and `id` shared by all v2 packets.
+ * Returns the end of them. */
+unsigned char *protocol_pack_header(unsigned char *buf,
+                                    uint16_t version,
+                                    enum packet_type type,
+                                    uint8_t id);
+
+/* Copy the keys and values of `state` into `values` */
+void protocol_get_state(const struct protocol_layout *layout,
+                        const void *state,
+                        struct protocol_state *values);
+
+/* Write the differences of the values of `state` to `base`, in the fields
+ * where any of them differs, and add those fields to `fields`. Returns the
+ * end of them. */
+unsigned char *protocol_pack_values(const struct protocol_layout *layout,
+                                    const void *state,
+                                    const struct protocol_state *base,
+                                    unsigned char *buf,
+                                    unsigned *fields);
+/* Add the differences in `fields` to the values of `state`. Returns the end
+ * of them, or NULL if the packet ends before `end`. */
+const unsigned char *
+protocol_unpack_values(const struct protocol_layout *layout,
+                       const unsigned char *buf,
+                       const unsigned char *end,
+                       unsigned fields,
+                       void *state);
+/* Skip the differences in `fields`, returns NULL like protocol_unpack_values()
+ */
+const unsigned char *protocol_skip_values(const unsigned char *buf,
+                                          const unsigned char *end,
+                                          unsigned fields);
+
+/* Write the motion batch of `count` samples in `motion`, oldest first, for
+ * the packet of `state` sampled at `sample` us. Only the newest
+ * PACKET_MOTION_MAX samples of at most PACKET_MOTION_AGE us before the packet
+ * are written, nothing if there are none. Returns the end of the batch. */
+unsigned char *
+protocol_pack_motion(const struct protocol_layout *layout,
+                     const struct protocol_motion_layout *mlayout,
+                     const void *state,
+                     uint32_t sample,
+                     const void *motion,
+                     size_t count,
+                     unsigned char *buf);
+/* Read the motion batch starting at `buf` of the packet of `state` sampled at
+ * `sample` us into `motion`, which must hold PACKET_MOTION_MAX samples.
+ * Returns the number of samples, 0 without a batch, or PACKET_ESIZE. */
+int protocol_unpack_motion(const struct protocol_layout *layout,
+                           const struct protocol_motion_layout *mlayout,
+                           const void *state,
+                           uint32_t sample,
+                           const unsigned char *buf,
+                           const unsigned char *end,
+                           void *motion);
+
+/* Type of the v2 packet in `buf` of at least `min` bytes, or -1 if it is none
+ */
+int protocol_v2_type(const unsigned char *buf, size_t len, size_t min);
+
+/* Pack `state`, sampled at `sample` us, as the next packet of `enc`. `buf`
+ * must hold PACKET_V2_MAX_SIZE bytes. Returns the number of bytes written. */
+int protocol_pack_v2(struct protocol_encoder *enc,
+                     const struct protocol_layout *layout,
+                     const void *state,
+                     uint32_t sample,
+                     unsigned char *buf);
+/* Take the ack in the packet received by a client, returns 0 if it was one */
+int protocol_receive_ack(struct protocol_encoder *enc,
+                         const unsigned char *buf,
+                         size_t len);
+
+/* Build the next probe of `clock`, sent at `now` us by a client of `version`.
+ * `buf` must hold PACKET_V2_PROBE_SIZE bytes. Returns the number of bytes
+ * written. */
+int protocol_pack_probe(struct protocol_clock *clock,
+                        uint16_t version,
+                        uint32_t now,
+                        unsigned char *buf);
+/* Update `clock` with a packet received by a client at `now` us. Returns 0 if
+ * it was an echo, only the one of the last probe is used. */
+int protocol_update_clock(struct protocol_clock *clock,
+                          const unsigned char *buf,
+                          size_t len,
+                          uint32_t now);
+/* Read the report in `buf`. Returns 0 if it is a report, a negative enum
+ * packet_error otherwise. */
+int protocol_unpack_report(const unsigned char *buf,
+                           size_t len,
+                           struct ratectl_report *report);
+
+#endif /* ----- #ifndef PROTOCOL_H  ----- */
@@ -0,0 +1,102 @@
+#include "ratectl.h"
+
+void ratectl_init(struct ratectl *ctl,
+                  unsigned rate_min,
+                  unsigned rate_max,
+                  unsigned redundancy_min,
+                  unsigned redundancy_max)
+{
+    *ctl = (struct ratectl){
+        .rate_min       = rate_min,
+        .rate_max       = rate_max,
+        .redundancy_min = redundancy_min,
+        .redundancy_max = redundancy_max,
+        .rate           = rate_max,
+        .redundancy     = redundancy_max,
+    };
+}
+
+static void ratectl_redundancy(struct ratectl *ctl, int step)
+{
+    if (step > 0 && ctl->redundancy < ctl->redundancy_max) {
+        ctl->redundancy++;
+    } else if (step < 0 && ctl->redundancy > ctl->redundancy_min) {
+        ctl->redundancy--;
+    }
+}
+
+static enum ratectl_link ratectl_classify(const struct ratectl *ctl,
+                                          const struct ratectl_report *report)
+{
+    uint32_t received = report->received - ctl->last.received;
+    /* Late packets are taken back from the lost ones */
+    int32_t lost = (int32_t)(report->lost - ctl->last.lost);
+    if (lost < 0) {
+        lost = 0;
+    }
+    if (received == 0) {
+        return RATECTL_UNKNOWN;
+    }
+
+    uint32_t loss = (uint64_t) lost * 1000 / (received + lost);
+    uint64_t queue_max =
+        RATECTL_QUEUE_MIN + (uint64_t) RATECTL_QUEUE_JITTER * report->jitter;
+    if (report->queue > queue_max || loss > RATECTL_LOSS_CONGESTED) {
+        return RATECTL_CONGESTED;
+    }
+    if (loss > RATECTL_LOSS_LOSSY) {
+        return RATECTL_LOSSY;
+    }
+    return (lost == 0) ? RATECTL_CLEAN : RATECTL_STEADY;
+}
+
+enum ratectl_link ratectl_update(struct ratectl *ctl,
+                                 const struct ratectl_report *report)
+{
+    enum ratectl_link link =
+        ctl->reported ? ratectl_classify(ctl, report) : RATECTL_UNKNOWN;
+    ctl->last     = *report;
+    ctl->reported = 1;
+    ctl->link     = link;
+
+    switch (link) {
+    case RATECTL_CONGESTED:
+        ctl->rate -= ctl->rate / 4;
+        if (ctl->rate < ctl->rate_min) {
+            ctl->rate = ctl->rate_min;
+        }
+        ratectl_redundancy(ctl, 1);
+        ctl->clean = 0;
+        break;
+    case RATECTL_LOSSY:
+        ratectl_redundancy(ctl, 1);
+        ctl->clean = 0;
+        break;
+    case RATECTL_CLEAN:
+        if (++ctl->clean < RATECTL_CLEAN_REPORTS) {
+            break;
+        }
+        unsigned step = (ctl->rate_max - ctl->rate_min) / 10;
+        ctl->rate += (step > 0) ? step : 1;
+        if (ctl->rate > ctl->rate_max) {
+            ctl->rate = ctl->rate_max;
+        }
+        ratectl_redundancy(ctl, -1);
+        ctl->clean = 0;
+        break;
+    case RATECTL_STEADY:
+    case RATECTL_UNKNOWN:
+        break;
+    }
+    return link;
+}
+
+int ratectl_due(const struct ratectl *ctl, unsigned *credit)
+{
+    *credit += ctl->rate;
+    if (*credit < ctl->rate_max) {
+        return 0;
+    }
+    *credit -= ctl->rate_max;
+    return 1;
+}
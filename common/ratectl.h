@@ -0,0 +1,80 @@
+#ifndef RATECTL_H
+#define RATECTL_H
+
+#include <stdint.h>
+
+/* Send rate and redundancy control of a client, driven by the reports the
+ * server sends with every echo of a clock probe (see linux/include/packet.h).
+ * Shared by the 3DS application and the tools on Linux, so it only depends on
+ * the C library.
+ *
+ * Every report is classified by the loss since the one before and by the peak
+ * queueing delay the server measured:
+ *
+ *  - congested: the queueing delay exceeds RATECTL_QUEUE_MIN plus a multiple
+ *    of the jitter, or more than RATECTL_LOSS_CONGESTED of the packets were
+ *    lost. The rate is cut by a quarter and the redundancy raised, the loss
+ *    is likely to go on for a while.
+ *  - lossy: packets are lost without queueing, like on a noisy Wi-Fi channel.
+ *    Sending less would not help, the redundancy is raised.
+ *  - clean: neither loss nor queueing. After RATECTL_CLEAN_REPORTS in a row,
+ *    the rate is raised by a tenth of its range and the redundancy lowered.
+ *  - steady: some loss, but too little to be lossy. Nothing changes.
+ *
+ * Redundancy is the number of packets back whose key edges are repeated.
+ */
+
+/* Loss in per mille above which the link is lossy or congested */
+#define RATECTL_LOSS_LOSSY 10
+#define RATECTL_LOSS_CONGESTED 100
+/* Queueing delay in us that counts as congestion, on top of the jitter times
+ * RATECTL_QUEUE_JITTER */
+#define RATECTL_QUEUE_MIN 10000
+#define RATECTL_QUEUE_JITTER 4
+/* Clean reports in a row before the rate is raised */
+#define RATECTL_CLEAN_REPORTS 2
+
+/* Counters of a client as reported by the server, the packet counts wrap
+ * around */
+struct ratectl_report {
+    uint32_t received; /* packets received in order */
+    uint32_t lost;     /* sequence numbers never received */
+    uint32_t jitter;   /* interarrival jitter, in us */
+    uint32_t queue;    /* peak queueing delay since the last report, in us */
+};
+
+enum ratectl_link {
+    RATECTL_UNKNOWN,   /* first report, or nothing received since the last */
+    RATECTL_CLEAN,     /* neither loss nor queueing */
+    RATECTL_STEADY,    /* some loss, too little to act on */
+    RATECTL_LOSSY,     /* loss without queueing */
+    RATECTL_CONGESTED, /* queueing, or heavy loss */
+};
+
+struct ratectl {
+    /* Range of the rate in packets per second, and of the redundancy */
+    unsigned rate_min, rate_max;
+    unsigned redundancy_min, redundancy_max;
+
+    unsigned rate;
+    unsigned redundancy;
+    enum ratectl_link link; /* of the last report */
+    unsigned clean;         /* clean reports since the rate was changed */
+    int reported;           /* whether `last` holds a report */
+    struct ratectl_report last;
+};
+
+/* Start at the highest rate and redundancy */
+void ratectl_init(struct ratectl *ctl,
+                  unsigned rate_min,
+                  unsigned rate_max,
+                  unsigned redundancy_min,
+                  unsigned redundancy_max);
+/* Adapt the rate and redundancy to `report`. Returns the state of the link. */
+enum ratectl_link ratectl_update(struct ratectl *ctl,
+                                 const struct ratectl_report *report);
+/* Whether to send in a frame of a loop running at `rate_max`, spreading the
+ * packets evenly. `credit` is kept by the caller, starting at 0. */
+int ratectl_due(const struct ratectl *ctl, unsigned *credit);
+
+#endif /* ----- #ifndef RATECTL_H  ----- */
@@ -0,0 +1,621 @@
+/*
+ *  ctroller -- use your 3DS as a gamepad on your PC
+ *  Copyright (C) 2016  Philipp Joram (phijor)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Microbenchmarks for the server hot path: unpacking packets (v1 and v2),
+ * generating the events of each device and the whole pipeline against the
+ * null output. v1 packets are unpacked by the vector shuffles and by the
+ * scalar reference.
+ */
+
+#define _GNU_SOURCE
+#include <features.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include <linux/input.h>
+
+#include "ctroller.h"
+#include "capture.h"
+#include "devices.h"
+#include "hid.h"
+#include "packet.h"
+#include "sink.h"
+
+/* Allocation counting, the bench binary is linked with --wrap=<function> */
+static unsigned long allocations;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    allocations++;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    allocations++;
+    return __real_realloc(ptr, size);
+}
+
+enum format {
+    FORMAT_TEXT,
+    FORMAT_JSON,
+};
+
+static struct {
+    size_t packets;
+    unsigned repeat;
+    unsigned seed;
+    const char *input;
+    int combined;
+    enum format format;
+} options = {
+    .packets  = 100000,
+    .repeat   = 5,
+    .seed     = 1,
+    .input    = NULL,
+    .combined = 0,
+    .format   = FORMAT_TEXT,
+};
+
+struct stream {
+    unsigned char (*packets)[PACKET_V1_SIZE];
+    struct hidinfo *hids;
+    size_t len;
+
+    /* `hids` encoded as v2 by stream_encode_v2() */
+    unsigned char (*v2_packets)[PACKET_V2_MAX_SIZE];
+    size_t *v2_lens;
+};
+
+struct result {
+    const char *stage;
+    double bytes_per_packet; /* 0 for stages not reading packets */
+    double ns_per_packet;
+    double packets_per_sec;
+    double allocs_per_packet;
+};
+
+/* Results of all stages are folded into this to keep them from being
+ * optimized away */
+static volatile unsigned long bench_sink;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int16_t walk(int16_t val, int step, int16_t min, int16_t max)
+{
+    int res = val + (rand() % (2 * step + 1)) - step;
+    return (res < min) ? min : (res > max) ? max : res;
+}
+
+/* Generate a stream resembling a player: buttons are pressed every few frames,
+ * sticks and motion sensors drift and the touchscreen is used occasionally.
+ */
+static void stream_synthesize(struct stream *stream)
+{
+    struct hidinfo hid = {.version = CTROLLER_VERSION};
+    srand(options.seed);
+
+    for (size_t i = 0; i < stream->len; i++) {
+        uint32_t held = hid.keys.held;
+        if (rand() % 8 == 0) {
+            /* Buttons are bits 0-11, 14 and 15 */
+            unsigned bit = rand() % 14;
+            held ^= BIT((bit < 12) ? bit : bit + 2);
+        }
+        if (rand() % 64 == 0) {
+            held ^= HID_KEY_TOUCH;
+        }
+        hid.keys.down = held & ~hid.keys.held;
+        hid.keys.up   = hid.keys.held & ~held;
+        hid.keys.held = held;
+
+        if (held & HID_KEY_TOUCH) {
+            hid.touchscreen.px = walk(hid.touchscreen.px, 4, 0, 320);
+            hid.touchscreen.py = walk(hid.touchscreen.py, 4, 0, 240);
+        } else {
+            hid.touchscreen.px = hid.touchscreen.py = 0;
+        }
+
+        hid.circlepad.dx = walk(hid.circlepad.dx, 6, -0x9c, 0x9c);
+        hid.circlepad.dy = walk(hid.circlepad.dy, 6, -0x9c, 0x9c);
+        hid.cstick.dx    = walk(hid.cstick.dx, 2, -0x9c, 0x9c);
+        hid.cstick.dy    = walk(hid.cstick.dy, 2, -0x9c, 0x9c);
+
+        hid.gyro.x  = walk(hid.gyro.x, 40, -12000, 12000);
+        hid.gyro.y  = walk(hid.gyro.y, 40, -12000, 12000);
+        hid.gyro.z  = walk(hid.gyro.z, 40, -12000, 12000);
+        hid.accel.x = walk(hid.accel.x, 3, -500, 500);
+        hid.accel.y = walk(hid.accel.y, 3, -500, 500);
+        hid.accel.z = walk(hid.accel.z, 3, -500, 500);
+
+        ctroller_pack_hid_info(&hid, stream->packets[i]);
+    }
+}
+
+static size_t stream_load_capture(struct stream *stream, const char *path)
+{
+    struct capture_reader reader;
+    if (capture_reader_open(&reader, path) < 0) {
+        return 0;
+    }
+
+    size_t n = 0;
+    const struct capture_record *record;
+    while (n < stream->len && (record = capture_reader_next(&reader))) {
+        if (record->len == PACKET_V1_SIZE) {
+            memcpy(stream->packets[n++],
+                   capture_record_data(record),
+                   PACKET_V1_SIZE);
+        }
+    }
+
+    capture_reader_close(&reader);
+    return n;
+}
+
+/* Read a capture recorded by the server (--capture) or raw packets, as
+ * received on the server's port, i.e. by `netcat -ul 15708 > recording`. The
+ * recording is repeated to fill the stream.
+ */
+static int stream_load(struct stream *stream, const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Error opening '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    size_t n;
+    char magic[sizeof(CAPTURE_MAGIC)];
+    if (fread(magic, sizeof(magic), 1, fp) == 1 &&
+        memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) == 0) {
+        n = stream_load_capture(stream, path);
+    } else {
+        rewind(fp);
+        n = fread(stream->packets, PACKET_V1_SIZE, stream->len, fp);
+    }
+    fclose(fp);
+    if (n == 0) {
+        fprintf(stderr, "'%s' does not contain any packets.\n", path);
+        return -1;
+    }
+
+    for (size_t i = n; i < stream->len; i++) {
+        memcpy(stream->packets[i], stream->packets[i % n], PACKET_V1_SIZE);
+    }
+    return 0;
+}
+
+static int stream_init(struct stream *stream, size_t len)
+{
+    stream->len     = len;
+    stream->packets = calloc(len, sizeof(*stream->packets));
+    stream->hids    = calloc(len, sizeof(*stream->hids));
+    if (stream->packets == NULL || stream->hids == NULL) {
+        perror("Allocating packet stream");
+        return -1;
+    }
+
+    if (options.input != NULL) {
+        return stream_load(stream, options.input);
+    }
+
+    stream_synthesize(stream);
+    return 0;
+}
+
+/* Encode the unpacked states as a v2 client would, acknowledging keyframes
+ * right away, and check that they decode to the same states */
+static int stream_encode_v2(struct stream *stream)
+{
+    stream->v2_packets = calloc(stream->len, sizeof(*stream->v2_packets));
+    stream->v2_lens    = calloc(stream->len, sizeof(*stream->v2_lens));
+    if (stream->v2_packets == NULL || stream->v2_lens == NULL) {
+        perror("Allocating v2 stream");
+        return -1;
+    }
+
+    static struct protocol_encoder enc = {.version = CTROLLER_VERSION};
+    static struct packet_stream decoder;
+    for (size_t i = 0; i < stream->len; i++) {
+        unsigned char *packet = stream->v2_packets[i];
+        /* Sampled at 60 Hz */
+        int len =
+            packet_v2_pack(&enc, &stream->hids[i], i * 1000000 / 60, packet);
+        stream->v2_lens[i] = len;
+
+        int id = packet_v2_keyframe_id(packet, len);
+        if (id >= 0) {
+            unsigned char ack[PACKET_V2_ACK_SIZE];
+            protocol_receive_ack(&enc, ack, packet_v2_pack_ack(id, ack));
+        }
+
+        struct hidinfo hid;
+        const struct hidinfo *expected = &stream->hids[i];
+        if (packet_v2_unpack(packet, len, &decoder, &hid) != len ||
+            hid.keys.held != expected->keys.held ||
+            hid.keys.down != expected->keys.down ||
+            hid.keys.up != expected->keys.up ||
+            memcmp(&hid.circlepad,
+                   &expected->circlepad,
+                   offsetof(struct hidinfo, received) -
+                       offsetof(struct hidinfo, circlepad)) != 0) {
+            fprintf(stderr, "Packet %zu differs after a v2 round trip.\n", i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+typedef unsigned long stage_run(const struct stream *stream, void *arg);
+
+static unsigned long run_unpack(const struct stream *stream, void *arg)
+{
+    struct packet_stream *decoder = arg;
+
+    unsigned long sum = 0;
+    for (size_t i = 0; i < stream->len; i++) {
+        sum += ctroller_unpack_hid_info(stream->packets[i],
+                                        PACKET_V1_SIZE,
+                                        decoder,
+                                        &stream->hids[i]);
+    }
+    return sum;
+}
+
+static unsigned long run_unpack_scalar(const struct stream *stream, void *arg)
+{
+    (void) arg;
+
+    unsigned long sum = 0;
+    for (size_t i = 0; i < stream->len; i++) {
+        struct hidinfo hid;
+        sum +=
+            packet_v1_unpack_scalar(stream->packets[i], PACKET_V1_SIZE, &hid);
+    }
+    return sum;
+}
+
+/* Check that the vector path unpacks the stream like the scalar reference */
+static int stream_check_v1(const struct stream *stream)
+{
+    for (size_t i = 0; i < stream->len; i++) {
+        /* Padding is left alone or zeroed */
+        struct hidinfo expected = {}, vector = {};
+        int res = packet_v1_unpack_scalar(
+            stream->packets[i], PACKET_V1_SIZE, &expected);
+        if (packet_v1_unpack(stream->packets[i], PACKET_V1_SIZE, &vector) !=
+                res ||
+            memcmp(&vector, &expected, sizeof(expected)) != 0) {
+            fprintf(stderr,
+                    "Packet %zu differs from the scalar reference.\n",
+                    i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static unsigned long run_unpack_v2(const struct stream *stream, void *arg)
+{
+    struct packet_stream *decoder = arg;
+    memset(decoder, 0, sizeof(*decoder));
+
+    unsigned long sum = 0;
+    for (size_t i = 0; i < stream->len; i++) {
+        struct hidinfo hid;
+        sum += ctroller_unpack_hid_info(
+            stream->v2_packets[i], stream->v2_lens[i], decoder, &hid);
+    }
+    return sum;
+}
+
+static void device_reset(struct device_context *dev)
+{
+    memset(&dev->last, 0, sizeof(dev->last));
+    dev->synced = 0;
+}
+
+static unsigned long run_events(const struct stream *stream, void *arg)
+{
+    struct device_context *dev = arg;
+    struct input_event events[DEVICE_PREPARE_MAX];
+
+    device_reset(dev);
+
+    unsigned long sum = 0;
+    for (size_t i = 0; i < stream->len; i++) {
+        size_t n = device_prepare(dev, &stream->hids[i], events);
+        if (n > 0) {
+            device_commit(dev, &stream->hids[i]);
+        }
+        sum += n;
+    }
+    return sum;
+}
+
+static unsigned long run_pipeline(const struct stream *stream, void *arg)
+{
+    struct device_context **devices = arg;
+    for (; *devices != NULL; devices++) {
+        device_reset(*devices);
+    }
+
+    static struct packet_stream decoder;
+
+    unsigned long sum = 0;
+    for (size_t i = 0; i < stream->len; i++) {
+        struct hidinfo hid;
+        sum += ctroller_unpack_hid_info(
+            stream->packets[i], PACKET_V1_SIZE, &decoder, &hid);
+        hid.received = 0;
+        hid.source   = NULL;
+        ctroller_write_hid_info(&hid);
+    }
+    return sum;
+}
+
+static struct result
+stage(const char *name, stage_run *run, const struct stream *stream, void *arg)
+{
+    uint64_t best      = UINT64_MAX;
+    unsigned long allocs = 0;
+
+    for (unsigned r = 0; r < options.repeat; r++) {
+        unsigned long allocs_before = allocations;
+        uint64_t start              = now_ns();
+
+        bench_sink += run(stream, arg);
+
+        uint64_t elapsed = now_ns() - start;
+        if (elapsed < best) {
+            best = elapsed;
+        }
+        allocs += allocations - allocs_before;
+    }
+
+    double ns = (double) best / stream->len;
+    return (struct result){
+        .stage             = name,
+        .ns_per_packet     = ns,
+        .packets_per_sec   = 1e9 / ns,
+        .allocs_per_packet = (double) allocs / options.repeat / stream->len,
+    };
+}
+
+static void report(const struct result *res)
+{
+    switch (options.format) {
+    case FORMAT_TEXT:
+        printf("%-16s %12.1f %16.0f %14.3f",
+               res->stage,
+               res->ns_per_packet,
+               res->packets_per_sec,
+               res->allocs_per_packet);
+        if (res->bytes_per_packet > 0) {
+            printf(" %13.1f", res->bytes_per_packet);
+        }
+        printf("\n");
+        break;
+    case FORMAT_JSON:
+        printf("{\"version\": \"%s\", \"stage\": \"%s\", \"input\": \"%s\", "
+               "\"combined\": %d, \"packets\": %zu, \"ns_per_packet\": %.2f, "
+               "\"packets_per_sec\": %.0f, \"allocs_per_packet\": %.3f, "
+               "\"bytes_per_packet\": %.1f}\n",
+               CTROLLER_VERSION_STRING,
+               res->stage,
+               (options.input != NULL) ? options.input : "synthetic",
+               options.combined,
+               options.packets,
+               res->ns_per_packet,
+               res->packets_per_sec,
+               res->allocs_per_packet,
+               res->bytes_per_packet);
+        break;
+    }
+}
+
+static void print_usage(void)
+{
+    printf("Usage:\n");
+    printf("  %s [<switches>]\n", program_invocation_short_name);
+    printf("\n");
+
+    printf("<switches>:\n");
+#define print_opt(shortopt, longopt, desc)                                     \
+    printf("  -%-1s  --%-22s " desc, shortopt, longopt)
+
+    print_opt("c", "combined", "run the pipeline on the combined device\n");
+    print_opt("f", "format=<text|json>", "output format (defaults to text)\n");
+    print_opt("h", "help", "print this help text\n");
+    print_opt("i", "input=<path>", "use a capture or a recording of raw "
+                                   "packets as input\n");
+    print_opt("n", "packets=<num>", "number of packets per run\n");
+    print_opt("r", "repeat=<num>", "number of runs per stage, the fastest "
+                                   "is reported\n");
+    print_opt("s", "seed=<num>", "seed of the synthetic input\n");
+#undef print_opt
+}
+
+int main(int argc, char *argv[])
+{
+    // clang-format off
+    static const struct option optstrings[] = {
+        {"combined", no_argument,       NULL, 'c'},
+        {"format",   required_argument, NULL, 'f'},
+        {"help",     no_argument,       NULL, 'h'},
+        {"input",    required_argument, NULL, 'i'},
+        {"packets",  required_argument, NULL, 'n'},
+        {"repeat",   required_argument, NULL, 'r'},
+        {"seed",     required_argument, NULL, 's'},
+        {NULL,       0,                 NULL, 0},
+    };
+    // clang-format on
+
+    int curopt;
+    while ((curopt = getopt_long(
+                argc, argv, "cf:hi:n:r:s:", optstrings, NULL)) != -1) {
+        switch (curopt) {
+        case 'c':
+            options.combined = 1;
+            break;
+        case 'f':
+            if (strcmp(optarg, "json") == 0) {
+                options.format = FORMAT_JSON;
+            } else if (strcmp(optarg, "text") == 0) {
+                options.format = FORMAT_TEXT;
+            } else {
+                print_usage();
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'h':
+            print_usage();
+            return EXIT_SUCCESS;
+        case 'i':
+            options.input = optarg;
+            break;
+        case 'n':
+            options.packets = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            options.repeat = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            options.seed = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (options.packets == 0 || options.repeat == 0) {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+
+    packet_init();
+    struct stream stream = {};
+    if (stream_init(&stream, options.packets) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    /* Event stages run on the states produced by the unpack stage */
+    gamepad_init();
+    struct device_context *devices[] = {
+        &device_gamepad,
+        &device_touchscreen,
+        &device_gyroscope,
+        &device_accelerometer,
+    };
+
+    if (options.format == FORMAT_TEXT) {
+        printf("%-16s %12s %16s %14s %13s\n",
+               "stage",
+               "ns/packet",
+               "packets/s",
+               "allocs/packet",
+               "bytes/packet");
+    }
+
+    if (stream_check_v1(&stream) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    static struct packet_stream decoder;
+    struct result res = stage("unpack", run_unpack, &stream, &decoder);
+    res.bytes_per_packet = PACKET_V1_SIZE;
+    report(&res);
+    res = stage("unpack-scalar", run_unpack_scalar, &stream, NULL);
+    res.bytes_per_packet = PACKET_V1_SIZE;
+    report(&res);
+
+    /* Encoded from the states the v1 stage unpacked */
+    if (stream_encode_v2(&stream) < 0) {
+        return EXIT_FAILURE;
+    }
+    size_t v2_bytes = 0;
+    for (size_t i = 0; i < stream.len; i++) {
+        v2_bytes += stream.v2_lens[i];
+    }
+    res = stage("unpack-v2", run_unpack_v2, &stream, &decoder);
+    res.bytes_per_packet = (double) v2_bytes / stream.len;
+    report(&res);
+
+    for (size_t i = 0; i < arrsize(devices); i++) {
+        res = stage(devices[i]->name, run_events, &stream, devices[i]);
+        report(&res);
+    }
+
+    /* Keep initialization messages out of the (machine-readable) report */
+    fflush(stdout);
+    int out = dup(STDOUT_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    int err = ctroller_devices_init(sink_null.name, ~0u, options.combined);
+    fflush(stdout);
+    dup2(out, STDOUT_FILENO);
+    close(out);
+    if (err < 0) {
+        return EXIT_FAILURE;
+    }
+
+    struct device_context *pipeline[] = {
+        &device_gamepad,
+        &device_touchscreen,
+        &device_gyroscope,
+        &device_accelerometer,
+        &device_combined,
+        NULL,
+    };
+    res = stage(options.combined ? "pipeline-combined" : "pipeline",
+                run_pipeline,
+                &stream,
+                pipeline);
+    report(&res);
+
+    ctroller_exit();
+    free(stream.packets);
+    free(stream.hids);
+    free(stream.v2_packets);
+    free(stream.v2_lens);
+
+    return (bench_sink != 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,79 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <sys/socket.h>
+
+/* Captures record every packet the server receives, with its receive time and
+ * source address, into an append-only file. The file is memory-mapped and
+ * grown in chunks, so recording a packet is a copy into the mapping.
+ *
+ * A capture starts with a struct capture_header, followed by `used` bytes of
+ * records. Each record is a struct capture_record, followed by `len` bytes of
+ * packet data and padded to CAPTURE_ALIGN bytes. All fields are in host byte
+ * order.
+ *
+ * Packets the server drained from the socket in one go are marked, so a replay
+ * coalesces them like the server did.
+ */
+
+#define CAPTURE_MAGIC "CTRLCAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_ALIGN 8
+/* Size the capture file grows by when it is full */
+#define CAPTURE_CHUNK_SIZE (1 << 20)
+
+struct capture_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t used; /* bytes of complete records following the header */
+};
+
+enum capture_flag {
+    /* Received in the same batch as the record before */
+    CAPTURE_BATCHED = 1 << 0,
+};
+
+struct capture_record {
+    uint64_t timestamp; /* receive time in ns since the epoch */
+    uint16_t len;       /* length of the packet data */
+    uint16_t port;      /* source port */
+    uint8_t family;     /* AF_INET or AF_INET6 */
+    uint8_t flags;      /* enum capture_flag */
+    uint8_t reserved[2];
+    uint8_t addr[16]; /* source address, IPv4 addresses use the first 4 bytes */
+};
+
+#define capture_record_data(record)                                            \
+    ((const unsigned char *) ((const struct capture_record *) (record) + 1))
+
+struct capture_reader {
+    int fd;
+    const unsigned char *map;
+    size_t mapped; /* size of the mapping */
+    size_t size;   /* end of the last complete record */
+    size_t offset;
+};
+
+/* Open the capture at `path`, appending to it if it exists */
+int capture_open(const char *path);
+void capture_close(void);
+int capture_active(void);
+
+/* Append a packet received at `timestamp` ns since the epoch from `addr` */
+void capture_write(uint64_t timestamp,
+                   unsigned flags,
+                   const struct sockaddr *addr,
+                   const void *data,
+                   size_t len);
+
+int capture_reader_open(struct capture_reader *reader, const char *path);
+void capture_reader_close(struct capture_reader *reader);
+/* Returns the next record, or NULL at the end of the capture */
+const struct capture_record *capture_reader_next(struct capture_reader *reader);
+
+#endif /* ----- #ifndef CAPTURE_H  ----- */
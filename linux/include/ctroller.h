@@ -2,8 +2,12 @@
 #define CTROLLER_H
 
 #include <stddef.h>
+#include <time.h>
+
+#include <sys/socket.h>
 
 #include "hid.h"
+#include "packet.h"
 
 #define _STRINGIFY(a) #a
 #define STRINGIFY(a) _STRINGIFY(a)
@@ -35,25 +39,123 @@
 
 #define CTROLLER_VERSION MAKEBCDVER(VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH)
 
-#define PACKET_MAGIC 0x3d5c
-#define PACKET_SIZE (2 * sizeof(uint16_t) + sizeof(struct hidinfo))
+/* Receive buffer size, larger than packets of any protocol revision */
+#define PACKET_SIZE 256
 
 #define UINPUT_DEFAULT_DEVICE "/dev/uinput"
 #define PORT_DEFAULT "15708"
 
+/* Maximum number of packets drained from the socket by a single recvmmsg() */
+#define CTROLLER_BATCH_SIZE 32
+/* Ancillary data received with each packet: its receive timestamp */
+#define CTROLLER_CONTROL_SIZE CMSG_SPACE(sizeof(struct timespec))
+/* Maximum number of distinct clients tracked within one batch */
+#define CTROLLER_CLIENTS_MAX 8
+
 typedef unsigned char packet_hid_t[PACKET_SIZE];
 typedef unsigned device_mask_t;
 
-int ctroller_init(const char *uinput_device, const char *port, device_mask_t device_mask);
+enum ctroller_backend {
+    CTROLLER_BACKEND_POLL,  /* poll(), recvmmsg() and write() */
+    CTROLLER_BACKEND_URING, /* io_uring, falls back to poll if unavailable */
+};
+
+struct ctroller_stats {
+    unsigned long batches;   /* number of non-empty batches received */
+    unsigned long packets;   /* number of packets received */
+    unsigned long invalid;   /* packets dropped due to bad size or magic */
+    unsigned long bad_size;  /* packets of the wrong size, i.e. short ones */
+    unsigned long bad_magic; /* packets with the wrong magic */
+    unsigned long mismatch;  /* packets of a different protocol version */
+    unsigned long stale;     /* deltas relative to an unknown keyframe */
+    unsigned long keyframes; /* keyframes received and acknowledged */
+    unsigned long probes;    /* clock probes received and echoed */
+    unsigned long late;      /* packets older than one received before */
+    unsigned long duplicate; /* packets received twice */
+    unsigned long lost;      /* sequence numbers never received */
+    unsigned long recovered; /* lost packets whose key edges were rebuilt */
+    unsigned long overflow;  /* packets dropped, too many clients */
+    unsigned long coalesced; /* packets folded into a newer one */
+    /* batch_coalesced[n]: number of batches that coalesced n packets, the
+     * last bucket counts everything at or above it */
+    unsigned long batch_coalesced[CTROLLER_BATCH_SIZE];
+
+    /* CLOCK_MONOTONIC time in ns the last batch was woken up at */
+    uint64_t batch_start;
+};
+
+int ctroller_init(const char *output,
+                  const char *port,
+                  device_mask_t device_mask,
+                  int combined,
+                  enum ctroller_backend backend);
 int ctroller_listener_init(const char *port);
-int ctroller_uinput_init(const char *uinput_device, device_mask_t device_mask);
+int ctroller_devices_init(const char *output,
+                          device_mask_t device_mask,
+                          int combined);
+
+/* Write devices with a playout delay at `rate` Hz from a jitter buffer.
+ * `delays` holds the longest delay of each device (enum DEVICE_ID) in ms, 0
+ * writes a device on receive. Requires the poll backend. */
+int ctroller_playout_init(unsigned rate, const unsigned *delays);
 
 void ctroller_exit(void);
 
 int ctroller_recv(void *buf, size_t len);
 
 int ctroller_poll_hid_info(struct hidinfo *);
-int ctroller_unpack_hid_info(unsigned char *sendbuf, struct hidinfo *hid);
+int ctroller_poll_hid_batch(struct hidinfo *hids, size_t len);
+
+/* Requests signal handlers pass to the main loop */
+enum ctroller_request {
+    CTROLLER_REQUEST_STOP   = 1 << 0, /* clean up and exit */
+    CTROLLER_REQUEST_REPORT = 1 << 1, /* print the latency histograms */
+};
+
+/* Post `request`, async-signal-safe. Wakes up ctroller_poll_hid_batch(),
+ * which then returns 0. */
+void ctroller_request(enum ctroller_request request);
+/* Take the requests posted since the last call, bits of enum
+ * ctroller_request */
+unsigned ctroller_take_requests(void);
+
+/* Unpack a packet of `len` bytes of any protocol revision. `stream` holds the
+ * keyframes of the client that sent it. Returns the number of bytes used or a
+ * negative enum packet_error. */
+int ctroller_unpack_hid_info(unsigned char *sendbuf,
+                             size_t len,
+                             struct packet_stream *stream,
+                             struct hidinfo *hid);
+int ctroller_unpack_hid_keys(unsigned char *sendbuf,
+                             size_t len,
+                             struct hidinfo *hid);
+int ctroller_pack_hid_info(const struct hidinfo *hid, unsigned char *sendbuf);
+
+long ctroller_replay(const char *path, double speed);
+
+const struct ctroller_stats *ctroller_get_stats(void);
+
+/* Number of clients whose state is kept across batches */
+#define CTROLLER_SESSIONS_MAX (2 * CTROLLER_CLIENTS_MAX)
+
+/* State of a v2 client kept across batches */
+struct ctroller_session {
+    struct sockaddr_storage addr;
+    socklen_t addr_len; /* 0 if unused */
+    unsigned long last_batch;
+    struct packet_stream stream;
+    struct packet_sequence sequence;
+    /* Clock estimate of the client's last probe, the round-trip time is
+     * PACKET_CLOCK_UNKNOWN without one */
+    struct protocol_clock_sample clock;
+};
+
+/* All CTROLLER_SESSIONS_MAX sessions, including unused ones */
+const struct ctroller_session *ctroller_get_sessions(void);
+/* Numeric address and port of the client of `session` */
+int ctroller_session_name(const struct ctroller_session *session,
+                          char *buf,
+                          size_t len);
 int ctroller_write_hid_info(struct hidinfo *hid);
 
 #endif /* ----- #ifndef CTROLLER_H  ----- */
@@ -5,6 +5,9 @@
 #include <devices/touchscreen.h>
 #include <devices/gyroscope.h>
 #include <devices/accelerometer.h>
+#include <devices/combined.h>
+
+#include "hid.h"
 
 #include <stddef.h>
 #include <stdint.h>
@@ -12,33 +15,84 @@
 
 #define arrsize(a) (sizeof(a) / sizeof(a[0]))
 
-int device_open(const char *uinput_device);
+/* Maximum number of events a device emits per packet, including SYN_REPORT.
+ * The gamepad may release and press each key again in two frames. */
+#define DEVICE_EVENTS_MAX 48
 
-ssize_t
-device_register_keys(const int uinputfd, const uint16_t *keycodes, size_t len);
+struct device_context;
+/* Create the device's output, returns its handle or -1 */
+typedef int device_call_create(struct device_context *dev);
 
-ssize_t device_register_absaxis(const int uinputfd,
-                                const uint16_t *axiscodes,
-                                size_t len);
+typedef int device_call_write(struct device_context *dev,
+                              const struct hidinfo *hid);
 
-struct uinput_user_dev;
-int device_create(int uinputfd, const struct uinput_user_dev *dev);
+struct input_event;
+/* Fill `events` with the events needed to bring the device from its last
+ * written state to `hid`, without the trailing SYN_REPORT. Returns the number
+ * of events. */
+typedef size_t device_call_events(const struct device_context *dev,
+                                  const struct hidinfo *hid,
+                                  struct input_event *events);
+
+/* Record `hid` as the state last written to the device */
+typedef void device_call_commit(struct device_context *dev,
+                                const struct hidinfo *hid);
 
-typedef int device_call_create(const char *uinput_device);
+struct uinput_user_dev;
 
-struct hidinfo;
-typedef int device_call_write(int uinputfd, struct hidinfo *hid);
+/* Counters of the writes to a device. Written by the thread handling packets
+ * only, other threads may read them at any time. */
+struct device_stats {
+    unsigned long writes; /* successful writes */
+    unsigned long events; /* events written, including SYN_REPORT */
+    unsigned long errors; /* failed writes */
+    unsigned long again;  /* writes failed with EAGAIN */
+};
 
 struct device_context {
+    /* Output handle, the uinput file descriptor when using the uinput sink.
+     * -1 if the device is not created. */
     int fd;
+    const char *name;
     device_call_write *write;
+    device_call_events *events;
+    device_call_commit *commit;
     device_call_create *create;
+
+    /* Descriptor, keys and axis the device registers */
+    const struct uinput_user_dev *dev;
+    const uint16_t *keys;
+    size_t nkeys;
+    const uint16_t *axis;
+    size_t naxis;
+    /* Codes `axis` are mapped to on the combined device */
+    const uint16_t *combined_axis;
+
+    /* Whether `last` holds the state last written to the device. If not, the
+     * next write emits the full state. */
+    int synced;
+    struct hidinfo last;
+
+    struct device_stats stats;
 };
 
+/* Number of events the buffer passed to device_prepare() must hold */
+#define DEVICE_PREPARE_MAX (DEVICE_EVENTS_MAX * DEVICES_COUNT)
+
+int device_create(struct device_context *dev);
+void device_destroy(struct device_context *dev);
+
+size_t device_prepare(struct device_context *dev,
+                      const struct hidinfo *hid,
+                      struct input_event *events);
+void device_commit(struct device_context *dev, const struct hidinfo *hid);
+int device_write(struct device_context *dev, const struct hidinfo *hid);
+
 extern struct device_context device_gamepad;
 extern struct device_context device_touchscreen;
 extern struct device_context device_gyroscope;
 extern struct device_context device_accelerometer;
+extern struct device_context device_combined;
 
 enum DEVICE_ID {
     DEVICE_GAMEPAD,
@@ -1,9 +1,13 @@
 #ifndef ACCELEROMETER_H
 #define ACCELEROMETER_H
 
-int accelerometer_create(const char *uinput_device);
+#include <stddef.h>
 
+struct device_context;
 struct hidinfo;
-int accelerometer_write(int uinputfd, struct hidinfo *hid);
+struct input_event;
+size_t accelerometer_events(const struct device_context *dev,
+                            const struct hidinfo *hid,
+                            struct input_event *events);
 
 #endif /* ----- #ifndef ACCELEROMETER_H  ----- */
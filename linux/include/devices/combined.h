@@ -0,0 +1,18 @@
+#ifndef COMBINED_H
+#define COMBINED_H
+
+#include <stddef.h>
+
+struct device_context;
+/* Add a device to the combined device, before creating it */
+int combined_add(struct device_context *member);
+int combined_create(struct device_context *dev);
+
+struct hidinfo;
+struct input_event;
+size_t combined_events(const struct device_context *dev,
+                       const struct hidinfo *hid,
+                       struct input_event *events);
+void combined_commit(struct device_context *dev, const struct hidinfo *hid);
+
+#endif /* ----- #ifndef COMBINED_H  ----- */
@@ -1,9 +1,16 @@
 #ifndef GAMEPAD_H
 #define GAMEPAD_H
 
-int gamepad_create(const char *uinput_device);
+#include <stddef.h>
 
+struct device_context;
 struct hidinfo;
-int gamepad_write(int uinputfd, struct hidinfo *hid);
+struct input_event;
+
+/* Map the HID keys to key codes, before the first call of gamepad_events() */
+void gamepad_init(void);
+size_t gamepad_events(const struct device_context *dev,
+                      const struct hidinfo *hid,
+                      struct input_event *events);
 
 #endif /* ----- #ifndef GAMEPAD_H  ----- */
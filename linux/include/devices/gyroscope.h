@@ -1,9 +1,13 @@
 #ifndef GYROSCOPE_H
 #define GYROSCOPE_H
 
-int gyroscope_create(const char *uinput_device);
+#include <stddef.h>
 
+struct device_context;
 struct hidinfo;
-int gyroscope_write(int uinputfd, struct hidinfo *hid);
+struct input_event;
+size_t gyroscope_events(const struct device_context *dev,
+                        const struct hidinfo *hid,
+                        struct input_event *events);
 
 #endif /* ----- #ifndef GYROSCOPE_H  ----- */
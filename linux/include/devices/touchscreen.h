@@ -1,9 +1,13 @@
 #ifndef TOUCHSCREEN_H
 #define TOUCHSCREEN_H
 
-int touchscreen_create(const char* uinput_device);
+#include <stddef.h>
 
+struct device_context;
 struct hidinfo;
-int touchscreen_write(int uinputfd, struct hidinfo *hid);
+struct input_event;
+size_t touchscreen_events(const struct device_context *dev,
+                          const struct hidinfo *hid,
+                          struct input_event *events);
 
 #endif /* ----- #ifndef TOUCHSCREEN_H  ----- */
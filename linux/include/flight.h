@@ -0,0 +1,66 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hid.h"
+
+/* Flight recorder: a ring of the last FLIGHT_RECORDS packets and device writes
+ * kept in memory, dumped to stderr on SIGUSR2 and when the server crashes.
+ *
+ * Records are written by the thread handling packets only. A dump interrupting
+ * a write may show that one record torn.
+ */
+
+/* Power of two */
+#define FLIGHT_RECORDS 4096
+
+enum flight_kind {
+    FLIGHT_PACKET,    /* newest packet of a client, fully unpacked */
+    FLIGHT_COALESCED, /* older packet, only its key edges were used */
+    FLIGHT_INVALID,   /* dropped packet, `result` holds its size */
+    FLIGHT_LATE,      /* packet out of order, `result` holds its size */
+    FLIGHT_WRITE,     /* write of `events` events to `device` */
+};
+
+struct device_context;
+
+struct flight_record {
+    uint64_t time; /* CLOCK_REALTIME in ns, of the last packet for writes */
+    uint8_t kind;
+    uint8_t client;
+    uint16_t version;
+    int32_t result;
+    union {
+        struct {
+            uint64_t received;
+            uint32_t held, down, up;
+            uint16_t px, py;
+            int16_t cpx, cpy, csx, csy;
+        } packet;
+        struct {
+            const char *device;
+            uint32_t events;
+        } write;
+    };
+};
+
+/* `time` is the CLOCK_REALTIME the packet was handled at, in ns. Writes do
+ * not read the clock, they are stamped with the time of the last packet. */
+void flight_packet(uint64_t time,
+                   enum flight_kind kind,
+                   unsigned client,
+                   const struct hidinfo *hid,
+                   int result);
+void flight_write(const struct device_context *dev, size_t events, int result);
+
+/* Write all records, oldest first, to `fd`. Async-signal-safe enough to be
+ * called from a crash handler. */
+void flight_dump(int fd);
+
+/* Dump on SIGUSR2 and on SIGSEGV, SIGBUS, SIGFPE, SIGILL and SIGABRT; the
+ * latter are re-raised afterwards */
+int flight_install(void);
+
+#endif /* ----- #ifndef FLIGHT_H  ----- */
@@ -77,6 +77,15 @@ struct hidinfo {
     struct touchpos touchscreen;
     struct gyrorate gyro;
     struct accelrate accel;
+
+    /* Not part of the packet: kernel receive time of the packet this state
+     * was unpacked from, in ns since the epoch, or 0 if unknown */
+    uint64_t received;
+    /* Time the client sampled the state at, in us of its clock, 0 if the
+     * packet has none (v1) */
+    uint32_t sample;
+    /* Client that sent it, compared by address only, NULL if unknown (v1) */
+    const void *source;
 };
 
 #endif /* ----- #ifndef HID_H  ----- */
@@ -0,0 +1,63 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "devices.h"
+
+/* Histograms of the time packets spend in the server, measured from the
+ * kernel's receive timestamp (SO_TIMESTAMPNS).
+ *
+ * Like HdrHistogram, every power of two is split into LATENCY_SUB_COUNT linear
+ * buckets, so reported values are within 2^-LATENCY_SUB_BITS (~3%) of the
+ * recorded ones over the whole range. Each histogram must only be written by
+ * the thread handling packets, it can be read at any time without locks.
+ */
+
+#define LATENCY_SUB_BITS 5
+#define LATENCY_SUB_COUNT (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB_COUNT)
+
+struct latency_histogram {
+    const char *name;
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[LATENCY_BUCKETS];
+};
+
+enum latency_stage {
+    LATENCY_RECEIVE, /* until the packet was read by the server */
+    LATENCY_UNPACK,  /* until the packet was unpacked */
+    LATENCY_WRITE,   /* until the state was written to all devices */
+    LATENCY_STAGES,
+};
+
+extern struct latency_histogram latency_stages[LATENCY_STAGES];
+/* Until the state was written to a device, indexed by enum DEVICE_ID with the
+ * combined device last */
+extern struct latency_histogram latency_devices[DEVICES_COUNT + 1];
+
+/* Time from waking up for a batch of packets until all of them were written,
+ * not measured from kernel receive */
+extern struct latency_histogram latency_loop;
+
+/* Time from sampling a state on the client until kernel receive, for clients
+ * that estimate the offset of their clock (see packet.h). Includes the error of
+ * the estimate, at most half the round-trip time. */
+extern struct latency_histogram latency_capture;
+
+/* Current time on the clock of the receive timestamps, in ns */
+uint64_t latency_now(void);
+
+void latency_record(struct latency_histogram *hist, uint64_t ns);
+/* Smallest recorded value `percentile` percent of all values are at or below,
+ * within the precision of the histogram */
+uint64_t latency_percentile(const struct latency_histogram *hist,
+                            double percentile);
+
+/* Print p50, p99, p99.9 and max of all histograms holding values */
+void latency_print(FILE *fp);
+
+#endif /* ----- #ifndef LATENCY_H  ----- */
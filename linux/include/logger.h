@@ -0,0 +1,41 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <syslog.h>
+
+/* Logging off the packet path. logger_post() only fills a fixed-size record in
+ * a lock-free ring; a background thread formats the records and writes them to
+ * stderr, or to syslog in daemon mode.
+ *
+ * Each message type is limited to LOGGER_BURST messages per second, further
+ * ones are counted and reported as suppressed. Records posted while the ring
+ * is full are dropped and counted the same way, posting never blocks.
+ */
+
+#define LOGGER_RECORDS 256 /* power of two */
+#define LOGGER_BURST 5
+
+enum logger_message {
+    LOGGER_BAD_MAGIC,   /* `arg`: the magic number received */
+    LOGGER_WRITE_ERROR, /* `subject`: the device, `error`: errno */
+    LOGGER_MESSAGES,
+};
+
+/* `subject` must stay valid until the record is formatted, i.e. be static */
+void logger_post(enum logger_message message,
+                 int error,
+                 const char *subject,
+                 long arg);
+
+/* Log a message synchronously, for use outside of the packet path. Without
+ * syslog, messages up to LOG_WARNING go to stderr and the rest to stdout. */
+void logger_printf(int priority, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/* Start the logging thread, logging to syslog instead of stderr if `use_syslog`
+ * is set. Records posted before are kept. */
+int logger_init(int use_syslog);
+/* Stop the thread after writing all pending records */
+void logger_exit(void);
+
+#endif /* ----- #ifndef LOGGER_H  ----- */
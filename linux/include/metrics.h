@@ -0,0 +1,16 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+/* Read-only metrics endpoint: a Unix domain socket answering every connection
+ * with the server's counters in the Prometheus text format, i.e.
+ *
+ *     socat - UNIX-CONNECT:<path>
+ *
+ * Connections are served by a separate thread reading the counters without
+ * locks, the packet path is not involved.
+ */
+
+int metrics_init(const char *path);
+void metrics_exit(void);
+
+#endif /* ----- #ifndef METRICS_H  ----- */
@@ -0,0 +1,254 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hid.h"
+#include "protocol.h"
+
+/* Protocol v2, a compact encoding of the HID state. Its constants and the
+ * order of the values are shared with the 3DS application, see protocol.h.
+ *
+ *
+ *     0  u16  magic (PACKET_MAGIC)
+ *     2  u16  version, the protocol revision in the upper nibble
+ *     4  u8   type (enum packet_type)
+ *     5  u8   keyframe id: of the packet itself for keyframes, of the keyframe
+ *             a delta is relative to otherwise
+ *     6  u16  sequence number, incremented with every packet
+ *     8  u32  time the state was sampled at, in us of the client's clock
+ *    12  u8   fields present (enum packet_field)
+ *    13  ...  fields in the order of their bits
+ *
+ * Keys are packed into the 24 bits the 3DS uses. All other values are zigzag
+ * varints (LEB128): absolute for keyframes, differences to the keyframe for
+ * deltas. A field is only present if it differs from the keyframe, or from
+ * zero in keyframes. Key edges (up/down) are never inherited from keyframes.
+ *
+ * The server acknowledges every keyframe with a PACKET_TYPE_ACK packet. A
+ * client only sends deltas relative to an acknowledged keyframe and sends
+ * keyframes until one is acknowledged, so a lost packet never corrupts the
+ * state. Acks consist of the first 6 bytes only. Multi-byte fields are in
+ * network byte order.
+ *
+ * The server drops packets older than one it already received from the same
+ * client, so a late packet never rolls the state back.
+ *
+ * Clients need not send at a fixed rate: one sending on changes only sends a
+ * state right away when it changes, once more after it settled, and otherwise
+ * every PACKET_KEEPALIVE_INTERVAL ms. The server holds the last state in
+ * between.
+ *
+ * To survive loss without retransmission, packets repeat the key edges of up
+ * to PACKET_HISTORY_MAX of the last PACKET_HISTORY_FRAMES packets that had
+ * any (PACKET_FIELD_HISTORY): a u8 count, then per packet, newest first, its
+ * distance in sequence numbers (u8) and its keys down and up. The server
+ * rebuilds the edges of packets it missed from the next one it receives.
+ *
+ * A packet may end with the motion batch: the gyroscope and accelerometer
+ * sampled since the packet before, so their rate is not bound to the packet
+ * rate. It follows the fields as a u8 count of at most PACKET_MOTION_MAX, then
+ * per sample, oldest first, a u16 age in us before the sample time of the
+ * packet and the differences of gyro x, y, z and accel x, y, z to the state of
+ * the packet as zigzag varints. Servers unaware of it ignore the trailing
+ * bytes.
+ *
+ * Clients estimate the round-trip time and the offset of their clock to the
+ * server's like NTP: about every PACKET_PROBE_INTERVAL ms they send a
+ * PACKET_TYPE_PROBE, which the server answers with a PACKET_TYPE_ECHO at once.
+ * Both carry the id of the probe in the keyframe id byte:
+ *
+ *     probe:  6  u32  time the probe was sent, in us of the client's clock
+ *            10  u32  round-trip time estimated so far, in us, or
+ *                     PACKET_CLOCK_UNKNOWN
+ *            14  u32  offset estimated so far, added to client times to get
+ *                     server times, in us
+ *     echo:   6  u32  time the probe was sent, copied from the probe
+ *            10  u32  time the server received the probe, in us
+ *            14  u32  time the server sent the echo, in us
+ *
+ * Server times are the lower 32 bits of CLOCK_REALTIME in us. All times wrap
+ * around, and so does the offset, which is only ever added to client times.
+ * Of the last PACKET_CLOCK_SAMPLES exchanges, the one with the smallest
+ * round-trip time gives the estimate, it was delayed the least by queueing.
+ * The server takes the estimate a client reports to measure the time from
+ * sampling a state to receiving it.
+ *
+ * Along with every echo, the server sends a PACKET_TYPE_REPORT on how it
+ * receives the client's packets, for the client to adapt its send rate and
+ * redundancy (see ratectl.h):
+ *
+ *     report: 6  u32  packets received in order
+ *            10  u32  sequence numbers never received
+ *            14  u32  interarrival jitter, in us
+ *            18  u32  peak queueing delay since the last report, in us
+ *
+ * The queueing delay is the transit time of a packet (receive time minus
+ * sample time) above the smallest one of the last PACKET_TRANSIT_WINDOW us.
+ * Clients may repeat the key edges of fewer than PACKET_HISTORY_FRAMES packets.
+ */
+
+/* Length of the windows the smallest transit time is taken from, in us */
+#define PACKET_TRANSIT_WINDOW 10000000
+
+struct packet_keyframe {
+    int valid;
+    uint8_t id;
+    struct hidinfo state;
+};
+
+/* Sequence numbers behind the highest one that are told apart from duplicates.
+ * Packets further behind are taken as a restart of the client. */
+#define PACKET_SEQUENCE_WINDOW 64
+
+enum packet_order {
+    PACKET_IN_ORDER,  /* newer than all packets before */
+    PACKET_LATE,      /* older than a packet received before */
+    PACKET_DUPLICATE, /* received before */
+};
+
+/* Sequence numbers and timing of the packets received from a client */
+struct packet_sequence {
+    int started;
+    uint16_t highest; /* highest sequence number received */
+    uint64_t window;  /* bit n: `highest - n` was received */
+    uint32_t sample;  /* sample time of `highest`, in us */
+    uint64_t arrival; /* receive time of `highest`, in ns */
+    /* Interarrival jitter like RFC 3550: the mean deviation of the receive
+     * intervals from the sample intervals, in us scaled by 16 */
+    uint64_t jitter;
+    /* Sequence numbers skipped right before `highest` */
+    unsigned skipped;
+    /* Smallest transit time (receive minus sample time, in us, offset by the
+     * difference of the clocks) of the current and the last window, and the
+     * sample time the current window started at. Only valid if `timed`. */
+    int timed;
+    uint32_t transit[2];
+    uint32_t transit_window;
+    /* Peak queueing delay since the last report, in us */
+    uint32_t queue;
+
+    unsigned long received;  /* packets in order */
+    unsigned long lost;      /* sequence numbers skipped and not received */
+    unsigned long late;      /* packets received after a newer one */
+    unsigned long duplicate; /* packets received twice */
+};
+
+/* A sample of the motion sensors of a motion batch */
+struct packet_motion {
+    uint32_t sample; /* time it was sampled at, in us of the client's clock */
+    struct gyrorate gyro;
+    struct accelrate accel;
+};
+
+/* Position of the keys and values in struct hidinfo */
+extern const struct protocol_layout packet_layout;
+
+/* Decoder state of a client */
+struct packet_stream {
+    struct packet_keyframe keyframes[PACKET_KEYFRAMES];
+};
+
+/* Set up the vector shuffles of packet_v1_unpack(), before the first packet
+ * is unpacked */
+void packet_init(void);
+
+/* Unpack a v1 packet of `len` bytes into `hid`. The magic, revision and size
+ * are checked first, then the whole packet is swapped at once by vector
+ * shuffles where the CPU has them and packet_init() was called. Returns
+ * PACKET_V1_SIZE or a negative enum packet_error. */
+int packet_v1_unpack(const unsigned char *buf,
+                     size_t len,
+                     struct hidinfo *hid);
+/* Same, one value at a time. The reference of the vector paths. */
+int packet_v1_unpack_scalar(const unsigned char *buf,
+                            size_t len,
+                            struct hidinfo *hid);
+
+/* Unpack a v2 packet of `len` bytes into `hid`, keyframes are kept in
+ * `stream`. Returns the number of bytes used or a negative enum packet_error.
+ */
+int packet_v2_unpack(const unsigned char *buf,
+                     size_t len,
+                     struct packet_stream *stream,
+                     struct hidinfo *hid);
+/* Only unpack the key edges, no stream needed. Keys held are only set if they
+ * differ from the keyframe. */
+int packet_v2_unpack_keys(const unsigned char *buf,
+                          size_t len,
+                          struct hidinfo *hid);
+/* Add the key edges of the `missed` packets sent right before the one in `buf`
+ * to `hid`, as far as `buf` repeats them. Returns the number of packets whose
+ * edges were found or a negative enum packet_error. */
+int packet_v2_recover(const unsigned char *buf,
+                      size_t len,
+                      unsigned missed,
+                      struct hidinfo *hid);
+/* Read the motion batch of the packet in `buf`, whose first `used` bytes
+ * packet_v2_unpack() unpacked into `hid`. `motion` must hold
+ * PACKET_MOTION_MAX samples. Returns the number of samples, 0 without a
+ * batch, or a negative enum packet_error. */
+int packet_v2_unpack_motion(const unsigned char *buf,
+                            size_t len,
+                            size_t used,
+                            const struct hidinfo *hid,
+                            struct packet_motion *motion);
+/* Id of the keyframe in `buf`, or -1 if it is no v2 keyframe */
+int packet_v2_keyframe_id(const unsigned char *buf, size_t len);
+/* Sequence number and sample time of a v2 keyframe or delta. Returns -1 if
+ * `buf` is neither. */
+int packet_v2_sequence(const unsigned char *buf,
+                       size_t len,
+                       uint16_t *number,
+                       uint32_t *sample);
+
+/* Account for packet `number`, sampled at `sample` us and received at
+ * `arrival` ns (0 if unknown). Only packets in order should be used. */
+enum packet_order packet_sequence_update(struct packet_sequence *seq,
+                                         uint16_t number,
+                                         uint32_t sample,
+                                         uint64_t arrival);
+
+/* Pack `hid`, sampled at `sample` us, as the next packet of `enc`. `buf` must
+ * hold PACKET_V2_MAX_SIZE bytes. Returns the number of bytes written. */
+int packet_v2_pack(struct protocol_encoder *enc,
+                   const struct hidinfo *hid,
+                   uint32_t sample,
+                   unsigned char *buf);
+/* Append the motion batch of `count` samples, oldest first, to the packet of
+ * `len` bytes in `buf`, packed from `hid` sampled at `sample` us. Only the
+ * newest PACKET_MOTION_MAX samples of at most PACKET_MOTION_AGE us before the
+ * packet are sent. Returns the new length of the packet. */
+int packet_v2_pack_motion(const struct hidinfo *hid,
+                          uint32_t sample,
+                          const struct packet_motion *motion,
+                          size_t count,
+                          unsigned char *buf,
+                          size_t len);
+/* Build the acknowledgement of keyframe `id` */
+int packet_v2_pack_ack(uint8_t id, unsigned char *buf);
+
+/* protocol_pack_probe() of this version */
+int packet_v2_pack_probe(struct protocol_clock *clock,
+                         uint32_t now,
+                         unsigned char *buf);
+/* Read the estimate a client reported in the probe in `buf`. Returns 0 if it
+ * is a probe, a negative enum packet_error otherwise. */
+int packet_v2_unpack_probe(const unsigned char *buf,
+                           size_t len,
+                           struct protocol_clock_sample *estimate);
+/* Build the echo of `probe`, received at `received` and answered at `replied`
+ * (server times in us). `buf` must hold PACKET_V2_ECHO_SIZE bytes. */
+int packet_v2_pack_echo(const unsigned char *probe,
+                        uint32_t received,
+                        uint32_t replied,
+                        unsigned char *buf);
+/* Build the report of the packets in `seq` for the echo of probe `id`, and
+ * start over with the peak queueing delay. `buf` must hold
+ * PACKET_V2_REPORT_SIZE bytes. */
+int packet_v2_pack_report(uint8_t id,
+                          struct packet_sequence *seq,
+                          unsigned char *buf);
+
+#endif /* ----- #ifndef PACKET_H  ----- */
@@ -0,0 +1,93 @@
+#ifndef PLAYOUT_H
+#define PLAYOUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hid.h"
+
+/* Jitter buffer and fixed-rate output scheduler. States are buffered with the
+ * time the client sampled them, mapped onto CLOCK_MONOTONIC by the smallest
+ * transit time seen recently. A timerfd ticks at a fixed rate; on every tick,
+ * each buffered device is given the state at `now - delay`, with its axes
+ * interpolated between the two states around that point and the key edges of
+ * all states up to it.
+ *
+ * The delay adapts to the stream: one sample interval, so the state after the
+ * playout point has usually arrived, plus the recent peak of the queueing
+ * delay (decaying over about a second). It is capped per device, a cap of 0
+ * bypasses the buffer.
+ *
+ * The motion batches of packets are buffered as states of their own, with
+ * the sensors sampled in between and everything else held, so the sensors are
+ * played out at the rate they were sampled at if the timer ticks as fast.
+ *
+ * States more than 100ms apart are taken as held by a client sending on
+ * changes only, they are neither interpolated between nor count as underruns.
+ *
+ * The buffer follows the client that sent the last state, another client or
+ * a jump of the sample clock starts it over. Only the thread handling packets
+ * uses it, the stats may be read by others at any time.
+ */
+
+/* States kept, must cover the longest delay at the client's sample rate */
+#define PLAYOUT_SAMPLES 128
+/* Devices (or other consumers) with their own playout position */
+#define PLAYOUT_SLOTS 8
+/* Default delay cap of the motion sensors and the largest allowed, in ms */
+#define PLAYOUT_DELAY_DEFAULT 30
+#define PLAYOUT_DELAY_MAX 250
+/* Highest tick rate, in Hz */
+#define PLAYOUT_RATE_MAX 1000
+
+struct playout_stats {
+    unsigned long ticks;     /* timer expirations handled */
+    unsigned long missed;    /* timer expirations missed, i.e. late wakeups */
+    unsigned long samples;   /* states buffered */
+    unsigned long motion;    /* of them, samples of motion batches */
+    unsigned long late;      /* states that arrived after their playout point */
+    unsigned long underruns; /* states played out before the next arrived */
+    unsigned long resets;    /* restarts for a new client or sample clock */
+    uint64_t delay;          /* current adaptive delay in ns, before the cap */
+    unsigned rate;           /* ticks per second, 0 if disabled */
+};
+
+/* Start ticking at `rate` Hz. Returns the timerfd or -1. */
+int playout_init(unsigned rate);
+void playout_exit(void);
+int playout_active(void);
+/* File descriptor that becomes readable on every tick */
+int playout_fd(void);
+/* Consume the pending expirations of the timer. Returns 1 if it ticked, 0 if
+ * not and -1 on error. */
+int playout_wait(void);
+
+/* Buffer `hid`, sent by `source` (compared by address only) and received at
+ * `arrival`, CLOCK_MONOTONIC in ns. `sample` is the client's sample time in
+ * us if `has_sample` is set, otherwise the arrival time is used. */
+void playout_push(const struct hidinfo *hid,
+                  const void *source,
+                  int has_sample,
+                  uint32_t sample,
+                  uint64_t arrival);
+
+/* Buffer a sample of the motion sensors `source` took at `sample` us, after
+ * the newest state and before the one it sends next. The other values are
+ * held from the newest state. Call it before pushing the state of the packet
+ * that carried it, samples not newer than the newest state are dropped. */
+void playout_push_motion(const void *source,
+                         uint32_t sample,
+                         const struct gyrorate *gyro,
+                         const struct accelrate *accel);
+
+/* State to play out by `slot` at `now` (CLOCK_MONOTONIC in ns), at most `cap`
+ * ns behind. Key edges are those of the states since the last call for the
+ * same slot. Returns 0 if there is no state to play yet, 1 otherwise. */
+int playout_state(size_t slot,
+                  uint64_t cap,
+                  uint64_t now,
+                  struct hidinfo *hid);
+
+const struct playout_stats *playout_get_stats(void);
+
+#endif /* ----- #ifndef PLAYOUT_H  ----- */
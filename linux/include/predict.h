@@ -0,0 +1,56 @@
+#ifndef PREDICT_H
+#define PREDICT_H
+
+#include <stdint.h>
+
+#include "devices.h"
+#include "hid.h"
+
+/* Extrapolation of the analog axes (circle pad, C-stick, gyroscope and
+ * accelerometer) to hide the network latency: each axis is moved ahead by its
+ * recent velocity, measured on the client's sample clock, times the horizon.
+ * Predictions stay within the range of the axis, and sticks are never
+ * predicted past their center, where their spring returns them to.
+ *
+ * Every prediction is checked against the states received later: the error
+ * is the distance to the actual value at the time predicted for, the baseline
+ * the distance of the unpredicted value. Both are summed per device, in the
+ * units of the axis.
+ *
+ * Every client is predicted on its own, by the `source` of its states. Up to
+ * PREDICT_SOURCES of them are tracked, one more replaces the one that was
+ * predicted least recently and starts over. v1 clients have no source and
+ * share one, so with more than one of them the predictions keep starting
+ * over. The stats are summed over all clients.
+ *
+ * Only used by the thread handling packets, the stats may be read by others
+ * at any time.
+ */
+
+/* Longest horizon, in ms */
+#define PREDICT_HORIZON_MAX 100
+/* Predictions waiting to be checked, per client */
+#define PREDICT_PENDING 16
+/* Clients predicted at once */
+#define PREDICT_SOURCES 8
+
+struct predict_stats {
+    unsigned long checked;  /* predictions checked */
+    unsigned long error;    /* summed absolute error of the predictions */
+    unsigned long baseline; /* summed absolute error without prediction */
+    unsigned long max;      /* largest error of a single prediction */
+};
+
+/* Predict the axes of the devices in `mask` (bits of enum DEVICE_ID)
+ * `horizon` ms ahead */
+void predict_init(unsigned horizon, unsigned mask);
+int predict_active(void);
+/* Replace the axes of `hid` with their predicted values */
+void predict_apply(struct hidinfo *hid);
+
+/* Stats of a device, indexed by enum DEVICE_ID */
+const struct predict_stats *predict_get_stats(void);
+unsigned predict_horizon(void);
+unsigned predict_mask(void);
+
+#endif /* ----- #ifndef PREDICT_H  ----- */
@@ -0,0 +1,45 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/* Static tracepoints (USDT) on the packet path, in the provider `ctroller`:
+ *
+ *     recv(packets)                          batch of packets read from the
+ *                                            socket
+ *     unpack(client, version, held, received)
+ *                                            newest packet of a client
+ *                                            unpacked, `received` is the kernel
+ *                                            timestamp in ns or 0
+ *     syn(device, events)                    SYN_REPORT appended after
+ *                                            `events` events
+ *     write(device, events, result)          events written to a device
+ *
+ * With <sys/sdt.h> (systemtap-sdt-dev) available at build time every probe is
+ * a single nop and an ELF note, e.g.
+ *
+ *     bpftrace -e 'usdt:bin/ctroller:ctroller:write
+ *                  { printf("%s %d\n", str(arg0), arg1); }'
+ *
+ * Without it, or with CTROLLER_NO_PROBES defined, the probes compile to
+ * nothing and their arguments are not evaluated.
+ */
+
+#if defined(__has_include) && !defined(CTROLLER_NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CTROLLER_HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef CTROLLER_HAVE_PROBES
+#define PROBE1(name, a) DTRACE_PROBE1(ctroller, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(ctroller, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(ctroller, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(ctroller, name, a, b, c, d)
+#else
+#define PROBE1(name, a) ((void) sizeof(a))
+#define PROBE2(name, a, b) ((void) sizeof(a), (void) sizeof(b))
+#define PROBE3(name, a, b, c) (PROBE2(name, a, b), (void) sizeof(c))
+#define PROBE4(name, a, b, c, d) (PROBE3(name, a, b, c), (void) sizeof(d))
+#endif
+
+#endif /* ----- #ifndef PROBES_H  ----- */
@@ -0,0 +1,70 @@
+#ifndef SINK_H
+#define SINK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+
+/* Output sinks receive the events generated by the devices. The uinput sink
+ * exposes them to the system, the null and file sinks allow running the server
+ * on machines without /dev/uinput.
+ */
+
+struct device_context;
+struct input_event;
+
+struct sink {
+    const char *name;
+
+    /* Prepare the sink, `arg` is the part of the output specification
+     * following the colon, or NULL */
+    int (*init)(const char *arg);
+    void (*exit)(void);
+
+    /* Create the output for a device. Returns a handle stored in the device's
+     * `fd`, or -1 on failure. */
+    int (*create)(const struct device_context *dev);
+    void (*destroy)(const struct device_context *dev);
+
+    ssize_t (*write)(const struct device_context *dev,
+                     const struct input_event *events,
+                     size_t len);
+};
+
+struct sink_stats {
+    unsigned long writes;
+    unsigned long events;
+};
+
+/* The file sink serializes the event stream into a single file. Every record
+ * starts with this header and is followed by `len` bytes: for SINK_FILE_CREATE
+ * the name of the device created with `handle`, for SINK_FILE_WRITE the
+ * struct input_event array written to it. All fields are in host byte order.
+ */
+struct sink_file_record {
+    uint8_t type;
+    uint8_t handle;
+    uint16_t len;
+};
+
+enum {
+    SINK_FILE_CREATE = 1,
+    SINK_FILE_WRITE  = 2,
+};
+
+extern const struct sink sink_uinput;
+extern const struct sink sink_null;
+extern const struct sink sink_file;
+
+/* Sink all devices write to */
+extern const struct sink *output_sink;
+
+/* Select and initialize the sink given by `spec`, which is one of
+ * "uinput[:<device>]", "null" or "file:<path>". */
+int sink_init(const char *spec);
+void sink_exit(void);
+
+/* Number of writes and events the null sink discarded */
+const struct sink_stats *sink_null_get_stats(void);
+
+#endif /* ----- #ifndef SINK_H  ----- */
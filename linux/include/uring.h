@@ -0,0 +1,21 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+
+/* Receive from `socket`. uring_recv() also wakes up when `wake` becomes
+ * readable. */
+int uring_init(int socket, int wake);
+void uring_exit(void);
+
+struct mmsghdr;
+int uring_recv(struct mmsghdr *msgs, size_t len, int wait);
+void uring_recv_done(void);
+
+struct device_context;
+struct hidinfo;
+int uring_write(struct device_context **devices,
+                size_t len,
+                const struct hidinfo *hid);
+
+#endif /* ----- #ifndef URING_H  ----- */
@@ -0,0 +1,38 @@
+#!/usr/bin/env bash
+#
+# Relay packets to a local server through ctroller-impair (see `make tools`)
+# using a named link profile. Point the client at port 15709, e.g.
+#
+#     impair.sh wifi &
+#     ctroller-client -p 15709
+#
+# Usage: impair.sh <good|wifi|congested|lossy> [<seed> [<ctroller-impair>]]
+
+PROFILE=${1:-wifi}
+SEED=${2:-1}
+IMPAIR=${3:-./bin/release/ctroller-impair}
+
+case "$PROFILE" in
+    good)
+        # Wired LAN
+        ARGS="-d 1 -j 0.2"
+        ;;
+    wifi)
+        # Home Wi-Fi: short bursts of loss, moderate jitter
+        ARGS="-l 1 -b 2 -d 3 -j 4 -J exponential -r 0.5 -g 10"
+        ;;
+    congested)
+        # Busy 2.4 GHz channel: queueing delay with large jitter
+        ARGS="-l 5 -b 4 -d 15 -j 20 -J exponential -r 2 -g 30 -D 0.5"
+        ;;
+    lossy)
+        # Edge of range: heavy, bursty loss
+        ARGS="-l 20 -b 6 -d 5 -j 10 -J normal -r 1"
+        ;;
+    *)
+        echo "Unknown profile '$PROFILE'." >&2
+        exit 1
+        ;;
+esac
+
+exec "$IMPAIR" -s "$SEED" $ARGS
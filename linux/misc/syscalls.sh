@@ -0,0 +1,75 @@
+#!/usr/bin/env bash
+#
+# Count the system calls the server makes per received packet, once with one
+# uinput device per 3DS device and once with the combined device (-c).
+# Requires strace, permission to attach to the server (ptrace) and access to
+# /dev/uinput.
+#
+# Usage: syscalls.sh [<path to ctroller> [<number of packets>]]
+
+CTROLLER=${1:-./ctroller}
+PACKETS=${2:-500}
+PORT=15709
+
+# Send $1 packets, changing buttons and the circle pad with every packet so
+# that every packet results in output on the gamepad.
+send_packets() {
+    local zero4='\x00\x00\x00\x00'
+    exec 3>/dev/udp/127.0.0.1/$PORT
+    for ((i = 0; i < $1; i++)); do
+        printf -v held '\\x%02x' $((i % 2))
+        printf -v dx '\\x%02x' $((i % 128))
+        # magic, version, keys up/down/held, touch, circle pad, c-stick,
+        # gyroscope, accelerometer
+        printf '\x3d\x5c\x00\x00%b%b%b%b%b%b%b%b' \
+            "$zero4" "$zero4" "\x00\x00\x00$held" "$zero4" \
+            "\x00$dx\x00\x00" "$zero4" "$zero4\x00\x00" "$zero4\x00\x00" >&3
+        sleep 0.002
+    done
+    exec 3>&-
+}
+
+# Trace the main thread of the server while sending $1 packets, print the
+# total number of syscalls and the number of write() calls. strace attaches to
+# the running server without -f, so the logger and metrics threads, which make
+# syscalls of their own, are not counted.
+count_syscalls() {
+    local packets=$1
+    shift
+    local summary
+    summary=$(mktemp)
+
+    "$CTROLLER" -p $PORT "$@" > /dev/null 2>&1 &
+    local pid=$!
+    sleep 0.5
+    strace -c -o "$summary" -p $pid 2> /dev/null &
+    local tracer=$!
+    sleep 0.5
+    send_packets "$packets"
+    sleep 0.5
+    kill -INT $tracer
+    wait $tracer
+    kill -INT $pid
+    wait $pid
+
+    awk '$NF == "total" { total = $4 }
+         $NF == "write" { write = $4 }
+         END { print total + 0, write + 0 }' "$summary"
+    rm -f "$summary"
+}
+
+printf "%-10s %10s %16s %14s\n" mode packets syscalls/packet writes/packet
+for mode in separate combined; do
+    flags=()
+    if [ $mode = combined ]; then
+        flags=(-c)
+    fi
+
+    read -r base_total base_write < <(count_syscalls 0 "${flags[@]}")
+    read -r total write < <(count_syscalls "$PACKETS" "${flags[@]}")
+
+    awk -v mode=$mode -v n="$PACKETS" \
+        -v total=$((total - base_total)) -v write=$((write - base_write)) \
+        'BEGIN { printf "%-10s %10d %16.2f %14.2f\n",
+                 mode, n, total / n, write / n }'
+done
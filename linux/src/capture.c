@@ -0,0 +1,251 @@
+#define _GNU_SOURCE
+#include "capture.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <netinet/in.h>
+
+static struct {
+    int fd;
+    unsigned char *map;
+    size_t size; /* size of the file and the mapping */
+    struct capture_header *header;
+} capture = {
+    .fd = -1,
+};
+
+static size_t capture_align(size_t len)
+{
+    return (len + CAPTURE_ALIGN - 1) & ~(size_t)(CAPTURE_ALIGN - 1);
+}
+
+static int capture_grow(size_t size)
+{
+    size = (size + CAPTURE_CHUNK_SIZE - 1) & ~(size_t)(CAPTURE_CHUNK_SIZE - 1);
+
+    if (ftruncate(capture.fd, size) < 0) {
+        perror("Error growing capture");
+        return -1;
+    }
+
+    void *map;
+    if (capture.map == NULL) {
+        map = mmap(
+            NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, capture.fd, 0);
+    } else {
+        map = mremap(capture.map, capture.size, size, MREMAP_MAYMOVE);
+    }
+    if (map == MAP_FAILED) {
+        perror("Error mapping capture");
+        return -1;
+    }
+
+    capture.map    = map;
+    capture.size   = size;
+    capture.header = map;
+    return 0;
+}
+
+static int capture_valid(const struct capture_header *header, size_t size)
+{
+    return memcmp(header->magic, CAPTURE_MAGIC, sizeof(header->magic)) == 0 &&
+           header->version == CAPTURE_VERSION &&
+           header->header_size >= sizeof(*header) &&
+           header->header_size + header->used <= size;
+}
+
+int capture_open(const char *path)
+{
+    capture.fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (capture.fd < 0) {
+        fprintf(stderr, "Error opening '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(capture.fd, &st) < 0) {
+        perror("Error reading capture size");
+        goto error;
+    }
+
+    /* Check existing files before touching them */
+    struct capture_header header = {};
+    if (st.st_size > 0 &&
+        (pread(capture.fd, &header, sizeof(header), 0) != sizeof(header) ||
+         !capture_valid(&header, st.st_size))) {
+        fprintf(stderr, "'%s' is not a capture of this version.\n", path);
+        goto error;
+    }
+
+    if (capture_grow((st.st_size > 0) ? (size_t) st.st_size : 1) < 0) {
+        goto error;
+    }
+
+    if (st.st_size == 0) {
+        memcpy(capture.header->magic, CAPTURE_MAGIC, sizeof(header.magic));
+        capture.header->version     = CAPTURE_VERSION;
+        capture.header->header_size = sizeof(header);
+        capture.header->used        = 0;
+    }
+
+    printf("Capturing packets to %s.\n", path);
+    return 0;
+
+error:
+    close(capture.fd);
+    capture.fd = -1;
+    return -1;
+}
+
+void capture_close(void)
+{
+    if (capture.fd < 0) {
+        return;
+    }
+
+    size_t used = 0;
+    if (capture.header != NULL) {
+        used = capture.header->header_size + capture.header->used;
+        munmap(capture.map, capture.size);
+    }
+    /* Drop the unused remainder of the last chunk */
+    if (used > 0 && ftruncate(capture.fd, used) < 0) {
+        perror("Error truncating capture");
+    }
+    close(capture.fd);
+
+    capture.fd     = -1;
+    capture.map    = NULL;
+    capture.size   = 0;
+    capture.header = NULL;
+}
+
+int capture_active(void)
+{
+    return capture.fd >= 0;
+}
+
+void capture_write(uint64_t timestamp,
+                   unsigned flags,
+                   const struct sockaddr *addr,
+                   const void *data,
+                   size_t len)
+{
+    if (capture.fd < 0) {
+        return;
+    }
+
+    struct capture_header *header = capture.header;
+    size_t offset = header->header_size + header->used;
+    size_t size   = capture_align(sizeof(struct capture_record) + len);
+    if (offset + size > capture.size) {
+        if (capture_grow(offset + size) < 0) {
+            /* Keep what was captured so far, stop capturing */
+            capture_close();
+            return;
+        }
+        header = capture.header;
+    }
+
+    struct capture_record *record =
+        (struct capture_record *) (capture.map + offset);
+    memset(record, 0, size);
+    record->timestamp = timestamp;
+    record->len       = len;
+    record->family    = addr->sa_family;
+    record->flags     = flags;
+
+    if (addr->sa_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *) addr;
+        record->port                 = ntohs(in->sin_port);
+        memcpy(record->addr, &in->sin_addr, sizeof(in->sin_addr));
+    } else if (addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *) addr;
+        record->port                   = ntohs(in6->sin6_port);
+        memcpy(record->addr, &in6->sin6_addr, sizeof(in6->sin6_addr));
+    }
+    memcpy(record + 1, data, len);
+
+    /* Publish the record only once it is complete, readers of a capture that
+     * was not closed cleanly stop at `used` */
+    __atomic_store_n(&header->used, header->used + size, __ATOMIC_RELEASE);
+}
+
+int capture_reader_open(struct capture_reader *reader, const char *path)
+{
+    *reader = (struct capture_reader){.fd = -1};
+
+    reader->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (reader->fd < 0) {
+        fprintf(stderr, "Error opening '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(reader->fd, &st) < 0) {
+        perror("Error reading capture size");
+        goto error;
+    }
+    if ((size_t) st.st_size < sizeof(struct capture_header)) {
+        fprintf(stderr, "'%s' is not a capture.\n", path);
+        goto error;
+    }
+
+    reader->mapped = st.st_size;
+    void *map =
+        mmap(NULL, reader->mapped, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Error mapping capture");
+        goto error;
+    }
+    reader->map = map;
+
+    const struct capture_header *header = map;
+    if (!capture_valid(header, reader->mapped)) {
+        fprintf(stderr, "'%s' is not a capture of this version.\n", path);
+        goto error;
+    }
+
+    reader->offset = header->header_size;
+    reader->size   = header->header_size + header->used;
+    return 0;
+
+error:
+    capture_reader_close(reader);
+    return -1;
+}
+
+void capture_reader_close(struct capture_reader *reader)
+{
+    if (reader->map != NULL) {
+        munmap((void *) reader->map, reader->mapped);
+    }
+    if (reader->fd >= 0) {
+        close(reader->fd);
+    }
+    *reader = (struct capture_reader){.fd = -1};
+}
+
+const struct capture_record *capture_reader_next(struct capture_reader *reader)
+{
+    if (reader->offset + sizeof(struct capture_record) > reader->size) {
+        return NULL;
+    }
+
+    const struct capture_record *record =
+        (const struct capture_record *) (reader->map + reader->offset);
+    size_t size = capture_align(sizeof(*record) + record->len);
+    if (reader->offset + size > reader->size) {
+        return NULL;
+    }
+
+    reader->offset += size;
+    return record;
+}
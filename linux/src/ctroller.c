@@ -1,11 +1,25 @@
+#define _GNU_SOURCE
 #include "ctroller.h"
+#include "capture.h"
 #include "devices.h"
+#include "flight.h"
+#include "latency.h"
+#include "logger.h"
+#include "packet.h"
+#include "playout.h"
+#include "predict.h"
+#include "probes.h"
+#include "sink.h"
+#include "uring.h"
 
 #include <stdio.h>
 #include <errno.h>
 #include <assert.h>
+#include <signal.h>
 #include <string.h>
+#include <time.h>
 
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/poll.h>
 #include <netdb.h>
@@ -15,16 +29,25 @@
 #include <fcntl.h>
 #include <unistd.h>
 
-#include <linux/uinput.h>
 #include <linux/input.h>
 
 #include "hid.h"
 
 static struct {
     int socket;
+    /* Readable while requests are pending, see ctroller_request() */
+    int wake;
+    enum ctroller_backend backend;
     struct device_context *devices[DEVICES_COUNT];
+    struct device_context *combined;
+    /* Longest playout delay of each device and the combined one in ns, 0 to
+     * write them on receive */
+    uint64_t delays[DEVICES_COUNT + 1];
 } ctroller = {
-    .socket = -1,
+    .socket   = -1,
+    .wake     = -1,
+    .backend  = CTROLLER_BACKEND_POLL,
+    .combined = &device_combined,
     .devices =
         {
             [DEVICE_GAMEPAD]       = &device_gamepad,
@@ -37,9 +60,39 @@ static struct {
 struct sockaddr listen_addr;
 socklen_t listen_addr_len;
 
-int ctroller_init(const char *uinput_device,
+/* Preallocated receive buffers for ctroller_poll_hid_batch() */
+static struct {
+    packet_hid_t packets[CTROLLER_BATCH_SIZE]
+        __attribute__((aligned(sizeof(uint32_t))));
+    struct sockaddr_storage addrs[CTROLLER_BATCH_SIZE];
+    struct iovec iovecs[CTROLLER_BATCH_SIZE];
+    struct mmsghdr msgs[CTROLLER_BATCH_SIZE];
+    /* Receive timestamps (SCM_TIMESTAMPNS) */
+    unsigned char control[CTROLLER_BATCH_SIZE][CTROLLER_CONTROL_SIZE]
+        __attribute__((aligned(sizeof(struct cmsghdr))));
+
+    /* Source addresses of the clients seen in the current batch */
+    struct sockaddr_storage clients[CTROLLER_CLIENTS_MAX];
+    socklen_t clients_len[CTROLLER_CLIENTS_MAX];
+    /* Per packet: kernel receive time, session of v2 packets, whether it is
+     * dropped for arriving out of order, whether it is a clock probe, and the
+     * number of packets missed right before it */
+    uint64_t received[CTROLLER_BATCH_SIZE];
+    struct ctroller_session *sessions[CTROLLER_BATCH_SIZE];
+    int late[CTROLLER_BATCH_SIZE];
+    int probe[CTROLLER_BATCH_SIZE];
+    unsigned missed[CTROLLER_BATCH_SIZE];
+} batch;
+
+static struct ctroller_session sessions[CTROLLER_SESSIONS_MAX];
+
+static struct ctroller_stats stats;
+
+int ctroller_init(const char *output,
                   const char *port,
-                  device_mask_t device_mask)
+                  device_mask_t device_mask,
+                  int combined,
+                  enum ctroller_backend backend)
 {
     puts("Initializing ctroller version " CTROLLER_VERSION_STRING ".");
     int res;
@@ -48,11 +101,34 @@ int ctroller_init(const char *uinput_device,
         return res;
     }
 
-    if ((res = ctroller_uinput_init(uinput_device, device_mask)) < 0) {
+    if ((res = ctroller_devices_init(output, device_mask, combined)) < 0) {
         fprintf(stderr, "Failed to create virtual device.\n");
         ctroller_exit();
         return res;
     }
+
+    ctroller.wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ctroller.wake < 0) {
+        perror("Failed to create eventfd");
+        ctroller_exit();
+        return -1;
+    }
+
+    if (backend == CTROLLER_BACKEND_URING) {
+        if (output_sink != &sink_uinput) {
+            fprintf(stderr,
+                    "io_uring requires the uinput output, "
+                    "falling back to poll.\n");
+            backend = CTROLLER_BACKEND_POLL;
+        } else if (uring_init(ctroller.socket, ctroller.wake) < 0) {
+            fprintf(stderr, "io_uring unavailable, falling back to poll.\n");
+            backend = CTROLLER_BACKEND_POLL;
+        } else {
+            puts("Using io_uring backend.");
+        }
+    }
+    ctroller.backend = backend;
+
     return 0;
 }
 
@@ -102,6 +178,13 @@ int ctroller_listener_init(const char *port)
         return -1;
     }
 
+    int on = 1;
+    if (setsockopt(
+            ctroller.socket, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) <
+        0) {
+        perror("Failed to enable receive timestamps");
+    }
+
     listen_addr     = *addr_info->ai_addr;
     listen_addr_len = addr_info->ai_addrlen;
 
@@ -111,10 +194,37 @@ int ctroller_listener_init(const char *port)
     return 0;
 }
 
-int ctroller_uinput_init(const char *uinput_device, device_mask_t device_mask)
+static int ctroller_combined_init(device_mask_t device_mask)
+{
+    for (size_t i = 0; i < arrsize(ctroller.devices); i++) {
+        if (device_mask & (1 << i)) {
+            combined_add(ctroller.devices[i]);
+        }
+    }
+
+    fprintf(stderr, "initializing combined device...\n");
+
+    return (ctroller.combined->create(ctroller.combined) < 0) ? -1 : 0;
+}
+
+int ctroller_devices_init(const char *output,
+                          device_mask_t device_mask,
+                          int combined)
 {
-    if (uinput_device == NULL) {
-        uinput_device = UINPUT_DEFAULT_DEVICE;
+    if (output == NULL) {
+        output = sink_uinput.name;
+    }
+
+    gamepad_init();
+    packet_init();
+
+    if (sink_init(output) < 0) {
+        return -1;
+    }
+    printf("Writing events to %s output.\n", output_sink->name);
+
+    if (combined) {
+        return ctroller_combined_init(device_mask);
     }
 
     for (size_t i = 0; i < arrsize(ctroller.devices); i++) {
@@ -122,15 +232,12 @@ int ctroller_uinput_init(const char *uinput_device, device_mask_t device_mask)
 
             fprintf(stderr, "initializing device DEVICE_ID=%zu...\n", i);
 
-            int fd = ctroller.devices[i]->create(uinput_device);
-            if (fd < 0) {
+            if (ctroller.devices[i]->create(ctroller.devices[i]) < 0) {
                 for (size_t j = 0; j < i; j++) {
-                    close(ctroller.devices[j]->fd);
-                    ctroller.devices[j]->fd = -1;
+                    device_destroy(ctroller.devices[j]);
                 }
                 return -1;
             }
-            ctroller.devices[i]->fd = fd;
         }
     }
 
@@ -143,116 +250,993 @@ int ctroller_recv(void *buf, size_t len)
         ctroller.socket, buf, len, 0, &listen_addr, &listen_addr_len);
 }
 
-int ctroller_poll_hid_info(struct hidinfo *hid)
+static uint64_t ctroller_clock(void)
 {
-    int res = 0;
-    packet_hid_t packet __attribute__((aligned(sizeof(uint32_t))));
-    struct pollfd ufds;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
 
-    ufds.fd     = ctroller.socket;
-    ufds.events = POLLIN;
+static void ctroller_record_latency(struct latency_histogram *hist,
+                                    const struct hidinfo *hid)
+{
+    if (hid->received == 0) {
+        return;
+    }
 
-    res = poll(&ufds, 1, -1);
-    if (res < 0) {
-        perror("Error polling 3DS");
+    uint64_t now = latency_now();
+    if (now >= hid->received) {
+        latency_record(hist, now - hid->received);
+    }
+}
+
+/* Write the state due at `now` to the device in playout `slot` */
+static void ctroller_playout_write(struct device_context *dev,
+                                   size_t slot,
+                                   uint64_t now)
+{
+    uint64_t cap = ctroller.delays[slot];
+    if (dev->fd == -1 || cap == 0) {
+        return;
+    }
+
+    struct hidinfo hid;
+    if (playout_state(slot, cap, now, &hid) && dev->write(dev, &hid) > 0) {
+        ctroller_record_latency(&latency_devices[slot], &hid);
+    }
+}
+
+static int ctroller_playout_tick(void)
+{
+    int res = playout_wait();
+    if (res <= 0) {
+        return res;
+    }
+
+    uint64_t now = ctroller_clock();
+    for (size_t i = 0; i < arrsize(ctroller.devices); i++) {
+        ctroller_playout_write(ctroller.devices[i], i, now);
+    }
+    ctroller_playout_write(ctroller.combined, DEVICES_COUNT, now);
+    return 1;
+}
+
+int ctroller_playout_init(unsigned rate, const unsigned *delays)
+{
+    if (ctroller.backend == CTROLLER_BACKEND_URING) {
+        fprintf(stderr,
+                "The playout scheduler requires the poll backend, "
+                "falling back to poll.\n");
+        uring_exit();
+        ctroller.backend = CTROLLER_BACKEND_POLL;
+    }
+
+    if (playout_init(rate) < 0) {
         return -1;
-    } else if (res == 0) {
-        // timeout
-        return 0;
     }
 
-    if (ufds.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+    /* The combined device is as smooth as its smoothest member */
+    uint64_t combined = 0;
+    for (size_t i = 0; i < DEVICES_COUNT; i++) {
+        ctroller.delays[i] = delays[i] * 1000000ull;
+        if (ctroller.delays[i] > combined) {
+            combined = ctroller.delays[i];
+        }
+    }
+    ctroller.delays[DEVICES_COUNT] = combined;
+
+    printf("Playing out buffered devices at %u Hz.\n", rate);
+    return 0;
+}
+
+/* Wait until the socket is readable, playing out buffered devices on every
+ * tick meanwhile. Returns 0 if a request was posted. */
+static int ctroller_poll_socket(void)
+{
+    int res = 0;
+    struct pollfd ufds[3];
+    nfds_t nfds = 2;
+
+    ufds[0].fd     = ctroller.socket;
+    ufds[0].events = POLLIN;
+    ufds[1].fd     = ctroller.wake;
+    ufds[1].events = POLLIN;
+    if (playout_active()) {
+        ufds[2].fd     = playout_fd();
+        ufds[2].events = POLLIN;
+        nfds           = 3;
+    }
+
+    do {
+        do {
+            res = poll(ufds, nfds, -1);
+        } while (res < 0 && errno == EINTR);
+        if (res < 0) {
+            perror("Error polling 3DS");
+            return -1;
+        } else if (res == 0) {
+            // timeout
+            return 0;
+        }
+
+        if (ufds[1].revents != 0) {
+            return 0;
+        }
+        if (nfds > 2 && ufds[2].revents != 0 && ctroller_playout_tick() < 0) {
+            perror("Error reading playout timer");
+            return -1;
+        }
+    } while (ufds[0].revents == 0);
+
+    if (ufds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
         fprintf(stderr, "Polling 3DS: revents indicate error\n");
         return -1;
     }
 
-    if (!(ufds.revents & POLLIN)) {
-        return 0;
+    return (ufds[0].revents & POLLIN) ? 1 : 0;
+}
+
+int ctroller_poll_hid_info(struct hidinfo *hid)
+{
+    int res = 0;
+    packet_hid_t packet __attribute__((aligned(sizeof(uint32_t))));
+    /* The sender is unknown, assume a single client */
+    static struct packet_stream stream;
+
+    res = ctroller_poll_socket();
+    if (res <= 0) {
+        return res;
     }
+
     res = ctroller_recv(packet, PACKET_SIZE);
     if (res < 0) {
         perror("Error receiving packet");
         return -1;
     }
 
-    res = ctroller_unpack_hid_info(packet, hid);
+    res = ctroller_unpack_hid_info(packet, res, &stream, hid);
     return res;
 }
 
-inline void *ctroller_unpack_int16_t(unsigned char *buf, int16_t *val)
+static void ctroller_batch_prepare(void)
+{
+    for (size_t i = 0; i < CTROLLER_BATCH_SIZE; i++) {
+        batch.iovecs[i].iov_base = batch.packets[i];
+        batch.iovecs[i].iov_len  = PACKET_SIZE;
+
+        batch.msgs[i].msg_hdr = (struct msghdr){
+            .msg_name       = &batch.addrs[i],
+            .msg_namelen    = sizeof(batch.addrs[i]),
+            .msg_iov        = &batch.iovecs[i],
+            .msg_iovlen     = 1,
+            .msg_control    = batch.control[i],
+            .msg_controllen = sizeof(batch.control[i]),
+        };
+        batch.msgs[i].msg_len = 0;
+    }
+}
+
+static size_t ctroller_batch_client(const struct msghdr *hdr,
+                                    size_t *nclients,
+                                    size_t max)
+{
+    size_t i;
+    for (i = 0; i < *nclients; i++) {
+        if (batch.clients_len[i] == hdr->msg_namelen &&
+            memcmp(&batch.clients[i], hdr->msg_name, hdr->msg_namelen) == 0) {
+            return i;
+        }
+    }
+
+    if (i < max) {
+        memcpy(&batch.clients[i], hdr->msg_name, hdr->msg_namelen);
+        batch.clients_len[i] = hdr->msg_namelen;
+        (*nclients)++;
+    }
+    return i;
+}
+
+static int ctroller_session_match(const struct ctroller_session *session,
+                                  const struct msghdr *hdr)
+{
+    return session->addr_len == hdr->msg_namelen &&
+           memcmp(&session->addr, hdr->msg_name, hdr->msg_namelen) == 0;
+}
+
+/* Session of the client that sent `hdr`, replacing the least recently used one
+ * if it is new */
+static struct ctroller_session *ctroller_session(const struct msghdr *hdr)
+{
+    struct ctroller_session *session = &sessions[0];
+    for (size_t i = 0; i < arrsize(sessions); i++) {
+        if (ctroller_session_match(&sessions[i], hdr)) {
+            session = &sessions[i];
+            goto found;
+        }
+        if (sessions[i].last_batch < session->last_batch) {
+            session = &sessions[i];
+        }
+    }
+
+    memset(session, 0, sizeof(*session));
+    memcpy(&session->addr, hdr->msg_name, hdr->msg_namelen);
+    session->addr_len  = hdr->msg_namelen;
+    session->clock.rtt = PACKET_CLOCK_UNKNOWN;
+
+found:
+    session->last_batch = stats.batches + 1;
+    return session;
+}
+
+static void ctroller_session_send(const struct ctroller_session *session,
+                                  const unsigned char *packet,
+                                  size_t len)
+{
+    sendto(ctroller.socket,
+           packet,
+           len,
+           MSG_DONTWAIT,
+           (const struct sockaddr *) &session->addr,
+           session->addr_len);
+}
+
+/* Acknowledge keyframe `id`. Lost acks only delay deltas, the client keeps
+ * sending keyframes until one is acknowledged. */
+static void ctroller_session_ack(const struct ctroller_session *session,
+                                 uint8_t id)
+{
+    unsigned char ack[PACKET_V2_ACK_SIZE];
+    packet_v2_pack_ack(id, ack);
+    ctroller_session_send(session, ack, sizeof(ack));
+    stats.keyframes++;
+}
+
+/* Echo the clock probe in `packet`, received at `received` ns (0 if unknown),
+ * right away: the time until it is sent counts towards the round-trip time.
+ * The report of the client's packets follows it. */
+static void ctroller_session_echo(struct ctroller_session *session,
+                                  const unsigned char *packet,
+                                  uint64_t received)
+{
+    unsigned char echo[PACKET_V2_ECHO_SIZE];
+    uint64_t now = latency_now();
+    packet_v2_pack_echo(
+        packet, ((received != 0) ? received : now) / 1000, now / 1000, echo);
+    ctroller_session_send(session, echo, sizeof(echo));
+    stats.probes++;
+
+    unsigned char report[PACKET_V2_REPORT_SIZE];
+    packet_v2_pack_report(
+        packet[PACKET_V2_OFFSET_ID], &session->sequence, report);
+    ctroller_session_send(session, report, sizeof(report));
+}
+
+/* Time from sampling a state at `sample` us of the client's clock until it was
+ * received at `received` ns, if the client estimated its clock offset */
+static void ctroller_session_capture(const struct ctroller_session *session,
+                                     uint32_t sample,
+                                     uint64_t received)
+{
+    if (session->clock.rtt == PACKET_CLOCK_UNKNOWN || received == 0) {
+        return;
+    }
+
+    /* Both clocks wrap around, their difference does not. A negative time
+     * is within the error of the estimate and left out. */
+    int32_t transit = (int32_t)((uint32_t)(received / 1000) -
+                                (sample + session->clock.offset));
+    if (transit >= 0) {
+        latency_record(&latency_capture, (uint64_t) transit * 1000);
+    }
+}
+
+static void ctroller_count_error(int error)
+{
+    if (error == PACKET_ESTALE) {
+        /* Not invalid, the client will send a keyframe */
+        stats.stale++;
+        return;
+    }
+
+    stats.invalid++;
+    switch (error) {
+    case PACKET_EMAGIC:
+        stats.bad_magic++;
+        break;
+    case PACKET_ESIZE:
+        stats.bad_size++;
+        break;
+    case PACKET_EPROTOCOL:
+        stats.mismatch++;
+        break;
+    }
+}
+
+/* Client states gathered while draining the socket */
+struct batch_state {
+    struct hidinfo *hids;
+    size_t len;
+    size_t nclients;
+    size_t received;
+    size_t coalesced;
+};
+
+/* Kernel receive time of a packet in ns, or 0 if the kernel did not attach
+ * one */
+static uint64_t ctroller_msg_timestamp(const struct msghdr *hdr)
+{
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg != NULL;
+         cmsg                 = CMSG_NXTHDR((struct msghdr *) hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+        }
+    }
+    return 0;
+}
+
+/* Look up the sessions of `n` received packets and check their sequence
+ * numbers in the order they arrived. Packets older than one received before
+ * are marked late. */
+static void ctroller_batch_order(const struct mmsghdr *msgs, int n)
+{
+    struct ctroller_session *session = NULL;
+    for (int i = 0; i < n; i++) {
+        const struct msghdr *hdr = &msgs[i].msg_hdr;
+        unsigned char *packet    = hdr->msg_iov[0].iov_base;
+        batch.received[i]        = ctroller_msg_timestamp(hdr);
+        batch.sessions[i]        = NULL;
+        batch.late[i]            = 0;
+        batch.probe[i]           = 0;
+        batch.missed[i]          = 0;
+        if (hdr->msg_flags & MSG_TRUNC) {
+            continue;
+        }
+
+        struct protocol_clock_sample estimate;
+        uint16_t number;
+        uint32_t sample;
+        if (packet_v2_unpack_probe(packet, msgs[i].msg_len, &estimate) == 0) {
+            batch.probe[i] = 1;
+        } else if (packet_v2_sequence(
+                       packet, msgs[i].msg_len, &number, &sample) < 0) {
+            continue;
+        }
+
+        /* Consecutive packets usually come from the same client */
+        if (session == NULL || !ctroller_session_match(session, hdr)) {
+            session = ctroller_session(hdr);
+        }
+        batch.sessions[i] = session;
+        if (batch.probe[i]) {
+            ctroller_session_echo(session, packet, batch.received[i]);
+            session->clock = estimate;
+            continue;
+        }
+
+        struct packet_sequence *seq = &session->sequence;
+        unsigned long lost          = seq->lost;
+        switch (
+            packet_sequence_update(seq, number, sample, batch.received[i])) {
+        case PACKET_IN_ORDER:
+            batch.missed[i] = seq->skipped;
+            ctroller_session_capture(session, sample, batch.received[i]);
+            break;
+        case PACKET_LATE:
+            stats.late++;
+            batch.late[i] = 1;
+            break;
+        case PACKET_DUPLICATE:
+            stats.duplicate++;
+            batch.late[i] = 1;
+            break;
+        }
+        stats.lost += seq->lost - lost;
+    }
+}
+
+/* Rebuild the key edges of the packets missed right before packet `i` from
+ * the ones it repeats */
+static void ctroller_batch_recover(const struct mmsghdr *msgs,
+                                   int i,
+                                   struct hidinfo *hid)
+{
+    if (batch.missed[i] == 0) {
+        return;
+    }
+
+    int res = packet_v2_recover(msgs[i].msg_hdr.msg_iov[0].iov_base,
+                                msgs[i].msg_len,
+                                batch.missed[i],
+                                hid);
+    if (res > 0) {
+        stats.recovered += res;
+    }
+}
+
+/* Buffer the state of every packet in order for the playout scheduler, the
+ * fold only keeps the newest one of each client */
+static void ctroller_batch_playout(const struct mmsghdr *msgs, int n)
+{
+    if (!playout_active()) {
+        return;
+    }
+
+    /* Receive timestamps are CLOCK_REALTIME, the buffer runs on
+     * CLOCK_MONOTONIC */
+    uint64_t monotonic = ctroller_clock();
+    uint64_t realtime  = latency_now();
+    for (int i = 0; i < n; i++) {
+        const struct mmsghdr *msg        = &msgs[i];
+        unsigned char *packet            = msg->msg_hdr.msg_iov[0].iov_base;
+        struct ctroller_session *session = batch.sessions[i];
+        if ((msg->msg_hdr.msg_flags & MSG_TRUNC) || batch.late[i] ||
+            batch.probe[i]) {
+            continue;
+        }
+
+        /* Errors are counted by the fold */
+        struct hidinfo hid;
+        struct packet_stream *stream = (session != NULL) ? &session->stream
+                                                         : NULL;
+        int used = ctroller_unpack_hid_info(packet, msg->msg_len, stream, &hid);
+        if (used < 0) {
+            continue;
+        }
+        if (batch.missed[i] != 0) {
+            packet_v2_recover(packet, msg->msg_len, batch.missed[i], &hid);
+        }
+
+        /* The motion sensors sampled since the last packet come first */
+        struct packet_motion motion[PACKET_MOTION_MAX];
+        int nmotion = (session != NULL)
+                          ? packet_v2_unpack_motion(
+                                packet, msg->msg_len, used, &hid, motion)
+                          : 0;
+        for (int m = 0; m < nmotion; m++) {
+            playout_push_motion(
+                session, motion[m].sample, &motion[m].gyro, &motion[m].accel);
+        }
+
+        uint64_t received = batch.received[i];
+        uint64_t arrival  = (received != 0 && received <= realtime)
+                                ? monotonic - (realtime - received)
+                                : monotonic;
+        hid.received      = received;
+        playout_push(&hid, session, hid.sample != 0, hid.sample, arrival);
+    }
+}
+
+/* Fold `n` received packets, ordered from oldest to newest and checked by
+ * ctroller_batch_order(), into the client states.
+ */
+static void ctroller_batch_fold(struct batch_state *state,
+                                const struct mmsghdr *msgs,
+                                int n)
+{
+    struct hidinfo *hids = state->hids;
+    ctroller_batch_playout(msgs, n);
+
+    /* Walk from newest to oldest, so that only the newest packet of each
+     * client needs to be unpacked completely. */
+    int seen[CTROLLER_CLIENTS_MAX] = {};
+    uint64_t now                   = latency_now();
+    for (int i = n - 1; i >= 0; i--) {
+        const struct mmsghdr *msg        = &msgs[i];
+        unsigned char *packet            = msg->msg_hdr.msg_iov[0].iov_base;
+        uint64_t received                = batch.received[i];
+        struct ctroller_session *session = batch.sessions[i];
+        if (received != 0 && received <= now) {
+            latency_record(&latency_stages[LATENCY_RECEIVE], now - received);
+        }
+
+        if (msg->msg_hdr.msg_flags & MSG_TRUNC) {
+            stats.invalid++;
+            stats.bad_size++;
+            flight_packet(now, FLIGHT_INVALID, 0, NULL, msg->msg_len);
+            continue;
+        }
+        if (batch.late[i]) {
+            /* Applying it would roll the state of its client back */
+            flight_packet(now, FLIGHT_LATE, 0, NULL, msg->msg_len);
+            continue;
+        }
+        if (batch.probe[i]) {
+            /* Echoed already, it holds no state */
+            continue;
+        }
+
+        size_t known = state->nclients;
+        size_t c =
+            ctroller_batch_client(&msg->msg_hdr, &state->nclients, state->len);
+        if (c >= state->len) {
+            stats.overflow++;
+            continue;
+        }
+
+        /* Only v2 packets have a session, v1 packets need none */
+        struct packet_stream *stream = (session != NULL) ? &session->stream
+                                                         : NULL;
+
+        struct hidinfo hid;
+        int keyframe = packet_v2_keyframe_id(packet, msg->msg_len);
+        int res;
+        if (!seen[c]) {
+            res = ctroller_unpack_hid_info(packet, msg->msg_len, stream, &hid);
+            if (res < 0) {
+                ctroller_count_error(res);
+                flight_packet(now, FLIGHT_INVALID, c, NULL, msg->msg_len);
+                if (c >= known) {
+                    state->nclients--;
+                }
+                continue;
+            }
+            if (keyframe >= 0) {
+                ctroller_session_ack(session, keyframe);
+            }
+            ctroller_batch_recover(msgs, i, &hid);
+            if (hid.version != CTROLLER_VERSION) {
+                stats.mismatch++;
+            }
+            hid.received = received;
+            hid.source   = session;
+            PROBE4(unpack, c, hid.version, hid.keys.held, received);
+            flight_packet(now, FLIGHT_PACKET, c, &hid, msg->msg_len);
+            if (received != 0) {
+                uint64_t unpacked = latency_now();
+                if (unpacked >= received) {
+                    latency_record(&latency_stages[LATENCY_UNPACK],
+                                   unpacked - received);
+                }
+            }
+            if (c < known) {
+                /* Newer than the state of a previous round */
+                hid.keys.up |= hids[c].keys.up;
+                hid.keys.down |= hids[c].keys.down;
+                state->coalesced++;
+            }
+            hids[c] = hid;
+            seen[c] = 1;
+        } else {
+            /* Older keyframes are still kept, deltas may refer to them */
+            res = (keyframe >= 0)
+                      ? ctroller_unpack_hid_info(
+                            packet, msg->msg_len, stream, &hid)
+                      : ctroller_unpack_hid_keys(packet, msg->msg_len, &hid);
+            if (res < 0) {
+                ctroller_count_error(res);
+                flight_packet(now, FLIGHT_INVALID, c, NULL, msg->msg_len);
+                continue;
+            }
+            if (keyframe >= 0) {
+                ctroller_session_ack(session, keyframe);
+            }
+            ctroller_batch_recover(msgs, i, &hid);
+            flight_packet(now, FLIGHT_COALESCED, c, &hid, msg->msg_len);
+            hids[c].keys.up |= hid.keys.up;
+            hids[c].keys.down |= hid.keys.down;
+            state->coalesced++;
+        }
+    }
+}
+
+/* Record `n` received packets, ordered from oldest to newest, after their
+ * receive times were read by ctroller_batch_order(). `first` is set if they
+ * start the batch. */
+static void ctroller_batch_capture(const struct mmsghdr *msgs, int n, int first)
+{
+    if (!capture_active()) {
+        return;
+    }
+
+    /* Packets the kernel did not timestamp were received at the latest now */
+    uint64_t now = latency_now();
+    for (int i = 0; i < n; i++) {
+        capture_write((batch.received[i] != 0) ? batch.received[i] : now,
+                      (i > 0 || !first) ? CAPTURE_BATCHED : 0,
+                      msgs[i].msg_hdr.msg_name,
+                      msgs[i].msg_hdr.msg_iov[0].iov_base,
+                      msgs[i].msg_len);
+    }
+}
+
+static void ctroller_batch_account(const struct batch_state *state)
+{
+    if (state->received == 0) {
+        return;
+    }
+
+    size_t coalesced = state->coalesced;
+
+    stats.batches++;
+    stats.packets += state->received;
+    stats.coalesced += coalesced;
+    if (coalesced >= CTROLLER_BATCH_SIZE) {
+        coalesced = CTROLLER_BATCH_SIZE - 1;
+    }
+    stats.batch_coalesced[coalesced]++;
+}
+
+static int ctroller_mmsg_recv(struct batch_state *state)
+{
+    int res = ctroller_poll_socket();
+    if (res <= 0) {
+        return res;
+    }
+    stats.batch_start = ctroller_clock();
+
+    int n;
+    do {
+        ctroller_batch_prepare();
+        n = recvmmsg(ctroller.socket,
+                     batch.msgs,
+                     CTROLLER_BATCH_SIZE,
+                     MSG_DONTWAIT,
+                     NULL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            perror("Error receiving packets");
+            return -1;
+        }
+        state->received += n;
+        PROBE1(recv, n);
+        ctroller_batch_order(batch.msgs, n);
+        ctroller_batch_capture(batch.msgs, n, state->received == (size_t) n);
+        ctroller_batch_fold(state, batch.msgs, n);
+    } while (n == CTROLLER_BATCH_SIZE);
+
+    return 1;
+}
+
+static int ctroller_uring_recv(struct batch_state *state)
+{
+    int n;
+    do {
+        n = uring_recv(batch.msgs, CTROLLER_BATCH_SIZE, state->received == 0);
+        if (n < 0) {
+            perror("Error receiving packets");
+            return -1;
+        }
+        if (n == 0 && state->received == 0) {
+            /* Woken up by a request */
+            return 0;
+        }
+        if (state->received == 0) {
+            stats.batch_start = ctroller_clock();
+        }
+        state->received += n;
+        PROBE1(recv, n);
+        ctroller_batch_order(batch.msgs, n);
+        ctroller_batch_capture(batch.msgs, n, state->received == (size_t) n);
+        ctroller_batch_fold(state, batch.msgs, n);
+        uring_recv_done();
+    } while (n == CTROLLER_BATCH_SIZE);
+
+    return 1;
+}
+
+/* Drain all pending packets from the socket and coalesce them into the newest
+ * state per client. Key edges (keys.up/keys.down) of skipped packets are
+ * folded into the forwarded state, so short presses are not lost.
+ *
+ * Returns the number of client states written to `hids`, or -1 on error.
+ */
+int ctroller_poll_hid_batch(struct hidinfo *hids, size_t len)
+{
+    struct batch_state state = {
+        .hids = hids,
+        .len  = (len > CTROLLER_CLIENTS_MAX) ? CTROLLER_CLIENTS_MAX : len,
+    };
+
+    do {
+        state.nclients  = 0;
+        state.received  = 0;
+        state.coalesced = 0;
+
+        int res = (ctroller.backend == CTROLLER_BACKEND_URING)
+                      ? ctroller_uring_recv(&state)
+                      : ctroller_mmsg_recv(&state);
+        if (res <= 0) {
+            return res;
+        }
+
+        ctroller_batch_account(&state);
+    } while (state.nclients == 0);
+
+    return state.nclients;
+}
+
+/* Bits of enum ctroller_request, posted by signal handlers */
+static volatile sig_atomic_t requests;
+
+void ctroller_request(enum ctroller_request request)
+{
+    __atomic_fetch_or(&requests, request, __ATOMIC_SEQ_CST);
+    if (ctroller.wake >= 0) {
+        int saved = errno;
+        uint64_t one = 1;
+        ssize_t res  = write(ctroller.wake, &one, sizeof(one));
+        (void) res;
+        errno = saved;
+    }
+}
+
+unsigned ctroller_take_requests(void)
 {
-    *val = (int16_t) ntohs(*(uint16_t *) buf);
-    return buf + sizeof(int16_t);
+    if (ctroller.wake >= 0) {
+        uint64_t count;
+        ssize_t res = read(ctroller.wake, &count, sizeof(count));
+        (void) res;
+    }
+    return __atomic_exchange_n(&requests, 0, __ATOMIC_SEQ_CST);
 }
 
-inline void *ctroller_unpack_uint16_t(unsigned char *buf, uint16_t *val)
+static void ctroller_replay_wait(uint64_t due)
 {
-    *val = ntohs(*(uint16_t *) buf);
-    return buf + sizeof(uint16_t);
+    struct timespec ts = {
+        .tv_sec  = due / 1000000000ull,
+        .tv_nsec = due % 1000000000ull,
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
 }
 
-inline void *ctroller_unpack_uint32_t(unsigned char *buf, uint32_t *val)
+/* Put `record` into slot `i` of the receive buffers, as if it was received.
+ * It is not timestamped, replays are excluded from the latencies. */
+static void ctroller_replay_record(const struct capture_record *record, int i)
 {
-    *val = ntohl(*(uint32_t *) buf);
-    return buf + sizeof(uint32_t);
+    struct msghdr *hdr = &batch.msgs[i].msg_hdr;
+
+    hdr->msg_controllen = 0;
+
+    memset(&batch.addrs[i], 0, sizeof(batch.addrs[i]));
+    if (record->family == AF_INET) {
+        struct sockaddr_in *in = (struct sockaddr_in *) &batch.addrs[i];
+        in->sin_family         = AF_INET;
+        in->sin_port           = htons(record->port);
+        memcpy(&in->sin_addr, record->addr, sizeof(in->sin_addr));
+        hdr->msg_namelen = sizeof(*in);
+    } else if (record->family == AF_INET6) {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) &batch.addrs[i];
+        in6->sin6_family         = AF_INET6;
+        in6->sin6_port           = htons(record->port);
+        memcpy(&in6->sin6_addr, record->addr, sizeof(in6->sin6_addr));
+        hdr->msg_namelen = sizeof(*in6);
+    } else {
+        hdr->msg_namelen = 0;
+    }
+
+    size_t len = (record->len < PACKET_SIZE) ? record->len : PACKET_SIZE;
+    memcpy(batch.packets[i], capture_record_data(record), len);
+    batch.msgs[i].msg_len = len;
 }
 
-inline int ctroller_unpack_hid_info(unsigned char *sendbuf, struct hidinfo *hid)
+/* Feed the packets of a capture through the devices. Packets the server
+ * received in one batch are replayed as one, through the same sessions,
+ * ordering, recovery and coalescing, so the states written are the ones the
+ * server wrote. With a `speed` of 0, batches are replayed as fast as
+ * possible, otherwise their original timing is scaled by `speed`. The events
+ * written do not depend on the speed.
+ *
+ * Returns the number of packets replayed, or -1 on error.
+ */
+long ctroller_replay(const char *path, double speed)
 {
-    uint16_t magic;
-    unsigned char *unpack = sendbuf;
-    unpack                = ctroller_unpack_uint16_t(unpack, &magic);
-    if (magic != PACKET_MAGIC) {
-        fprintf(stderr, "Invalid package header (%#08x).\n", magic);
+    struct capture_reader reader;
+    if (capture_reader_open(&reader, path) < 0) {
         return -1;
     }
 
-    unpack = ctroller_unpack_uint16_t(unpack, &hid->version);
+    long replayed  = 0;
+    uint64_t first = 0, start = 0;
+    struct hidinfo hids[CTROLLER_CLIENTS_MAX];
+    const struct capture_record *record = capture_reader_next(&reader);
+    while (record != NULL) {
+        if (speed > 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (replayed == 0) {
+                first = record->timestamp;
+                start = (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+            }
+            /* Timestamps are wall clock time and might step backwards */
+            if (record->timestamp > first) {
+                ctroller_replay_wait(
+                    start + (uint64_t)((record->timestamp - first) / speed));
+            }
+        }
 
-    unpack = ctroller_unpack_uint32_t(unpack, &hid->keys.up);
-    unpack = ctroller_unpack_uint32_t(unpack, &hid->keys.down);
-    unpack = ctroller_unpack_uint32_t(unpack, &hid->keys.held);
+        int n = 0;
+        ctroller_batch_prepare();
+        do {
+            ctroller_replay_record(record, n++);
+            record = capture_reader_next(&reader);
+        } while (record != NULL && (record->flags & CAPTURE_BATCHED) &&
+                 n < CTROLLER_BATCH_SIZE);
+        replayed += n;
 
-    unpack = ctroller_unpack_uint16_t(unpack, &hid->touchscreen.px);
-    unpack = ctroller_unpack_uint16_t(unpack, &hid->touchscreen.py);
+        struct batch_state state = {
+            .hids     = hids,
+            .len      = CTROLLER_CLIENTS_MAX,
+            .received = n,
+        };
+        ctroller_batch_order(batch.msgs, n);
+        ctroller_batch_fold(&state, batch.msgs, n);
+        ctroller_batch_account(&state);
+        for (int i = state.nclients - 1; i >= 0; i--) {
+            ctroller_write_hid_info(&hids[i]);
+        }
+    }
 
-    unpack = ctroller_unpack_int16_t(unpack, &hid->circlepad.dx);
-    unpack = ctroller_unpack_int16_t(unpack, &hid->circlepad.dy);
+    capture_reader_close(&reader);
+    return replayed;
+}
 
-    unpack = ctroller_unpack_int16_t(unpack, &hid->cstick.dx);
-    unpack = ctroller_unpack_int16_t(unpack, &hid->cstick.dy);
+const struct ctroller_stats *ctroller_get_stats(void)
+{
+    return &stats;
+}
 
-    unpack = ctroller_unpack_int16_t(unpack, &hid->gyro.x);
-    unpack = ctroller_unpack_int16_t(unpack, &hid->gyro.y);
-    unpack = ctroller_unpack_int16_t(unpack, &hid->gyro.z);
+const struct ctroller_session *ctroller_get_sessions(void)
+{
+    return sessions;
+}
 
-    unpack = ctroller_unpack_int16_t(unpack, &hid->accel.x);
-    unpack = ctroller_unpack_int16_t(unpack, &hid->accel.y);
-    unpack = ctroller_unpack_int16_t(unpack, &hid->accel.z);
+int ctroller_session_name(const struct ctroller_session *session,
+                          char *buf,
+                          size_t len)
+{
+    char host[NI_MAXHOST], port[NI_MAXSERV];
+    int res = getnameinfo((const struct sockaddr *) &session->addr,
+                          session->addr_len,
+                          host,
+                          sizeof(host),
+                          port,
+                          sizeof(port),
+                          NI_NUMERICHOST | NI_NUMERICSERV);
+    if (res != 0) {
+        return snprintf(buf, len, "?");
+    }
+    return snprintf(buf,
+                    len,
+                    (session->addr.ss_family == AF_INET6) ? "[%s]:%s" : "%s:%s",
+                    host,
+                    port);
+}
 
-    return unpack - sendbuf;
+/* Magic and protocol revision of a packet, or a negative enum packet_error */
+static int ctroller_unpack_protocol(unsigned char *sendbuf, size_t len)
+{
+    int protocol = protocol_revision(sendbuf, len);
+    if (protocol == PACKET_EMAGIC) {
+        logger_post(LOGGER_BAD_MAGIC, 0, NULL, protocol_get_u16(sendbuf));
+    }
+    return protocol;
+}
+
+inline int ctroller_unpack_hid_info(unsigned char *sendbuf,
+                                    size_t len,
+                                    struct packet_stream *stream,
+                                    struct hidinfo *hid)
+{
+    int protocol = ctroller_unpack_protocol(sendbuf, len);
+    switch (protocol) {
+    case PACKET_PROTOCOL_V1:
+        break;
+    case PACKET_PROTOCOL_V2:
+        return packet_v2_unpack(sendbuf, len, stream, hid);
+    default:
+        return (protocol < 0) ? protocol : PACKET_EPROTOCOL;
+    }
+
+    return packet_v1_unpack(sendbuf, len, hid);
+}
+
+/* Only unpack the key edges of a packet, used for packets that are coalesced
+ * into a newer one.
+ */
+int ctroller_unpack_hid_keys(unsigned char *sendbuf,
+                             size_t len,
+                             struct hidinfo *hid)
+{
+    int protocol = ctroller_unpack_protocol(sendbuf, len);
+    switch (protocol) {
+    case PACKET_PROTOCOL_V1:
+        break;
+    case PACKET_PROTOCOL_V2:
+        return packet_v2_unpack_keys(sendbuf, len, hid);
+    default:
+        return (protocol < 0) ? protocol : PACKET_EPROTOCOL;
+    }
+
+    return protocol_unpack_v1_keys(&packet_layout, sendbuf, len, hid);
+}
+
+/* Counterpart of ctroller_unpack_hid_info(), produces the same packets as
+ * ctrollerPackHIDInfo() on the 3DS. Used by the tools simulating a client.
+ */
+int ctroller_pack_hid_info(const struct hidinfo *hid, unsigned char *sendbuf)
+{
+    return protocol_pack_v1(&packet_layout, hid, hid->version, sendbuf);
+}
+
+static int ctroller_uring_write(struct hidinfo *hid)
+{
+    struct device_context *active[DEVICES_COUNT + 1];
+    size_t nactive = 0;
+
+    for (size_t i = 0; i < arrsize(ctroller.devices); i++) {
+        if (ctroller.devices[i]->fd != -1) {
+            active[nactive++] = ctroller.devices[i];
+        }
+    }
+    if (ctroller.combined->fd != -1) {
+        active[nactive++] = ctroller.combined;
+    }
+
+    /* Writes complete asynchronously, only their submission is timed */
+    int res = uring_write(active, nactive, hid);
+    ctroller_record_latency(&latency_stages[LATENCY_WRITE], hid);
+    return res;
 }
 
 int ctroller_write_hid_info(struct hidinfo *hid)
 {
+    struct hidinfo predicted;
+    if (predict_active()) {
+        predicted = *hid;
+        predict_apply(&predicted);
+        hid = &predicted;
+    }
+
+    if (ctroller.backend == CTROLLER_BACKEND_URING) {
+        return ctroller_uring_write(hid);
+    }
+
+    /* Devices with a playout delay are written on the ticks of the playout
+     * scheduler instead */
     for (size_t i = 0; i < arrsize(ctroller.devices); i++) {
-        int devfd = ctroller.devices[i]->fd;
-        if (devfd != -1) {
-            ctroller.devices[i]->write(devfd, hid);
+        struct device_context *dev = ctroller.devices[i];
+        if (dev->fd != -1 && ctroller.delays[i] == 0 &&
+            dev->write(dev, hid) > 0) {
+            ctroller_record_latency(&latency_devices[i], hid);
         }
     }
+
+    if (ctroller.combined->fd != -1 && ctroller.delays[DEVICES_COUNT] == 0 &&
+        ctroller.combined->write(ctroller.combined, hid) > 0) {
+        ctroller_record_latency(&latency_devices[DEVICES_COUNT], hid);
+    }
+
+    ctroller_record_latency(&latency_stages[LATENCY_WRITE], hid);
     return 0;
 }
 
 void ctroller_exit()
 {
+    if (ctroller.backend == CTROLLER_BACKEND_URING) {
+        uring_exit();
+        ctroller.backend = CTROLLER_BACKEND_POLL;
+    }
+    playout_exit();
+
     close(ctroller.socket);
     ctroller.socket = -1;
+    if (ctroller.wake >= 0) {
+        close(ctroller.wake);
+        ctroller.wake = -1;
+    }
 
     for (size_t i = 0; i < arrsize(ctroller.devices); i++) {
-        ioctl(ctroller.devices[i]->fd, UI_DEV_DESTROY);
-        ctroller.devices[i]->fd = -1;
+        device_destroy(ctroller.devices[i]);
     }
+    device_destroy(ctroller.combined);
+
+    sink_exit();
 
     return;
 }
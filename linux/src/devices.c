@@ -1,4 +1,8 @@
 #include "devices.h"
+#include "flight.h"
+#include "logger.h"
+#include "probes.h"
+#include "sink.h"
 
 #include <stddef.h>
 #include <stdint.h>
@@ -6,86 +10,83 @@
 #include <errno.h>
 #include <string.h>
 
-#include <fcntl.h>
-#include <unistd.h>
-
 #include <linux/input.h>
-#include <linux/uinput.h>
 
-int device_open(const char *uinput_device)
+int device_create(struct device_context *dev)
 {
-    int uinputfd;
-    if (uinput_device == NULL) {
-        errno    = EINVAL;
-        uinputfd = -1;
-        goto error;
-    }
-    uinputfd = open(uinput_device, O_WRONLY | O_NONBLOCK);
-    if (uinputfd < 0) {
-        goto error;
+    int handle = output_sink->create(dev);
+    if (handle < 0) {
+        fprintf(stderr, "Failed to initialize %s.\n", dev->name);
+        return -1;
     }
-    return uinputfd;
 
-error:
-    fprintf(stderr,
-            "Error opening uinput device at '%s': %s\n",
-            uinput_device,
-            strerror(errno));
-    return uinputfd;
+    dev->fd     = handle;
+    dev->synced = 0;
+    return handle;
 }
 
-ssize_t
-device_register_keys(const int uinputfd, const uint16_t *keycodes, size_t len)
+void device_destroy(struct device_context *dev)
 {
-    ssize_t res;
-    res = ioctl(uinputfd, UI_SET_EVBIT, EV_KEY);
-    if (res < 0) {
-        perror("Failed to register event type for keys");
-        return -1;
+    if (dev->fd != -1) {
+        output_sink->destroy(dev);
+        dev->fd = -1;
     }
-    for (size_t i = 0; i < len; i++) {
-        res = ioctl(uinputfd, UI_SET_KEYBIT, keycodes[i]);
-        if (res < 0) {
-            perror("Failed to register key");
-            return i;
-        }
-    }
-    return len;
 }
 
-ssize_t device_register_absaxis(const int uinputfd,
-                                const uint16_t *axiscodes,
-                                size_t len)
+size_t device_prepare(struct device_context *dev,
+                      const struct hidinfo *hid,
+                      struct input_event *events)
 {
-    ssize_t res;
-    res = ioctl(uinputfd, UI_SET_EVBIT, EV_ABS);
-    if (res < 0) {
-        perror("Failed to register event type for absolute axis");
-        return -1;
+    size_t i = dev->events(dev, hid, events);
+    if (i == 0) {
+        // Nothing changed since the last write
+        return 0;
     }
-    for (size_t i = 0; i < len; i++) {
-        res = ioctl(uinputfd, UI_SET_ABSBIT, axiscodes[i]);
-        if (res < 0) {
-            perror("Failed to register absolute axis");
-            return i;
-        }
+
+    events[i].type  = EV_SYN;
+    events[i].code  = SYN_REPORT;
+    events[i].value = 0;
+    PROBE2(syn, dev->name, i);
+    i++;
+
+    return i;
+}
+
+void device_commit(struct device_context *dev, const struct hidinfo *hid)
+{
+    if (dev->commit != NULL) {
+        dev->commit(dev, hid);
+        return;
     }
-    return len;
+
+    dev->last   = *hid;
+    dev->synced = 1;
 }
 
-int device_create(int uinputfd, const struct uinput_user_dev *dev)
+int device_write(struct device_context *dev, const struct hidinfo *hid)
 {
     int res;
-    res = write(uinputfd, dev, sizeof(struct uinput_user_dev));
-    if (res < 0) {
-        perror("Failed to register virtual device");
-        return -1;
+    struct input_event events[DEVICE_PREPARE_MAX];
+
+    size_t i = device_prepare(dev, hid, events);
+    if (i == 0) {
+        return 0;
     }
 
-    res = ioctl(uinputfd, UI_DEV_CREATE);
+    res = output_sink->write(dev, events, i);
+    PROBE3(write, dev->name, i, res);
+    flight_write(dev, i, res);
     if (res < 0) {
-        perror("Unable to create virtual device");
-        return -1;
+        dev->stats.errors++;
+        if (errno == EAGAIN) {
+            dev->stats.again++;
+        }
+        logger_post(LOGGER_WRITE_ERROR, errno, dev->name, 0);
+        return res;
     }
-    return uinputfd;
+
+    dev->stats.writes++;
+    dev->stats.events += i;
+    device_commit(dev, hid);
+    return res;
 }
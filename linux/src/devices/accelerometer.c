@@ -1,10 +1,6 @@
 #include "devices.h"
 #include "hid.h"
 
-#include <stdio.h>
-
-#include <unistd.h>
-
 #include <linux/uinput.h>
 
 static const struct uinput_user_dev accelerometer = {
@@ -36,70 +32,51 @@ static const uint16_t axis[] = {
     ABS_X, ABS_Y, ABS_Z,
 };
 
-#define NUMEVENTS (arrsize(axis) + 1)
+// Axis reported on the combined device
+static const uint16_t combined_axis[] = {
+    ABS_RUDDER, ABS_WHEEL, ABS_GAS,
+};
 
 struct device_context device_accelerometer = {
-    -1,
-    accelerometer_write,
-    accelerometer_create,
+    .fd     = -1,
+    .name   = "accelerometer",
+    .write  = device_write,
+    .events = accelerometer_events,
+    .create = device_create,
+
+    .dev           = &accelerometer,
+    .axis          = axis,
+    .naxis         = arrsize(axis),
+    .combined_axis = combined_axis,
 };
 
-int accelerometer_create(const char *uinput_device)
+size_t accelerometer_events(const struct device_context *dev,
+                            const struct hidinfo *hid,
+                            struct input_event *events)
 {
-    int uinputfd = device_open(uinput_device);
-    if (uinputfd < 0) {
-        goto failure_noclose;
-    }
+    const struct hidinfo *last = &dev->last;
+    size_t i = 0;
 
-    int res;
-    res = device_register_absaxis(uinputfd, axis, arrsize(axis));
-    if (res != arrsize(axis)) {
-        goto failure;
+    if (!dev->synced || hid->accel.x != last->accel.x) {
+        events[i].type  = EV_ABS;
+        events[i].code  = ABS_X;
+        events[i].value = hid->accel.x;
+        i++;
     }
 
-    res = device_create(uinputfd, &accelerometer);
-    if (res < 0) {
-        goto failure;
+    if (!dev->synced || hid->accel.y != last->accel.y) {
+        events[i].type  = EV_ABS;
+        events[i].code  = ABS_Y;
+        events[i].value = hid->accel.y;
+        i++;
     }
 
-    return uinputfd;
-
-failure:
-    close(uinputfd);
-failure_noclose:
-    fprintf(stderr, "Failed to initialize accelerometer.\n");
-    return -1;
-}
-
-int accelerometer_write(int uinputfd, struct hidinfo *hid)
-{
-    int res;
-    static struct input_event events[NUMEVENTS];
-    size_t i = 0;
-
-    events[i].type  = EV_ABS;
-    events[i].code  = ABS_X;
-    events[i].value = hid->accel.x;
-    i++;
-
-    events[i].type  = EV_ABS;
-    events[i].code  = ABS_Y;
-    events[i].value = hid->accel.y;
-    i++;
-
-    events[i].type  = EV_ABS;
-    events[i].code  = ABS_Z;
-    events[i].value = hid->accel.z;
-    i++;
-
-    events[i].type  = EV_SYN;
-    events[i].code  = SYN_REPORT;
-    events[i].value = 0;
-    i++;
-
-    res = write(uinputfd, events, i * sizeof(struct input_event));
-    if (res < 0) {
-        perror("Error writing accelerometer events");
+    if (!dev->synced || hid->accel.z != last->accel.z) {
+        events[i].type  = EV_ABS;
+        events[i].code  = ABS_Z;
+        events[i].value = hid->accel.z;
+        i++;
     }
-    return res;
+
+    return i;
 }
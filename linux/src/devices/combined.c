@@ -0,0 +1,128 @@
+#include "devices.h"
+#include "hid.h"
+
+#include <errno.h>
+
+#include <linux/uinput.h>
+
+/* The combined device registers the keys and axis of all its members on a
+ * single uinput device, so that a whole packet is written using a single
+ * write() and SYN_REPORT. Axis of members that would collide are moved to the
+ * codes given in their `combined_axis`.
+ */
+
+static struct uinput_user_dev combined = {
+    .name = "Nintendo 3DS (combined)",
+    .id =
+        {
+            .vendor  = 0x057e,
+            .product = 0x0400,
+            .version = 1,
+            .bustype = BUS_VIRTUAL,
+        },
+};
+
+static struct device_context *members[DEVICES_COUNT];
+static size_t nmembers;
+
+static uint16_t keys[DEVICES_COUNT * DEVICE_EVENTS_MAX];
+static uint16_t axis[DEVICES_COUNT * DEVICE_EVENTS_MAX];
+
+struct device_context device_combined = {
+    .fd     = -1,
+    .name   = "combined",
+    .write  = device_write,
+    .events = combined_events,
+    .commit = combined_commit,
+    .create = combined_create,
+
+    .dev  = &combined,
+    .keys = keys,
+    .axis = axis,
+};
+
+int combined_add(struct device_context *member)
+{
+    if (nmembers == arrsize(members)) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    members[nmembers++] = member;
+    return 0;
+}
+
+static void combined_merge(struct device_context *dev,
+                           const struct device_context *member)
+{
+    const struct uinput_user_dev *from = member->dev;
+
+    for (size_t i = 0; i < member->nkeys; i++) {
+        keys[dev->nkeys++] = member->keys[i];
+    }
+
+    for (size_t i = 0; i < member->naxis; i++) {
+        uint16_t code = member->combined_axis[i];
+
+        combined.absmin[code]  = from->absmin[member->axis[i]];
+        combined.absmax[code]  = from->absmax[member->axis[i]];
+        combined.absflat[code] = from->absflat[member->axis[i]];
+        combined.absfuzz[code] = from->absfuzz[member->axis[i]];
+
+        axis[dev->naxis++] = code;
+    }
+}
+
+int combined_create(struct device_context *dev)
+{
+    dev->nkeys = 0;
+    dev->naxis = 0;
+    for (size_t m = 0; m < nmembers; m++) {
+        combined_merge(dev, members[m]);
+        members[m]->synced = 0;
+    }
+
+    return device_create(dev);
+}
+
+static void combined_remap(const struct device_context *member,
+                           struct input_event *events,
+                           size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        if (events[i].type != EV_ABS) {
+            continue;
+        }
+        for (size_t j = 0; j < member->naxis; j++) {
+            if (events[i].code == member->axis[j]) {
+                events[i].code = member->combined_axis[j];
+                break;
+            }
+        }
+    }
+}
+
+size_t combined_events(const struct device_context *dev,
+                       const struct hidinfo *hid,
+                       struct input_event *events)
+{
+    (void) dev;
+
+    size_t i = 0;
+    for (size_t m = 0; m < nmembers; m++) {
+        size_t n = members[m]->events(members[m], hid, &events[i]);
+        combined_remap(members[m], &events[i], n);
+        i += n;
+    }
+
+    return i;
+}
+
+void combined_commit(struct device_context *dev, const struct hidinfo *hid)
+{
+    (void) dev;
+
+    for (size_t m = 0; m < nmembers; m++) {
+        device_commit(members[m], hid);
+    }
+}
@@ -1,9 +1,6 @@
 #include "devices.h"
 #include "hid.h"
 
-#include <stdio.h>
-#include <unistd.h>
-
 #include <linux/uinput.h>
 
 static const struct uinput_user_dev gamepad = {
@@ -91,87 +88,100 @@ static const uint16_t axis[] = {
     ABS_RY,
 };
 
-#define NUMEVENTS (arrsize(keys) + arrsize(axis) + 1)
-
 struct device_context device_gamepad = {
-    -1,
-    gamepad_write,
-    gamepad_create,
+    .fd     = -1,
+    .name   = "gamepad",
+    .write  = device_write,
+    .events = gamepad_events,
+    .create = device_create,
+
+    .dev           = &gamepad,
+    .keys          = keys,
+    .nkeys         = arrsize(keys),
+    .axis          = axis,
+    .naxis         = arrsize(axis),
+    .combined_axis = axis, // The gamepad keeps its axis when combined
 };
 
-int gamepad_create(const char *uinput_device)
+/* Key codes indexed by the bit position of their HID key mask */
+static uint16_t keybits[32];
+/* All HID keys reported by the gamepad */
+static uint32_t keys_reported;
+
+void gamepad_init(void)
 {
-    int uinputfd = device_open(uinput_device);
-    if (uinputfd < 0) {
-        goto failure_noclose;
+    keys_reported = 0;
+    for (size_t i = 0; i < arrsize(keymasks); i++) {
+        keybits[__builtin_ctz(keymasks[i])] = keys[i];
+        keys_reported |= keymasks[i];
     }
+}
 
-    int res;
-    res = device_register_keys(uinputfd, keys, arrsize(keys));
-    if (res != arrsize(keys)) {
-        goto failure;
-    }
+size_t gamepad_events(const struct device_context *dev,
+                      const struct hidinfo *hid,
+                      struct input_event *events)
+{
+    const struct hidinfo *last = &dev->last;
 
-    res = device_register_absaxis(uinputfd, axis, arrsize(axis));
-    if (res != arrsize(axis)) {
-        goto failure;
-    }
+    uint32_t held     = (hid->keys.held | hid->keys.down) & keys_reported;
+    uint32_t lastheld = (last->keys.held | last->keys.down) & keys_reported;
+    uint32_t changed  = dev->synced ? held ^ lastheld : keys_reported;
+
+    size_t i = 0;
 
-    res = device_create(uinputfd, &gamepad);
-    if (res < 0) {
-        goto failure;
+    /* Keys released and pressed again since the last write, in packets that
+     * were coalesced or lost, are released in a frame of their own */
+    uint32_t repressed = dev->synced ? held & lastheld & hid->keys.up : 0;
+    if (repressed != 0) {
+        for (uint32_t keys = repressed; keys != 0; keys &= keys - 1) {
+            events[i].type  = EV_KEY;
+            events[i].code  = keybits[__builtin_ctz(keys)];
+            events[i].value = 0;
+            i++;
+        }
+        events[i].type  = EV_SYN;
+        events[i].code  = SYN_REPORT;
+        events[i].value = 0;
+        i++;
+        changed |= repressed;
     }
 
-    return uinputfd;
+    for (; changed != 0; changed &= changed - 1) {
+        unsigned bit = __builtin_ctz(changed);
 
-failure:
-    close(uinputfd);
-failure_noclose:
-    fprintf(stderr, "Failed to initialize Gamepad.\n");
-    return -1;
-}
+        events[i].type  = EV_KEY;
+        events[i].code  = keybits[bit];
+        events[i].value = HID_HAS_KEY(held, BIT(bit));
+        i++;
+    }
 
-int gamepad_write(int uinputfd, struct hidinfo *hid)
-{
-    int res;
-    static struct input_event events[NUMEVENTS];
+    if (!dev->synced || hid->circlepad.dx != last->circlepad.dx) {
+        events[i].type  = EV_ABS;
+        events[i].code  = ABS_X;
+        events[i].value = hid->circlepad.dx;
+        i++;
+    }
 
-    size_t i = 0;
-    for (; i < arrsize(keys); i++) {
-        events[i].type = EV_KEY;
-        events[i].code = keys[i];
-        events[i].value =
-            HID_HAS_KEY(hid->keys.held | hid->keys.down, keymasks[i]);
+    if (!dev->synced || hid->circlepad.dy != last->circlepad.dy) {
+        events[i].type  = EV_ABS;
+        events[i].code  = ABS_Y;
+        events[i].value = -hid->circlepad.dy;
+        i++;
+    }
+
+    if (!dev->synced || hid->cstick.dx != last->cstick.dx) {
+        events[i].type  = EV_ABS;
+        events[i].code  = ABS_RX;
+        events[i].value = hid->cstick.dx;
+        i++;
     }
 
-    events[i].type  = EV_ABS;
-    events[i].code  = ABS_X;
-    events[i].value = hid->circlepad.dx;
-    i++;
-
-    events[i].type  = EV_ABS;
-    events[i].code  = ABS_Y;
-    events[i].value = -hid->circlepad.dy;
-    i++;
-
-    events[i].type  = EV_ABS;
-    events[i].code  = ABS_RX;
-    events[i].value = hid->cstick.dx;
-    i++;
-
-    events[i].type  = EV_ABS;
-    events[i].code  = ABS_RY;
-    events[i].value = -hid->cstick.dy;
-    i++;
-
-    events[i].type  = EV_SYN;
-    events[i].code  = SYN_REPORT;
-    events[i].value = 0;
-    i++;
-
-    res = write(uinputfd, events, i * sizeof(struct input_event));
-    if (res < 0) {
-        perror("Error writing key events");
+    if (!dev->synced || hid->cstick.dy != last->cstick.dy) {
+        events[i].type  = EV_ABS;
+        events[i].code  = ABS_RY;
+        events[i].value = -hid->cstick.dy;
+        i++;
     }
-    return res;
+
+    return i;
 }
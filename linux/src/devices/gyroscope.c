@@ -1,10 +1,6 @@
 #include "devices.h"
 #include "hid.h"
 
-#include <stdio.h>
-
-#include <unistd.h>
-
 #include <linux/uinput.h>
 
 #define GYRO_MAX_VAL 12000
@@ -39,70 +35,51 @@ static const uint16_t axis[] = {
     ABS_X, ABS_Y, ABS_Z,
 };
 
-#define NUMEVENTS (arrsize(axis) + 1)
+// Axis reported on the combined device
+static const uint16_t combined_axis[] = {
+    ABS_Z, ABS_RZ, ABS_THROTTLE,
+};
 
 struct device_context device_gyroscope = {
-    -1,
-    gyroscope_write,
-    gyroscope_create,
+    .fd     = -1,
+    .name   = "gyroscope",
+    .write  = device_write,
+    .events = gyroscope_events,
+    .create = device_create,
+
+    .dev           = &gyroscope,
+    .axis          = axis,
+    .naxis         = arrsize(axis),
+    .combined_axis = combined_axis,
 };
 
-int gyroscope_create(const char *uinput_device)
+size_t gyroscope_events(const struct device_context *dev,
+                        const struct hidinfo *hid,
+                        struct input_event *events)
 {
-    int uinputfd = device_open(uinput_device);
-    if (uinputfd < 0) {
-        goto failure_noclose;
-    }
+    const struct hidinfo *last = &dev->last;
+    size_t i = 0;
 
-    int res;
-    res = device_register_absaxis(uinputfd, axis, arrsize(axis));
-    if (res != arrsize(axis)) {
-        goto failure;
+    if (!dev->synced || hid->gyro.x != last->gyro.x) {
+        events[i].type  = EV_ABS;
+        events[i].code  = ABS_X;
+        events[i].value = hid->gyro.x;
+        i++;
     }
 
-    res = device_create(uinputfd, &gyroscope);
-    if (res < 0) {
-        goto failure;
+    if (!dev->synced || hid->gyro.y != last->gyro.y) {
+        events[i].type  = EV_ABS;
+        events[i].code  = ABS_Y;
+        events[i].value = hid->gyro.y;
+        i++;
     }
 
-    return uinputfd;
-
-failure:
-    close(uinputfd);
-failure_noclose:
-    fprintf(stderr, "Failed to initialize gyroscope.\n");
-    return -1;
-}
-
-int gyroscope_write(int uinputfd, struct hidinfo *hid)
-{
-    int res;
-    static struct input_event events[NUMEVENTS];
-    size_t i = 0;
-
-    events[i].type  = EV_ABS;
-    events[i].code  = ABS_X;
-    events[i].value = hid->gyro.x;
-    i++;
-
-    events[i].type  = EV_ABS;
-    events[i].code  = ABS_Y;
-    events[i].value = hid->gyro.y;
-    i++;
-
-    events[i].type  = EV_ABS;
-    events[i].code  = ABS_Z;
-    events[i].value = hid->gyro.z;
-    i++;
-
-    events[i].type  = EV_SYN;
-    events[i].code  = SYN_REPORT;
-    events[i].value = 0;
-    i++;
-
-    res = write(uinputfd, events, i * sizeof(struct input_event));
-    if (res < 0) {
-        perror("Error writing gyroscope events");
+    if (!dev->synced || hid->gyro.z != last->gyro.z) {
+        events[i].type  = EV_ABS;
+        events[i].code  = ABS_Z;
+        events[i].value = hid->gyro.z;
+        i++;
     }
-    return res;
+
+    return i;
 }
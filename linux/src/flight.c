@@ -0,0 +1,223 @@
+#define _GNU_SOURCE
+#include "flight.h"
+#include "devices.h"
+
+#include <stdio.h>
+#include <signal.h>
+#include <string.h>
+
+#include <unistd.h>
+
+static struct {
+    uint64_t next; /* records written so far */
+    uint64_t time; /* time of the last packet record */
+    struct flight_record records[FLIGHT_RECORDS];
+} flight;
+
+static const char *const flight_kinds[] = {
+    [FLIGHT_PACKET]    = "packet",
+    [FLIGHT_COALESCED] = "coalesced",
+    [FLIGHT_INVALID]   = "invalid",
+    [FLIGHT_LATE]      = "late",
+    [FLIGHT_WRITE]     = "write",
+};
+
+static const int flight_fatal[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+
+/* Crash handlers run here, the regular stack may be what overflowed */
+static char flight_stack[16384];
+
+static struct flight_record *flight_next(enum flight_kind kind)
+{
+    struct flight_record *record =
+        &flight.records[flight.next & (FLIGHT_RECORDS - 1)];
+
+    record->time = flight.time;
+    record->kind = kind;
+
+    __atomic_store_n(&flight.next, flight.next + 1, __ATOMIC_RELEASE);
+    return record;
+}
+
+void flight_packet(uint64_t time,
+                   enum flight_kind kind,
+                   unsigned client,
+                   const struct hidinfo *hid,
+                   int result)
+{
+    flight.time                  = time;
+    struct flight_record *record = flight_next(kind);
+
+    record->client = client;
+    record->result = result;
+    if (kind != FLIGHT_PACKET) {
+        /* Only the key edges of coalesced packets are unpacked */
+        record->version = 0;
+        memset(&record->packet, 0, sizeof(record->packet));
+        if (kind == FLIGHT_COALESCED) {
+            record->packet.down = hid->keys.down;
+            record->packet.up   = hid->keys.up;
+        }
+        return;
+    }
+
+    record->version         = hid->version;
+    record->packet.received = hid->received;
+    record->packet.held     = hid->keys.held;
+    record->packet.down     = hid->keys.down;
+    record->packet.up       = hid->keys.up;
+    record->packet.px       = hid->touchscreen.px;
+    record->packet.py       = hid->touchscreen.py;
+    record->packet.cpx      = hid->circlepad.dx;
+    record->packet.cpy      = hid->circlepad.dy;
+    record->packet.csx      = hid->cstick.dx;
+    record->packet.csy      = hid->cstick.dy;
+}
+
+void flight_write(const struct device_context *dev, size_t events, int result)
+{
+    struct flight_record *record = flight_next(FLIGHT_WRITE);
+
+    record->client       = 0;
+    record->version      = 0;
+    record->result       = result;
+    record->write.device = dev->name;
+    record->write.events = events;
+}
+
+static int flight_format(char *buf,
+                         size_t len,
+                         const struct flight_record *record)
+{
+    int n = snprintf(buf,
+                     len,
+                     "  %lu.%09lu %-9s ",
+                     (unsigned long) (record->time / 1000000000ull),
+                     (unsigned long) (record->time % 1000000000ull),
+                     (record->kind < arrsize(flight_kinds))
+                         ? flight_kinds[record->kind]
+                         : "?");
+
+    switch (record->kind) {
+    case FLIGHT_PACKET:
+    case FLIGHT_COALESCED:
+        n += snprintf(buf + n,
+                      len - n,
+                      "client %u v%04x held %08x down %08x up %08x "
+                      "touch %u,%u cp %d,%d cs %d,%d",
+                      record->client,
+                      record->version,
+                      record->packet.held,
+                      record->packet.down,
+                      record->packet.up,
+                      record->packet.px,
+                      record->packet.py,
+                      record->packet.cpx,
+                      record->packet.cpy,
+                      record->packet.csx,
+                      record->packet.csy);
+        if (record->packet.received != 0 &&
+            record->time >= record->packet.received) {
+            n += snprintf(buf + n,
+                          len - n,
+                          " after %luns",
+                          (unsigned long) (record->time -
+                                           record->packet.received));
+        }
+        break;
+    case FLIGHT_INVALID:
+    case FLIGHT_LATE:
+        n += snprintf(buf + n,
+                      len - n,
+                      "client %u %d bytes",
+                      record->client,
+                      record->result);
+        break;
+    case FLIGHT_WRITE:
+        n += snprintf(buf + n,
+                      len - n,
+                      "%s %u events -> %d",
+                      record->write.device,
+                      record->write.events,
+                      record->result);
+        break;
+    }
+
+    n += snprintf(buf + n, len - n, "\n");
+    return n;
+}
+
+/* Only uses snprintf() with integer conversions and write(), which do not
+ * allocate, so it can run in a signal handler */
+void flight_dump(int fd)
+{
+    char buf[256];
+    uint64_t next  = __atomic_load_n(&flight.next, __ATOMIC_ACQUIRE);
+    uint64_t first = (next > FLIGHT_RECORDS) ? next - FLIGHT_RECORDS : 0;
+
+    int n = snprintf(buf,
+                     sizeof(buf),
+                     "Flight recorder, last %lu of %lu records:\n",
+                     (unsigned long) (next - first),
+                     (unsigned long) next);
+    if (write(fd, buf, n) < 0) {
+        return;
+    }
+
+    for (uint64_t i = first; i < next; i++) {
+        n = flight_format(
+            buf, sizeof(buf), &flight.records[i & (FLIGHT_RECORDS - 1)]);
+        if (write(fd, buf, n) < 0) {
+            return;
+        }
+    }
+}
+
+static void on_dump(int signum)
+{
+    (void) signum;
+    flight_dump(STDERR_FILENO);
+}
+
+static void on_crash(int signum)
+{
+    static const char msg[] = "Crashed, dumping flight recorder.\n";
+    if (write(STDERR_FILENO, msg, sizeof(msg) - 1) >= 0) {
+        flight_dump(STDERR_FILENO);
+    }
+
+    /* The handler was reset when entering, die of the original signal */
+    raise(signum);
+}
+
+int flight_install(void)
+{
+    stack_t stack = {
+        .ss_sp    = flight_stack,
+        .ss_size  = sizeof(flight_stack),
+        .ss_flags = 0,
+    };
+    if (sigaltstack(&stack, NULL) < 0) {
+        perror("Error setting up signal stack");
+        return -1;
+    }
+
+    struct sigaction action = {
+        .sa_handler = on_crash,
+        .sa_flags   = SA_ONSTACK | SA_RESETHAND | SA_NODEFER,
+    };
+    sigemptyset(&action.sa_mask);
+    for (size_t i = 0; i < arrsize(flight_fatal); i++) {
+        if (sigaction(flight_fatal[i], &action, NULL) < 0) {
+            perror("Error registering crash handler");
+            return -1;
+        }
+    }
+
+    if (signal(SIGUSR2, on_dump) == SIG_ERR) {
+        fprintf(stderr, "Failed to register SIGUSR2 handler.\n");
+        return -1;
+    }
+
+    return 0;
+}
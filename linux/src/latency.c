@@ -0,0 +1,134 @@
+#include "latency.h"
+
+#include <time.h>
+
+struct latency_histogram latency_stages[LATENCY_STAGES] = {
+    [LATENCY_RECEIVE] = {.name = "receive"},
+    [LATENCY_UNPACK]  = {.name = "unpack"},
+    [LATENCY_WRITE]   = {.name = "write"},
+};
+
+struct latency_histogram latency_devices[DEVICES_COUNT + 1] = {
+    [DEVICE_GAMEPAD]       = {.name = "gamepad"},
+    [DEVICE_TOUCHSCREEN]   = {.name = "touchscreen"},
+    [DEVICE_GYROSCOPE]     = {.name = "gyroscope"},
+    [DEVICE_ACCELEROMETER] = {.name = "accelerometer"},
+    [DEVICES_COUNT]        = {.name = "combined"},
+};
+
+struct latency_histogram latency_loop = {.name = "loop"};
+
+struct latency_histogram latency_capture = {.name = "capture"};
+
+uint64_t latency_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static size_t latency_bucket(uint64_t ns)
+{
+    if (ns < LATENCY_SUB_COUNT) {
+        return ns;
+    }
+
+    unsigned msb = 63 - __builtin_clzll(ns);
+    unsigned sub = (ns >> (msb - LATENCY_SUB_BITS)) & (LATENCY_SUB_COUNT - 1);
+    return (msb - LATENCY_SUB_BITS + 1) * LATENCY_SUB_COUNT + sub;
+}
+
+/* Largest value falling into `bucket` */
+static uint64_t latency_bucket_value(size_t bucket)
+{
+    if (bucket < LATENCY_SUB_COUNT) {
+        return bucket;
+    }
+
+    unsigned shift = bucket / LATENCY_SUB_COUNT - 1;
+    uint64_t sub   = bucket % LATENCY_SUB_COUNT;
+    return ((LATENCY_SUB_COUNT + sub + 1) << shift) - 1;
+}
+
+/* Add `n` to a counter only this thread writes. A plain load and store are
+ * enough, and unlike __atomic_fetch_add() they compile to no locked
+ * instruction, the atomics only keep readers from seeing torn values. */
+static void latency_add(uint64_t *counter, uint64_t n, int order)
+{
+    __atomic_store_n(
+        counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, order);
+}
+
+void latency_record(struct latency_histogram *hist, uint64_t ns)
+{
+    latency_add(&hist->buckets[latency_bucket(ns)], 1, __ATOMIC_RELAXED);
+    latency_add(&hist->sum, ns, __ATOMIC_RELAXED);
+    if (ns > __atomic_load_n(&hist->max, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&hist->max, ns, __ATOMIC_RELAXED);
+    }
+    /* Readers use the count as an upper bound of the buckets' sum */
+    latency_add(&hist->count, 1, __ATOMIC_RELEASE);
+}
+
+uint64_t latency_percentile(const struct latency_histogram *hist,
+                            double percentile)
+{
+    uint64_t count = __atomic_load_n(&hist->count, __ATOMIC_ACQUIRE);
+    if (count == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(percentile / 100.0 * count + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+    uint64_t sum = 0;
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+        sum += __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+        if (sum >= rank) {
+            uint64_t value = latency_bucket_value(i);
+            return (value < max) ? value : max;
+        }
+    }
+    return max;
+}
+
+static void latency_print_histogram(FILE *fp,
+                                    const char *kind,
+                                    const struct latency_histogram *hist)
+{
+    uint64_t count = __atomic_load_n(&hist->count, __ATOMIC_ACQUIRE);
+    if (count == 0) {
+        return;
+    }
+
+    fprintf(fp,
+            "  %-6s %-14s %10lu samples, p50 %9.1fus, p99 %9.1fus, "
+            "p99.9 %9.1fus, max %9.1fus\n",
+            kind,
+            hist->name,
+            (unsigned long) count,
+            latency_percentile(hist, 50.0) / 1e3,
+            latency_percentile(hist, 99.0) / 1e3,
+            latency_percentile(hist, 99.9) / 1e3,
+            __atomic_load_n(&hist->max, __ATOMIC_RELAXED) / 1e3);
+}
+
+void latency_print(FILE *fp)
+{
+    fprintf(fp, "Latency since kernel receive:\n");
+    for (size_t i = 0; i < LATENCY_STAGES; i++) {
+        latency_print_histogram(fp, "stage", &latency_stages[i]);
+    }
+    for (size_t i = 0; i < DEVICES_COUNT + 1; i++) {
+        latency_print_histogram(fp, "device", &latency_devices[i]);
+    }
+    fprintf(fp, "Time spent per batch:\n");
+    latency_print_histogram(fp, "batch", &latency_loop);
+    if (__atomic_load_n(&latency_capture.count, __ATOMIC_RELAXED) != 0) {
+        fprintf(fp, "Latency from sampling on the client to kernel receive:\n");
+        latency_print_histogram(fp, "client", &latency_capture);
+    }
+}
@@ -0,0 +1,272 @@
+#define _GNU_SOURCE
+#include "logger.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+#define LOGGER_INTERVAL_NS 1000000000ull
+/* How often the thread looks for new records */
+#define LOGGER_POLL_NS 100000000l
+
+/* A slot is free for position `pos` while `lap` is `pos` rounded down to a
+ * multiple of LOGGER_RECORDS and holds a record while it is one more. The
+ * zero-initialized ring is therefore empty. */
+struct logger_record {
+    uint64_t lap;
+    enum logger_message message;
+    int error;
+    const char *subject;
+    long arg;
+};
+
+#define logger_lap(pos) ((pos) & ~(uint64_t)(LOGGER_RECORDS - 1))
+
+static struct {
+    struct logger_record records[LOGGER_RECORDS];
+    uint64_t head; /* next position to post to */
+    uint64_t tail; /* next position to format, used by the thread only */
+    unsigned long dropped[LOGGER_MESSAGES];
+
+    int syslog;
+    int running;
+    int stop;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+} logger = {
+    .lock   = PTHREAD_MUTEX_INITIALIZER,
+    .wakeup = PTHREAD_COND_INITIALIZER,
+};
+
+/* Rate limiting state of each message type, used by the thread only */
+static struct {
+    const char *name;
+    int priority;
+    uint64_t window; /* start of the current interval */
+    unsigned emitted;
+    unsigned long suppressed;
+} logger_limits[LOGGER_MESSAGES] = {
+    [LOGGER_BAD_MAGIC]   = {.name = "invalid header", .priority = LOG_WARNING},
+    [LOGGER_WRITE_ERROR] = {.name = "write error", .priority = LOG_ERR},
+};
+
+void logger_post(enum logger_message message,
+                 int error,
+                 const char *subject,
+                 long arg)
+{
+    uint64_t pos = __atomic_load_n(&logger.head, __ATOMIC_RELAXED);
+    struct logger_record *record;
+
+    for (;;) {
+        record       = &logger.records[pos & (LOGGER_RECORDS - 1)];
+        uint64_t lap = __atomic_load_n(&record->lap, __ATOMIC_ACQUIRE);
+
+        if (lap == logger_lap(pos)) {
+            if (__atomic_compare_exchange_n(&logger.head,
+                                            &pos,
+                                            pos + 1,
+                                            1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (lap < logger_lap(pos)) {
+            /* Still holds the record of the previous lap, the ring is full */
+            __atomic_fetch_add(&logger.dropped[message], 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            /* Taken by another thread */
+            pos = __atomic_load_n(&logger.head, __ATOMIC_RELAXED);
+        }
+    }
+
+    record->message = message;
+    record->error   = error;
+    record->subject = subject;
+    record->arg     = arg;
+    __atomic_store_n(&record->lap, logger_lap(pos) + 1, __ATOMIC_RELEASE);
+}
+
+static void logger_vemit(int priority, const char *format, va_list args)
+{
+    if (logger.syslog) {
+        vsyslog(priority, format, args);
+        return;
+    }
+
+    /* Like syslog, all but warnings and errors are informational */
+    FILE *fp = (priority <= LOG_WARNING) ? stderr : stdout;
+    vfprintf(fp, format, args);
+    fputc('\n', fp);
+}
+
+void logger_printf(int priority, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    logger_vemit(priority, format, args);
+    va_end(args);
+}
+
+static uint64_t logger_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void logger_format(const struct logger_record *record)
+{
+    switch (record->message) {
+    case LOGGER_BAD_MAGIC:
+        logger_printf(LOG_WARNING,
+                      "Invalid package header (%#06lx).",
+                      (unsigned long) record->arg);
+        break;
+    case LOGGER_WRITE_ERROR:
+        logger_printf(LOG_ERR,
+                      "Error writing %s events: %s",
+                      record->subject,
+                      strerror(record->error));
+        break;
+    case LOGGER_MESSAGES:
+        break;
+    }
+}
+
+/* Report messages suppressed in intervals that are over, or all of them when
+ * `flush` is set */
+static void logger_report(uint64_t now, int flush)
+{
+    for (size_t i = 0; i < LOGGER_MESSAGES; i++) {
+        logger_limits[i].suppressed +=
+            __atomic_exchange_n(&logger.dropped[i], 0, __ATOMIC_RELAXED);
+
+        if (!flush && now - logger_limits[i].window < LOGGER_INTERVAL_NS) {
+            continue;
+        }
+        if (logger_limits[i].suppressed != 0) {
+            logger_printf(logger_limits[i].priority,
+                          "Suppressed %lu %s messages.",
+                          logger_limits[i].suppressed,
+                          logger_limits[i].name);
+        }
+        logger_limits[i].window     = now;
+        logger_limits[i].emitted    = 0;
+        logger_limits[i].suppressed = 0;
+    }
+}
+
+/* Format all records posted so far */
+static void logger_drain(void)
+{
+    uint64_t now = logger_clock();
+    logger_report(now, 0);
+
+    for (;;) {
+        uint64_t pos = logger.tail;
+        struct logger_record *record =
+            &logger.records[pos & (LOGGER_RECORDS - 1)];
+        if (__atomic_load_n(&record->lap, __ATOMIC_ACQUIRE) !=
+            logger_lap(pos) + 1) {
+            break;
+        }
+
+        enum logger_message message = record->message;
+        if (message < LOGGER_MESSAGES &&
+            logger_limits[message].emitted < LOGGER_BURST) {
+            logger_limits[message].emitted++;
+            logger_format(record);
+        } else if (message < LOGGER_MESSAGES) {
+            logger_limits[message].suppressed++;
+        }
+
+        /* Hand the slot to the next lap */
+        __atomic_store_n(
+            &record->lap, logger_lap(pos) + LOGGER_RECORDS, __ATOMIC_RELEASE);
+        logger.tail = pos + 1;
+    }
+
+    if (!logger.syslog) {
+        fflush(stderr);
+    }
+}
+
+static void *logger_run(void *arg)
+{
+    (void) arg;
+
+    pthread_mutex_lock(&logger.lock);
+    while (!logger.stop) {
+        struct timespec due;
+        clock_gettime(CLOCK_REALTIME, &due);
+        due.tv_nsec += LOGGER_POLL_NS;
+        if (due.tv_nsec >= 1000000000l) {
+            due.tv_sec++;
+            due.tv_nsec -= 1000000000l;
+        }
+        pthread_cond_timedwait(&logger.wakeup, &logger.lock, &due);
+
+        pthread_mutex_unlock(&logger.lock);
+        logger_drain();
+        pthread_mutex_lock(&logger.lock);
+    }
+    pthread_mutex_unlock(&logger.lock);
+
+    logger_drain();
+    logger_report(logger_clock(), 1);
+    return NULL;
+}
+
+int logger_init(int use_syslog)
+{
+    logger.syslog = use_syslog;
+    if (use_syslog) {
+        openlog(program_invocation_short_name, LOG_PID, LOG_DAEMON);
+    }
+
+    uint64_t now = logger_clock();
+    for (size_t i = 0; i < LOGGER_MESSAGES; i++) {
+        logger_limits[i].window = now;
+    }
+
+    /* Signals are handled by the main thread */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int res = pthread_create(&logger.thread, NULL, logger_run, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (res != 0) {
+        fprintf(stderr, "Error starting logging thread: %s\n", strerror(res));
+        return -1;
+    }
+
+    logger.running = 1;
+    return 0;
+}
+
+void logger_exit(void)
+{
+    if (!logger.running) {
+        return;
+    }
+
+    pthread_mutex_lock(&logger.lock);
+    logger.stop = 1;
+    pthread_cond_signal(&logger.wakeup);
+    pthread_mutex_unlock(&logger.lock);
+    pthread_join(logger.thread, NULL);
+
+    logger.running = 0;
+    logger.stop    = 0;
+    if (logger.syslog) {
+        closelog();
+    }
+}
@@ -23,21 +23,145 @@
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <time.h>
 
 #include <errno.h>
 #include <getopt.h>
+#include <limits.h>
 #include <unistd.h>
 
 #include "ctroller.h"
+#include "capture.h"
 #include "hid.h"
 #include "devices.h"
+#include "flight.h"
+#include "latency.h"
+#include "logger.h"
+#include "metrics.h"
+#include "playout.h"
+#include "predict.h"
+#include "sink.h"
+
+static const struct device_name_to_id {
+    const char *name;
+    enum DEVICE_ID id;
+} dev_to_id[] = {
+    {"gamepad", DEVICE_GAMEPAD},
+    {"touchscreen", DEVICE_TOUCHSCREEN},
+    {"gyroscope", DEVICE_GYROSCOPE},
+    {"accelerometer", DEVICE_ACCELEROMETER},
+};
+
+void print_stats(void)
+{
+    const struct ctroller_stats *stats = ctroller_get_stats();
+
+    printf("Received %lu packets in %lu batches "
+           "(%lu coalesced, %lu invalid, %lu dropped).\n",
+           stats->packets,
+           stats->batches,
+           stats->coalesced,
+           stats->invalid,
+           stats->overflow);
+    if (stats->keyframes != 0) {
+        printf("  %lu keyframes acknowledged, %lu stale deltas dropped, "
+               "%lu lost packets recovered\n",
+               stats->keyframes,
+               stats->stale,
+               stats->recovered);
+    }
+    if (stats->probes != 0) {
+        printf("  %lu clock probes echoed\n", stats->probes);
+    }
+
+    for (size_t i = 0; i < arrsize(stats->batch_coalesced); i++) {
+        if (stats->batch_coalesced[i] != 0) {
+            printf("  %2zu%s packets coalesced: %lu batches\n",
+                   i,
+                   (i == arrsize(stats->batch_coalesced) - 1) ? "+" : " ",
+                   stats->batch_coalesced[i]);
+        }
+    }
+
+    const struct playout_stats *playout = playout_get_stats();
+    if (playout->rate != 0) {
+        printf("Playout at %u Hz: %lu ticks (%lu missed), %lu states buffered "
+               "(%lu late, %lu motion), %lu underruns, %lu restarts, "
+               "delay %.1fms.\n",
+               playout->rate,
+               playout->ticks,
+               playout->missed,
+               playout->samples,
+               playout->late,
+               playout->motion,
+               playout->underruns,
+               playout->resets,
+               playout->delay / 1e6);
+    }
+
+    const struct predict_stats *predict = predict_get_stats();
+    for (size_t i = 0; i < arrsize(dev_to_id); i++) {
+        const struct predict_stats *dev = &predict[dev_to_id[i].id];
+        if (dev->checked == 0) {
+            continue;
+        }
+        printf("Prediction of %s %ums ahead: %lu checked, mean error %.1f "
+               "(%.1f unpredicted), max %lu.\n",
+               dev_to_id[i].name,
+               predict_horizon(),
+               dev->checked,
+               (double) dev->error / dev->checked,
+               (double) dev->baseline / dev->checked,
+               dev->max);
+    }
+
+    const struct ctroller_session *sessions = ctroller_get_sessions();
+    for (size_t i = 0; i < CTROLLER_SESSIONS_MAX; i++) {
+        const struct packet_sequence *seq = &sessions[i].sequence;
+        if (sessions[i].addr_len == 0 || !seq->started) {
+            continue;
+        }
+
+        char name[64];
+        ctroller_session_name(&sessions[i], name, sizeof(name));
+        unsigned long expected = seq->received + seq->lost;
+        printf("Client %s: %lu packets, %lu lost (%.2f%%), %lu late, "
+               "%lu duplicate, jitter %.3fms.\n",
+               name,
+               seq->received,
+               seq->lost,
+               (expected > 0) ? 100.0 * seq->lost / expected : 0.0,
+               seq->late,
+               seq->duplicate,
+               seq->jitter / 16 / 1000.0);
+        if (sessions[i].clock.rtt != PACKET_CLOCK_UNKNOWN) {
+            printf("  round-trip time %.3fms, as estimated by the client.\n",
+                   sessions[i].clock.rtt / 1000.0);
+        }
+    }
+
+    if (output_sink == &sink_null) {
+        const struct sink_stats *null_stats = sink_null_get_stats();
+        printf("Discarded %lu events in %lu writes.\n",
+               null_stats->events,
+               null_stats->writes);
+    }
+
+    latency_print(stdout);
+}
+
+/* The handlers only post a request, the main loop acts on it: nothing they
+ * would call (stdio, malloc, the loggers) is async-signal-safe */
+void on_report(int signum)
+{
+    (void) signum;
+    ctroller_request(CTROLLER_REQUEST_REPORT);
+}
 
 void on_terminate(int signum)
 {
     (void) signum;
-    puts("Exiting...");
-    ctroller_exit();
-    exit(EXIT_SUCCESS);
+    ctroller_request(CTROLLER_REQUEST_STOP);
 }
 
 void print_usage(void)
@@ -50,15 +174,55 @@ void print_usage(void)
 #define print_opt(shortopt, longopt, desc)                                     \
     printf("  -%-1s  --%-34s " desc, shortopt, longopt)
 
+    print_opt("b",
+              "backend=<name>",
+              "I/O backend, either poll or uring (defaults to poll)\n");
+    print_opt("c",
+              "combined",
+              "provide all 3DS devices as a single input device\n");
+    print_opt("C",
+              "capture=<path>",
+              "record all received packets to a capture file\n");
     print_opt("d", "daemonize", "execute in background\n");
+    print_opt("D",
+              "delay=<device>:<ms>[,...]",
+              "longest playout delay of a device with --tick, 0 writes it on "
+              "receive (defaults to " STRINGIFY(PLAYOUT_DELAY_DEFAULT) " for "
+              "the gyroscope and accelerometer, 0 otherwise)\n");
     print_opt("h", "help", "print this help text\n");
+    print_opt("m",
+              "metrics=<path>",
+              "serve metrics in the Prometheus text format on a Unix "
+              "socket\n");
+    print_opt("o",
+              "output=<output>",
+              "where to write events: uinput[:<path>], null or "
+              "file:<path> (defaults to uinput)\n");
+    print_opt("P",
+              "predict=<ms>",
+              "extrapolate the analog axes 'ms' ahead, at most "
+              STRINGIFY(PREDICT_HORIZON_MAX) " (defaults to 0, off)\n");
     print_opt("p",
               "port=<num>",
               "listen on port 'num' (defaults to " PORT_DEFAULT ")\n");
+    print_opt("r",
+              "replay=<path>",
+              "write the packets of a capture file instead of listening\n");
+    print_opt("s",
+              "speed=<factor>",
+              "replay speed relative to the original timing, 0 replays as "
+              "fast as possible (defaults to 1)\n");
+    print_opt("t",
+              "tick=<rate>",
+              "write devices with a playout delay from a jitter buffer, "
+              "'rate' times per second\n");
     print_opt("u",
               "uinput-device=<path>",
               "uinput character "
               "device (defaults to " UINPUT_DEFAULT_DEVICE ")\n");
+    print_opt("X",
+              "predict-exclude=<device1>[,...]",
+              "3DS devices whose axes are not predicted\n");
     print_opt("x",
               "exclude=<device1>[,<device2>,...]",
               "3DS devices that will not be provided to the system"
@@ -67,15 +231,40 @@ void print_usage(void)
 #undef print_opt
 }
 
-static const struct device_name_to_id {
-    const char *name;
-    enum DEVICE_ID id;
-} dev_to_id[] = {
-    {"gamepad", DEVICE_GAMEPAD},
-    {"touchscreen", DEVICE_TOUCHSCREEN},
-    {"gyroscope", DEVICE_GYROSCOPE},
-    {"accelerometer", DEVICE_ACCELEROMETER},
-};
+/* Parse `<device>:<ms>` pairs into `delays`, indexed by enum DEVICE_ID */
+static int parse_delays(const char *list, unsigned *delays)
+{
+    const char *cur = list;
+    const char *end;
+
+    do {
+        end = strchrnul(cur, ',');
+
+        const char *colon = memchr(cur, ':', end - cur);
+        size_t i;
+        for (i = 0; colon != NULL && i < arrsize(dev_to_id); i++) {
+            if (strlen(dev_to_id[i].name) == (size_t)(colon - cur) &&
+                strncmp(dev_to_id[i].name, cur, colon - cur) == 0) {
+                break;
+            }
+        }
+        char *last;
+        unsigned long ms =
+            (colon != NULL) ? strtoul(colon + 1, &last, 10) : ULONG_MAX;
+        if (colon == NULL || i == arrsize(dev_to_id) || last != end ||
+            ms > PLAYOUT_DELAY_MAX) {
+            fprintf(stderr,
+                    "Invalid playout delay '%.*s'.\n",
+                    (int) (end - cur),
+                    cur);
+            return -1;
+        }
+        delays[dev_to_id[i].id] = ms;
+        cur                     = end + 1;
+    } while (*end != '\0');
+
+    return 0;
+}
 
 static device_mask_t parse_device_mask(const char *device_list)
 {
@@ -107,21 +296,57 @@ int main(int argc, char *argv[])
     // clang-format off
     struct options {
         char *uinput_device;
+        char *output;
         char *port;
+        char *capture;
+        char *metrics;
+        char *replay;
+        double speed;
+        unsigned tick;
+        unsigned delays[DEVICES_COUNT];
+        unsigned predict;
+        unsigned predict_exclude_mask;
         int daemonize;
+        int combined;
+        enum ctroller_backend backend;
         unsigned device_exclude_mask;
     } options = {
-        .uinput_device       = NULL,
-        .port                = NULL,
-        .daemonize           = 0,
-        .device_exclude_mask = 0,
+        .uinput_device        = NULL,
+        .output               = NULL,
+        .port                 = NULL,
+        .capture              = NULL,
+        .metrics              = NULL,
+        .replay               = NULL,
+        .speed                = 1.0,
+        .tick                 = 0,
+        .delays               = {
+            [DEVICE_GYROSCOPE]     = PLAYOUT_DELAY_DEFAULT,
+            [DEVICE_ACCELEROMETER] = PLAYOUT_DELAY_DEFAULT,
+        },
+        .predict              = 0,
+        .predict_exclude_mask = 0,
+        .daemonize            = 0,
+        .combined             = 0,
+        .backend              = CTROLLER_BACKEND_POLL,
+        .device_exclude_mask  = 0,
     };
 
     static const struct option optstrings[] = {
+        {"backend",         required_argument, NULL, 'b'},
+        {"combined",        no_argument,       NULL, 'c'},
+        {"capture",         required_argument, NULL, 'C'},
         {"daemonize",       no_argument,       NULL, 'd'},
+        {"delay",           required_argument, NULL, 'D'},
         {"help",            no_argument,       NULL, 'h'},
+        {"metrics",         required_argument, NULL, 'm'},
+        {"output",          required_argument, NULL, 'o'},
+        {"predict",         required_argument, NULL, 'P'},
         {"port",            required_argument, NULL, 'p'},
+        {"replay",          required_argument, NULL, 'r'},
+        {"speed",           required_argument, NULL, 's'},
+        {"tick",            required_argument, NULL, 't'},
         {"uinput-device",   required_argument, NULL, 'u'},
+        {"predict-exclude", required_argument, NULL, 'X'},
         {"exclude",         required_argument, NULL, 'x'},
         {NULL,              0,                 NULL, 0},
     };
@@ -129,24 +354,86 @@ int main(int argc, char *argv[])
 
     int index = 0;
     int curopt;
-    while ((curopt = getopt_long(argc, argv, "dhp:u:x:", optstrings, &index)) !=
-           -1) {
+    while ((curopt = getopt_long(argc,
+                                 argv,
+                                 "b:cC:dD:hm:o:P:p:r:s:t:u:X:x:",
+                                 optstrings,
+                                 &index)) != -1) {
         switch (curopt) {
         case 0:
             break;
+        case 'b':
+            if (strcmp(optarg, "uring") == 0) {
+                options.backend = CTROLLER_BACKEND_URING;
+            } else if (strcmp(optarg, "poll") == 0) {
+                options.backend = CTROLLER_BACKEND_POLL;
+            } else {
+                fprintf(stderr, "Unknown backend '%s'.\n", optarg);
+                print_usage();
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'c':
+            options.combined = 1;
+            break;
+        case 'C':
+            options.capture = optarg;
+            break;
         case 'd':
             options.daemonize = 1;
             break;
+        case 'D':
+            if (parse_delays(optarg, options.delays) < 0) {
+                return EXIT_FAILURE;
+            }
+            break;
         case 'h':
             print_usage();
             return EXIT_SUCCESS;
+        case 'm':
+            options.metrics = optarg;
+            break;
+        case 'o':
+            options.output = optarg;
+            break;
+        case 'P':
+            options.predict = strtoul(optarg, NULL, 10);
+            if (options.predict > PREDICT_HORIZON_MAX) {
+                fprintf(stderr,
+                        "Prediction horizon must be at most %dms.\n",
+                        PREDICT_HORIZON_MAX);
+                return EXIT_FAILURE;
+            }
+            break;
         case 'p':
             options.port = optarg;
             break;
+        case 'r':
+            options.replay = optarg;
+            break;
+        case 's':
+            options.speed = strtod(optarg, NULL);
+            if (options.speed < 0) {
+                fprintf(stderr, "Replay speed must not be negative.\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 't':
+            options.tick = strtoul(optarg, NULL, 10);
+            if (options.tick == 0 || options.tick > PLAYOUT_RATE_MAX) {
+                fprintf(stderr,
+                        "Tick rate must be between 1 and %d.\n",
+                        PLAYOUT_RATE_MAX);
+                return EXIT_FAILURE;
+            }
+            break;
         case 'u':
             options.uinput_device = optarg;
             printf("uinput device: %s\n", optarg);
             break;
+        case 'X':
+            options.predict_exclude_mask = parse_device_mask(optarg);
+            break;
         case 'x':
             options.device_exclude_mask = parse_device_mask(optarg);
             break;
@@ -157,10 +444,13 @@ int main(int argc, char *argv[])
     }
 
     fprintf(stderr,
-            "options: deamonize=%d, port=%s, uinput_device=%s, exclude=0%o\n",
+            "options: deamonize=%d, combined=%d, port=%s, uinput_device=%s, "
+            "output=%s, exclude=0%o\n",
             options.daemonize,
+            options.combined,
             options.port,
             options.uinput_device,
+            options.output,
             options.device_exclude_mask);
 
     if (options.daemonize) {
@@ -171,57 +461,149 @@ int main(int argc, char *argv[])
         }
     }
 
-    if (ctroller_init(options.uinput_device,
+    char uinput_output[PATH_MAX + sizeof("uinput:")];
+    if (options.output == NULL && options.uinput_device != NULL) {
+        snprintf(uinput_output,
+                 sizeof(uinput_output),
+                 "uinput:%s",
+                 options.uinput_device);
+        options.output = uinput_output;
+    }
+
+    /* Failing to install it only loses the dump */
+    flight_install();
+
+    if (logger_init(options.daemonize) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    /* Also applies to replays, to tune it against recordings */
+    predict_init(options.predict,
+                 ~options.predict_exclude_mask & ((1 << DEVICES_COUNT) - 1));
+
+    if (options.replay != NULL) {
+        if (options.tick != 0) {
+            fprintf(stderr, "Replays are written without a playout delay.\n");
+        }
+        if (ctroller_devices_init(options.output,
+                                  ~options.device_exclude_mask,
+                                  options.combined) < 0) {
+            fprintf(stderr, "Failed to create virtual device.\n");
+            logger_exit();
+            return EXIT_FAILURE;
+        }
+        long replayed = ctroller_replay(options.replay, options.speed);
+        ctroller_exit();
+        logger_exit();
+        if (replayed < 0) {
+            return EXIT_FAILURE;
+        }
+        printf("Replayed %ld packets from %s.\n", replayed, options.replay);
+        print_stats();
+        return EXIT_SUCCESS;
+    }
+
+    if (options.capture != NULL && capture_open(options.capture) < 0) {
+        logger_exit();
+        return EXIT_FAILURE;
+    }
+
+    if (ctroller_init(options.output,
                       options.port,
-                      ~options.device_exclude_mask) == -1) {
+                      ~options.device_exclude_mask,
+                      options.combined,
+                      options.backend) == -1) {
         perror("Error initializing ctroller");
+        logger_exit();
+        exit(EXIT_FAILURE);
+    }
+
+    if (options.tick != 0 &&
+        ctroller_playout_init(options.tick, options.delays) < 0) {
+        ctroller_exit();
+        capture_close();
+        logger_exit();
+        exit(EXIT_FAILURE);
+    }
+
+    if (options.metrics != NULL && metrics_init(options.metrics) < 0) {
+        ctroller_exit();
+        capture_close();
+        logger_exit();
         exit(EXIT_FAILURE);
     }
 
     if (signal(SIGINT, on_terminate) == SIG_ERR) {
         fprintf(stderr, "Failed to register SIGINT handler.\n");
     }
+    if (signal(SIGUSR1, on_report) == SIG_ERR) {
+        fprintf(stderr, "Failed to register SIGUSR1 handler.\n");
+    }
 
     printf("Waiting for incoming packets...\n");
 
-    int connected      = 0;
-    struct hidinfo hid = {};
+    int connected = 0;
+    struct hidinfo hids[CTROLLER_CLIENTS_MAX] = {};
     while (1) {
-        res = ctroller_poll_hid_info(&hid);
+        res = ctroller_poll_hid_batch(hids, arrsize(hids));
         if (res < 0) {
-            fprintf(stderr, "An error occured (%d). Exiting...", res);
-            fflush(stderr);
+            logger_printf(LOG_ERR, "An error occured (%d). Exiting...", res);
             res = EXIT_FAILURE;
             break;
         }
 
+        unsigned requests = ctroller_take_requests();
+        if (requests & CTROLLER_REQUEST_REPORT) {
+            latency_print(stdout);
+            fflush(stdout);
+        }
+        if (requests & CTROLLER_REQUEST_STOP) {
+            puts("Exiting...");
+            res = EXIT_SUCCESS;
+            break;
+        }
+
         if (res != 0) {
+            struct hidinfo *hid = &hids[0];
             if (!connected) {
-                printf("Nintendo 3DS connected. (ctroller version "
-                       "%01d.%01d.%01d)\n",
-                       (hid.version & 0x0f00) >> 8,
-                       (hid.version & 0x00f0) >> 4,
-                       (hid.version & 0x000f) >> 0);
+                logger_printf(LOG_INFO,
+                              "Nintendo 3DS connected. (ctroller version "
+                              "%01d.%01d.%01d)",
+                              (hid->version & 0x0f00) >> 8,
+                              (hid->version & 0x00f0) >> 4,
+                              (hid->version & 0x000f) >> 0);
                 connected = 1;
-                if (hid.version != CTROLLER_VERSION) {
-                    fprintf(stderr,
-                            "Server version (%#04x) and client version "
-                            "(%#04x) differ.\n",
-                            CTROLLER_VERSION,
-                            hid.version);
+                if (hid->version != CTROLLER_VERSION) {
+                    logger_printf(LOG_WARNING,
+                                  "Server version (%#04x) and client version "
+                                  "(%#04x) differ.",
+                                  CTROLLER_VERSION,
+                                  hid->version);
                 }
             }
-            ctroller_write_hid_info(&hid);
-        } else {
+            for (int i = res - 1; i >= 0; i--) {
+                ctroller_write_hid_info(&hids[i]);
+            }
+
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            latency_record(&latency_loop,
+                           (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec -
+                               ctroller_get_stats()->batch_start);
+        } else if (requests == 0) {
             connected = 0;
-            memset(&hid, 0, sizeof(hid));
+            memset(hids, 0, sizeof(hids));
             if (!options.daemonize) {
                 puts("Timeout waiting for 3DS. Retrying...");
             }
         }
     }
 
+    metrics_exit();
     ctroller_exit();
+    capture_close();
+    logger_exit();
+    print_stats();
 
     return res;
 }
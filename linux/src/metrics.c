@@ -0,0 +1,461 @@
+#define _GNU_SOURCE
+#include "metrics.h"
+#include "ctroller.h"
+#include "devices.h"
+#include "latency.h"
+#include "playout.h"
+#include "predict.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static struct {
+    int socket;
+    pthread_t thread;
+    struct sockaddr_un addr;
+} metrics = {
+    .socket = -1,
+};
+
+static struct device_context *const metrics_devices[] = {
+    [DEVICE_GAMEPAD]       = &device_gamepad,
+    [DEVICE_TOUCHSCREEN]   = &device_touchscreen,
+    [DEVICE_GYROSCOPE]     = &device_gyroscope,
+    [DEVICE_ACCELEROMETER] = &device_accelerometer,
+    [DEVICES_COUNT]        = &device_combined,
+};
+
+static const double metrics_quantiles[] = {0.5, 0.99, 0.999};
+
+/* Counters are written by the thread handling packets without atomics */
+#define metrics_load(value) __atomic_load_n(&(value), __ATOMIC_RELAXED)
+
+static void metrics_header(FILE *fp,
+                           const char *name,
+                           const char *type,
+                           const char *help)
+{
+    fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void metrics_counter(FILE *fp,
+                            const char *name,
+                            const char *help,
+                            unsigned long value)
+{
+    metrics_header(fp, name, "counter", help);
+    fprintf(fp, "%s %lu\n", name, value);
+}
+
+static void metrics_device_counter(FILE *fp,
+                                   const char *name,
+                                   const char *help,
+                                   size_t offset)
+{
+    metrics_header(fp, name, "counter", help);
+    for (size_t i = 0; i < arrsize(metrics_devices); i++) {
+        const struct device_context *dev = metrics_devices[i];
+        if (dev->fd == -1) {
+            continue;
+        }
+        const unsigned long *value =
+            (const unsigned long *) ((const char *) &dev->stats + offset);
+        fprintf(fp,
+                "%s{device=\"%s\"} %lu\n",
+                name,
+                dev->name,
+                metrics_load(*value));
+    }
+}
+
+static void metrics_predict_counter(FILE *fp,
+                                    const char *name,
+                                    const char *help,
+                                    size_t offset)
+{
+    const struct predict_stats *stats = predict_get_stats();
+
+    metrics_header(fp, name, "counter", help);
+    for (size_t i = 0; i < DEVICES_COUNT; i++) {
+        if (!(predict_mask() & (1 << i)) || metrics_devices[i]->fd == -1) {
+            continue;
+        }
+        const unsigned long *value =
+            (const unsigned long *) ((const char *) &stats[i] + offset);
+        fprintf(fp,
+                "%s{device=\"%s\"} %lu\n",
+                name,
+                metrics_devices[i]->name,
+                metrics_load(*value));
+    }
+}
+
+/* Histograms are exported as summaries, their buckets are too fine-grained */
+static void metrics_summary(FILE *fp,
+                            const char *name,
+                            const char *labels,
+                            const struct latency_histogram *hist)
+{
+    uint64_t count = __atomic_load_n(&hist->count, __ATOMIC_ACQUIRE);
+
+    for (size_t i = 0; i < arrsize(metrics_quantiles); i++) {
+        fprintf(fp,
+                "%s{%s%squantile=\"%g\"} %.9f\n",
+                name,
+                labels,
+                (*labels != '\0') ? "," : "",
+                metrics_quantiles[i],
+                latency_percentile(hist, metrics_quantiles[i] * 100) / 1e9);
+    }
+    fprintf(fp,
+            "%s_sum%s%s%s %.9f\n",
+            name,
+            (*labels != '\0') ? "{" : "",
+            labels,
+            (*labels != '\0') ? "}" : "",
+            metrics_load(hist->sum) / 1e9);
+    fprintf(fp,
+            "%s_count%s%s%s %lu\n",
+            name,
+            (*labels != '\0') ? "{" : "",
+            labels,
+            (*labels != '\0') ? "}" : "",
+            (unsigned long) count);
+}
+
+static void metrics_session_counter(FILE *fp,
+                                    const char *name,
+                                    const char *help,
+                                    size_t offset)
+{
+    const struct ctroller_session *sessions = ctroller_get_sessions();
+
+    metrics_header(fp, name, "counter", help);
+    for (size_t i = 0; i < CTROLLER_SESSIONS_MAX; i++) {
+        if (metrics_load(sessions[i].addr_len) == 0) {
+            continue;
+        }
+        const unsigned long *value =
+            (const unsigned long *) ((const char *) &sessions[i].sequence +
+                                     offset);
+        char client[64];
+        ctroller_session_name(&sessions[i], client, sizeof(client));
+        fprintf(fp,
+                "%s{client=\"%s\"} %lu\n",
+                name,
+                client,
+                metrics_load(*value));
+    }
+}
+
+static void metrics_render(FILE *fp)
+{
+    const struct ctroller_stats *stats = ctroller_get_stats();
+
+    metrics_counter(fp,
+                    "ctroller_batches_total",
+                    "Batches of packets received.",
+                    metrics_load(stats->batches));
+    metrics_counter(fp,
+                    "ctroller_packets_received_total",
+                    "Packets received.",
+                    metrics_load(stats->packets));
+    metrics_counter(fp,
+                    "ctroller_packets_bad_magic_total",
+                    "Packets dropped due to a wrong magic number.",
+                    metrics_load(stats->bad_magic));
+    metrics_counter(fp,
+                    "ctroller_packets_short_total",
+                    "Packets dropped due to a wrong size.",
+                    metrics_load(stats->bad_size));
+    metrics_counter(fp,
+                    "ctroller_packets_version_mismatch_total",
+                    "Packets from a client of a different version.",
+                    metrics_load(stats->mismatch));
+    metrics_counter(fp,
+                    "ctroller_packets_overflow_total",
+                    "Packets dropped due to too many clients.",
+                    metrics_load(stats->overflow));
+    metrics_counter(fp,
+                    "ctroller_packets_coalesced_total",
+                    "Packets folded into a newer one.",
+                    metrics_load(stats->coalesced));
+    metrics_counter(fp,
+                    "ctroller_packets_stale_total",
+                    "Deltas dropped because their keyframe was not received.",
+                    metrics_load(stats->stale));
+    metrics_counter(fp,
+                    "ctroller_packets_recovered_total",
+                    "Lost packets whose key edges were recovered.",
+                    metrics_load(stats->recovered));
+    metrics_counter(fp,
+                    "ctroller_keyframes_total",
+                    "Keyframes received and acknowledged.",
+                    metrics_load(stats->keyframes));
+    metrics_counter(fp,
+                    "ctroller_probes_total",
+                    "Clock probes received and echoed.",
+                    metrics_load(stats->probes));
+    metrics_counter(fp,
+                    "ctroller_packets_late_total",
+                    "Packets dropped for being older than one received before.",
+                    metrics_load(stats->late));
+    metrics_counter(fp,
+                    "ctroller_packets_duplicate_total",
+                    "Packets dropped for being received twice.",
+                    metrics_load(stats->duplicate));
+    metrics_counter(fp,
+                    "ctroller_packets_lost_total",
+                    "Sequence numbers that were never received.",
+                    metrics_load(stats->lost));
+
+    const struct playout_stats *playout = playout_get_stats();
+    if (playout->rate != 0) {
+        metrics_counter(fp,
+                        "ctroller_playout_ticks_total",
+                        "Ticks of the playout scheduler.",
+                        metrics_load(playout->ticks));
+        metrics_counter(fp,
+                        "ctroller_playout_ticks_missed_total",
+                        "Ticks of the playout scheduler that were missed.",
+                        metrics_load(playout->missed));
+        metrics_counter(fp,
+                        "ctroller_playout_late_total",
+                        "States buffered after their playout point.",
+                        metrics_load(playout->late));
+        metrics_counter(fp,
+                        "ctroller_playout_motion_total",
+                        "Samples of motion batches buffered.",
+                        metrics_load(playout->motion));
+        metrics_counter(fp,
+                        "ctroller_playout_underruns_total",
+                        "Playouts past the newest state buffered.",
+                        metrics_load(playout->underruns));
+        metrics_header(fp,
+                       "ctroller_playout_delay_seconds",
+                       "gauge",
+                       "Adaptive playout delay, before the device caps.");
+        fprintf(fp,
+                "ctroller_playout_delay_seconds %.9f\n",
+                metrics_load(playout->delay) / 1e9);
+    }
+
+    if (predict_active()) {
+        metrics_predict_counter(fp,
+                                "ctroller_predictions_checked_total",
+                                "Predictions checked against later states.",
+                                offsetof(struct predict_stats, checked));
+        metrics_predict_counter(fp,
+                                "ctroller_prediction_error_total",
+                                "Summed absolute error of the predictions.",
+                                offsetof(struct predict_stats, error));
+        metrics_predict_counter(
+            fp,
+            "ctroller_prediction_baseline_error_total",
+            "Summed absolute error of the states without prediction.",
+            offsetof(struct predict_stats, baseline));
+    }
+
+    metrics_device_counter(fp,
+                           "ctroller_device_writes_total",
+                           "Successful writes to a device.",
+                           offsetof(struct device_stats, writes));
+    metrics_device_counter(fp,
+                           "ctroller_device_events_total",
+                           "Events written to a device.",
+                           offsetof(struct device_stats, events));
+    metrics_device_counter(fp,
+                           "ctroller_device_write_errors_total",
+                           "Failed writes to a device.",
+                           offsetof(struct device_stats, errors));
+    metrics_device_counter(fp,
+                           "ctroller_device_write_eagain_total",
+                           "Writes to a device failed with EAGAIN.",
+                           offsetof(struct device_stats, again));
+
+    /* Sessions are replaced while they are read, a client's address may be
+     * torn for the time of one scrape */
+    metrics_session_counter(fp,
+                            "ctroller_client_packets_total",
+                            "Packets received in order per client.",
+                            offsetof(struct packet_sequence, received));
+    metrics_session_counter(fp,
+                            "ctroller_client_packets_lost_total",
+                            "Sequence numbers never received per client.",
+                            offsetof(struct packet_sequence, lost));
+    metrics_session_counter(fp,
+                            "ctroller_client_packets_late_total",
+                            "Packets received out of order per client.",
+                            offsetof(struct packet_sequence, late));
+    metrics_session_counter(fp,
+                            "ctroller_client_packets_duplicate_total",
+                            "Packets received twice per client.",
+                            offsetof(struct packet_sequence, duplicate));
+
+    const struct ctroller_session *sessions = ctroller_get_sessions();
+    metrics_header(fp,
+                   "ctroller_client_jitter_seconds",
+                   "gauge",
+                   "Interarrival jitter per client, as in RFC 3550.");
+    for (size_t i = 0; i < CTROLLER_SESSIONS_MAX; i++) {
+        if (metrics_load(sessions[i].addr_len) == 0) {
+            continue;
+        }
+        char client[64];
+        ctroller_session_name(&sessions[i], client, sizeof(client));
+        fprintf(fp,
+                "ctroller_client_jitter_seconds{client=\"%s\"} %.9f\n",
+                client,
+                metrics_load(sessions[i].sequence.jitter) / 16 / 1e6);
+    }
+
+    metrics_header(fp,
+                   "ctroller_client_rtt_seconds",
+                   "gauge",
+                   "Round-trip time per client, as estimated by the client.");
+    for (size_t i = 0; i < CTROLLER_SESSIONS_MAX; i++) {
+        uint32_t rtt = metrics_load(sessions[i].clock.rtt);
+        if (metrics_load(sessions[i].addr_len) == 0 ||
+            rtt == PACKET_CLOCK_UNKNOWN) {
+            continue;
+        }
+        char client[64];
+        ctroller_session_name(&sessions[i], client, sizeof(client));
+        fprintf(fp,
+                "ctroller_client_rtt_seconds{client=\"%s\"} %.9f\n",
+                client,
+                rtt / 1e6);
+    }
+
+    metrics_header(fp,
+                   "ctroller_loop_seconds",
+                   "summary",
+                   "Time from waking up for a batch until it was written.");
+    metrics_summary(fp, "ctroller_loop_seconds", "", &latency_loop);
+
+    metrics_header(fp,
+                   "ctroller_capture_latency_seconds",
+                   "summary",
+                   "Time from sampling on the client until kernel receive.");
+    metrics_summary(
+        fp, "ctroller_capture_latency_seconds", "", &latency_capture);
+
+    metrics_header(fp,
+                   "ctroller_latency_seconds",
+                   "summary",
+                   "Time since kernel receive per stage or device.");
+    char labels[64];
+    for (size_t i = 0; i < LATENCY_STAGES; i++) {
+        snprintf(
+            labels, sizeof(labels), "stage=\"%s\"", latency_stages[i].name);
+        metrics_summary(
+            fp, "ctroller_latency_seconds", labels, &latency_stages[i]);
+    }
+    for (size_t i = 0; i < arrsize(latency_devices); i++) {
+        if (metrics_devices[i]->fd == -1) {
+            continue;
+        }
+        snprintf(labels,
+                 sizeof(labels),
+                 "stage=\"device\",device=\"%s\"",
+                 latency_devices[i].name);
+        metrics_summary(
+            fp, "ctroller_latency_seconds", labels, &latency_devices[i]);
+    }
+}
+
+static void *metrics_serve(void *arg)
+{
+    (void) arg;
+
+    for (;;) {
+        int conn = accept4(metrics.socket, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            /* The socket was shut down by metrics_exit() */
+            break;
+        }
+
+        FILE *fp = fdopen(conn, "w");
+        if (fp == NULL) {
+            close(conn);
+            continue;
+        }
+        metrics_render(fp);
+        fclose(fp);
+    }
+
+    return NULL;
+}
+
+int metrics_init(const char *path)
+{
+    if (strlen(path) >= sizeof(metrics.addr.sun_path)) {
+        fprintf(stderr, "Metrics socket path '%s' is too long.\n", path);
+        return -1;
+    }
+
+    metrics.addr.sun_family = AF_UNIX;
+    strcpy(metrics.addr.sun_path, path);
+
+    metrics.socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (metrics.socket < 0) {
+        perror("Error creating metrics socket");
+        return -1;
+    }
+
+    /* Remove the socket of a previous run */
+    unlink(path);
+    if (bind(metrics.socket,
+             (struct sockaddr *) &metrics.addr,
+             sizeof(metrics.addr)) < 0 ||
+        listen(metrics.socket, 4) < 0) {
+        fprintf(stderr, "Error binding to '%s': %s\n", path, strerror(errno));
+        goto error;
+    }
+
+    /* Signals are handled by the main thread. Blocking them in the metrics
+     * thread also turns SIGPIPE from clients hanging up into EPIPE. */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int res = pthread_create(&metrics.thread, NULL, metrics_serve, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (res != 0) {
+        fprintf(stderr, "Error starting metrics thread: %s\n", strerror(res));
+        unlink(path);
+        goto error;
+    }
+
+    printf("Serving metrics on %s.\n", path);
+    return 0;
+
+error:
+    close(metrics.socket);
+    metrics.socket = -1;
+    return -1;
+}
+
+void metrics_exit(void)
+{
+    if (metrics.socket < 0) {
+        return;
+    }
+
+    /* Wakes up the thread blocked in accept() */
+    shutdown(metrics.socket, SHUT_RDWR);
+    pthread_join(metrics.thread, NULL);
+
+    close(metrics.socket);
+    metrics.socket = -1;
+    unlink(metrics.addr.sun_path);
+}
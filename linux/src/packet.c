@@ -0,0 +1,543 @@
+#include "packet.h"
+#include "ctroller.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#define PACKET_V1_SSSE3 1
+#else
+#define PACKET_V1_SSSE3 0
+#endif
+
+PROTOCOL_ASSERT_LAYOUT(struct hidinfo)
+PROTOCOL_ASSERT_MOTION_LAYOUT(struct packet_motion)
+
+const struct protocol_layout packet_layout = PROTOCOL_LAYOUT(struct hidinfo);
+
+static const struct protocol_motion_layout packet_motion_layout =
+    PROTOCOL_MOTION_LAYOUT(struct packet_motion);
+
+/* Base of keyframes */
+static const struct hidinfo packet_zero;
+
+#if PACKET_V1_SSSE3
+/* packet_v1_swap() shuffles a v1 packet straight into struct hidinfo, in three
+ * windows of 16 bytes, each loaded from and stored at the same offset. The
+ * windows are stored in this order, each one over the bytes of the one
+ * before. packet_init() builds the shuffles from packet_layout, so every
+ * member of the schema must lie within the windows. */
+#define PACKET_V1_WINDOWS 3
+static const size_t packet_v1_windows[PACKET_V1_WINDOWS] = {
+    PACKET_V1_SIZE - 16, 16, 0};
+/* Source byte within its window of each byte of a window, negative for zero */
+static signed char packet_v1_shuffles[PACKET_V1_WINDOWS][16];
+/* Whether the shuffles are used */
+static int packet_v1_vector;
+
+/* PACKET_V1_SIZE expands the schema, which cannot be expanded within itself */
+enum { PACKET_V1_END = PACKET_V1_SIZE };
+
+#define PACKET_V1_ASSERT_MEMBER(type, member)                                  \
+    _Static_assert(offsetof(type, member) + sizeof(((type *) 0)->member) <=   \
+                       PACKET_V1_END,                                          \
+                   #type "." #member " is out of reach of the v1 shuffles");
+#define PACKET_V1_ASSERT_KEY(type, key, member)                                \
+    PACKET_V1_ASSERT_MEMBER(type, member)
+#define PACKET_V1_ASSERT_VALUE(type, field, member)                            \
+    PACKET_V1_ASSERT_MEMBER(type, member)
+
+_Static_assert(PACKET_V1_SIZE > 32 && PACKET_V1_SIZE <= 48,
+               "three windows must cover a v1 packet");
+_Static_assert(sizeof(struct hidinfo) >= PACKET_V1_SIZE,
+               "the windows are stored into struct hidinfo");
+PACKET_V1_ASSERT_MEMBER(struct hidinfo, version)
+PROTOCOL_KEYS(PACKET_V1_ASSERT_KEY, struct hidinfo)
+PROTOCOL_VALUES(PACKET_V1_ASSERT_VALUE, struct hidinfo)
+
+#undef PACKET_V1_ASSERT_VALUE
+#undef PACKET_V1_ASSERT_KEY
+#undef PACKET_V1_ASSERT_MEMBER
+
+/* Have the shuffles move byte `from` of a packet to byte `to` of struct
+ * hidinfo. Returns -1 if the window storing `to` does not hold `from`. */
+static int packet_v1_route(size_t from, size_t to)
+{
+    /* The last window stored over `to` */
+    size_t w = PACKET_V1_WINDOWS;
+    while (w-- > 0) {
+        size_t base = packet_v1_windows[w];
+        if (to >= base && to < base + 16) {
+            if (from < base || from >= base + 16) {
+                return -1;
+            }
+            packet_v1_shuffles[w][to - base] = from - base;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Route the big-endian number of `size` bytes at `from` to the member at `to`
+ */
+static int packet_v1_route_number(size_t from, size_t to, size_t size)
+{
+    for (size_t b = 0; b < size; b++) {
+        if (packet_v1_route(from + b, to + size - 1 - b) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+#endif
+
+void packet_init(void)
+{
+#if PACKET_V1_SSSE3
+    memset(packet_v1_shuffles, -1, sizeof(packet_v1_shuffles));
+
+    /* The magic is dropped */
+    size_t pos = 2;
+    int res    = packet_v1_route_number(
+        pos, offsetof(struct hidinfo, version), 2);
+    pos += 2;
+    for (size_t k = 0; k < PROTOCOL_KEYS_COUNT; k++, pos += 4) {
+        res |= packet_v1_route_number(pos, packet_layout.keys[k], 4);
+    }
+    for (size_t k = 0; k < PROTOCOL_VALUES_COUNT; k++, pos += 2) {
+        res |= packet_v1_route_number(pos, packet_layout.values[k], 2);
+    }
+
+    packet_v1_vector = (res == 0 && __builtin_cpu_supports("ssse3"));
+#endif
+}
+
+/* Magic, revision and size of a v1 packet, returns its size or a negative
+ * enum packet_error */
+static inline int packet_v1_check(const unsigned char *buf, size_t len)
+{
+    if (len == PACKET_V1_SIZE && protocol_get_u16(buf) == PACKET_MAGIC &&
+        PACKET_PROTOCOL(protocol_get_u16(buf + 2)) == PACKET_PROTOCOL_V1) {
+        return PACKET_V1_SIZE;
+    }
+
+    /* Tell the errors apart */
+    int revision = protocol_revision(buf, len);
+    if (revision < 0) {
+        return revision;
+    }
+    return (revision == PACKET_PROTOCOL_V1) ? PACKET_V1_SIZE : PACKET_EPROTOCOL;
+}
+
+int packet_v1_unpack_scalar(const unsigned char *buf,
+                            size_t len,
+                            struct hidinfo *hid)
+{
+    int res = packet_v1_check(buf, len);
+    if (res < 0) {
+        return res;
+    }
+
+    hid->version = protocol_get_u16(buf + 2);
+    hid->sample  = 0;
+    return protocol_unpack_v1(&packet_layout, buf, hid);
+}
+
+#if PACKET_V1_SSSE3
+/* Swap a checked packet into `hid` with the shuffles of packet_init() */
+__attribute__((target("ssse3"))) static void
+packet_v1_swap(const unsigned char *buf, struct hidinfo *hid)
+{
+    char *dst = (char *) hid;
+    for (size_t w = 0; w < PACKET_V1_WINDOWS; w++) {
+        size_t base    = packet_v1_windows[w];
+        __m128i window = _mm_loadu_si128((const __m128i *) (buf + base));
+        __m128i mask   = _mm_loadu_si128(
+            (const __m128i *) packet_v1_shuffles[w]);
+        _mm_storeu_si128((__m128i *) (dst + base),
+                         _mm_shuffle_epi8(window, mask));
+    }
+}
+#endif
+
+int packet_v1_unpack(const unsigned char *buf,
+                     size_t len,
+                     struct hidinfo *hid)
+{
+#if PACKET_V1_SSSE3
+    if (packet_v1_vector) {
+        int res = packet_v1_check(buf, len);
+        if (res < 0) {
+            return res;
+        }
+        packet_v1_swap(buf, hid);
+        hid->sample = 0;
+        return res;
+    }
+#endif
+    return packet_v1_unpack_scalar(buf, len, hid);
+}
+
+static unsigned char *packet_v2_header(unsigned char *buf,
+                                       uint16_t version,
+                                       enum packet_type type,
+                                       uint8_t id)
+{
+    version = PACKET_BCD_VERSION(version) | PACKET_PROTOCOL_V2 << 12;
+    return protocol_pack_header(buf, version, type, id);
+}
+
+int packet_v2_unpack(const unsigned char *buf,
+                     size_t len,
+                     struct packet_stream *stream,
+                     struct hidinfo *hid)
+{
+    int type = protocol_v2_type(buf, len, PACKET_V2_HEADER_SIZE);
+    if (type < 0) {
+        return (len < PACKET_V2_HEADER_SIZE) ? PACKET_ESIZE : PACKET_EMAGIC;
+    }
+
+    uint8_t id                 = buf[PACKET_V2_OFFSET_ID];
+    unsigned fields            = buf[PACKET_V2_OFFSET_FIELDS];
+    struct packet_keyframe *kf = &stream->keyframes[id % PACKET_KEYFRAMES];
+    const struct hidinfo *base;
+    switch (type) {
+    case PACKET_TYPE_KEYFRAME:
+        base = &packet_zero;
+        break;
+    case PACKET_TYPE_DELTA:
+        if (!kf->valid || kf->id != id) {
+            return PACKET_ESTALE;
+        }
+        base = &kf->state;
+        break;
+    default:
+        return PACKET_EPROTOCOL;
+    }
+
+    struct hidinfo state = *base;
+    state.version   = PACKET_BCD_VERSION(protocol_get_u16(buf + 2));
+    state.keys.up   = 0;
+    state.keys.down = 0;
+    state.sample    = protocol_get_u32(buf + PACKET_V2_OFFSET_SAMPLE);
+
+    const unsigned char *pos = buf + PACKET_V2_HEADER_SIZE;
+    const unsigned char *end = buf + len;
+    if ((fields & PACKET_FIELD_HELD) &&
+        (pos = protocol_get_keys(pos, end, &state.keys.held)) == NULL) {
+        return PACKET_ESIZE;
+    }
+    if ((fields & PACKET_FIELD_EDGES) &&
+        ((pos = protocol_get_keys(pos, end, &state.keys.down)) == NULL ||
+         (pos = protocol_get_keys(pos, end, &state.keys.up)) == NULL)) {
+        return PACKET_ESIZE;
+    }
+
+    if ((pos = protocol_unpack_values(
+             &packet_layout, pos, end, fields, &state)) == NULL) {
+        return PACKET_ESIZE;
+    }
+
+    if (fields & PACKET_FIELD_HISTORY) {
+        /* Only used by packet_v2_recover() */
+        if (pos == end || (size_t)(end - pos) < 1 + (size_t) *pos * 7) {
+            return PACKET_ESIZE;
+        }
+        pos += 1 + *pos * 7;
+    }
+
+    if (type == PACKET_TYPE_KEYFRAME) {
+        kf->valid = 1;
+        kf->id    = id;
+        kf->state = state;
+    }
+
+    *hid = state;
+    return pos - buf;
+}
+
+int packet_v2_unpack_keys(const unsigned char *buf,
+                          size_t len,
+                          struct hidinfo *hid)
+{
+    int type = protocol_v2_type(buf, len, PACKET_V2_HEADER_SIZE);
+    if (type < 0) {
+        return (len < PACKET_V2_HEADER_SIZE) ? PACKET_ESIZE : PACKET_EMAGIC;
+    }
+    if (type != PACKET_TYPE_KEYFRAME && type != PACKET_TYPE_DELTA) {
+        return PACKET_EPROTOCOL;
+    }
+
+    unsigned fields          = buf[PACKET_V2_OFFSET_FIELDS];
+    const unsigned char *pos = buf + PACKET_V2_HEADER_SIZE;
+    const unsigned char *end = buf + len;
+
+    hid->keys.up   = 0;
+    hid->keys.down = 0;
+    if ((fields & PACKET_FIELD_HELD) &&
+        (pos = protocol_get_keys(pos, end, &hid->keys.held)) == NULL) {
+        return PACKET_ESIZE;
+    }
+    if ((fields & PACKET_FIELD_EDGES) &&
+        ((pos = protocol_get_keys(pos, end, &hid->keys.down)) == NULL ||
+         (pos = protocol_get_keys(pos, end, &hid->keys.up)) == NULL)) {
+        return PACKET_ESIZE;
+    }
+
+    return pos - buf;
+}
+
+int packet_v2_recover(const unsigned char *buf,
+                      size_t len,
+                      unsigned missed,
+                      struct hidinfo *hid)
+{
+    int type = protocol_v2_type(buf, len, PACKET_V2_HEADER_SIZE);
+    if (type != PACKET_TYPE_KEYFRAME && type != PACKET_TYPE_DELTA) {
+        return (type < 0) ? PACKET_EMAGIC : PACKET_EPROTOCOL;
+    }
+
+    unsigned fields = buf[PACKET_V2_OFFSET_FIELDS];
+    if (!(fields & PACKET_FIELD_HISTORY)) {
+        return 0;
+    }
+
+    const unsigned char *pos = buf + PACKET_V2_HEADER_SIZE;
+    const unsigned char *end = buf + len;
+
+    /* The history is the last field */
+    size_t keys = ((fields & PACKET_FIELD_HELD) ? 3 : 0) +
+                  ((fields & PACKET_FIELD_EDGES) ? 6 : 0);
+    if ((size_t)(end - pos) < keys ||
+        (pos = protocol_skip_values(pos + keys, end, fields)) == NULL ||
+        pos == end) {
+        return PACKET_ESIZE;
+    }
+
+    int recovered = 0;
+    for (unsigned count = *pos++; count > 0; count--) {
+        if (pos == end) {
+            return PACKET_ESIZE;
+        }
+        unsigned distance = *pos++;
+        uint32_t down, up;
+        if ((pos = protocol_get_keys(pos, end, &down)) == NULL ||
+            (pos = protocol_get_keys(pos, end, &up)) == NULL) {
+            return PACKET_ESIZE;
+        }
+        /* The edges of packets received were already applied */
+        if (distance == 0 || distance > missed) {
+            continue;
+        }
+        hid->keys.down |= down;
+        hid->keys.up |= up;
+        recovered++;
+    }
+    return recovered;
+}
+
+int packet_v2_unpack_motion(const unsigned char *buf,
+                            size_t len,
+                            size_t used,
+                            const struct hidinfo *hid,
+                            struct packet_motion *motion)
+{
+    return protocol_unpack_motion(&packet_layout,
+                                  &packet_motion_layout,
+                                  hid,
+                                  hid->sample,
+                                  buf + used,
+                                  buf + len,
+                                  motion);
+}
+
+int packet_v2_keyframe_id(const unsigned char *buf, size_t len)
+{
+    if (protocol_v2_type(buf, len, PACKET_V2_HEADER_SIZE) !=
+        PACKET_TYPE_KEYFRAME) {
+        return -1;
+    }
+    return buf[PACKET_V2_OFFSET_ID];
+}
+
+int packet_v2_sequence(const unsigned char *buf,
+                       size_t len,
+                       uint16_t *number,
+                       uint32_t *sample)
+{
+    int type = protocol_v2_type(buf, len, PACKET_V2_HEADER_SIZE);
+    if (type != PACKET_TYPE_KEYFRAME && type != PACKET_TYPE_DELTA) {
+        return -1;
+    }
+    *number = protocol_get_u16(buf + PACKET_V2_OFFSET_SEQUENCE);
+    *sample = protocol_get_u32(buf + PACKET_V2_OFFSET_SAMPLE);
+    return 0;
+}
+
+/* Track the queueing delay of a packet in order */
+static void packet_sequence_transit(struct packet_sequence *seq,
+                                    uint32_t sample,
+                                    uint64_t arrival)
+{
+    if (arrival == 0) {
+        return;
+    }
+
+    /* Both clocks wrap around, transit times are compared by difference */
+    uint32_t transit = (uint32_t)(arrival / 1000) - sample;
+    if (!seq->timed) {
+        seq->timed          = 1;
+        seq->transit[0]     = transit;
+        seq->transit[1]     = transit;
+        seq->transit_window = sample;
+    } else if (sample - seq->transit_window >= PACKET_TRANSIT_WINDOW) {
+        /* A new window, so the smallest transit follows drifting clocks */
+        seq->transit[1]     = seq->transit[0];
+        seq->transit[0]     = transit;
+        seq->transit_window = sample;
+    } else if ((int32_t)(transit - seq->transit[0]) < 0) {
+        seq->transit[0] = transit;
+    }
+
+    uint32_t base  = ((int32_t)(seq->transit[1] - seq->transit[0]) < 0)
+                         ? seq->transit[1]
+                         : seq->transit[0];
+    int32_t queued = (int32_t)(transit - base);
+    if (queued > 0 && (uint32_t) queued > seq->queue) {
+        seq->queue = queued;
+    }
+}
+
+enum packet_order packet_sequence_update(struct packet_sequence *seq,
+                                         uint16_t number,
+                                         uint32_t sample,
+                                         uint64_t arrival)
+{
+    int16_t ahead = number - seq->highest;
+    if (seq->started && ahead <= 0 && ahead > -PACKET_SEQUENCE_WINDOW) {
+        uint64_t bit = 1ull << -ahead;
+        if (seq->window & bit) {
+            seq->duplicate++;
+            return PACKET_DUPLICATE;
+        }
+        /* Counted as lost when the newer packet arrived, unless it was sent
+         * before the first packet received */
+        seq->window |= bit;
+        if (seq->lost > 0) {
+            seq->lost--;
+        }
+        seq->late++;
+        return PACKET_LATE;
+    }
+
+    if (!seq->started || ahead <= 0) {
+        /* First packet, or the client restarted */
+        seq->started = 1;
+        seq->window  = 1;
+        seq->skipped = 0;
+        seq->timed   = 0;
+    } else {
+        seq->skipped = ahead - 1;
+        seq->lost += seq->skipped;
+        seq->window =
+            (ahead < PACKET_SEQUENCE_WINDOW) ? seq->window << ahead | 1 : 1;
+
+        if (arrival != 0 && seq->arrival != 0) {
+            /* Deviation of the receive interval from the sample interval */
+            int64_t deviation = (int64_t)(arrival - seq->arrival) / 1000 -
+                                (int32_t)(sample - seq->sample);
+            if (deviation < 0) {
+                deviation = -deviation;
+            }
+            seq->jitter += deviation - ((seq->jitter + 8) >> 4);
+        }
+    }
+
+    packet_sequence_transit(seq, sample, arrival);
+    seq->highest = number;
+    seq->sample  = sample;
+    seq->arrival = arrival;
+    seq->received++;
+    return PACKET_IN_ORDER;
+}
+
+int packet_v2_pack(struct protocol_encoder *enc,
+                   const struct hidinfo *hid,
+                   uint32_t sample,
+                   unsigned char *buf)
+{
+    return protocol_pack_v2(enc, &packet_layout, hid, sample, buf);
+}
+
+int packet_v2_pack_motion(const struct hidinfo *hid,
+                          uint32_t sample,
+                          const struct packet_motion *motion,
+                          size_t count,
+                          unsigned char *buf,
+                          size_t len)
+{
+    return protocol_pack_motion(&packet_layout,
+                                &packet_motion_layout,
+                                hid,
+                                sample,
+                                motion,
+                                count,
+                                buf + len) -
+           buf;
+}
+
+int packet_v2_pack_ack(uint8_t id, unsigned char *buf)
+{
+    return packet_v2_header(buf, CTROLLER_VERSION, PACKET_TYPE_ACK, id) - buf;
+}
+
+int packet_v2_pack_probe(struct protocol_clock *clock,
+                         uint32_t now,
+                         unsigned char *buf)
+{
+    return protocol_pack_probe(clock, CTROLLER_VERSION, now, buf);
+}
+
+int packet_v2_unpack_probe(const unsigned char *buf,
+                           size_t len,
+                           struct protocol_clock_sample *estimate)
+{
+    int type = protocol_v2_type(buf, len, PACKET_V2_PROBE_SIZE);
+    if (type != PACKET_TYPE_PROBE) {
+        return (type < 0) ? PACKET_EMAGIC : PACKET_EPROTOCOL;
+    }
+
+    estimate->rtt    = protocol_get_u32(buf + PACKET_V2_OFFSET_PROBE_RTT);
+    estimate->offset = protocol_get_u32(buf + PACKET_V2_OFFSET_PROBE_OFFSET);
+    return 0;
+}
+
+int packet_v2_pack_echo(const unsigned char *probe,
+                        uint32_t received,
+                        uint32_t replied,
+                        unsigned char *buf)
+{
+    uint32_t sent      = protocol_get_u32(probe + PACKET_V2_OFFSET_PROBE_SENT);
+    unsigned char *pos = packet_v2_header(
+        buf, CTROLLER_VERSION, PACKET_TYPE_ECHO, probe[PACKET_V2_OFFSET_ID]);
+    pos = protocol_put_u32(pos, sent);
+    pos = protocol_put_u32(pos, received);
+    pos = protocol_put_u32(pos, replied);
+    return pos - buf;
+}
+
+int packet_v2_pack_report(uint8_t id,
+                          struct packet_sequence *seq,
+                          unsigned char *buf)
+{
+    unsigned char *pos = packet_v2_header(
+        buf, CTROLLER_VERSION, PACKET_TYPE_REPORT, id);
+    pos = protocol_put_u32(pos, seq->received);
+    pos = protocol_put_u32(pos, seq->lost);
+    pos = protocol_put_u32(pos, seq->jitter / 16);
+    pos = protocol_put_u32(pos, seq->queue);
+
+    seq->queue = 0;
+    return pos - buf;
+}
@@ -0,0 +1,352 @@
+#include "playout.h"
+
+#include <stdio.h>
+#include <errno.h>
+
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+/* Sample times further apart are taken as a restart of the client, in ns */
+#define PLAYOUT_GAP 1000000000ll
+/* States further apart on the sample clock were held by a client sending on
+ * changes only (see PACKET_KEEPALIVE_INTERVAL): nothing is interpolated
+ * across the gap and it is left out of the mean interval, in ns */
+#define PLAYOUT_HOLD 100000000ull
+/* The transit time is the smallest one of the current and the last window of
+ * this length, so it follows a drifting clock, in ns */
+#define PLAYOUT_WINDOW 1000000000ull
+/* Weight of a new value in the queueing peak and the sample interval */
+#define PLAYOUT_PEAK_DECAY 64
+#define PLAYOUT_INTERVAL_GAIN 16
+
+struct playout_sample {
+    uint64_t clock; /* sample time on the monotonic clock, before the offset */
+    struct hidinfo hid;
+};
+
+struct playout_slot {
+    uint64_t next;  /* first state whose key edges were not played */
+    uint64_t point; /* last playout point, never moves backwards */
+};
+
+static struct {
+    int fd;
+    const void *source;
+    int started;
+    uint32_t last_sample; /* client time of the newest state, in us */
+    uint64_t clock;       /* monotonic time of the newest state, in ns */
+    uint64_t packet;      /* of the newest state that was not from a batch */
+    uint64_t window;      /* clock the current transit window started at */
+    int64_t transit[2];   /* smallest transit of this and the last window */
+    uint64_t peak;        /* decaying peak of the queueing delay, in ns */
+    uint64_t interval;    /* mean interval between states, in ns */
+    uint64_t first;       /* index of the first state of this stream */
+    uint64_t head;        /* index of the next state */
+    uint64_t played;      /* latest playout point of any slot */
+    struct playout_sample samples[PLAYOUT_SAMPLES];
+    struct playout_slot slots[PLAYOUT_SLOTS];
+} playout = {
+    .fd = -1,
+};
+
+static struct playout_stats stats;
+
+int playout_init(unsigned rate)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        perror("Failed to create playout timer");
+        return -1;
+    }
+
+    uint64_t period      = 1000000000ull / rate;
+    struct timespec tick = {
+        .tv_sec  = period / 1000000000ull,
+        .tv_nsec = period % 1000000000ull,
+    };
+    struct itimerspec spec = {
+        .it_interval = tick,
+        .it_value    = tick,
+    };
+    if (timerfd_settime(fd, 0, &spec, NULL) < 0) {
+        perror("Failed to start playout timer");
+        close(fd);
+        return -1;
+    }
+
+    playout.fd = fd;
+    stats.rate = rate;
+    return fd;
+}
+
+void playout_exit(void)
+{
+    if (playout.fd != -1) {
+        close(playout.fd);
+        playout.fd = -1;
+    }
+}
+
+int playout_active(void)
+{
+    return playout.fd != -1;
+}
+
+int playout_fd(void)
+{
+    return playout.fd;
+}
+
+int playout_wait(void)
+{
+    uint64_t expirations;
+    if (read(playout.fd, &expirations, sizeof(expirations)) < 0) {
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    }
+
+    stats.ticks++;
+    stats.missed += expirations - 1;
+    return 1;
+}
+
+/* Smallest transit time, the offset from sample times to playout times */
+static int64_t playout_offset(void)
+{
+    return (playout.transit[0] < playout.transit[1]) ? playout.transit[0]
+                                                     : playout.transit[1];
+}
+
+static void playout_restart(const void *source, uint64_t arrival)
+{
+    playout.source     = source;
+    playout.started    = 1;
+    playout.clock      = arrival;
+    playout.packet     = arrival;
+    playout.window     = arrival;
+    playout.transit[0] = 0;
+    playout.transit[1] = 0;
+    playout.peak       = 0;
+    playout.interval   = 0;
+    playout.first      = playout.head;
+    playout.played     = 0;
+    /* Edges of the old stream that were not played yet are dropped */
+    for (size_t i = 0; i < PLAYOUT_SLOTS; i++) {
+        playout.slots[i] = (struct playout_slot){.next = playout.head};
+    }
+    stats.resets++;
+}
+
+static int16_t playout_lerp(int16_t a, int16_t b, uint32_t frac)
+{
+    return a + (((int32_t) b - a) * (int64_t) frac >> 16);
+}
+
+/* The states of a motion batch held the sticks of the packet before, move
+ * them towards `hid`, sampled at `clock`, as if they had been interpolated */
+static void playout_blend(uint64_t clock, const struct hidinfo *hid)
+{
+    uint64_t span = clock - playout.packet;
+    for (uint64_t i = playout.head; i-- > playout.first;) {
+        struct playout_sample *s = &playout.samples[i % PLAYOUT_SAMPLES];
+        if (s->clock <= playout.packet) {
+            break;
+        }
+        uint32_t frac = ((s->clock - playout.packet) << 16) / span;
+        s->hid.circlepad.dx =
+            playout_lerp(s->hid.circlepad.dx, hid->circlepad.dx, frac);
+        s->hid.circlepad.dy =
+            playout_lerp(s->hid.circlepad.dy, hid->circlepad.dy, frac);
+        s->hid.cstick.dx = playout_lerp(s->hid.cstick.dx, hid->cstick.dx, frac);
+        s->hid.cstick.dy = playout_lerp(s->hid.cstick.dy, hid->cstick.dy, frac);
+    }
+}
+
+static void playout_store(uint64_t clock, const struct hidinfo *hid)
+{
+    struct playout_sample *next = &playout.samples[playout.head %
+                                                   PLAYOUT_SAMPLES];
+    next->clock                 = clock;
+    next->hid                   = *hid;
+    playout.head++;
+    stats.samples++;
+}
+
+void playout_push(const struct hidinfo *hid,
+                  const void *source,
+                  int has_sample,
+                  uint32_t sample,
+                  uint64_t arrival)
+{
+    uint64_t clock;
+    if (!playout.started || source != playout.source) {
+        playout_restart(source, arrival);
+        clock = arrival;
+    } else if (has_sample) {
+        int64_t delta = (int64_t)(int32_t)(sample - playout.last_sample) * 1000;
+        if (delta < 0 || delta > PLAYOUT_GAP) {
+            playout_restart(source, arrival);
+            clock = arrival;
+        } else {
+            clock = playout.clock + delta;
+        }
+    } else {
+        /* Without sample times, states are played out as they arrived */
+        clock = (arrival > playout.clock) ? arrival : playout.clock;
+    }
+
+    if (playout.head > playout.first && clock - playout.packet < PLAYOUT_HOLD) {
+        uint64_t delta = clock - playout.packet;
+        if (playout.interval == 0) {
+            playout.interval = delta;
+        } else {
+            playout.interval += ((int64_t) delta - (int64_t) playout.interval) /
+                                PLAYOUT_INTERVAL_GAIN;
+        }
+        /* The previous state was played out while this one was missing */
+        if (playout.played > playout.clock + playout_offset()) {
+            stats.underruns++;
+        }
+        playout_blend(clock, hid);
+    }
+    playout.clock       = clock;
+    playout.packet      = clock;
+    playout.last_sample = sample;
+
+    int64_t transit = (int64_t)(arrival - clock);
+    if (clock - playout.window >= PLAYOUT_WINDOW) {
+        playout.transit[1] = playout.transit[0];
+        playout.transit[0] = transit;
+        playout.window     = clock;
+    } else if (transit < playout.transit[0]) {
+        playout.transit[0] = transit;
+    }
+
+    uint64_t queued = transit - playout_offset();
+    playout.peak -= playout.peak / PLAYOUT_PEAK_DECAY;
+    if (queued > playout.peak) {
+        playout.peak = queued;
+    }
+    stats.delay = playout.interval + playout.peak;
+
+    if (clock + playout_offset() <= playout.played) {
+        stats.late++;
+    }
+    playout_store(clock, hid);
+}
+
+void playout_push_motion(const void *source,
+                         uint32_t sample,
+                         const struct gyrorate *gyro,
+                         const struct accelrate *accel)
+{
+    if (!playout.started || source != playout.source ||
+        playout.head == playout.first) {
+        return;
+    }
+    int64_t delta = (int64_t)(int32_t)(sample - playout.last_sample) * 1000;
+    if (delta <= 0 || delta > PLAYOUT_GAP) {
+        return;
+    }
+
+    /* Sampled along with the newest state, whose edges were played already */
+    struct hidinfo hid =
+        playout.samples[(playout.head - 1) % PLAYOUT_SAMPLES].hid;
+    hid.keys.down = 0;
+    hid.keys.up   = 0;
+    hid.gyro      = *gyro;
+    hid.accel     = *accel;
+    hid.received  = 0;
+    hid.sample    = sample;
+
+    playout.clock += delta;
+    playout.last_sample = sample;
+    stats.motion++;
+    playout_store(playout.clock, &hid);
+}
+
+/* Interpolate the axes of `hid`, taken from `a`, towards `b` by `frac` / 2^16.
+ * Keys and the touchscreen are not interpolated, the touch position is only
+ * valid while it is touched. */
+static void playout_interpolate(struct hidinfo *hid,
+                                const struct hidinfo *b,
+                                uint32_t frac)
+{
+    hid->circlepad.dx = playout_lerp(hid->circlepad.dx, b->circlepad.dx, frac);
+    hid->circlepad.dy = playout_lerp(hid->circlepad.dy, b->circlepad.dy, frac);
+    hid->cstick.dx    = playout_lerp(hid->cstick.dx, b->cstick.dx, frac);
+    hid->cstick.dy    = playout_lerp(hid->cstick.dy, b->cstick.dy, frac);
+    hid->gyro.x       = playout_lerp(hid->gyro.x, b->gyro.x, frac);
+    hid->gyro.y       = playout_lerp(hid->gyro.y, b->gyro.y, frac);
+    hid->gyro.z       = playout_lerp(hid->gyro.z, b->gyro.z, frac);
+    hid->accel.x      = playout_lerp(hid->accel.x, b->accel.x, frac);
+    hid->accel.y      = playout_lerp(hid->accel.y, b->accel.y, frac);
+    hid->accel.z      = playout_lerp(hid->accel.z, b->accel.z, frac);
+}
+
+int playout_state(size_t slot,
+                  uint64_t cap,
+                  uint64_t now,
+                  struct hidinfo *hid)
+{
+    struct playout_slot *pos = &playout.slots[slot];
+
+    uint64_t first = playout.first;
+    if (playout.head - first > PLAYOUT_SAMPLES) {
+        first = playout.head - PLAYOUT_SAMPLES;
+    }
+    if (playout.head == first) {
+        return 0;
+    }
+
+    uint64_t delay = (stats.delay < cap) ? stats.delay : cap;
+    uint64_t point = now - delay;
+    if (point < pos->point) {
+        point = pos->point;
+    }
+    pos->point = point;
+    if (point > playout.played) {
+        playout.played = point;
+    }
+
+    /* Newest state at or before the playout point */
+    int64_t offset = playout_offset();
+    uint64_t a     = playout.head;
+    const struct playout_sample *sa;
+    do {
+        if (a == first) {
+            return 0;
+        }
+        sa = &playout.samples[--a % PLAYOUT_SAMPLES];
+    } while (sa->clock + offset > point);
+
+    *hid           = sa->hid;
+    hid->keys.down = 0;
+    hid->keys.up   = 0;
+    for (uint64_t i = (pos->next > first) ? pos->next : first; i <= a; i++) {
+        const struct hidinfo *edges = &playout.samples[i % PLAYOUT_SAMPLES].hid;
+        hid->keys.down |= edges->keys.down;
+        hid->keys.up |= edges->keys.up;
+    }
+    if (a + 1 > pos->next) {
+        pos->next = a + 1;
+    }
+
+    /* Nothing to interpolate towards, the state is held */
+    if (a + 1 == playout.head) {
+        return 1;
+    }
+
+    const struct playout_sample *sb =
+        &playout.samples[(a + 1) % PLAYOUT_SAMPLES];
+    uint64_t span = sb->clock - sa->clock;
+    if (span != 0 && span < PLAYOUT_HOLD) {
+        uint64_t into = point - (sa->clock + offset);
+        playout_interpolate(hid, &sb->hid, (into << 16) / span);
+    }
+    return 1;
+}
+
+const struct playout_stats *playout_get_stats(void)
+{
+    return &stats;
+}
@@ -0,0 +1,309 @@
+#include "predict.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include <linux/uinput.h>
+
+/* States further apart start the prediction over, in us */
+#define PREDICT_GAP 250000
+
+#define predict_value(hid, offset) (*(int16_t *) ((char *) (hid) + (offset)))
+
+/* Axes predicted, their device and their code on it, which holds the range */
+static const struct predict_axis {
+    enum DEVICE_ID device;
+    const struct device_context *dev;
+    uint16_t code;
+    size_t offset;
+    int centered; /* returns to 0 when released */
+} predict_axes[] = {
+    {DEVICE_GAMEPAD,
+     &device_gamepad,
+     ABS_X,
+     offsetof(struct hidinfo, circlepad.dx),
+     1},
+    {DEVICE_GAMEPAD,
+     &device_gamepad,
+     ABS_Y,
+     offsetof(struct hidinfo, circlepad.dy),
+     1},
+    {DEVICE_GAMEPAD,
+     &device_gamepad,
+     ABS_RX,
+     offsetof(struct hidinfo, cstick.dx),
+     1},
+    {DEVICE_GAMEPAD,
+     &device_gamepad,
+     ABS_RY,
+     offsetof(struct hidinfo, cstick.dy),
+     1},
+    {DEVICE_GYROSCOPE,
+     &device_gyroscope,
+     ABS_X,
+     offsetof(struct hidinfo, gyro.x),
+     0},
+    {DEVICE_GYROSCOPE,
+     &device_gyroscope,
+     ABS_Y,
+     offsetof(struct hidinfo, gyro.y),
+     0},
+    {DEVICE_GYROSCOPE,
+     &device_gyroscope,
+     ABS_Z,
+     offsetof(struct hidinfo, gyro.z),
+     0},
+    {DEVICE_ACCELEROMETER,
+     &device_accelerometer,
+     ABS_X,
+     offsetof(struct hidinfo, accel.x),
+     0},
+    {DEVICE_ACCELEROMETER,
+     &device_accelerometer,
+     ABS_Y,
+     offsetof(struct hidinfo, accel.y),
+     0},
+    {DEVICE_ACCELEROMETER,
+     &device_accelerometer,
+     ABS_Z,
+     offsetof(struct hidinfo, accel.z),
+     0},
+};
+
+#define PREDICT_AXES (sizeof(predict_axes) / sizeof(*predict_axes))
+
+/* A prediction waiting for the states around its target time */
+struct predict_pending {
+    int64_t target;
+    int16_t predicted[PREDICT_AXES];
+    int16_t held[PREDICT_AXES];
+};
+
+enum predict_clock {
+    PREDICT_CLOCK_NONE,
+    PREDICT_CLOCK_SAMPLE,   /* the client's sample times */
+    PREDICT_CLOCK_RECEIVED, /* receive times, for v1 clients */
+};
+
+/* States of one source, on its clock */
+struct predict_stream {
+    const void *source;
+    unsigned long used; /* when it last predicted, to replace the oldest */
+    enum predict_clock clock;
+    uint32_t last_sample;
+    int64_t time; /* of the last state, in us */
+    int16_t values[PREDICT_AXES];
+    double velocity[PREDICT_AXES]; /* in units per us */
+    int moving;                    /* whether `velocity` was measured */
+    struct predict_pending pending[PREDICT_PENDING];
+    size_t first, count;
+};
+
+static struct {
+    unsigned horizon; /* in us, 0 if disabled */
+    unsigned mask;
+    unsigned long states; /* states predicted */
+    struct predict_stream streams[PREDICT_SOURCES];
+} predict;
+
+static struct predict_stats stats[DEVICES_COUNT];
+
+void predict_init(unsigned horizon, unsigned mask)
+{
+    /* Devices without axes to predict are left out of the stats */
+    unsigned axes = 0;
+    for (size_t i = 0; i < PREDICT_AXES; i++) {
+        axes |= 1 << predict_axes[i].device;
+    }
+
+    predict.horizon = horizon * 1000;
+    predict.mask    = mask & axes;
+}
+
+int predict_active(void)
+{
+    return predict.horizon != 0 && predict.mask != 0;
+}
+
+unsigned predict_horizon(void)
+{
+    return predict.horizon / 1000;
+}
+
+unsigned predict_mask(void)
+{
+    return predict.mask;
+}
+
+const struct predict_stats *predict_get_stats(void)
+{
+    return stats;
+}
+
+/* Time `hid` was sampled at in us, on the clock of the stream. Returns 0 if
+ * the stream continues, 1 if it starts over and -1 without a time. */
+static int predict_time(struct predict_stream *stream,
+                        const struct hidinfo *hid,
+                        int64_t *time)
+{
+    enum predict_clock clock = (hid->sample != 0)     ? PREDICT_CLOCK_SAMPLE
+                               : (hid->received != 0) ? PREDICT_CLOCK_RECEIVED
+                                                      : PREDICT_CLOCK_NONE;
+    int restart = (clock != stream->clock);
+    stream->clock = clock;
+
+    switch (clock) {
+    case PREDICT_CLOCK_SAMPLE:
+        *time = restart ? 0
+                        : stream->time +
+                              (int32_t)(hid->sample - stream->last_sample);
+        stream->last_sample = hid->sample;
+        break;
+    case PREDICT_CLOCK_RECEIVED:
+        *time = hid->received / 1000;
+        break;
+    case PREDICT_CLOCK_NONE:
+        return -1;
+    }
+
+    int64_t elapsed = *time - stream->time;
+    return (restart || elapsed <= 0 || elapsed > PREDICT_GAP) ? 1 : 0;
+}
+
+/* Check the predictions for times up to `time`, at which `hid` was sampled,
+ * against the values interpolated from the last state to `hid` */
+static void predict_check(struct predict_stream *stream,
+                          const struct hidinfo *hid,
+                          int64_t time)
+{
+    int64_t elapsed = time - stream->time;
+
+    while (stream->count > 0) {
+        const struct predict_pending *p = &stream->pending[stream->first];
+        if (p->target > time) {
+            break;
+        }
+
+        unsigned long error[DEVICES_COUNT]    = {};
+        unsigned long baseline[DEVICES_COUNT] = {};
+        for (size_t i = 0; i < PREDICT_AXES; i++) {
+            const struct predict_axis *axis = &predict_axes[i];
+            int16_t value = predict_value(hid, axis->offset);
+            int64_t actual =
+                stream->values[i] + (value - stream->values[i]) *
+                                        (p->target - stream->time) / elapsed;
+            error[axis->device] += llabs(p->predicted[i] - actual);
+            baseline[axis->device] += llabs(p->held[i] - actual);
+        }
+
+        for (size_t d = 0; d < DEVICES_COUNT; d++) {
+            if (!(predict.mask & (1 << d))) {
+                continue;
+            }
+            stats[d].checked++;
+            stats[d].error += error[d];
+            stats[d].baseline += baseline[d];
+            if (error[d] > stats[d].max) {
+                stats[d].max = error[d];
+            }
+        }
+
+        stream->first = (stream->first + 1) % PREDICT_PENDING;
+        stream->count--;
+    }
+}
+
+static int16_t predict_axis(const struct predict_axis *axis,
+                            int16_t value,
+                            double velocity,
+                            unsigned horizon)
+{
+    const struct uinput_user_dev *dev = axis->dev->dev;
+    double predicted                  = value + velocity * horizon;
+
+    if (axis->centered && (double) value * predicted < 0) {
+        predicted = 0;
+    }
+    if (predicted < dev->absmin[axis->code]) {
+        predicted = dev->absmin[axis->code];
+    } else if (predicted > dev->absmax[axis->code]) {
+        predicted = dev->absmax[axis->code];
+    }
+    return (int16_t) predicted;
+}
+
+/* Stream of `source`, replacing the least recently used one if it is new */
+static struct predict_stream *predict_stream(const void *source)
+{
+    struct predict_stream *stream = &predict.streams[0];
+    for (size_t i = 0; i < PREDICT_SOURCES; i++) {
+        if (predict.streams[i].used != 0 &&
+            predict.streams[i].source == source) {
+            stream = &predict.streams[i];
+            goto found;
+        }
+        if (predict.streams[i].used < stream->used) {
+            stream = &predict.streams[i];
+        }
+    }
+
+    *stream = (struct predict_stream){.source = source};
+
+found:
+    stream->used = ++predict.states;
+    return stream;
+}
+
+void predict_apply(struct hidinfo *hid)
+{
+    struct predict_stream *stream = predict_stream(hid->source);
+
+    int64_t time;
+    int res = predict_time(stream, hid, &time);
+    if (res < 0) {
+        return;
+    }
+    if (res > 0) {
+        stream->moving = 0;
+        stream->count  = 0;
+    } else {
+        predict_check(stream, hid, time);
+    }
+
+    /* Velocities are averaged over the last two intervals against noise */
+    int64_t elapsed = time - stream->time;
+    for (size_t i = 0; i < PREDICT_AXES; i++) {
+        int16_t value = predict_value(hid, predict_axes[i].offset);
+        if (res == 0) {
+            double velocity = (double) (value - stream->values[i]) / elapsed;
+            stream->velocity[i] =
+                stream->moving ? (stream->velocity[i] + velocity) / 2
+                               : velocity;
+        }
+        stream->values[i] = value;
+    }
+    stream->time = time;
+    if (res > 0) {
+        return;
+    }
+    stream->moving = 1;
+
+    struct predict_pending *p = NULL;
+    if (stream->count < PREDICT_PENDING) {
+        p = &stream->pending[(stream->first + stream->count++) %
+                             PREDICT_PENDING];
+        p->target = time + predict.horizon;
+    }
+    for (size_t i = 0; i < PREDICT_AXES; i++) {
+        const struct predict_axis *axis = &predict_axes[i];
+        int16_t predicted               = predict_axis(
+            axis, stream->values[i], stream->velocity[i], predict.horizon);
+        if (p != NULL) {
+            p->predicted[i] = predicted;
+            p->held[i]      = stream->values[i];
+        }
+        if (predict.mask & (1 << axis->device)) {
+            predict_value(hid, axis->offset) = predicted;
+        }
+    }
+}
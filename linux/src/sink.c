@@ -0,0 +1,45 @@
+#include "sink.h"
+#include "devices.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+
+static const struct sink *sinks[] = {
+    &sink_uinput,
+    &sink_null,
+    &sink_file,
+};
+
+const struct sink *output_sink = &sink_uinput;
+
+int sink_init(const char *spec)
+{
+    const char *arg = strchr(spec, ':');
+    size_t namelen  = (arg != NULL) ? (size_t)(arg - spec) : strlen(spec);
+    if (arg != NULL) {
+        arg++;
+    }
+
+    for (size_t i = 0; i < arrsize(sinks); i++) {
+        if (strlen(sinks[i]->name) == namelen &&
+            strncmp(sinks[i]->name, spec, namelen) == 0) {
+            if (sinks[i]->init != NULL && sinks[i]->init(arg) < 0) {
+                return -1;
+            }
+            output_sink = sinks[i];
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "Unknown output '%.*s'.\n", (int) namelen, spec);
+    errno = EINVAL;
+    return -1;
+}
+
+void sink_exit(void)
+{
+    if (output_sink->exit != NULL) {
+        output_sink->exit();
+    }
+}
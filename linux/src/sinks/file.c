@@ -0,0 +1,105 @@
+#include "sink.h"
+#include "devices.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include <linux/input.h>
+
+static int filefd = -1;
+static int handles;
+
+static int file_init(const char *arg)
+{
+    if (arg == NULL || *arg == '\0') {
+        fprintf(stderr, "The file output requires a path (file:<path>).\n");
+        errno = EINVAL;
+        return -1;
+    }
+
+    filefd = open(arg, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (filefd < 0) {
+        fprintf(stderr, "Error opening '%s': %s\n", arg, strerror(errno));
+        return -1;
+    }
+    handles = 0;
+    return 0;
+}
+
+static void file_exit(void)
+{
+    close(filefd);
+    filefd = -1;
+}
+
+static ssize_t file_record(uint8_t type,
+                           int handle,
+                           const void *data,
+                           size_t len)
+{
+    struct sink_file_record record = {
+        .type   = type,
+        .handle = handle,
+        .len    = len,
+    };
+    struct iovec iov[] = {
+        {.iov_base = &record, .iov_len = sizeof(record)},
+        {.iov_base = (void *) data, .iov_len = len},
+    };
+
+    ssize_t res = writev(filefd, iov, arrsize(iov));
+    return (res < 0) ? res : res - (ssize_t) sizeof(record);
+}
+
+static int file_create(const struct device_context *dev)
+{
+    int handle = handles++;
+    if (file_record(SINK_FILE_CREATE, handle, dev->name, strlen(dev->name)) <
+        0) {
+        perror("Error writing device record");
+        return -1;
+    }
+    return handle;
+}
+
+static void file_destroy(const struct device_context *dev)
+{
+    (void) dev;
+}
+
+static ssize_t file_write(const struct device_context *dev,
+                          const struct input_event *events,
+                          size_t len)
+{
+    /* Event timestamps are left unset by the devices (uinput fills them in),
+     * clear them so the same input always results in the same file */
+    struct input_event cleared[DEVICE_PREPARE_MAX];
+    if (len > arrsize(cleared)) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (size_t i = 0; i < len; i++) {
+        cleared[i] = (struct input_event){
+            .type  = events[i].type,
+            .code  = events[i].code,
+            .value = events[i].value,
+        };
+    }
+
+    return file_record(
+        SINK_FILE_WRITE, dev->fd, cleared, len * sizeof(struct input_event));
+}
+
+const struct sink sink_file = {
+    .name    = "file",
+    .init    = file_init,
+    .exit    = file_exit,
+    .create  = file_create,
+    .destroy = file_destroy,
+    .write   = file_write,
+};
@@ -0,0 +1,41 @@
+#include "sink.h"
+#include "devices.h"
+
+#include <linux/input.h>
+
+static struct sink_stats stats;
+static int handles;
+
+static int null_create(const struct device_context *dev)
+{
+    (void) dev;
+    return handles++;
+}
+
+static void null_destroy(const struct device_context *dev)
+{
+    (void) dev;
+}
+
+static ssize_t null_write(const struct device_context *dev,
+                          const struct input_event *events,
+                          size_t len)
+{
+    (void) dev, (void) events;
+
+    stats.writes++;
+    stats.events += len;
+    return len * sizeof(struct input_event);
+}
+
+const struct sink sink_null = {
+    .name    = "null",
+    .create  = null_create,
+    .destroy = null_destroy,
+    .write   = null_write,
+};
+
+const struct sink_stats *sink_null_get_stats(void)
+{
+    return &stats;
+}
@@ -0,0 +1,146 @@
+#include "sink.h"
+#include "devices.h"
+#include "ctroller.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <linux/input.h>
+#include <linux/uinput.h>
+
+static const char *uinput_device = UINPUT_DEFAULT_DEVICE;
+
+static int uinput_init(const char *arg)
+{
+    if (arg != NULL && *arg != '\0') {
+        uinput_device = arg;
+    }
+    return 0;
+}
+
+static int uinput_open(const char *uinput_device)
+{
+    int uinputfd;
+    if (uinput_device == NULL) {
+        errno    = EINVAL;
+        uinputfd = -1;
+        goto error;
+    }
+    uinputfd = open(uinput_device, O_WRONLY | O_NONBLOCK);
+    if (uinputfd < 0) {
+        goto error;
+    }
+    return uinputfd;
+
+error:
+    fprintf(stderr,
+            "Error opening uinput device at '%s': %s\n",
+            uinput_device,
+            strerror(errno));
+    return uinputfd;
+}
+
+static ssize_t
+uinput_register_keys(const int uinputfd, const uint16_t *keycodes, size_t len)
+{
+    ssize_t res;
+    res = ioctl(uinputfd, UI_SET_EVBIT, EV_KEY);
+    if (res < 0) {
+        perror("Failed to register event type for keys");
+        return -1;
+    }
+    for (size_t i = 0; i < len; i++) {
+        res = ioctl(uinputfd, UI_SET_KEYBIT, keycodes[i]);
+        if (res < 0) {
+            perror("Failed to register key");
+            return i;
+        }
+    }
+    return len;
+}
+
+static ssize_t uinput_register_absaxis(const int uinputfd,
+                                       const uint16_t *axiscodes,
+                                       size_t len)
+{
+    ssize_t res;
+    res = ioctl(uinputfd, UI_SET_EVBIT, EV_ABS);
+    if (res < 0) {
+        perror("Failed to register event type for absolute axis");
+        return -1;
+    }
+    for (size_t i = 0; i < len; i++) {
+        res = ioctl(uinputfd, UI_SET_ABSBIT, axiscodes[i]);
+        if (res < 0) {
+            perror("Failed to register absolute axis");
+            return i;
+        }
+    }
+    return len;
+}
+
+static int uinput_create(const struct device_context *dev)
+{
+    int uinputfd = uinput_open(uinput_device);
+    if (uinputfd < 0) {
+        return -1;
+    }
+
+    ssize_t res;
+    if (dev->nkeys > 0) {
+        res = uinput_register_keys(uinputfd, dev->keys, dev->nkeys);
+        if (res != (ssize_t) dev->nkeys) {
+            goto failure;
+        }
+    }
+
+    res = uinput_register_absaxis(uinputfd, dev->axis, dev->naxis);
+    if (res != (ssize_t) dev->naxis) {
+        goto failure;
+    }
+
+    res = write(uinputfd, dev->dev, sizeof(struct uinput_user_dev));
+    if (res < 0) {
+        perror("Failed to register virtual device");
+        goto failure;
+    }
+
+    res = ioctl(uinputfd, UI_DEV_CREATE);
+    if (res < 0) {
+        perror("Unable to create virtual device");
+        goto failure;
+    }
+
+    return uinputfd;
+
+failure:
+    close(uinputfd);
+    return -1;
+}
+
+static void uinput_destroy(const struct device_context *dev)
+{
+    ioctl(dev->fd, UI_DEV_DESTROY);
+    close(dev->fd);
+}
+
+static ssize_t uinput_write(const struct device_context *dev,
+                            const struct input_event *events,
+                            size_t len)
+{
+    return write(dev->fd, events, len * sizeof(struct input_event));
+}
+
+const struct sink sink_uinput = {
+    .name    = "uinput",
+    .init    = uinput_init,
+    .create  = uinput_create,
+    .destroy = uinput_destroy,
+    .write   = uinput_write,
+};
@@ -0,0 +1,623 @@
+#define _GNU_SOURCE
+#include "uring.h"
+#include "ctroller.h"
+#include "devices.h"
+#include "flight.h"
+#include "logger.h"
+#include "probes.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+#include <linux/input.h>
+
+/* The io_uring backend keeps a multishot recvmsg armed on the socket, which
+ * receives packets into a ring of provided buffers. Device writes for a packet
+ * are queued as a linked chain and submitted together with the wait for the
+ * next packet, so a single io_uring_enter() replaces poll(), recvmmsg() and one
+ * write() per device.
+ */
+
+#define URING_ENTRIES 64
+#define URING_BUFFERS 64
+#define URING_BUFFER_SIZE 512
+#define URING_BUFFER_GROUP 0
+
+/* Number of device writes that can be in flight */
+#define URING_WRITES (4 * (DEVICES_COUNT + 1))
+
+/* user_data of the receive and of the poll of the wake fd; writes use their
+ * slot index + 1 */
+#define URING_RECV 0
+#define URING_WAKE (URING_WRITES + 1)
+
+struct uring_write_slot {
+    struct device_context *dev;
+    struct input_event events[DEVICE_PREPARE_MAX];
+    int busy;
+};
+
+static struct {
+    int fd;
+    int socket;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    /* Tail of the entries filled so far, published to the kernel by
+     * uring_enter() only, so it never sees an entry being filled */
+    unsigned sqe_tail;
+    /* Queued, but not yet submitted entries */
+    unsigned sq_pending;
+
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    unsigned char (*buffers)[URING_BUFFER_SIZE];
+    struct iovec iovecs[URING_BUFFERS];
+    /* Buffers holding received packets, in order of arrival */
+    uint16_t ready[URING_BUFFERS];
+    size_t nready;
+    /* Buffers handed out by uring_recv(), returned by uring_recv_done() */
+    uint16_t used[URING_BUFFERS];
+    size_t nused;
+    /* Error of the last failed receive */
+    int recv_error;
+
+    struct msghdr recv_msg;
+    int recv_armed;
+
+    /* Polled for readability, it wakes up uring_recv() */
+    int wake;
+    int wake_armed;
+    int woken;
+
+    struct uring_write_slot writes[URING_WRITES];
+    size_t next_write;
+} uring = {
+    .fd   = -1,
+    .wake = -1,
+};
+
+static int uring_enter(unsigned to_submit, unsigned min_complete)
+{
+    unsigned flags = (min_complete > 0) ? IORING_ENTER_GETEVENTS : 0;
+
+    __atomic_store_n(uring.sq_tail, uring.sqe_tail, __ATOMIC_RELEASE);
+
+    int res;
+    do {
+        res = syscall(__NR_io_uring_enter,
+                      uring.fd,
+                      to_submit,
+                      min_complete,
+                      flags,
+                      NULL,
+                      0);
+    } while (res < 0 && errno == EINTR);
+
+    if (res >= 0) {
+        uring.sq_pending -= res;
+    }
+    return res;
+}
+
+/* Make room for `count` entries in the submission queue, flushing it if it
+ * is too full */
+static int uring_reserve_sqes(unsigned count)
+{
+    unsigned head = __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE);
+    if (uring.sqe_tail - head + count > URING_ENTRIES &&
+        uring_enter(uring.sq_pending, 0) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static struct io_uring_sqe *uring_get_sqe(void)
+{
+    if (uring_reserve_sqes(1) < 0) {
+        return NULL;
+    }
+
+    unsigned index           = uring.sqe_tail & *uring.sq_mask;
+    struct io_uring_sqe *sqe = &uring.sqes[index];
+    uring.sq_array[index]    = index;
+    memset(sqe, 0, sizeof(*sqe));
+
+    uring.sqe_tail++;
+    uring.sq_pending++;
+
+    return sqe;
+}
+
+static void uring_provide_buffer(uint16_t bid, unsigned offset)
+{
+    unsigned index = (uring.buf_ring->tail + offset) & (URING_BUFFERS - 1);
+    struct io_uring_buf *buf = &uring.buf_ring->bufs[index];
+
+    buf->addr = (uint64_t)(uintptr_t) uring.buffers[bid];
+    buf->len  = URING_BUFFER_SIZE;
+    buf->bid  = bid;
+}
+
+static void uring_advance_buffers(unsigned count)
+{
+    __atomic_store_n(&uring.buf_ring->tail,
+                     uring.buf_ring->tail + count,
+                     __ATOMIC_RELEASE);
+}
+
+static int uring_arm_recv(int socket)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    if (sqe == NULL) {
+        return -1;
+    }
+
+    sqe->opcode    = IORING_OP_RECVMSG;
+    sqe->fd        = socket;
+    sqe->addr      = (uint64_t)(uintptr_t) &uring.recv_msg;
+    sqe->ioprio    = IORING_RECV_MULTISHOT;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = URING_RECV;
+
+    uring.recv_armed = 1;
+    return 0;
+}
+
+static int uring_arm_wake(void)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    if (sqe == NULL) {
+        return -1;
+    }
+
+    sqe->opcode        = IORING_OP_POLL_ADD;
+    sqe->fd            = uring.wake;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data     = URING_WAKE;
+
+    uring.wake_armed = 1;
+    return 0;
+}
+
+static int uring_map(const struct io_uring_params *params)
+{
+    uring.sq_ring_size =
+        params->sq_off.array + params->sq_entries * sizeof(unsigned);
+    uring.cq_ring_size =
+        params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+
+    if (params->features & IORING_FEAT_SINGLE_MMAP) {
+        if (uring.cq_ring_size > uring.sq_ring_size) {
+            uring.sq_ring_size = uring.cq_ring_size;
+        }
+        uring.cq_ring_size = uring.sq_ring_size;
+    }
+
+    uring.sq_ring = mmap(NULL,
+                         uring.sq_ring_size,
+                         PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE,
+                         uring.fd,
+                         IORING_OFF_SQ_RING);
+    if (uring.sq_ring == MAP_FAILED) {
+        uring.sq_ring = NULL;
+        return -1;
+    }
+
+    if (params->features & IORING_FEAT_SINGLE_MMAP) {
+        uring.cq_ring = uring.sq_ring;
+    } else {
+        uring.cq_ring = mmap(NULL,
+                             uring.cq_ring_size,
+                             PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE,
+                             uring.fd,
+                             IORING_OFF_CQ_RING);
+        if (uring.cq_ring == MAP_FAILED) {
+            uring.cq_ring = NULL;
+            return -1;
+        }
+    }
+
+    uring.sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+    uring.sqes      = mmap(NULL,
+                      uring.sqes_size,
+                      PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE,
+                      uring.fd,
+                      IORING_OFF_SQES);
+    if (uring.sqes == MAP_FAILED) {
+        uring.sqes = NULL;
+        return -1;
+    }
+
+    unsigned char *sq = uring.sq_ring;
+    uring.sq_head     = (unsigned *) (sq + params->sq_off.head);
+    uring.sq_tail     = (unsigned *) (sq + params->sq_off.tail);
+    uring.sq_mask     = (unsigned *) (sq + params->sq_off.ring_mask);
+    uring.sq_array    = (unsigned *) (sq + params->sq_off.array);
+    uring.sqe_tail    = *uring.sq_tail;
+
+    unsigned char *cq = uring.cq_ring;
+    uring.cq_head     = (unsigned *) (cq + params->cq_off.head);
+    uring.cq_tail     = (unsigned *) (cq + params->cq_off.tail);
+    uring.cq_mask     = (unsigned *) (cq + params->cq_off.ring_mask);
+    uring.cqes        = (struct io_uring_cqe *) (cq + params->cq_off.cqes);
+
+    return 0;
+}
+
+static int uring_register_buffers(void)
+{
+    uring.buf_ring_size = URING_BUFFERS * sizeof(struct io_uring_buf);
+    uring.buf_ring      = mmap(NULL,
+                          uring.buf_ring_size,
+                          PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS,
+                          -1,
+                          0);
+    if (uring.buf_ring == MAP_FAILED) {
+        uring.buf_ring = NULL;
+        return -1;
+    }
+
+    uring.buffers = mmap(NULL,
+                         URING_BUFFERS * URING_BUFFER_SIZE,
+                         PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS,
+                         -1,
+                         0);
+    if (uring.buffers == MAP_FAILED) {
+        uring.buffers = NULL;
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr    = (uint64_t)(uintptr_t) uring.buf_ring,
+        .ring_entries = URING_BUFFERS,
+        .bgid         = URING_BUFFER_GROUP,
+    };
+    if (syscall(__NR_io_uring_register,
+                uring.fd,
+                IORING_REGISTER_PBUF_RING,
+                &reg,
+                1) < 0) {
+        return -1;
+    }
+
+    for (uint16_t bid = 0; bid < URING_BUFFERS; bid++) {
+        uring_provide_buffer(bid, bid);
+    }
+    uring_advance_buffers(URING_BUFFERS);
+
+    return 0;
+}
+
+static void uring_complete_write(const struct io_uring_cqe *cqe)
+{
+    struct uring_write_slot *slot = &uring.writes[cqe->user_data - 1];
+    size_t events = (cqe->res > 0) ? cqe->res / sizeof(struct input_event) : 0;
+
+    PROBE3(write, slot->dev->name, events, cqe->res);
+    flight_write(slot->dev, events, cqe->res);
+    if (cqe->res < 0) {
+        /* Writes following a failed one in the chain are cancelled */
+        if (cqe->res != -ECANCELED) {
+            slot->dev->stats.errors++;
+            if (cqe->res == -EAGAIN) {
+                slot->dev->stats.again++;
+            }
+            logger_post(LOGGER_WRITE_ERROR, -cqe->res, slot->dev->name, 0);
+        }
+        /* The state was committed when queueing the write, resend all of it
+         * with the next one */
+        slot->dev->synced = 0;
+    } else {
+        slot->dev->stats.writes++;
+        slot->dev->stats.events += events;
+    }
+
+    slot->busy = 0;
+}
+
+static void uring_complete_recv(const struct io_uring_cqe *cqe)
+{
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        uring.recv_armed = 0;
+    }
+
+    if (cqe->res < 0) {
+        /* Running out of buffers only ends the multishot receive, it is
+         * re-armed once buffers are returned */
+        if (cqe->res != -ENOBUFS) {
+            uring.recv_error = -cqe->res;
+        }
+        return;
+    }
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        uring.ready[uring.nready++] = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    }
+}
+
+static void uring_reap(void)
+{
+    unsigned head = *uring.cq_head;
+
+    while (head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+        const struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cq_mask];
+
+        if (cqe->user_data == URING_RECV) {
+            uring_complete_recv(cqe);
+        } else if (cqe->user_data == URING_WAKE) {
+            uring.wake_armed = 0;
+            uring.woken      = 1;
+        } else {
+            uring_complete_write(cqe);
+        }
+        head++;
+    }
+
+    __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Hand out up to `len` received packets in `msgs` */
+static size_t uring_take(struct mmsghdr *msgs, size_t len)
+{
+    size_t n = (uring.nready < len) ? uring.nready : len;
+
+    for (size_t i = 0; i < n; i++) {
+        uint16_t bid                           = uring.ready[i];
+        unsigned char *buf                     = uring.buffers[bid];
+        const struct io_uring_recvmsg_out *out = (void *) buf;
+
+        unsigned char *name    = buf + sizeof(*out);
+        unsigned char *payload = name + uring.recv_msg.msg_namelen +
+                                 uring.recv_msg.msg_controllen;
+
+        uring.iovecs[bid].iov_base = payload;
+        uring.iovecs[bid].iov_len  = out->payloadlen;
+
+        msgs[i].msg_hdr = (struct msghdr){
+            .msg_name    = name,
+            .msg_namelen = (out->namelen < uring.recv_msg.msg_namelen)
+                               ? out->namelen
+                               : uring.recv_msg.msg_namelen,
+            .msg_iov        = &uring.iovecs[bid],
+            .msg_iovlen     = 1,
+            .msg_control    = name + uring.recv_msg.msg_namelen,
+            .msg_controllen = out->controllen,
+            .msg_flags      = out->flags,
+        };
+        msgs[i].msg_len = out->payloadlen;
+
+        uring.used[uring.nused++] = bid;
+    }
+
+    uring.nready -= n;
+    memmove(uring.ready, &uring.ready[n], uring.nready * sizeof(*uring.ready));
+
+    return n;
+}
+
+int uring_init(int socket, int wake)
+{
+    struct io_uring_params params = {};
+
+    uring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (uring.fd < 0) {
+        perror("io_uring_setup");
+        return -1;
+    }
+
+    if (uring_map(&params) < 0) {
+        perror("Failed to map io_uring");
+        goto failure;
+    }
+
+    if (uring_register_buffers() < 0) {
+        perror("Failed to register io_uring buffers");
+        goto failure;
+    }
+
+    uring.recv_msg = (struct msghdr){
+        .msg_namelen    = sizeof(struct sockaddr_storage),
+        .msg_controllen = CTROLLER_CONTROL_SIZE,
+    };
+    uring.socket = socket;
+    uring.wake   = wake;
+
+    /* Unsupported receives fail during submission, check for that now */
+    if (uring_arm_recv(socket) < 0 || uring_enter(uring.sq_pending, 0) < 0) {
+        perror("Failed to arm io_uring receive");
+        goto failure;
+    }
+    uring_reap();
+    if (uring.recv_error != 0) {
+        fprintf(stderr,
+                "Multishot receive not supported: %s\n",
+                strerror(uring.recv_error));
+        goto failure;
+    }
+
+    return 0;
+
+failure:
+    uring_exit();
+    return -1;
+}
+
+void uring_exit(void)
+{
+    if (uring.sqes != NULL) {
+        munmap(uring.sqes, uring.sqes_size);
+        uring.sqes = NULL;
+    }
+    if (uring.cq_ring != NULL && uring.cq_ring != uring.sq_ring) {
+        munmap(uring.cq_ring, uring.cq_ring_size);
+    }
+    uring.cq_ring = NULL;
+    if (uring.sq_ring != NULL) {
+        munmap(uring.sq_ring, uring.sq_ring_size);
+        uring.sq_ring = NULL;
+    }
+    if (uring.fd >= 0) {
+        close(uring.fd);
+        uring.fd = -1;
+    }
+    if (uring.buffers != NULL) {
+        munmap(uring.buffers, URING_BUFFERS * URING_BUFFER_SIZE);
+        uring.buffers = NULL;
+    }
+    if (uring.buf_ring != NULL) {
+        munmap(uring.buf_ring, uring.buf_ring_size);
+        uring.buf_ring = NULL;
+    }
+
+    uring.sqe_tail   = 0;
+    uring.sq_pending = 0;
+    uring.recv_armed = 0;
+    uring.recv_error = 0;
+    uring.wake       = -1;
+    uring.wake_armed = 0;
+    uring.woken      = 0;
+    uring.nready     = 0;
+    uring.nused      = 0;
+    uring.next_write = 0;
+    memset(uring.writes, 0, sizeof(uring.writes));
+}
+
+int uring_recv(struct mmsghdr *msgs, size_t len, int wait)
+{
+    /* Submit queued writes, and wait for a packet if none is ready yet */
+    uring.woken = 0;
+    uring_reap();
+    while (uring.sq_pending > 0 || (wait && uring.nready == 0)) {
+        if (uring.recv_error != 0 || (uring.woken && uring.nready == 0)) {
+            break;
+        }
+
+        unsigned min_complete = 0;
+        if (wait && uring.nready == 0) {
+            if (!uring.recv_armed && uring_arm_recv(uring.socket) < 0) {
+                return -1;
+            }
+            if (!uring.wake_armed && uring_arm_wake() < 0) {
+                return -1;
+            }
+            min_complete = 1;
+        }
+
+        if (uring_enter(uring.sq_pending, min_complete) < 0) {
+            return -1;
+        }
+        uring_reap();
+    }
+
+    if (uring.nready == 0 && uring.recv_error != 0) {
+        errno            = uring.recv_error;
+        uring.recv_error = 0;
+        return -1;
+    }
+
+    return uring_take(msgs, len);
+}
+
+void uring_recv_done(void)
+{
+    for (size_t i = 0; i < uring.nused; i++) {
+        uring_provide_buffer(uring.used[i], i);
+    }
+    uring_advance_buffers(uring.nused);
+    uring.nused = 0;
+
+    if (!uring.recv_armed) {
+        uring_arm_recv(uring.socket);
+    }
+}
+
+/* Queue a linked chain of writes to `devices`. The writes are submitted with
+ * the next call to uring_recv().
+ */
+int uring_write(struct device_context **devices,
+                size_t len,
+                const struct hidinfo *hid)
+{
+    /* Slots and entries are reserved up front: nothing may be submitted while
+     * the chain is built, or a link would be set on an entry the kernel
+     * already consumed */
+    for (size_t i = 0; i < len; i++) {
+        struct uring_write_slot *slot =
+            &uring.writes[(uring.next_write + i) % URING_WRITES];
+
+        /* All slots in flight, submit and wait for this one to finish */
+        while (slot->busy) {
+            if (uring_enter(uring.sq_pending, 1) < 0) {
+                return -1;
+            }
+            uring_reap();
+        }
+    }
+    if (uring_reserve_sqes(len) < 0) {
+        return -1;
+    }
+
+    struct io_uring_sqe *prev = NULL;
+    for (size_t i = 0; i < len; i++) {
+        struct uring_write_slot *slot = &uring.writes[uring.next_write];
+        size_t n = device_prepare(devices[i], hid, slot->events);
+        if (n == 0) {
+            continue;
+        }
+
+        struct io_uring_sqe *sqe = uring_get_sqe();
+        if (sqe == NULL) {
+            return -1;
+        }
+
+        sqe->opcode    = IORING_OP_WRITE;
+        sqe->fd        = devices[i]->fd;
+        sqe->addr      = (uint64_t)(uintptr_t) slot->events;
+        sqe->len       = n * sizeof(struct input_event);
+        sqe->off       = (uint64_t) -1;
+        sqe->user_data = uring.next_write + 1;
+
+        if (prev != NULL) {
+            prev->flags |= IOSQE_IO_LINK;
+        }
+        prev = sqe;
+
+        slot->dev        = devices[i];
+        slot->busy       = 1;
+        uring.next_write = (uring.next_write + 1) % URING_WRITES;
+
+        /* Later packets are prepared against this state before the write
+         * completes; a failed write makes the device resync. */
+        device_commit(devices[i], hid);
+    }
+
+    return 0;
+}
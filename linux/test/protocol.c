@@ -0,0 +1,352 @@
+/*
+ *  ctroller -- use your 3DS as a gamepad on your PC
+ *  Copyright (C) 2016  Philipp Joram (phijor)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Round trips through the shared wire format in common/protocol.c: v1
+ * packets, the differences of v2 packets, their varints and motion batches.
+ * Truncated input must be rejected rather than read past its end.
+ */
+
+#include <string.h>
+
+#include "ctroller.h"
+#include "packet.h"
+#include "test.h"
+
+static const struct protocol_motion_layout motion_layout =
+    PROTOCOL_MOTION_LAYOUT(struct packet_motion);
+
+/* Edges of the range of a 16-bit value, and the values around 0 */
+static const int16_t edges[] = {0, 1, -1, 32767, -32767, -32768};
+
+static void random_state(struct hidinfo *hid)
+{
+    memset(hid, 0, sizeof(*hid));
+    hid->version = CTROLLER_VERSION;
+    for (size_t k = 0; k < PROTOCOL_KEYS_COUNT; k++) {
+        protocol_set_key(
+            hid, packet_layout.keys[k], (uint32_t) rand() << 16 ^ rand());
+    }
+    for (size_t k = 0; k < PROTOCOL_VALUES_COUNT; k++) {
+        protocol_set_value(hid, packet_layout.values[k], rand());
+    }
+}
+
+/* Whether the keys and values of `a` and `b` match */
+static int same_state(const struct hidinfo *a, const struct hidinfo *b)
+{
+    for (size_t k = 0; k < PROTOCOL_KEYS_COUNT; k++) {
+        size_t offset = packet_layout.keys[k];
+        if (protocol_key(a, offset) != protocol_key(b, offset)) {
+            return 0;
+        }
+    }
+    for (size_t k = 0; k < PROTOCOL_VALUES_COUNT; k++) {
+        size_t offset = packet_layout.values[k];
+        if (protocol_value(a, offset) != protocol_value(b, offset)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void test_v1(void)
+{
+    for (int i = 0; i < 1000; i++) {
+        struct hidinfo hid, unpacked = {}, vector = {};
+        random_state(&hid);
+
+        unsigned char buf[PACKET_V1_SIZE];
+        check(protocol_pack_v1(&packet_layout, &hid, hid.version, buf) ==
+              PACKET_V1_SIZE);
+        check(protocol_revision(buf, sizeof(buf)) == PACKET_PROTOCOL_V1);
+        check(protocol_unpack_v1(&packet_layout, buf, &unpacked) ==
+              PACKET_V1_SIZE);
+        check(same_state(&hid, &unpacked));
+
+        check(packet_v1_unpack(buf, sizeof(buf), &vector) == PACKET_V1_SIZE);
+        check(same_state(&hid, &vector) && vector.version == hid.version);
+
+        check(packet_v1_unpack(buf, sizeof(buf) - 1, &vector) == PACKET_ESIZE);
+
+        /* Coalesced packets only have their keys read */
+        struct hidinfo keys = {};
+        int used = protocol_unpack_v1_keys(&packet_layout,
+                                           buf,
+                                           sizeof(buf),
+                                           &keys);
+        check(used == 2 * 2 + PROTOCOL_KEYS_COUNT * 4);
+        for (size_t k = 0; k < PROTOCOL_KEYS_COUNT; k++) {
+            size_t offset = packet_layout.keys[k];
+            check(protocol_key(&keys, offset) == protocol_key(&hid, offset));
+        }
+        for (size_t k = 0; k < PROTOCOL_VALUES_COUNT; k++) {
+            check(protocol_value(&keys, packet_layout.values[k]) == 0);
+        }
+        check(protocol_unpack_v1_keys(
+                  &packet_layout, buf, sizeof(buf) - 1, &keys) == PACKET_ESIZE);
+
+        keys = (struct hidinfo){};
+        check(ctroller_unpack_hid_keys(buf, sizeof(buf), &keys) == used);
+        check(keys.keys.up == hid.keys.up && keys.keys.down == hid.keys.down);
+    }
+}
+
+static void test_varint(void)
+{
+    for (size_t i = 0; i < sizeof(edges) / sizeof(edges[0]); i++) {
+        unsigned char buf[4];
+        unsigned char *end = protocol_put_varint(buf, edges[i]);
+        check(end - buf >= 1 && end - buf <= 3);
+
+        int16_t value = 0;
+        check(protocol_get_varint(buf, end, &value) == end);
+        check(value == edges[i]);
+        check(protocol_get_varint(buf, end - 1, &value) == NULL);
+    }
+
+    /* A zero difference takes a single byte, the largest ones three */
+    unsigned char buf[4];
+    check(protocol_put_varint(buf, 0) == buf + 1);
+    check(protocol_put_varint(buf, -32768) == buf + 3);
+
+    /* More than three bytes would not fit 16 bits */
+    const unsigned char overlong[] = {0x80, 0x80, 0x80, 0x00};
+    int16_t value;
+    check(protocol_get_varint(overlong, overlong + sizeof(overlong), &value) ==
+          NULL);
+}
+
+/* Pack the differences of `hid` to `base`, unpack them onto `base` again and
+ * check every truncation of them */
+static void round_trip_values(const struct hidinfo *hid,
+                              const struct hidinfo *base)
+{
+    struct protocol_state values;
+    protocol_get_state(&packet_layout, base, &values);
+
+    unsigned char buf[PROTOCOL_VALUES_COUNT * 3];
+    unsigned fields    = 0;
+    unsigned char *end = protocol_pack_values(
+        &packet_layout, hid, &values, buf, &fields);
+
+    struct hidinfo unpacked = *base;
+    unpacked.keys           = hid->keys;
+    check(protocol_unpack_values(
+              &packet_layout, buf, end, fields, &unpacked) == end);
+    check(same_state(hid, &unpacked));
+    check(protocol_skip_values(buf, end, fields) == end);
+
+    for (unsigned char *cut = buf; cut < end; cut++) {
+        struct hidinfo truncated = *base;
+        check(protocol_unpack_values(
+                  &packet_layout, buf, cut, fields, &truncated) == NULL);
+        check(protocol_skip_values(buf, cut, fields) == NULL);
+    }
+}
+
+static void test_values(void)
+{
+    struct hidinfo hid, base;
+    random_state(&base);
+
+    /* Nothing changed, nothing is sent */
+    struct protocol_state values;
+    protocol_get_state(&packet_layout, &base, &values);
+    unsigned char buf[PROTOCOL_VALUES_COUNT * 3];
+    unsigned fields = 0;
+    check(protocol_pack_values(&packet_layout, &base, &values, buf, &fields) ==
+          buf);
+    check(fields == 0);
+
+    for (int i = 0; i < 1000; i++) {
+        random_state(&hid);
+        random_state(&base);
+        round_trip_values(&hid, &base);
+    }
+
+    /* The largest differences in either direction */
+    for (size_t i = 0; i < sizeof(edges) / sizeof(edges[0]); i++) {
+        for (size_t j = 0; j < sizeof(edges) / sizeof(edges[0]); j++) {
+            for (size_t k = 0; k < PROTOCOL_VALUES_COUNT; k++) {
+                protocol_set_value(&hid, packet_layout.values[k], edges[i]);
+                protocol_set_value(&base, packet_layout.values[k], edges[j]);
+            }
+            round_trip_values(&hid, &base);
+        }
+    }
+}
+
+static void test_motion(void)
+{
+    struct hidinfo hid;
+    random_state(&hid);
+    hid.sample = 1000000;
+
+    struct packet_motion motion[PACKET_MOTION_MAX];
+    for (size_t i = 0; i < PACKET_MOTION_MAX; i++) {
+        motion[i].sample = hid.sample - (PACKET_MOTION_MAX - i) * 2000;
+        for (size_t k = 0; k < PROTOCOL_MOTION_COUNT; k++) {
+            protocol_set_value(&motion[i], motion_layout.values[k], rand());
+        }
+    }
+    protocol_set_value(&motion[0], motion_layout.values[0], 32767);
+    protocol_set_value(&motion[1], motion_layout.values[0], -32768);
+
+    unsigned char buf[PACKET_V2_MAX_SIZE];
+    unsigned char *end = protocol_pack_motion(&packet_layout,
+                                              &motion_layout,
+                                              &hid,
+                                              hid.sample,
+                                              motion,
+                                              PACKET_MOTION_MAX,
+                                              buf);
+    check(end > buf);
+
+    struct packet_motion unpacked[PACKET_MOTION_MAX] = {};
+    check(protocol_unpack_motion(&packet_layout,
+                                 &motion_layout,
+                                 &hid,
+                                 hid.sample,
+                                 buf,
+                                 end,
+                                 unpacked) == PACKET_MOTION_MAX);
+    check(memcmp(unpacked, motion, sizeof(motion)) == 0);
+
+    /* No batch at all is fine, part of one is not */
+    check(protocol_unpack_motion(&packet_layout,
+                                 &motion_layout,
+                                 &hid,
+                                 hid.sample,
+                                 buf,
+                                 buf,
+                                 unpacked) == 0);
+    for (unsigned char *cut = buf + 1; cut < end; cut++) {
+        check(protocol_unpack_motion(&packet_layout,
+                                     &motion_layout,
+                                     &hid,
+                                     hid.sample,
+                                     buf,
+                                     cut,
+                                     unpacked) == PACKET_ESIZE);
+    }
+
+    /* More samples than a batch holds */
+    buf[0] = PACKET_MOTION_MAX + 1;
+    check(protocol_unpack_motion(&packet_layout,
+                                 &motion_layout,
+                                 &hid,
+                                 hid.sample,
+                                 buf,
+                                 end,
+                                 unpacked) == PACKET_ESIZE);
+
+    /* Samples too old for their age field are left out */
+    motion[0].sample = hid.sample - PACKET_MOTION_AGE - 1;
+    end              = protocol_pack_motion(&packet_layout,
+                                            &motion_layout,
+                                            &hid,
+                                            hid.sample,
+                                            motion,
+                                            PACKET_MOTION_MAX,
+                                            buf);
+    check(buf[0] == PACKET_MOTION_MAX - 1);
+    check(protocol_unpack_motion(&packet_layout,
+                                 &motion_layout,
+                                 &hid,
+                                 hid.sample,
+                                 buf,
+                                 end,
+                                 unpacked) == PACKET_MOTION_MAX - 1);
+    check(memcmp(unpacked, &motion[1], sizeof(motion[1])) == 0);
+}
+
+static void test_clock(void)
+{
+    struct protocol_clock clock = {};
+    struct protocol_clock_sample estimate;
+    unsigned char probe[PACKET_V2_PROBE_SIZE];
+    unsigned char echo[PACKET_V2_ECHO_SIZE];
+
+    check(packet_v2_pack_probe(&clock, 1000, probe) == sizeof(probe));
+    check(packet_v2_unpack_probe(probe, sizeof(probe), &estimate) == 0);
+    check(estimate.rtt == PACKET_CLOCK_UNKNOWN);
+    check(clock.pending && clock.sent == 1000);
+
+    /* 300 us on the way there, 100 on the server and 300 on the way back,
+     * with the server clock 5000 us ahead */
+    check(packet_v2_pack_echo(probe, 6300, 6400, echo) == sizeof(echo));
+    check(protocol_unpack_report(echo, sizeof(echo), NULL) < 0);
+    check(protocol_update_clock(&clock, echo, sizeof(echo) - 1, 1700) < 0);
+    check(protocol_update_clock(&clock, echo, sizeof(echo), 1700) == 0);
+    check(!clock.pending && clock.count == 1);
+    check(clock.estimate.rtt == 600 && clock.estimate.offset == 5000);
+
+    /* A repeated echo is not taken again */
+    check(protocol_update_clock(&clock, echo, sizeof(echo), 1900) == 0);
+    check(clock.count == 1);
+
+    /* A slower exchange is kept, but not used as the estimate */
+    check(packet_v2_pack_probe(&clock, 2000, probe) == sizeof(probe));
+    check(packet_v2_unpack_probe(probe, sizeof(probe), &estimate) == 0);
+    check(estimate.rtt == 600 && estimate.offset == 5000);
+    check(packet_v2_pack_echo(probe, 7500, 7500, echo) == sizeof(echo));
+    check(protocol_update_clock(&clock, echo, sizeof(echo), 3000) == 0);
+    check(clock.count == 2 && clock.samples[1].rtt == 1000);
+    check(clock.estimate.rtt == 600);
+}
+
+static void test_report(void)
+{
+    struct packet_sequence seq = {
+        .received = 1000,
+        .lost     = 20,
+        .jitter   = 16 * 300,
+        .queue    = 4000,
+    };
+    struct ratectl_report report;
+    unsigned char buf[PACKET_V2_REPORT_SIZE];
+
+    check(packet_v2_pack_report(7, &seq, buf) == sizeof(buf));
+    check(seq.queue == 0);
+    check(protocol_unpack_report(buf, sizeof(buf) - 1, &report) ==
+          PACKET_EMAGIC);
+    check(protocol_unpack_report(buf, sizeof(buf), &report) == 0);
+    check(report.received == 1000 && report.lost == 20);
+    check(report.jitter == 300 && report.queue == 4000);
+
+    /* Reports are not echoes or acks */
+    struct protocol_clock clock = {.pending = 1};
+    check(protocol_update_clock(&clock, buf, sizeof(buf), 0) < 0);
+    check(packet_v2_pack_ack(7, buf) == PACKET_V2_ACK_SIZE);
+    check(protocol_unpack_report(buf, PACKET_V2_ACK_SIZE, &report) < 0);
+}
+
+int main(void)
+{
+    srand(1);
+    packet_init();
+
+    test_v1();
+    test_varint();
+    test_values();
+    test_motion();
+    test_clock();
+    test_report();
+
+    return test_exit("protocol");
+}
@@ -0,0 +1,190 @@
+/*
+ *  ctroller -- use your 3DS as a gamepad on your PC
+ *  Copyright (C) 2016  Philipp Joram (phijor)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Report sequences of clean, lossy, congested and reordered links fed to the
+ * rate control in common/ratectl.c. The rate and redundancy must follow the
+ * link and never leave their range.
+ */
+
+#include "ratectl.h"
+#include "test.h"
+
+#define RATE_MIN 10
+#define RATE_MAX 60
+#define REDUNDANCY_MIN 1
+#define REDUNDANCY_MAX 8
+
+/* Enough reports to run any of the ranges from one end to the other */
+#define REPORTS 64
+
+/* Jitter of all reports, and the queueing delay just below congestion */
+#define JITTER 500
+#define QUEUE_MAX (RATECTL_QUEUE_MIN + RATECTL_QUEUE_JITTER * JITTER)
+
+static void start(struct ratectl *ctl, struct ratectl_report *report)
+{
+    ratectl_init(ctl, RATE_MIN, RATE_MAX, REDUNDANCY_MIN, REDUNDANCY_MAX);
+    check(ctl->rate == RATE_MAX && ctl->redundancy == REDUNDANCY_MAX);
+
+    *report = (struct ratectl_report){.jitter = JITTER};
+    check(ratectl_update(ctl, report) == RATECTL_UNKNOWN);
+}
+
+/* Report `received` and `lost` more packets and a peak queueing delay of
+ * `queue`. Returns the state of the link. */
+static enum ratectl_link feed(struct ratectl *ctl,
+                              struct ratectl_report *report,
+                              uint32_t received,
+                              int32_t lost,
+                              uint32_t queue)
+{
+    report->received += received;
+    report->lost += lost;
+    report->queue = queue;
+
+    enum ratectl_link link = ratectl_update(ctl, report);
+    check(ctl->link == link);
+    check(ctl->rate >= RATE_MIN && ctl->rate <= RATE_MAX);
+    check(ctl->redundancy >= REDUNDANCY_MIN &&
+          ctl->redundancy <= REDUNDANCY_MAX);
+    return link;
+}
+
+static void test_clean(void)
+{
+    struct ratectl ctl;
+    struct ratectl_report report;
+    start(&ctl, &report);
+
+    /* Only every RATECTL_CLEAN_REPORTS-th report lowers the redundancy */
+    for (unsigned i = 1; i < RATECTL_CLEAN_REPORTS; i++) {
+        check(feed(&ctl, &report, 60, 0, 0) == RATECTL_CLEAN);
+        check(ctl.redundancy == REDUNDANCY_MAX);
+    }
+    check(feed(&ctl, &report, 60, 0, 0) == RATECTL_CLEAN);
+    check(ctl.redundancy == REDUNDANCY_MAX - 1);
+
+    for (unsigned i = 0; i < REPORTS; i++) {
+        check(feed(&ctl, &report, 60, 0, QUEUE_MAX) == RATECTL_CLEAN);
+    }
+    check(ctl.rate == RATE_MAX && ctl.redundancy == REDUNDANCY_MIN);
+
+    /* Nothing received since the last report says nothing about the link */
+    check(feed(&ctl, &report, 0, 0, 0) == RATECTL_UNKNOWN);
+    check(ctl.rate == RATE_MAX && ctl.redundancy == REDUNDANCY_MIN);
+}
+
+static void test_lossy(void)
+{
+    struct ratectl ctl;
+    struct ratectl_report report;
+    start(&ctl, &report);
+
+    for (unsigned i = 0; i < REPORTS; i++) {
+        feed(&ctl, &report, 60, 0, 0);
+    }
+    check(ctl.redundancy == REDUNDANCY_MIN);
+
+    /* Loss just above RATECTL_LOSS_LOSSY without queueing raises the
+     * redundancy, but keeps the rate */
+    uint32_t received = 1000 - RATECTL_LOSS_LOSSY - 1;
+    for (unsigned i = 0; i < REPORTS; i++) {
+        check(feed(&ctl, &report, received, RATECTL_LOSS_LOSSY + 1, 0) ==
+              RATECTL_LOSSY);
+    }
+    check(ctl.rate == RATE_MAX && ctl.redundancy == REDUNDANCY_MAX);
+
+    /* Loss up to RATECTL_LOSS_LOSSY changes nothing */
+    received = 1000 - RATECTL_LOSS_LOSSY;
+    for (unsigned i = 0; i < REPORTS; i++) {
+        check(feed(&ctl, &report, received, RATECTL_LOSS_LOSSY, 0) ==
+              RATECTL_STEADY);
+    }
+    check(ctl.rate == RATE_MAX && ctl.redundancy == REDUNDANCY_MAX);
+}
+
+static void test_congested(void)
+{
+    struct ratectl ctl;
+    struct ratectl_report report;
+    start(&ctl, &report);
+
+    /* Queueing beyond the jitter cuts the rate down to its minimum */
+    unsigned rate = ctl.rate;
+    for (unsigned i = 0; i < REPORTS; i++) {
+        check(feed(&ctl, &report, 60, 0, QUEUE_MAX + 1) == RATECTL_CONGESTED);
+        check(ctl.rate <= rate);
+        rate = ctl.rate;
+    }
+    check(ctl.rate == RATE_MIN && ctl.redundancy == REDUNDANCY_MAX);
+
+    /* So does heavy loss without queueing */
+    start(&ctl, &report);
+    uint32_t received = 1000 - RATECTL_LOSS_CONGESTED - 1;
+    for (unsigned i = 0; i < REPORTS; i++) {
+        check(feed(&ctl, &report, received, RATECTL_LOSS_CONGESTED + 1, 0) ==
+              RATECTL_CONGESTED);
+    }
+    check(ctl.rate == RATE_MIN && ctl.redundancy == REDUNDANCY_MAX);
+
+    /* A clean link recovers the full rate, and does not go beyond it */
+    for (unsigned i = 0; i < REPORTS; i++) {
+        check(feed(&ctl, &report, 60, 0, 0) == RATECTL_CLEAN);
+        check(ctl.rate >= rate);
+        rate = ctl.rate;
+    }
+    check(ctl.rate == RATE_MAX && ctl.redundancy == REDUNDANCY_MIN);
+}
+
+static void test_reordered(void)
+{
+    struct ratectl ctl;
+    struct ratectl_report report;
+    start(&ctl, &report);
+
+    /* Packets the server counted as lost arrive late, so the lost counter
+     * goes backwards. That is no loss, and no huge one either. */
+    for (unsigned i = 0; i < REPORTS; i++) {
+        check(feed(&ctl, &report, 60, (i % 2) ? -3 : 3, 0) !=
+              RATECTL_CONGESTED);
+    }
+    check(ctl.rate == RATE_MAX);
+    check(feed(&ctl, &report, 60, -3, 0) == RATECTL_CLEAN);
+
+    /* The counters wrap around */
+    ratectl_init(&ctl, RATE_MIN, RATE_MAX, REDUNDANCY_MIN, REDUNDANCY_MAX);
+    report = (struct ratectl_report){
+        .received = UINT32_MAX - 10,
+        .lost     = UINT32_MAX - 1,
+        .jitter   = JITTER,
+    };
+    check(ratectl_update(&ctl, &report) == RATECTL_UNKNOWN);
+    check(feed(&ctl, &report, 60, 0, 0) == RATECTL_CLEAN);
+    check(feed(&ctl, &report, 600, 2, 0) == RATECTL_STEADY);
+    check(feed(&ctl, &report, 60, -2, 0) == RATECTL_CLEAN);
+}
+
+int main(void)
+{
+    test_clean();
+    test_lossy();
+    test_congested();
+    test_reordered();
+
+    return test_exit("ratectl");
+}
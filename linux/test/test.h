@@ -0,0 +1,57 @@
+/*
+ *  ctroller -- use your 3DS as a gamepad on your PC
+ *  Copyright (C) 2016  Philipp Joram (phijor)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Checks shared by the unit tests in this directory. Each test is a program
+ * of its own, built and run by `make test`; it keeps going after a failed
+ * check and exits with EXIT_FAILURE if there was any.
+ */
+
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static int test_failures;
+
+/* Report `cond` if it does not hold */
+#define check(cond)                                                            \
+    do {                                                                       \
+        if (!(cond)) {                                                         \
+            fprintf(stderr,                                                    \
+                    "%s:%d: %s: check failed: %s\n",                           \
+                    __FILE__,                                                  \
+                    __LINE__,                                                  \
+                    __func__,                                                  \
+                    #cond);                                                    \
+            test_failures++;                                                   \
+        }                                                                      \
+    } while (0)
+
+/* Exit status of a test program named `name` */
+static inline int test_exit(const char *name)
+{
+    if (test_failures != 0) {
+        printf("%s: %d checks failed\n", name, test_failures);
+        return EXIT_FAILURE;
+    }
+    printf("%s: ok\n", name);
+    return EXIT_SUCCESS;
+}
+
+#endif /* ----- #ifndef TEST_H  ----- */
@@ -0,0 +1,939 @@
+/*
+ *  ctroller -- use your 3DS as a gamepad on your PC
+ *  Copyright (C) 2016  Philipp Joram (phijor)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Software client: simulates one or more consoles sending scripted or random
+ * input to a ctroller server, to load-test it without a 3DS.
+ */
+
+#define _GNU_SOURCE
+#include <features.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include "ctroller.h"
+#include "devices.h"
+#include "hid.h"
+#include "packet.h"
+#include "ratectl.h"
+
+/* Smallest analog changes sent right away with --event, like on the 3DS */
+#define EVENT_THRESHOLD_STICK 2
+#define EVENT_THRESHOLD_TOUCH 1
+#define EVENT_THRESHOLD_GYRO 16
+#define EVENT_THRESHOLD_ACCEL 4
+
+/* A line of a script: the state of the console, held for some frames */
+struct script_step {
+    unsigned frames;
+    struct hidinfo hid;
+};
+
+static struct {
+    struct script_step *steps;
+    size_t len;
+} script;
+
+struct console {
+    int socket;
+    unsigned seed;
+    struct hidinfo hid;
+    size_t step;    /* current step of the script */
+    unsigned frame; /* frames the current step has been held for */
+    uint32_t keys;  /* keys held in the next packet */
+    struct protocol_encoder encoder;
+    struct protocol_clock clock;
+    uint64_t probe_at; /* time the next clock probe is due, in ns */
+    struct ratectl ratectl;
+    unsigned credit;   /* of ratectl_due() */
+    uint32_t down, up; /* key edges of the frames not sent yet */
+    struct hidinfo last; /* state sent last */
+    uint64_t sent_at;    /* time it was sent, in ns */
+    int settling;        /* whether it carried a change */
+    /* Motion sensors sampled between the frames, for the next packet */
+    struct packet_motion motion[PACKET_MOTION_MAX];
+    size_t nmotion;
+    uint32_t sampled; /* time of the last frame, in us */
+};
+
+struct counters {
+    unsigned long sent;   /* packets handed to the kernel */
+    unsigned long errors; /* packets send() failed for */
+    unsigned long late;   /* ticks skipped to catch up with the schedule */
+    unsigned long drops;  /* UDP receive buffer errors on this host */
+    unsigned long bytes;  /* payload bytes of the packets sent */
+    unsigned long acks;   /* keyframe acknowledgements received */
+    unsigned long echoes; /* echoes of clock probes received in time */
+    unsigned long rtt;    /* summed round-trip times of the echoes, in us */
+    /* Reports of the server by the state of the link, enum ratectl_link */
+    unsigned long links[RATECTL_CONGESTED + 1];
+};
+
+static struct {
+    const char *host;
+    const char *port;
+    size_t consoles;
+    double rate;
+    double duration;
+    double interval;
+    unsigned seed;
+    const char *script;
+    int protocol;
+    int adaptive;
+    int event;
+    unsigned motion;
+} options = {
+    .host     = "localhost",
+    .port     = PORT_DEFAULT,
+    .consoles = 1,
+    .rate     = 60.0,
+    .duration = 10.0,
+    .interval = 1.0,
+    .seed     = 1,
+    .script   = NULL,
+    .protocol = 2,
+};
+
+static volatile sig_atomic_t terminate;
+
+static void on_terminate(int signum)
+{
+    (void) signum;
+    terminate = 1;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// clang-format off
+static const struct {
+    const char *name;
+    uint32_t key;
+} key_names[] = {
+    {"A",      HID_KEY_A},
+    {"B",      HID_KEY_B},
+    {"X",      HID_KEY_X},
+    {"Y",      HID_KEY_Y},
+    {"L",      HID_KEY_L},
+    {"R",      HID_KEY_R},
+    {"ZL",     HID_KEY_ZL},
+    {"ZR",     HID_KEY_ZR},
+    {"START",  HID_KEY_START},
+    {"SELECT", HID_KEY_SELECT},
+    {"UP",     HID_KEY_DUP},
+    {"DOWN",   HID_KEY_DDOWN},
+    {"LEFT",   HID_KEY_DLEFT},
+    {"RIGHT",  HID_KEY_DRIGHT},
+    {"TOUCH",  HID_KEY_TOUCH},
+};
+// clang-format on
+
+static int script_parse_token(const char *token, struct hidinfo *hid)
+{
+    int x, y, z;
+
+    if (sscanf(token, "cp=%d,%d", &x, &y) == 2) {
+        hid->circlepad.dx = x;
+        hid->circlepad.dy = y;
+    } else if (sscanf(token, "cs=%d,%d", &x, &y) == 2) {
+        hid->cstick.dx = x;
+        hid->cstick.dy = y;
+    } else if (sscanf(token, "touch=%d,%d", &x, &y) == 2) {
+        hid->keys.held |= HID_KEY_TOUCH;
+        hid->touchscreen.px = x;
+        hid->touchscreen.py = y;
+    } else if (sscanf(token, "gyro=%d,%d,%d", &x, &y, &z) == 3) {
+        hid->gyro.x = x;
+        hid->gyro.y = y;
+        hid->gyro.z = z;
+    } else if (sscanf(token, "accel=%d,%d,%d", &x, &y, &z) == 3) {
+        hid->accel.x = x;
+        hid->accel.y = y;
+        hid->accel.z = z;
+    } else {
+        for (size_t i = 0; i < arrsize(key_names); i++) {
+            if (strcasecmp(token, key_names[i].name) == 0) {
+                hid->keys.held |= key_names[i].key;
+                return 0;
+            }
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/* Scripts consist of lines of the form
+ *
+ *     <frames> [<key>...] [cp=<dx>,<dy>] [cs=<dx>,<dy>] [touch=<x>,<y>]
+ *              [gyro=<x>,<y>,<z>] [accel=<x>,<y>,<z>]
+ *
+ * each holding that state for a number of frames. Everything after a '#' is
+ * ignored. The script is repeated until the client stops.
+ */
+static int script_load(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Error opening '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    char *line    = NULL;
+    size_t size   = 0;
+    size_t lineno = 0;
+    int res       = -1;
+
+    while (getline(&line, &size, fp) != -1) {
+        lineno++;
+        line[strcspn(line, "#\n")] = '\0';
+
+        char *save;
+        char *token = strtok_r(line, " \t", &save);
+        if (token == NULL) {
+            continue;
+        }
+
+        struct script_step step = {.hid = {.version = CTROLLER_VERSION}};
+        char *end;
+        step.frames = strtoul(token, &end, 0);
+        if (*end != '\0' || step.frames == 0) {
+            fprintf(stderr, "%s:%zu: Invalid frame count.\n", path, lineno);
+            goto out;
+        }
+
+        while ((token = strtok_r(NULL, " \t", &save)) != NULL) {
+            if (script_parse_token(token, &step.hid) < 0) {
+                fprintf(stderr,
+                        "%s:%zu: Invalid token '%s'.\n",
+                        path,
+                        lineno,
+                        token);
+                goto out;
+            }
+        }
+
+        struct script_step *steps =
+            realloc(script.steps, (script.len + 1) * sizeof(*steps));
+        if (steps == NULL) {
+            perror("Allocating script");
+            goto out;
+        }
+        script.steps               = steps;
+        script.steps[script.len++] = step;
+    }
+
+    if (script.len == 0) {
+        fprintf(stderr, "'%s' does not contain any steps.\n", path);
+        goto out;
+    }
+    res = 0;
+
+out:
+    free(line);
+    fclose(fp);
+    return res;
+}
+
+static int16_t walk(unsigned *seed, int16_t val, int step, int min, int max)
+{
+    int res = val + (rand_r(seed) % (2 * step + 1)) - step;
+    return (res < min) ? min : (res > max) ? max : res;
+}
+
+/* Random input resembling a player: buttons are pressed every few frames,
+ * sticks and motion sensors drift and the touchscreen is used occasionally.
+ */
+static void console_random(struct console *con)
+{
+    struct hidinfo *hid = &con->hid;
+
+    con->keys = hid->keys.held;
+    if (rand_r(&con->seed) % 8 == 0) {
+        /* Bits 12 and 13 are unused on the 3DS */
+        unsigned bit = rand_r(&con->seed) % 14;
+        con->keys ^= BIT((bit < 12) ? bit : bit + 2);
+    }
+    if (rand_r(&con->seed) % 64 == 0) {
+        con->keys ^= HID_KEY_TOUCH;
+    }
+
+    if (con->keys & HID_KEY_TOUCH) {
+        hid->touchscreen.px = walk(&con->seed, hid->touchscreen.px, 4, 0, 320);
+        hid->touchscreen.py = walk(&con->seed, hid->touchscreen.py, 4, 0, 240);
+    } else {
+        hid->touchscreen.px = hid->touchscreen.py = 0;
+    }
+
+    hid->circlepad.dx = walk(&con->seed, hid->circlepad.dx, 6, -0x9c, 0x9c);
+    hid->circlepad.dy = walk(&con->seed, hid->circlepad.dy, 6, -0x9c, 0x9c);
+    hid->cstick.dx    = walk(&con->seed, hid->cstick.dx, 2, -0x9c, 0x9c);
+    hid->cstick.dy    = walk(&con->seed, hid->cstick.dy, 2, -0x9c, 0x9c);
+
+    hid->gyro.x  = walk(&con->seed, hid->gyro.x, 40, -12000, 12000);
+    hid->gyro.y  = walk(&con->seed, hid->gyro.y, 40, -12000, 12000);
+    hid->gyro.z  = walk(&con->seed, hid->gyro.z, 40, -12000, 12000);
+    hid->accel.x = walk(&con->seed, hid->accel.x, 3, -500, 500);
+    hid->accel.y = walk(&con->seed, hid->accel.y, 3, -500, 500);
+    hid->accel.z = walk(&con->seed, hid->accel.z, 3, -500, 500);
+}
+
+static void console_scripted(struct console *con)
+{
+    const struct script_step *step = &script.steps[con->step];
+
+    uint32_t held      = con->hid.keys.held;
+    con->hid           = step->hid;
+    con->hid.keys.held = held;
+    con->keys          = step->hid.keys.held;
+
+    if (++con->frame >= step->frames) {
+        con->frame = 0;
+        con->step  = (con->step + 1) % script.len;
+    }
+}
+
+/* Sample the motion sensors `options.motion` times between the last frame
+ * and the one at `sample` us, like a 3DS sampling faster than it sends. Only
+ * the newest samples are kept while frames are not sent. */
+static void console_motion(struct console *con, uint32_t sample)
+{
+    struct hidinfo *hid = &con->hid;
+    uint32_t elapsed    = sample - con->sampled;
+    int first           = (con->sampled == 0);
+    con->sampled        = sample;
+    if (first) {
+        return;
+    }
+
+    for (unsigned i = 1; i <= options.motion; i++) {
+        if (con->nmotion == PACKET_MOTION_MAX) {
+            memmove(con->motion,
+                    con->motion + 1,
+                    (PACKET_MOTION_MAX - 1) * sizeof(*con->motion));
+            con->nmotion--;
+        }
+        hid->gyro.x  = walk(&con->seed, hid->gyro.x, 40, -12000, 12000);
+        hid->gyro.y  = walk(&con->seed, hid->gyro.y, 40, -12000, 12000);
+        hid->gyro.z  = walk(&con->seed, hid->gyro.z, 40, -12000, 12000);
+        hid->accel.x = walk(&con->seed, hid->accel.x, 3, -500, 500);
+        hid->accel.y = walk(&con->seed, hid->accel.y, 3, -500, 500);
+        hid->accel.z = walk(&con->seed, hid->accel.z, 3, -500, 500);
+
+        con->motion[con->nmotion++] = (struct packet_motion){
+            .sample = sample - elapsed + elapsed * i / (options.motion + 1),
+            .gyro   = hid->gyro,
+            .accel  = hid->accel,
+        };
+    }
+}
+
+/* Advance the console by one frame, then update the key edges like
+ * hidScanInput() does */
+static void console_step(struct console *con)
+{
+    if (script.len > 0) {
+        console_scripted(con);
+    } else {
+        console_random(con);
+    }
+
+    struct hidinfo *hid = &con->hid;
+    hid->keys.down      = con->keys & ~hid->keys.held;
+    hid->keys.up        = hid->keys.held & ~con->keys;
+    hid->keys.held      = con->keys;
+}
+
+static int console_connect(struct console *con, const struct addrinfo *server)
+{
+    con->socket =
+        socket(server->ai_family, server->ai_socktype | SOCK_NONBLOCK, 0);
+    if (con->socket < 0) {
+        perror("Error creating socket");
+        return -1;
+    }
+
+    /* Connecting binds each console to its own source port */
+    if (connect(con->socket, server->ai_addr, server->ai_addrlen) < 0) {
+        perror("Error connecting to server");
+        close(con->socket);
+        con->socket = -1;
+        return -1;
+    }
+
+    /* Echoes are only read once per frame, their receive time is taken from
+     * the kernel */
+    int enable = 1;
+    if (setsockopt(con->socket,
+                   SOL_SOCKET,
+                   SO_TIMESTAMPNS,
+                   &enable,
+                   sizeof(enable)) < 0) {
+        perror("Warning: failed to enable receive timestamps");
+    }
+    return 0;
+}
+
+/* Time `msg` was received at on the clock of now_ns(), from its kernel
+ * timestamp on CLOCK_REALTIME */
+static uint64_t console_received(struct msghdr *msg)
+{
+    uint64_t now = now_ns();
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+         cmsg                 = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET ||
+            cmsg->cmsg_type != SCM_TIMESTAMPNS) {
+            continue;
+        }
+
+        struct timespec ts, realtime;
+        memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+        clock_gettime(CLOCK_REALTIME, &realtime);
+        int64_t age = (realtime.tv_sec - ts.tv_sec) * 1000000000ll +
+                      (realtime.tv_nsec - ts.tv_nsec);
+        return (age > 0 && (uint64_t) age < now) ? now - age : now;
+    }
+    return now;
+}
+
+/* Handle the keyframe acknowledgements and probe echoes the server sent since
+ * the last frame */
+static void console_receive(struct console *con, struct counters *counters)
+{
+    unsigned char packet[PACKET_SIZE];
+    unsigned char control[CTROLLER_CONTROL_SIZE]
+        __attribute__((aligned(sizeof(struct cmsghdr))));
+
+    for (;;) {
+        struct iovec iov  = {.iov_base = packet, .iov_len = sizeof(packet)};
+        struct msghdr msg = {
+            .msg_iov        = &iov,
+            .msg_iovlen     = 1,
+            .msg_control    = control,
+            .msg_controllen = sizeof(control),
+        };
+        ssize_t len = recvmsg(con->socket, &msg, 0);
+        if (len < 0) {
+            /* Reported here instead of by the next send() */
+            if (errno != ECONNREFUSED) {
+                break;
+            }
+            counters->errors++;
+            continue;
+        }
+
+        unsigned count = con->clock.count;
+        struct ratectl_report report;
+        if (protocol_receive_ack(&con->encoder, packet, len) == 0) {
+            counters->acks++;
+        } else if (protocol_unpack_report(packet, len, &report) == 0) {
+            counters->links[ratectl_update(&con->ratectl, &report)]++;
+            if (options.adaptive) {
+                con->encoder.redundancy = con->ratectl.redundancy;
+            }
+        } else if (protocol_update_clock(&con->clock,
+                                         packet,
+                                         len,
+                                         console_received(&msg) / 1000) == 0 &&
+                   con->clock.count != count) {
+            counters->echoes++;
+            counters->rtt +=
+                con->clock.samples[count % PACKET_CLOCK_SAMPLES].rtt;
+        }
+    }
+}
+
+static void console_probe(struct console *con, struct counters *counters)
+{
+    unsigned char packet[PACKET_V2_PROBE_SIZE];
+
+    uint64_t now = now_ns();
+    if (now < con->probe_at) {
+        return;
+    }
+    con->probe_at = now + PACKET_PROBE_INTERVAL * 1000000ull;
+
+    int len = packet_v2_pack_probe(&con->clock, now / 1000, packet);
+    if (send(con->socket, packet, len, 0) < 0) {
+        counters->errors++;
+    }
+}
+
+static int event_exceeds(int a, int b, int threshold)
+{
+    return abs(a - b) >= threshold;
+}
+
+/* Whether an analog value of `hid` moved beyond its threshold from `last` */
+static int event_axes_changed(const struct hidinfo *hid,
+                              const struct hidinfo *last)
+{
+    return event_exceeds(hid->circlepad.dx,
+                         last->circlepad.dx,
+                         EVENT_THRESHOLD_STICK) ||
+           event_exceeds(hid->circlepad.dy,
+                         last->circlepad.dy,
+                         EVENT_THRESHOLD_STICK) ||
+           event_exceeds(
+               hid->cstick.dx, last->cstick.dx, EVENT_THRESHOLD_STICK) ||
+           event_exceeds(
+               hid->cstick.dy, last->cstick.dy, EVENT_THRESHOLD_STICK) ||
+           event_exceeds(hid->touchscreen.px,
+                         last->touchscreen.px,
+                         EVENT_THRESHOLD_TOUCH) ||
+           event_exceeds(hid->touchscreen.py,
+                         last->touchscreen.py,
+                         EVENT_THRESHOLD_TOUCH) ||
+           event_exceeds(hid->gyro.x, last->gyro.x, EVENT_THRESHOLD_GYRO) ||
+           event_exceeds(hid->gyro.y, last->gyro.y, EVENT_THRESHOLD_GYRO) ||
+           event_exceeds(hid->gyro.z, last->gyro.z, EVENT_THRESHOLD_GYRO) ||
+           event_exceeds(hid->accel.x, last->accel.x, EVENT_THRESHOLD_ACCEL) ||
+           event_exceeds(hid->accel.y, last->accel.y, EVENT_THRESHOLD_ACCEL) ||
+           event_exceeds(hid->accel.z, last->accel.z, EVENT_THRESHOLD_ACCEL);
+}
+
+/* Whether to send the frame with --event: key edges right away, other
+ * changes when the rate is due and once more after they settled, nothing
+ * else until the keepalive is due */
+static int console_event_due(struct console *con, int due, uint64_t now)
+{
+    int keys   = (con->down | con->up) != 0;
+    int axes   = event_axes_changed(&con->hid, &con->last);
+    int recent = now - con->sent_at < PACKET_KEEPALIVE_INTERVAL * 1000000ull;
+    if (!keys && !(due && (axes || con->settling)) && recent) {
+        return 0;
+    }
+    con->settling = keys || axes;
+    return 1;
+}
+
+static void console_send(struct console *con, struct counters *counters)
+{
+    unsigned char packet[PACKET_V2_MAX_SIZE] __attribute__((aligned(4)));
+    size_t len;
+
+    uint32_t sample = now_ns() / 1000;
+    if (options.motion > 0) {
+        console_motion(con, sample);
+    }
+    console_step(con);
+    if (options.adaptive || options.event) {
+        /* Edges of the frames skipped are sent with the next one */
+        con->down |= con->hid.keys.down;
+        con->up |= con->hid.keys.up;
+        int due = 1;
+        if (options.adaptive) {
+            console_receive(con, counters);
+            console_probe(con, counters);
+            due = ratectl_due(&con->ratectl, &con->credit);
+        }
+        if (options.event ? !console_event_due(con, due, now_ns()) : !due) {
+            return;
+        }
+        con->hid.keys.down = con->down;
+        con->hid.keys.up   = con->up;
+        con->down          = 0;
+        con->up            = 0;
+    }
+
+    if (options.protocol == 1) {
+        ctroller_pack_hid_info(&con->hid, packet);
+        len = PACKET_V1_SIZE;
+    } else {
+        console_receive(con, counters);
+        len = packet_v2_pack(&con->encoder, &con->hid, sample, packet);
+        len = packet_v2_pack_motion(
+            &con->hid, sample, con->motion, con->nmotion, packet, len);
+        con->nmotion = 0;
+    }
+
+    if (send(con->socket, packet, len, 0) < 0) {
+        /* ECONNREFUSED reports an earlier packet the server did not take */
+        counters->errors++;
+        return;
+    }
+    counters->sent++;
+    counters->bytes += len;
+    con->last    = con->hid;
+    con->sent_at = now_ns();
+
+    if (options.protocol == 2 && !options.adaptive) {
+        console_probe(con, counters);
+    }
+}
+
+/* UDP receive buffer errors of this host, only meaningful if the server runs
+ * locally */
+static unsigned long udp_drops(void)
+{
+    FILE *fp = fopen("/proc/net/snmp", "r");
+    if (fp == NULL) {
+        return 0;
+    }
+
+    char line[512];
+    unsigned long drops = 0;
+    int header          = 1;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, "Udp:", 4) != 0) {
+            continue;
+        }
+        /* The first line names the fields, the second holds the values */
+        if (header) {
+            header = 0;
+            continue;
+        }
+        unsigned long in, noports, errors, out, rcvbuf;
+        if (sscanf(line,
+                   "Udp: %lu %lu %lu %lu %lu",
+                   &in,
+                   &noports,
+                   &errors,
+                   &out,
+                   &rcvbuf) == 5) {
+            drops = rcvbuf;
+        }
+        break;
+    }
+    fclose(fp);
+    return drops;
+}
+
+static void report(const char *label,
+                   double elapsed,
+                   const struct counters *counters,
+                   double expected)
+{
+    double rate         = counters->sent / elapsed;
+    unsigned long lost  = counters->errors + counters->drops;
+    unsigned long total = counters->sent + counters->errors;
+
+    printf("%-8s %7.2fs %10lu sent %11.1f pkt/s",
+           label,
+           elapsed,
+           counters->sent,
+           rate);
+    if (expected > 0) {
+        printf(" (%5.1f%%)", 100.0 * rate / expected);
+    }
+    printf(" %8lu errors %8lu late %8lu dropped (%.2f%% loss)",
+           counters->errors,
+           counters->late,
+           counters->drops,
+           (total > 0) ? 100.0 * lost / total : 0.0);
+    printf(" %5.1f B/pkt", (counters->sent > 0) ? (double) counters->bytes /
+                                                     counters->sent
+                                               : 0.0);
+    if (options.protocol == 2) {
+        printf(" %6lu acks", counters->acks);
+        if (counters->echoes != 0) {
+            printf(" %5lu echoes (rtt %.3fms)",
+                   counters->echoes,
+                   counters->rtt / 1000.0 / counters->echoes);
+        }
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+/* Mean rate and redundancy of the consoles, and the links reported */
+static void report_adaptive(const struct console *consoles,
+                            size_t len,
+                            const struct counters *counters)
+{
+    double rate = 0, redundancy = 0;
+    for (size_t i = 0; i < len; i++) {
+        rate += consoles[i].ratectl.rate;
+        redundancy += consoles[i].ratectl.redundancy;
+    }
+
+    printf("%-8s rate %.1f Hz, redundancy %.1f packets, "
+           "%lu clean, %lu lossy, %lu congested\n",
+           "",
+           rate / len,
+           redundancy / len,
+           counters->links[RATECTL_CLEAN],
+           counters->links[RATECTL_LOSSY],
+           counters->links[RATECTL_CONGESTED]);
+    fflush(stdout);
+}
+
+static void print_usage(void)
+{
+    printf("Usage:\n");
+    printf("  %s [<switches>]\n", program_invocation_short_name);
+    printf("\n");
+
+    printf("<switches>:\n");
+#define print_opt(shortopt, longopt, desc)                                     \
+    printf("  -%-1s  --%-22s " desc, shortopt, longopt)
+
+    print_opt("a", "adaptive", "adapt the rate (up to --rate) and redundancy "
+                               "to the server's reports\n");
+    print_opt("c", "consoles=<num>", "number of simulated consoles, each "
+                                     "sending from its own port\n");
+    print_opt("d", "duration=<sec>", "stop after this many seconds "
+                                     "(0: run until interrupted)\n");
+    print_opt("e", "event", "send on changes and keepalives only, best "
+                            "with --script\n");
+    print_opt("h", "help", "print this help text\n");
+    print_opt("H", "host=<host>", "address of the server "
+                                  "(defaults to localhost)\n");
+    print_opt("i", "interval=<sec>", "seconds between reports\n");
+    print_opt("m", "motion=<num>", "motion samples between two frames, "
+                                   "sent in a batch with the next packet\n");
+    print_opt("p", "port=<port>", "port of the server "
+                                  "(defaults to " PORT_DEFAULT ")\n");
+    print_opt("P", "protocol=<1|2>", "protocol version to send "
+                                     "(defaults to 2)\n");
+    print_opt("r", "rate=<hz>", "packets per second and console "
+                                "(0: as fast as possible, defaults to 60)\n");
+    print_opt("s", "seed=<num>", "seed of the random input\n");
+    print_opt("S", "script=<path>", "send scripted instead of random input\n");
+#undef print_opt
+}
+
+int main(int argc, char *argv[])
+{
+    // clang-format off
+    static const struct option optstrings[] = {
+        {"adaptive", no_argument,       NULL, 'a'},
+        {"consoles", required_argument, NULL, 'c'},
+        {"duration", required_argument, NULL, 'd'},
+        {"event",    no_argument,       NULL, 'e'},
+        {"help",     no_argument,       NULL, 'h'},
+        {"host",     required_argument, NULL, 'H'},
+        {"interval", required_argument, NULL, 'i'},
+        {"motion",   required_argument, NULL, 'm'},
+        {"port",     required_argument, NULL, 'p'},
+        {"protocol", required_argument, NULL, 'P'},
+        {"rate",     required_argument, NULL, 'r'},
+        {"seed",     required_argument, NULL, 's'},
+        {"script",   required_argument, NULL, 'S'},
+        {NULL,       0,                 NULL, 0},
+    };
+    // clang-format on
+
+    int curopt;
+    while ((curopt = getopt_long(argc,
+                                 argv,
+                                 "ac:d:ehH:i:m:p:P:r:s:S:",
+                                 optstrings,
+                                 NULL)) != -1) {
+        switch (curopt) {
+        case 'a':
+            options.adaptive = 1;
+            break;
+        case 'c':
+            options.consoles = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            options.duration = strtod(optarg, NULL);
+            break;
+        case 'e':
+            options.event = 1;
+            break;
+        case 'h':
+            print_usage();
+            return EXIT_SUCCESS;
+        case 'H':
+            options.host = optarg;
+            break;
+        case 'i':
+            options.interval = strtod(optarg, NULL);
+            break;
+        case 'm':
+            options.motion = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            options.port = optarg;
+            break;
+        case 'P':
+            options.protocol = strtol(optarg, NULL, 0);
+            break;
+        case 'r':
+            options.rate = strtod(optarg, NULL);
+            break;
+        case 's':
+            options.seed = strtoul(optarg, NULL, 0);
+            break;
+        case 'S':
+            options.script = optarg;
+            break;
+        default:
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (options.consoles == 0 || options.rate < 0 || options.interval <= 0 ||
+        (options.protocol != 1 && options.protocol != 2) ||
+        (options.adaptive && (options.protocol != 2 || options.rate < 1)) ||
+        (options.motion > 0 && (options.protocol != 2 || options.rate <= 0))) {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+
+    if (options.script != NULL && script_load(options.script) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    struct addrinfo hints = {
+        .ai_family   = AF_UNSPEC,
+        .ai_socktype = SOCK_DGRAM,
+    };
+    struct addrinfo *server;
+    int res;
+    if ((res = getaddrinfo(options.host, options.port, &hints, &server))) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(res));
+        return EXIT_FAILURE;
+    }
+
+    int exitcode     = EXIT_FAILURE;
+    size_t nconsoles = 0;
+    struct console *consoles = calloc(options.consoles, sizeof(*consoles));
+    if (consoles == NULL) {
+        perror("Allocating consoles");
+        goto out;
+    }
+
+    for (; nconsoles < options.consoles; nconsoles++) {
+        struct console *con = &consoles[nconsoles];
+        con->seed            = options.seed + nconsoles;
+        con->hid.version     = CTROLLER_VERSION;
+        con->encoder.version = CTROLLER_VERSION;
+        /* At least a quarter of the rate, like a 3DS at 15 of 60 frames */
+        unsigned rate = options.rate;
+        ratectl_init(&con->ratectl,
+                     (rate >= 4) ? rate / 4 : 1,
+                     rate,
+                     1,
+                     PACKET_HISTORY_FRAMES);
+        if (console_connect(con, server) < 0) {
+            goto out;
+        }
+    }
+
+    struct sigaction sa = {.sa_handler = on_terminate};
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    printf("Sending to %s:%s from %zu console(s) at ",
+           options.host,
+           options.port,
+           options.consoles);
+    if (options.rate > 0) {
+        printf("%.1f Hz.\n", options.rate);
+    } else {
+        printf("maximum rate.\n");
+    }
+
+    const double expected = options.rate * options.consoles;
+    const uint64_t period =
+        (options.rate > 0) ? (uint64_t)(1e9 / options.rate) : 0;
+    const uint64_t interval = options.interval * 1e9;
+    const uint64_t duration = options.duration * 1e9;
+
+    struct counters total = {0}, last = {0};
+    unsigned long drops   = udp_drops();
+
+    uint64_t start       = now_ns();
+    uint64_t next        = start;
+    uint64_t next_report = start + interval;
+    uint64_t last_report = start;
+
+    while (!terminate) {
+        for (size_t i = 0; i < nconsoles; i++) {
+            console_send(&consoles[i], &total);
+        }
+
+        uint64_t now = now_ns();
+        if (now >= next_report) {
+            total.drops = udp_drops() - drops;
+            struct counters delta = {
+                .sent   = total.sent - last.sent,
+                .errors = total.errors - last.errors,
+                .late   = total.late - last.late,
+                .drops  = total.drops - last.drops,
+                .bytes  = total.bytes - last.bytes,
+                .acks   = total.acks - last.acks,
+                .echoes = total.echoes - last.echoes,
+                .rtt    = total.rtt - last.rtt,
+            };
+            for (size_t l = 0; l < arrsize(delta.links); l++) {
+                delta.links[l] = total.links[l] - last.links[l];
+            }
+            report("interval", (now - last_report) / 1e9, &delta, expected);
+            if (options.adaptive) {
+                report_adaptive(consoles, nconsoles, &delta);
+            }
+            last        = total;
+            last_report = now;
+            next_report += interval;
+        }
+        if (duration > 0 && now - start >= duration) {
+            break;
+        }
+
+        if (period == 0) {
+            continue;
+        }
+
+        /* Keep a fixed schedule, but do not send bursts after stalls */
+        next += period;
+        if (now > next + period) {
+            uint64_t missed = (now - next) / period;
+            total.late += missed;
+            next += missed * period;
+        }
+        struct timespec ts = {
+            .tv_sec  = next / 1000000000ull,
+            .tv_nsec = next % 1000000000ull,
+        };
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    }
+
+    total.drops = udp_drops() - drops;
+    report("total", (now_ns() - start) / 1e9, &total, expected);
+    if (options.adaptive) {
+        report_adaptive(consoles, nconsoles, &total);
+    }
+    exitcode = EXIT_SUCCESS;
+
+out:
+    for (size_t i = 0; consoles != NULL && i < nconsoles; i++) {
+        close(consoles[i].socket);
+    }
+    free(consoles);
+    free(script.steps);
+    freeaddrinfo(server);
+    return exitcode;
+}
@@ -0,0 +1,619 @@
+/*
+ *  ctroller -- use your 3DS as a gamepad on your PC
+ *  Copyright (C) 2016  Philipp Joram (phijor)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* UDP relay impairing the traffic between clients and a ctroller server: it
+ * drops, duplicates, reorders and delays packets like a bad Wi-Fi link would.
+ * All decisions are drawn from a seeded generator, so the same input results
+ * in the same impairments.
+ */
+
+#define _GNU_SOURCE
+#include <features.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include "ctroller.h"
+#include "devices.h"
+
+#define IMPAIR_PORT_DEFAULT "15709"
+/* Maximum number of distinct clients relayed */
+#define IMPAIR_CLIENTS_MAX 64
+/* Maximum number of packets held back at once */
+#define IMPAIR_QUEUE_SIZE 4096
+#define IMPAIR_PACKET_MAX 512
+
+enum jitter {
+    JITTER_UNIFORM,     /* uniform in [0, jitter] */
+    JITTER_NORMAL,      /* normal with a standard deviation of jitter */
+    JITTER_EXPONENTIAL, /* exponential with a mean of jitter */
+};
+
+static struct {
+    const char *port;
+    const char *host;
+    const char *target_port;
+    double loss;      /* probability of entering a loss burst */
+    double burst;     /* mean length of a loss burst in packets */
+    double duplicate; /* probability of sending a packet twice */
+    double reorder;   /* probability of holding a packet back */
+    double gap;       /* time a reordered packet is held back, in ms */
+    double delay;     /* base delay in ms */
+    double jitter;    /* delay variation in ms */
+    enum jitter distribution;
+    uint64_t seed;
+} options = {
+    .port         = IMPAIR_PORT_DEFAULT,
+    .host         = "localhost",
+    .target_port  = PORT_DEFAULT,
+    .loss         = 0,
+    .burst        = 1,
+    .duplicate    = 0,
+    .reorder      = 0,
+    .gap          = 20,
+    .delay        = 0,
+    .jitter       = 0,
+    .distribution = JITTER_UNIFORM,
+    .seed         = 1,
+};
+
+struct client {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int socket; /* connected to the server, one per client */
+};
+
+struct pending {
+    uint64_t due;
+    uint64_t order; /* keeps packets due at the same time in order */
+    struct client *client;
+    size_t len;
+    unsigned char data[IMPAIR_PACKET_MAX];
+};
+
+static struct {
+    struct client clients[IMPAIR_CLIENTS_MAX];
+    size_t nclients;
+
+    /* Min-heap of pending packets, ordered by due time */
+    struct pending *heap[IMPAIR_QUEUE_SIZE];
+    struct pending pool[IMPAIR_QUEUE_SIZE];
+    struct pending *free[IMPAIR_QUEUE_SIZE];
+    size_t len;
+    size_t nfree;
+    uint64_t order;
+
+    uint64_t rng;
+    int lossy; /* currently in a loss burst */
+} relay;
+
+static struct {
+    unsigned long received;
+    unsigned long forwarded;
+    unsigned long failed; /* send() errors, i.e. no server listening */
+    unsigned long lost;
+    unsigned long duplicated;
+    unsigned long reordered;
+    unsigned long overflow;
+    unsigned long replies;
+} stats;
+
+static volatile sig_atomic_t terminate;
+
+static void on_terminate(int signum)
+{
+    (void) signum;
+    terminate = 1;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* splitmix64, independent of the libc's generator so seeds are portable */
+static uint64_t random_next(void)
+{
+    uint64_t z = (relay.rng += 0x9e3779b97f4a7c15ull);
+    z          = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z          = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+/* Uniform in [0, 1) */
+static double random_uniform(void)
+{
+    return (random_next() >> 11) * (1.0 / (1ull << 53));
+}
+
+static int random_chance(double p)
+{
+    return p > 0 && random_uniform() < p;
+}
+
+static double random_jitter(void)
+{
+    if (options.jitter <= 0) {
+        return 0;
+    }
+
+    switch (options.distribution) {
+    case JITTER_UNIFORM:
+        return random_uniform() * options.jitter;
+    case JITTER_NORMAL: {
+        /* Box-Muller */
+        double u = 1.0 - random_uniform();
+        double v = random_uniform();
+        return options.jitter * sqrt(-2.0 * log(u)) * cos(2 * M_PI * v);
+    }
+    case JITTER_EXPONENTIAL:
+        return -options.jitter * log(1.0 - random_uniform());
+    }
+    return 0;
+}
+
+/* Gilbert model: packets are lost in bursts of a mean length, entered with a
+ * probability chosen so the overall loss rate matches the requested one */
+static int random_lost(void)
+{
+    if (relay.lossy) {
+        relay.lossy = random_chance(1.0 - 1.0 / options.burst);
+    } else {
+        double enter = options.loss / (options.burst * (1.0 - options.loss));
+        relay.lossy  = random_chance(enter);
+    }
+    return relay.lossy;
+}
+
+static int pending_before(const struct pending *a, const struct pending *b)
+{
+    return (a->due != b->due) ? a->due < b->due : a->order < b->order;
+}
+
+static void queue_swap(size_t i, size_t j)
+{
+    struct pending *tmp = relay.heap[i];
+    relay.heap[i]       = relay.heap[j];
+    relay.heap[j]       = tmp;
+}
+
+static void queue_push(struct client *client,
+                       const void *data,
+                       size_t len,
+                       uint64_t due)
+{
+    if (relay.nfree == 0) {
+        stats.overflow++;
+        return;
+    }
+
+    struct pending *p = relay.free[--relay.nfree];
+    p->due            = due;
+    p->order          = relay.order++;
+    p->client         = client;
+    p->len            = len;
+    memcpy(p->data, data, len);
+
+    size_t i      = relay.len++;
+    relay.heap[i] = p;
+    while (i > 0 && pending_before(relay.heap[i], relay.heap[(i - 1) / 2])) {
+        queue_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void queue_pop(void)
+{
+    relay.free[relay.nfree++] = relay.heap[0];
+    relay.heap[0]             = relay.heap[--relay.len];
+
+    size_t i = 0;
+    for (;;) {
+        size_t min = i;
+        size_t l = 2 * i + 1, r = 2 * i + 2;
+        if (l < relay.len && pending_before(relay.heap[l], relay.heap[min])) {
+            min = l;
+        }
+        if (r < relay.len && pending_before(relay.heap[r], relay.heap[min])) {
+            min = r;
+        }
+        if (min == i) {
+            break;
+        }
+        queue_swap(i, min);
+        i = min;
+    }
+}
+
+static struct client *client_get(const struct sockaddr_storage *addr,
+                                 socklen_t addr_len,
+                                 const struct addrinfo *server)
+{
+    for (size_t i = 0; i < relay.nclients; i++) {
+        struct client *c = &relay.clients[i];
+        if (c->addr_len == addr_len && memcmp(&c->addr, addr, addr_len) == 0) {
+            return c;
+        }
+    }
+
+    if (relay.nclients == IMPAIR_CLIENTS_MAX) {
+        return NULL;
+    }
+
+    int sock =
+        socket(server->ai_family, server->ai_socktype | SOCK_NONBLOCK, 0);
+    if (sock < 0) {
+        perror("Error creating socket");
+        return NULL;
+    }
+    if (connect(sock, server->ai_addr, server->ai_addrlen) < 0) {
+        perror("Error connecting to server");
+        close(sock);
+        return NULL;
+    }
+
+    struct client *c = &relay.clients[relay.nclients++];
+    memcpy(&c->addr, addr, addr_len);
+    c->addr_len = addr_len;
+    c->socket   = sock;
+    printf("Relaying new client (%zu).\n", relay.nclients);
+    return c;
+}
+
+static void relay_packet(struct client *client, const void *data, size_t len)
+{
+    stats.received++;
+
+    if (random_lost()) {
+        stats.lost++;
+        return;
+    }
+
+    int copies = 1;
+    if (random_chance(options.duplicate)) {
+        stats.duplicated++;
+        copies++;
+    }
+
+    uint64_t now = now_ns();
+    for (int i = 0; i < copies; i++) {
+        double delay = options.delay + random_jitter();
+        if (random_chance(options.reorder)) {
+            stats.reordered++;
+            delay += options.gap;
+        }
+        if (delay < 0) {
+            delay = 0;
+        }
+        queue_push(client, data, len, now + (uint64_t)(delay * 1e6));
+    }
+}
+
+static void relay_due(void)
+{
+    uint64_t now = now_ns();
+    while (relay.len > 0 && relay.heap[0]->due <= now) {
+        struct pending *p = relay.heap[0];
+        if (send(p->client->socket, p->data, p->len, 0) >= 0) {
+            stats.forwarded++;
+        } else {
+            stats.failed++;
+        }
+        queue_pop();
+    }
+}
+
+/* Replies of the server are passed back unimpaired */
+static void relay_replies(int listener, struct client *client)
+{
+    unsigned char buf[IMPAIR_PACKET_MAX];
+    ssize_t len;
+    while ((len = recv(client->socket, buf, sizeof(buf), 0)) >= 0) {
+        sendto(listener,
+               buf,
+               len,
+               0,
+               (struct sockaddr *) &client->addr,
+               client->addr_len);
+        stats.replies++;
+    }
+}
+
+static int listener_init(const char *port)
+{
+    struct addrinfo hints = {
+        .ai_family   = AF_UNSPEC,
+        .ai_socktype = SOCK_DGRAM,
+        .ai_flags    = AI_PASSIVE,
+    };
+    struct addrinfo *info;
+    int res;
+    if ((res = getaddrinfo(NULL, port, &hints, &info))) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(res));
+        return -1;
+    }
+
+    int sock = -1;
+    for (struct addrinfo *p = info; p != NULL; p = p->ai_next) {
+        sock = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK, 0);
+        if (sock < 0) {
+            continue;
+        }
+        if (bind(sock, p->ai_addr, p->ai_addrlen) == 0) {
+            break;
+        }
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(info);
+
+    if (sock < 0) {
+        fprintf(stderr, "Failed to bind to port %s.\n", port);
+    }
+    return sock;
+}
+
+static void print_stats(void)
+{
+    printf("Received %lu packets: %lu lost, %lu duplicated, %lu reordered, "
+           "%lu overflowed, %lu forwarded, %lu failed (%lu replies).\n",
+           stats.received,
+           stats.lost,
+           stats.duplicated,
+           stats.reordered,
+           stats.overflow,
+           stats.forwarded,
+           stats.failed,
+           stats.replies);
+}
+
+static void print_usage(void)
+{
+    printf("Usage:\n");
+    printf("  %s [<switches>]\n", program_invocation_short_name);
+    printf("\n");
+
+    printf("<switches>:\n");
+#define print_opt(shortopt, longopt, desc)                                     \
+    printf("  -%-1s  --%-24s " desc, shortopt, longopt)
+
+    print_opt("b", "burst=<packets>", "mean length of loss bursts "
+                                      "(defaults to 1)\n");
+    print_opt("d", "delay=<ms>", "base delay\n");
+    print_opt("D", "duplicate=<percent>", "chance of duplicating a packet\n");
+    print_opt("g", "gap=<ms>", "time reordered packets are held back "
+                               "(defaults to 20)\n");
+    print_opt("h", "help", "print this help text\n");
+    print_opt("H", "host=<host>", "address of the server "
+                                  "(defaults to localhost)\n");
+    print_opt("j", "jitter=<ms>", "delay variation\n");
+    print_opt("J",
+              "distribution=<dist>",
+              "distribution of the jitter: uniform (default), normal or "
+              "exponential\n");
+    print_opt("l", "loss=<percent>", "chance of losing a packet\n");
+    print_opt("p", "port=<port>", "port to listen on "
+                                  "(defaults to " IMPAIR_PORT_DEFAULT ")\n");
+    print_opt("r", "reorder=<percent>", "chance of holding a packet back\n");
+    print_opt("s", "seed=<num>", "seed of the impairments\n");
+    print_opt("t", "target=<port>", "port of the server "
+                                    "(defaults to " PORT_DEFAULT ")\n");
+#undef print_opt
+}
+
+int main(int argc, char *argv[])
+{
+    // clang-format off
+    static const struct option optstrings[] = {
+        {"burst",        required_argument, NULL, 'b'},
+        {"delay",        required_argument, NULL, 'd'},
+        {"duplicate",    required_argument, NULL, 'D'},
+        {"gap",          required_argument, NULL, 'g'},
+        {"help",         no_argument,       NULL, 'h'},
+        {"host",         required_argument, NULL, 'H'},
+        {"jitter",       required_argument, NULL, 'j'},
+        {"distribution", required_argument, NULL, 'J'},
+        {"loss",         required_argument, NULL, 'l'},
+        {"port",         required_argument, NULL, 'p'},
+        {"reorder",      required_argument, NULL, 'r'},
+        {"seed",         required_argument, NULL, 's'},
+        {"target",       required_argument, NULL, 't'},
+        {NULL,           0,                 NULL, 0},
+    };
+    // clang-format on
+
+    int curopt;
+    while ((curopt = getopt_long(argc,
+                                 argv,
+                                 "b:d:D:g:hH:j:J:l:p:r:s:t:",
+                                 optstrings,
+                                 NULL)) != -1) {
+        switch (curopt) {
+        case 'b':
+            options.burst = strtod(optarg, NULL);
+            break;
+        case 'd':
+            options.delay = strtod(optarg, NULL);
+            break;
+        case 'D':
+            options.duplicate = strtod(optarg, NULL) / 100;
+            break;
+        case 'g':
+            options.gap = strtod(optarg, NULL);
+            break;
+        case 'h':
+            print_usage();
+            return EXIT_SUCCESS;
+        case 'H':
+            options.host = optarg;
+            break;
+        case 'j':
+            options.jitter = strtod(optarg, NULL);
+            break;
+        case 'J':
+            if (strcmp(optarg, "uniform") == 0) {
+                options.distribution = JITTER_UNIFORM;
+            } else if (strcmp(optarg, "normal") == 0) {
+                options.distribution = JITTER_NORMAL;
+            } else if (strcmp(optarg, "exponential") == 0) {
+                options.distribution = JITTER_EXPONENTIAL;
+            } else {
+                print_usage();
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'l':
+            options.loss = strtod(optarg, NULL) / 100;
+            break;
+        case 'p':
+            options.port = optarg;
+            break;
+        case 'r':
+            options.reorder = strtod(optarg, NULL) / 100;
+            break;
+        case 's':
+            options.seed = strtoull(optarg, NULL, 0);
+            break;
+        case 't':
+            options.target_port = optarg;
+            break;
+        default:
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (options.loss < 0 || options.loss >= 1 || options.burst < 1) {
+        fprintf(stderr, "Loss must be below 100%% and bursts at least 1.\n");
+        return EXIT_FAILURE;
+    }
+
+    struct addrinfo hints = {
+        .ai_family   = AF_UNSPEC,
+        .ai_socktype = SOCK_DGRAM,
+    };
+    struct addrinfo *server;
+    int res;
+    if ((res = getaddrinfo(
+             options.host, options.target_port, &hints, &server))) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(res));
+        return EXIT_FAILURE;
+    }
+
+    int listener = listener_init(options.port);
+    if (listener < 0) {
+        freeaddrinfo(server);
+        return EXIT_FAILURE;
+    }
+
+    relay.rng = options.seed;
+    for (size_t i = 0; i < IMPAIR_QUEUE_SIZE; i++) {
+        relay.free[relay.nfree++] = &relay.pool[i];
+    }
+
+    struct sigaction sa = {.sa_handler = on_terminate};
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    printf("Relaying port %s to %s:%s.\n",
+           options.port,
+           options.host,
+           options.target_port);
+
+    struct pollfd fds[1 + IMPAIR_CLIENTS_MAX];
+    while (!terminate) {
+        fds[0] = (struct pollfd){.fd = listener, .events = POLLIN};
+        for (size_t i = 0; i < relay.nclients; i++) {
+            fds[1 + i] = (struct pollfd){
+                .fd     = relay.clients[i].socket,
+                .events = POLLIN,
+            };
+        }
+
+        int timeout = -1;
+        if (relay.len > 0) {
+            uint64_t now = now_ns();
+            uint64_t due = relay.heap[0]->due;
+            /* Round up, waking early would spin */
+            timeout = (due > now) ? (due - now + 999999) / 1000000 : 0;
+        }
+
+        /* Clients may be added while handling the listener */
+        size_t npolled = relay.nclients;
+        if (poll(fds, 1 + npolled, timeout) < 0) {
+            if (errno != EINTR) {
+                perror("poll");
+            }
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            unsigned char buf[IMPAIR_PACKET_MAX];
+            struct sockaddr_storage addr;
+            socklen_t addr_len;
+            ssize_t len;
+            for (;;) {
+                addr_len = sizeof(addr);
+                len      = recvfrom(listener,
+                               buf,
+                               sizeof(buf),
+                               0,
+                               (struct sockaddr *) &addr,
+                               &addr_len);
+                if (len < 0) {
+                    break;
+                }
+                struct client *c = client_get(&addr, addr_len, server);
+                if (c != NULL) {
+                    relay_packet(c, buf, len);
+                }
+            }
+        }
+
+        for (size_t i = 0; i < npolled; i++) {
+            if (fds[1 + i].revents & POLLIN) {
+                relay_replies(listener, &relay.clients[i]);
+            }
+        }
+
+        relay_due();
+    }
+
+    print_stats();
+
+    for (size_t i = 0; i < relay.nclients; i++) {
+        close(relay.clients[i].socket);
+    }
+    close(listener);
+    freeaddrinfo(server);
+    return EXIT_SUCCESS;
+}